@@ -34,7 +34,8 @@ cgroup_get_pids()
 	[ -f "${cgroup_procs}" ] || return 0
 	subpid=$(exec sh -c 'echo "$PPID"')
 	while read -r p; do
-		[ "$p" -eq $$ ] || [ "$p" -eq "$subpid" ] || pids="${pids} ${p}"
+		[ "$p" -eq "${_rc_pid:-$$}" ] || [ "$p" -eq "$subpid" ] ||
+			pids="${pids} ${p}"
 	done < "${cgroup_procs}"
 	printf "%s" "${pids}"
 	return 0
@@ -164,7 +165,7 @@ cgroup2_remove()
 	[ ! -d "${rc_cgroup_path}" ] ||
 		[ ! -e "${rc_cgroup_path}"/cgroup.events ] &&
 		return 0
-	grep -qx "$$" "${rc_cgroup_path}/cgroup.procs" &&
+	grep -qx "${_rc_pid:-$$}" "${rc_cgroup_path}/cgroup.procs" &&
 		printf "%d" 0 > "${cgroup_path}/cgroup.procs"
 	local key populated vvalue
 	while read -r key value; do
@@ -198,26 +199,44 @@ cgroup2_set_limits()
 	return 0
 }
 
+# start-stop-daemon and supervise-daemon set these limits themselves,
+# after the daemon forks and before it execs
+cgroup2_daemon_args()
+{
+	local cgroup_path
+	cgroup_path="$(cgroup2_find_path)"
+	[ -n "${cgroup_path}" ] || return 0
+	mountinfo -q "${cgroup_path}" || return 0
+	printf -- "--cgroup %s" "${cgroup_path}/${RC_SVCNAME}"
+	[ -n "${rc_cgroup_cpu_max}" ] &&
+		printf -- " --cgroup-limit \"cpu.max=%s\"" "${rc_cgroup_cpu_max}"
+	[ -n "${rc_cgroup_cpu_weight}" ] &&
+		printf -- " --cgroup-limit cpu.weight=%s" "${rc_cgroup_cpu_weight}"
+	[ -n "${rc_cgroup_io_weight}" ] &&
+		printf -- " --cgroup-limit \"io.weight=%s\"" "${rc_cgroup_io_weight}"
+	[ -n "${rc_cgroup_memory_high}" ] &&
+		printf -- " --cgroup-limit memory.high=%s" "${rc_cgroup_memory_high}"
+	[ -n "${rc_cgroup_memory_max}" ] &&
+		printf -- " --cgroup-limit memory.max=%s" "${rc_cgroup_memory_max}"
+	return 0
+}
+
 cgroup_cleanup()
 {
 	cgroup_running || return 0
 	ebegin "starting cgroups cleanup"
-	local pids loops=0
-	pids="$(cgroup_get_pids)"
-	if [ -n "${pids}" ]; then
-		kill -s CONT ${pids} 2> /dev/null
-		kill -s "${stopsig:-TERM}" ${pids} 2> /dev/null
-		yesno "${rc_send_sighup:-no}" &&
-			kill -s HUP ${pids} 2> /dev/null
-		kill -s "${stopsig:-TERM}" ${pids} 2> /dev/null
-		while [ -n "$(cgroup_get_pids)" ] &&
-			[ "${loops}" -lt "${rc_timeout_stopsec:-90}" ]; do
-			loops=$((loops+1))
-			sleep 1
-		done
-		pids="$(cgroup_get_pids)"
-		[ -n "${pids}" ] && yesno "${rc_send_sigkill:-yes}" &&
-			kill -s KILL ${pids} 2> /dev/null
+	local cgroup_path retry
+	cgroup_path="$(cgroup2_find_path)"
+	[ -n "${cgroup_path}" ] &&
+		cgroup_path="${cgroup_path}/${RC_SVCNAME}" ||
+		cgroup_path="/sys/fs/cgroup/openrc/${RC_SVCNAME}"
+	if [ -n "$(cgroup_get_pids)" ]; then
+		retry="${stopsig:-TERM}"
+		yesno "${rc_send_sighup:-no}" && retry="${retry}/HUP"
+		retry="${retry}/${stopsig:-TERM}/${rc_timeout_stopsec:-90}"
+		yesno "${rc_send_sigkill:-yes}" && retry="${retry}/KILL/5"
+		start-stop-daemon --stop --quiet --cgroup "${cgroup_path}" \
+			--retry "${retry}" > /dev/null 2>&1
 	fi
 	cgroup2_remove
 	[ -z "$(cgroup_get_pids)" ]
@@ -119,7 +119,7 @@ _depend() {
 	# Add any user defined depends
 	for _deptype in config:CONFIG need:NEED use:USE want:WANT \
 	after:AFTER before:BEFORE \
-	provide:PROVIDE keyword:KEYWORD; do
+	provide:PROVIDE listen:LISTEN keyword:KEYWORD; do
 		IFS=:
 		set -- $_deptype
 		unset IFS
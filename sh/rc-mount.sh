@@ -52,7 +52,7 @@ do_unmount()
 					fuser $f_opts "$mnt" 2>/dev/null)"
 			fi
 			case " $pids " in
-				*" $$ "*)
+				*" ${_rc_pid:-$$} "*)
 					eend 1 "failed because we are using" \
 					"$mnt"
 					retry=0;;
@@ -42,6 +42,10 @@ ssd_start()
 		output_logger_arg="--stdout-logger \"$output_logger\""
 	[ -n "$error_logger" ] &&
 		error_logger_arg="--stderr-logger \"$error_logger\""
+	[ -n "$ready_check" ] &&
+		ready_check_arg="--ready-check \"$ready_check\""
+	[ "$(command -v cgroup2_daemon_args)" = "cgroup2_daemon_args" ] &&
+		cgroup_args="$(cgroup2_daemon_args)"
 	#the eval call is necessary for cases like:
 	# command_args="this \"is a\" test"
 	# to work properly.
@@ -57,6 +61,12 @@ ssd_start()
 		${pidfile:+--pidfile} $pidfile \
 		${command_user+--user} $command_user \
 		${umask+--umask} $umask \
+		${notify:+--notify} $notify \
+		${ready_check_arg} \
+		${ready_timeout:+--ready-timeout} $ready_timeout \
+		${RC_LISTEN_FDS:+--listen-fds} $RC_LISTEN_FDS \
+		${cgroup_args} \
+		${rc_cpu_affinity:+--cpu-affinity} $rc_cpu_affinity \
 		$_background $start_stop_daemon_args \
 		-- $command_args $command_args_background
 	if eend $? "Failed to start ${name:-$RC_SVCNAME}"; then
@@ -20,11 +20,18 @@ supervise_start()
 		return 1
 	fi
 
+	local _shared= _ready_check= _cgroup=
+	yesno "${supervise_daemon_shared}" && _shared=--shared
+	[ -n "$ready_check" ] &&
+		_ready_check="--ready-check \"$ready_check\""
+	[ "$(command -v cgroup2_daemon_args)" = "cgroup2_daemon_args" ] &&
+		_cgroup="$(cgroup2_daemon_args)"
+
 	ebegin "Starting ${name:-$RC_SVCNAME}"
 	# The eval call is necessary for cases like:
 	# command_args="this \"is a\" test"
 	# to work properly.
-	eval supervise-daemon "${RC_SVCNAME}" --start \
+	eval supervise-daemon "${RC_SVCNAME}" --start ${_shared} \
 		${retry:+--retry} $retry \
 		${directory:+--chdir} $directory  \
 		${chroot:+--chroot} $chroot \
@@ -34,10 +41,18 @@ supervise_start()
 		${respawn_delay:+--respawn-delay} $respawn_delay \
 		${respawn_max:+--respawn-max} $respawn_max \
 		${respawn_period:+--respawn-period} $respawn_period \
+		${respawn_delay_max:+--respawn-delay-max} $respawn_delay_max \
+		${respawn_stable:+--respawn-stable} $respawn_stable \
 		${healthcheck_delay:+--healthcheck-delay} $healthcheck_delay \
 		${healthcheck_timer:+--healthcheck-timer} $healthcheck_timer \
 		${command_user+--user} $command_user \
 		${umask+--umask} $umask \
+		${notify:+--notify} $notify \
+		${_ready_check} \
+		${ready_timeout:+--ready-timeout} $ready_timeout \
+		${RC_LISTEN_FDS:+--listen-fds} $RC_LISTEN_FDS \
+		${_cgroup} \
+		${rc_cpu_affinity:+--cpu-affinity} $rc_cpu_affinity \
 		${supervise_daemon_args:-${start_stop_daemon_args}} \
 		$command \
 		-- $command_args $command_args_foreground
@@ -0,0 +1,147 @@
+/*
+ * rc-events.h
+ * This is private to us and not for user consumption
+ *
+ * When EINFO_EVENTS names a file, libeinfo and librc append one JSON
+ * object per line to it for each message, ebegin/eend and service state
+ * change. Each record goes out whole in a single O_APPEND write as soon
+ * as it is made, so records from different processes never mix and none
+ * are lost when a process execs, calls _exit or is killed.
+ * The file is kept open between records. Both libraries get their own
+ * copy of it, which is fine as neither buffers anything. Code that
+ * closes every fd does so in a child, and a new pid means we open the
+ * file again.
+ */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#ifndef __RC_EVENTS_H__
+#define __RC_EVENTS_H__
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "helpers.h"
+
+#define EVENT_BUFSIZ	4096
+#define EVENT_MSGSIZ	1024
+
+static int event_fd = -1;
+static pid_t event_pid;
+static char *event_path;
+
+/* The fd for path in this process, opened again if either changed */
+_unused static int event_open(const char *path)
+{
+	pid_t pid = getpid();
+
+	if (event_fd != -1 && event_pid == pid &&
+	    strcmp(event_path, path) == 0)
+		return event_fd;
+	/* A child may have closed the fd it got from us and had the number
+	 * given to something else, so only close one we opened ourselves */
+	if (event_fd != -1 && event_pid == pid)
+		close(event_fd);
+	free(event_path);
+	event_path = xstrdup(path);
+	event_pid = pid;
+	event_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+	    0644);
+	return event_fd;
+}
+
+/* Append "key":"value" to rec, escaped for JSON */
+_unused static size_t event_json(char *rec, size_t len, size_t size,
+		const char *key, const char *value)
+{
+	const char *p;
+
+	if (!value || len + strlen(key) + 8 >= size)
+		return len;
+	len += snprintf(rec + len, size - len, ",\"%s\":\"", key);
+	for (p = value; *p && len + 8 < size; p++) {
+		if (*p == '"' || *p == '\\')
+			len += snprintf(rec + len, size - len, "\\%c", *p);
+		else if ((unsigned char)*p < 0x20)
+			len += snprintf(rec + len, size - len, "\\u%04x",
+			    (unsigned char)*p);
+		else
+			rec[len++] = *p;
+	}
+	rec[len++] = '"';
+	return len;
+}
+
+/*
+ * Record an event. service defaults to RC_SVCNAME, result and fmt may be
+ * NULL to leave them out.
+ */
+_unused _xasprintf(4, 0) static void event_addv(const char *service,
+		const char *event, const char *result, const char *fmt,
+		va_list ap)
+{
+	const char *path = getenv("EINFO_EVENTS");
+	char rec[EVENT_BUFSIZ], msg[EVENT_MSGSIZ];
+	struct timespec ts;
+	size_t len;
+	va_list apc;
+	int fd, serrno;
+
+	if (!path)
+		return;
+	if (!service)
+		service = getenv("RC_SVCNAME");
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	len = snprintf(rec, sizeof(rec), "{\"time\":%lld.%06ld,\"pid\":%d",
+	    (long long)ts.tv_sec, ts.tv_nsec / 1000, (int)getpid());
+	len = event_json(rec, len, sizeof(rec) - 2, "service", service);
+	len = event_json(rec, len, sizeof(rec) - 2, "runlevel",
+	    getenv("RC_RUNLEVEL"));
+	len = event_json(rec, len, sizeof(rec) - 2, "event", event);
+	len = event_json(rec, len, sizeof(rec) - 2, "result", result);
+	if (fmt) {
+		va_copy(apc, ap);
+		vsnprintf(msg, sizeof(msg), fmt, apc);
+		va_end(apc);
+		len = event_json(rec, len, sizeof(rec) - 2, "message", msg);
+	}
+	rec[len++] = '}';
+	rec[len++] = '\n';
+
+	/* Losing a record is not worth failing the caller over */
+	serrno = errno;
+	if ((fd = event_open(path)) != -1 && write(fd, rec, len) == -1) {}
+	errno = serrno;
+}
+
+_unused _xasprintf(4, 5) static void event_add(const char *service,
+		const char *event, const char *result, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	event_addv(service, event, result, fmt, ap);
+	va_end(ap);
+}
+
+#endif
@@ -32,7 +32,19 @@
 #define RC_LEVEL_DEFAULT        "default"
 
 #define RC_DEPTREE_CACHE        RC_SVCDIR "/deptree"
+#define RC_DEPTREE_BIN_SUFFIX	".bin"
+#define RC_DEPTREE_BINARY	RC_DEPTREE_CACHE RC_DEPTREE_BIN_SUFFIX
 #define RC_DEPTREE_SKEWED	RC_SVCDIR "/clock-skewed"
+#define RC_DEPCACHE		RC_SVCDIR "/depcache"
+#define RC_DEPCONFIG		RC_SVCDIR "/depconfig"
+#define RC_DEPTREE_GEN		RC_DEPTREE_CACHE ".gen"
+#define RC_DEPWATCH		RC_SVCDIR "/depwatch"
+#define RC_DEPWATCH_LOCK	RC_DEPWATCH ".lock"
+#define RC_PROCS_SNAPSHOT	RC_SVCDIR "/procs"
+#define RC_TIMING		RC_SVCDIR "/timing"
+#define RC_EVENTLOG		RC_SVCDIR "/rc.events"
+#define RC_PLUGIN_SPOOL		RC_SVCDIR "/plugin.events"
+#define RC_CONF_CACHE		RC_SVCDIR "/tmp/rc.conf.bin"
 #define RC_KRUNLEVEL            RC_SVCDIR "/krunlevel"
 #define RC_STARTING             RC_SVCDIR "/rc.starting"
 #define RC_STOPPING             RC_SVCDIR "/rc.stopping"
@@ -41,6 +53,9 @@
 #define RC_SVCDIR_INACTIVE      RC_SVCDIR "/inactive"
 #define RC_SVCDIR_STARTED       RC_SVCDIR "/started"
 #define RC_SVCDIR_COLDPLUGGED	RC_SVCDIR "/coldplugged"
+#define RC_SVCDIR_STATE		RC_SVCDIR "/state"
+#define RC_SVCDIR_STATE_LOCK	RC_SVCDIR "/state.lock"
+#define RC_SVCDIR_LISTENING	RC_SVCDIR "/listening"
 
 char *rc_conf_value(const char *var);
 bool rc_conf_yesno(const char *var);
@@ -51,6 +66,7 @@ int signal_setup_restart(int sig, void (*handler)(int));
 int svc_lock(const char *);
 int svc_unlock(const char *, int);
 pid_t exec_service(const char *, const char *);
+void exec_service_deptree(int);
 
 /*
  * Check whether path is writable or not,
@@ -70,5 +86,7 @@ RC_SERVICE lookup_service_state(const char *service);
 void from_time_t(char *time_string, time_t tv);
 time_t to_time_t(char *timestring);
 pid_t get_pid(const char *applet, const char *pidfile);
+void timing_mark(const char *service, const char *action, const char *phase);
+void timing_trim(void);
 
 #endif
@@ -128,6 +128,10 @@ void eoutdent(void);
 void eindentv(void);
 void eoutdentv(void);
 
+/*! @brief Work out the terminal capabilities and save them in the
+ * environment, so that our children do not have to */
+void eterm_export(void);
+
 /*! @brief Prefix each einfo line with something */
 void eprefix(const char * EINFO_RESTRICT);
 
@@ -39,6 +39,7 @@ static const char libeinfo_copyright[] = "Copyright (c) 2007-2008 Roy Marples";
 
 #include "einfo.h"
 #include "helpers.h"
+#include "rc-events.h"
 
 /* Incase we cannot work out how many columns from ioctl, supply a default */
 #define DEFAULT_COLS		 80
@@ -102,6 +103,15 @@ static char *goto_column = NULL;
 
 static const char *term = NULL;
 static bool term_is_cons25 = false;
+static int term_columns = 0;
+
+/* eterm_export() saves what colour_terminal() works out in
+ * TERMCACHE as TERM, EINFO_COLOR, colour, columns and then the escape
+ * strings, separated by TERMCACHE_SEP. */
+#define TERMCACHE		"EINFO_TERMCAP"
+#define TERMCACHE_SEP		'\037'
+#define TERMCACHE_FIELDS	(4 + ARRAY_SIZE(ecolors) + 3)
+static char termcache[sizeof(ebuffer) + 256];
 
 /* Termcap buffers and pointers
  * Static buffers suck hard, but some termcap implementations require them */
@@ -310,6 +320,43 @@ tgoto(const char *cap, int col, int line)
 }
 #endif
 
+/* Pick up the capabilities our parent worked out for us, returning
+ * -1 if they do not apply to our terminal, otherwise 0 or 1 for colour */
+static int
+termcache_load(void)
+{
+	char *e = getenv(TERMCACHE);
+	char *field[TERMCACHE_FIELDS];
+	const char *color = getenv("EINFO_COLOR");
+	size_t n, i;
+	char *p;
+
+	if (!e || strlen(e) >= sizeof(termcache))
+		return -1;
+	strlcpy(termcache, e, sizeof(termcache));
+	for (n = 0, p = termcache; n < TERMCACHE_FIELDS; n++) {
+		field[n] = p;
+		if (!(p = strchr(p, TERMCACHE_SEP)))
+			break;
+		*p++ = '\0';
+	}
+	if (n < 3 || strcmp(field[0], term) != 0 ||
+	    strcmp(field[1], color ? color : "") != 0)
+		return -1;
+	term_columns = atoi(field[3]);
+	if (field[2][0] != '1')
+		return 0;
+	if (n != TERMCACHE_FIELDS - 1)
+		return -1;
+
+	for (i = 0; i < ARRAY_SIZE(ecolors); i++)
+		ecolors_str[i] = field[4 + i];
+	flush = field[4 + i];
+	up = field[5 + i];
+	goto_column = field[6 + i];
+	return 1;
+}
+
 static bool
 colour_terminal(FILE * EINFO_RESTRICT f)
 {
@@ -345,6 +392,9 @@ colour_terminal(FILE * EINFO_RESTRICT f)
 	if (strcmp(term, "cons25") == 0)
 		term_is_cons25 = true;
 
+	if ((in_colour = termcache_load()) != -1)
+		return in_colour == 1;
+
 #ifdef HAVE_TERMCAP
 	/* Check termcap to see if we can do colour or not */
 	if (tgetent(termcapbuf, term) == 1) {
@@ -457,8 +507,10 @@ colour_terminal(FILE * EINFO_RESTRICT f)
 	return true;
 }
 
+/* Our parent only knows the width of its terminal, so we can only use
+ * it when we know we are writing to a terminal too */
 static int
-get_term_columns(FILE * EINFO_RESTRICT stream)
+get_term_columns(FILE * EINFO_RESTRICT stream, bool tty)
 {
 	struct winsize ws;
 	char *env = getenv("COLUMNS");
@@ -471,12 +523,48 @@ get_term_columns(FILE * EINFO_RESTRICT stream)
 			return i;
 	}
 
+	if (tty && term_columns > 0)
+		return term_columns;
 	if (ioctl(fileno(stream), TIOCGWINSZ, &ws) == 0)
 		return ws.ws_col;
 
 	return DEFAULT_COLS;
 }
 
+void
+eterm_export(void)
+{
+	struct winsize ws;
+	const char *color = getenv("EINFO_COLOR");
+	char buf[sizeof(termcache)];
+	bool colour;
+	size_t len, i;
+	int cols = 0;
+
+	/* This reuses what our parent gave us if it still applies */
+	colour = colour_terminal(NULL);
+	if (!term || strchr(term, TERMCACHE_SEP) ||
+	    (color && strchr(color, TERMCACHE_SEP)))
+		return;
+	if (isatty(STDOUT_FILENO) &&
+	    ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0)
+		cols = ws.ws_col;
+
+	len = snprintf(buf, sizeof(buf), "%s%c%s%c%d%c%d", term,
+	    TERMCACHE_SEP, color ? color : "", TERMCACHE_SEP, colour,
+	    TERMCACHE_SEP, cols);
+	if (colour) {
+		for (i = 0; i < ARRAY_SIZE(ecolors); i++)
+			len += snprintf(buf + len, sizeof(buf) - len, "%c%s",
+			    TERMCACHE_SEP, ecolors_str[i]);
+		len += snprintf(buf + len, sizeof(buf) - len, "%c%s%c%s%c%s",
+		    TERMCACHE_SEP, flush, TERMCACHE_SEP, up,
+		    TERMCACHE_SEP, goto_column);
+	}
+	if (len < sizeof(buf))
+		setenv(TERMCACHE, buf, 1);
+}
+
 void
 eprefix(const char *EINFO_RESTRICT prefix)
 {
@@ -489,6 +577,10 @@ elogv(int level, const char *EINFO_RESTRICT fmt, va_list ap)
 	char *e = getenv("EINFO_LOG");
 	va_list apc;
 
+	if (fmt)
+		event_addv(NULL, "log",
+		    level == LOG_ERR ? "error" :
+		    level == LOG_WARNING ? "warning" : "info", fmt, ap);
 	if (fmt && e) {
 		closelog();
 		openlog(e, LOG_PID, LOG_DAEMON);
@@ -730,9 +822,14 @@ ebegin(const char *EINFO_RESTRICT fmt, ...)
 	int retval;
 	va_list ap;
 
-	if (!fmt || is_quiet())
+	if (!fmt)
 		return 0;
 	va_start(ap, fmt);
+	event_addv(NULL, "begin", NULL, fmt, ap);
+	if (is_quiet()) {
+		va_end(ap);
+		return 0;
+	}
 	retval = _einfovn(fmt, ap);
 	va_end(ap);
 	retval += printf(" ...");
@@ -747,11 +844,13 @@ _eend(FILE * EINFO_RESTRICT fp, int col, ECOLOR color, const char *msg)
 {
 	int i;
 	int cols;
+	bool colour;
 
 	if (!msg)
 		return;
 
-	cols = get_term_columns(fp) - (strlen(msg) + 5);
+	colour = colour_terminal(fp);
+	cols = get_term_columns(fp, colour) - (strlen(msg) + 5);
 
 	/* cons25 is special - we need to remove one char, otherwise things
 	 * do not align properly at all. */
@@ -765,7 +864,7 @@ _eend(FILE * EINFO_RESTRICT fp, int col, ECOLOR color, const char *msg)
 	if (term_is_cons25)
 		cols--;
 
-	if (cols > 0 && colour_terminal(fp)) {
+	if (cols > 0 && colour) {
 		fprintf(fp, "%s%s %s[%s %s %s]%s\n", up, tgoto(goto_column, 0, cols),
 		    ecolor(ECOLOR_BRACKET), ecolor(color), msg,
 		    ecolor(ECOLOR_BRACKET), ecolor(ECOLOR_NORMAL));
@@ -777,6 +876,14 @@ _eend(FILE * EINFO_RESTRICT fp, int col, ECOLOR color, const char *msg)
 	}
 }
 
+static void EINFO_PRINTF(2, 0)
+_end_event(int retval, const char *EINFO_RESTRICT fmt, va_list ap)
+{
+	/* The message is only shown for failures */
+	event_addv(NULL, "end", retval == 0 ? OK : "fail",
+	    fmt && *fmt != '\0' && retval != 0 ? fmt : NULL, ap);
+}
+
 static int EINFO_PRINTF(3, 0)
 _do_eend(const char *cmd, int retval,
     const char *EINFO_RESTRICT fmt, va_list ap)
@@ -785,6 +892,7 @@ _do_eend(const char *cmd, int retval,
 	FILE *fp = stdout;
 	va_list apc;
 
+	_end_event(retval, fmt, ap);
 	if (fmt && *fmt != '\0' && retval != 0) {
 		fp = stderr;
 		va_copy(apc, ap);
@@ -806,9 +914,12 @@ eend(int retval, const char *EINFO_RESTRICT fmt, ...)
 {
 	va_list ap;
 
-	if (is_quiet())
-		return retval;
 	va_start(ap, fmt);
+	if (is_quiet()) {
+		_end_event(retval, fmt, ap);
+		va_end(ap);
+		return retval;
+	}
 	_do_eend("eend", retval, fmt, ap);
 	va_end(ap);
 	LASTCMD("eend");
@@ -820,9 +931,12 @@ ewend(int retval, const char *EINFO_RESTRICT fmt, ...)
 {
 	va_list ap;
 
-	if (is_quiet())
-		return retval;
 	va_start(ap, fmt);
+	if (is_quiet()) {
+		_end_event(retval, fmt, ap);
+		va_end(ap);
+		return retval;
+	}
 	_do_eend("ewend", retval, fmt, ap);
 	va_end(ap);
 	LASTCMD("ewend");
@@ -953,6 +1067,7 @@ ebeginv(const char *EINFO_RESTRICT fmt, ...)
 		return 0;
 
 	va_start(ap, fmt);
+	event_addv(NULL, "begin", NULL, fmt, ap);
 	retval = _einfovn(fmt, ap);
 	retval += printf(" ...");
 	if (colour_terminal(stdout))
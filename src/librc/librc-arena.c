@@ -0,0 +1,120 @@
+/*
+ * librc-arena.c
+ * Memory handed out in pieces from a few large blocks and freed all at
+ * once, for things which are built up and thrown away together.
+ */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include "queue.h"
+#include "librc.h"
+#include "helpers.h"
+
+#define ARENA_BLOCK	8192
+
+union arena_align {
+	void *p;
+	long long l;
+	double d;
+};
+
+#define ARENA_ALIGN	sizeof(union arena_align)
+
+struct arena_block {
+	struct arena_block *next;
+	size_t len;
+	size_t size;
+	union arena_align data[];
+};
+
+struct rc_arena {
+	struct arena_block *block;
+};
+
+RC_ARENA *
+arena_new(void)
+{
+	RC_ARENA *arena = xmalloc(sizeof(*arena));
+
+	arena->block = NULL;
+	return arena;
+}
+
+void *
+arena_alloc(RC_ARENA *arena, size_t size)
+{
+	struct arena_block *b = arena->block;
+	size_t bsize;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (!b || b->size - b->len < size) {
+		/* Big requests get a block of their own behind the current
+		 * one so we carry on filling that */
+		bsize = size > ARENA_BLOCK / 4 ? size : ARENA_BLOCK;
+		b = xmalloc(sizeof(*b) + bsize);
+		b->len = 0;
+		b->size = bsize;
+		if (bsize != ARENA_BLOCK && arena->block) {
+			b->next = arena->block->next;
+			arena->block->next = b;
+		} else {
+			b->next = arena->block;
+			arena->block = b;
+		}
+	}
+	p = (char *)b->data + b->len;
+	b->len += size;
+	return p;
+}
+
+char *
+arena_strdup(RC_ARENA *arena, const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	return memcpy(arena_alloc(arena, len), s, len);
+}
+
+RC_STRINGLIST *
+arena_stringlist_new(RC_ARENA *arena)
+{
+	RC_STRINGLIST *list = arena_alloc(arena, sizeof(*list));
+
+	TAILQ_INIT(list);
+	return list;
+}
+
+RC_STRING *
+arena_stringlist_add(RC_ARENA *arena, RC_STRINGLIST *list, char *value)
+{
+	RC_STRING *s = arena_alloc(arena, sizeof(*s));
+
+	s->value = value;
+	TAILQ_INSERT_TAIL(list, s, entries);
+	return s;
+}
+
+void
+arena_free(RC_ARENA *arena)
+{
+	struct arena_block *b, *nb;
+
+	if (!arena)
+		return;
+	for (b = arena->block; b; b = nb) {
+		nb = b->next;
+		free(b);
+	}
+	free(arena);
+}
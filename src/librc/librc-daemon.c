@@ -20,61 +20,476 @@
 
 #if defined(__linux__) || (defined (__FreeBSD_kernel__) && defined(__GLIBC__)) \
 	|| defined(__GNU__)
+#include <sys/mman.h>
+#include <inttypes.h>
+#include <stdint.h>
+
+/* Read the name and start time of a process from /proc/<pid>/stat */
+static bool
+pid_stat(pid_t pid, char *comm, size_t commlen, unsigned long long *start)
+{
+	char file[PATH_MAX], buffer[1024];
+	char *p, *e;
+	ssize_t bytes;
+	int fd, i;
+
+	snprintf(file, sizeof(file), "/proc/%d/stat", pid);
+	if ((fd = open(file, O_RDONLY)) == -1)
+		return false;
+	bytes = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (bytes <= 0)
+		return false;
+	buffer[bytes] = '\0';
+
+	/* The name can have anything in it, so look for the last ) */
+	if (!(p = strchr(buffer, '(')) || !(e = strrchr(p, ')')))
+		return false;
+	if (comm)
+		snprintf(comm, commlen, "%.*s", (int)(e - p - 1), p + 1);
+
+	/* starttime is the 20th field after the name */
+	if (start) {
+		p = e + 1;
+		for (i = 0; i < 19 && p; i++)
+			p = strchr(p + 1, ' ');
+		if (!p || sscanf(p, "%llu", start) != 1)
+			return false;
+	}
+	return true;
+}
+
+static bool
+pid_start(pid_t pid, unsigned long long *start)
+{
+	return pid_stat(pid, NULL, 0, start);
+}
+
+/* Matches like the kernel shows it, the name is followed by ) */
+static bool
+comm_is_exec(const char *comm, const char *exec)
+{
+	size_t len;
+
+	exec = basename_c(exec);
+	len = strlen(exec);
+	return strncmp(comm, exec, len) == 0 &&
+	    (comm[len] == '\0' || comm[len] == ')');
+}
+
 static bool
 pid_is_exec(pid_t pid, const char *exec)
 {
-	char *buffer = NULL;
+	char comm[PATH_MAX];
+
+	return pid_stat(pid, comm, sizeof(comm), NULL) &&
+	    comm_is_exec(comm, exec);
+}
+
+static bool
+cmdline_is_argv(const char *buffer, size_t size, const char *const *argv)
+{
+	const char *p = buffer;
+
+	while (*argv) {
+		if (strcmp(*argv, p) != 0)
+			return false;
+		argv++;
+		p += strlen(p) + 1;
+		if ((size_t)(p - buffer) > size)
+			return false;
+	}
+	return true;
+}
+
+static ssize_t
+pid_cmdline(pid_t pid, char *buffer, size_t size)
+{
+	char file[PATH_MAX];
+	int fd;
+	ssize_t bytes;
+
+	snprintf(file, sizeof(file), "/proc/%u/cmdline", pid);
+	if ((fd = open(file, O_RDONLY)) < 0)
+		return -1;
+	bytes = read(fd, buffer, size - 1);
+	close(fd);
+	if (bytes == -1)
+		return -1;
+	buffer[bytes] = '\0';
+	return bytes;
+}
+
+static bool
+pid_is_argv(pid_t pid, const char *const *argv)
+{
+	char buffer[PATH_MAX];
+
+	if (pid_cmdline(pid, buffer, sizeof(buffer)) == -1)
+		return false;
+	return cmdline_is_argv(buffer, sizeof(buffer), argv);
+}
+
+/*
+ * rc can take a snapshot of the process table before stopping a lot of
+ * services at once, so that rc_find_pids in each of them can search
+ * that instead of walking /proc again.
+ * RC_PROCS in the environment holds the generation of the snapshot to
+ * use, anything else in the file is ignored. Processes found in it are
+ * checked to still be running with the same start time before we hand
+ * them out. Entries are sorted by pid, and we still list /proc to look
+ * properly at any process that is not in the snapshot as it started
+ * after it was taken, so nothing forked since escapes a stop.
+ */
+#define PROCS_MAGIC	"RCPROCS"
+
+struct procs_header {
+	char magic[8];
+	uint64_t generation;
+	uint32_t count;
+	uint32_t size;
+};
+
+struct procs_entry {
+	int32_t pid;
+	uint32_t uid;
+	uint64_t start;
+	uint32_t comm;
+	uint32_t cmdline;
+	uint32_t cmdlen;
+	uint32_t ns;
+	uint32_t container;
+};
+
+static uint64_t procs_generation;
+
+/* Is this an OpenVZ host, in which case we skip container processes */
+static bool
+openvz_host(void)
+{
 	FILE *fp;
-	int c;
+	char *line = NULL;
+	size_t len = 0;
 	bool retval = false;
 
-	exec = basename_c(exec);
-	xasprintf(&buffer, "/proc/%d/stat", pid);
-	if ((fp = fopen(buffer, "r"))) {
-		while ((c = getc(fp)) != EOF && c != '(')
-			;
-		if (c == '(') {
-			while ((c = getc(fp)) != EOF && c == *exec)
-				exec++;
-			if (c == ')' && *exec == '\0')
-				retval = true;
+	if (!exists("/proc/self/status") ||
+	    !(fp = fopen("/proc/self/status", "r")))
+		return false;
+	while (! feof(fp)) {
+		rc_getline(&line, &len, fp);
+		if (strncmp(line, "envID:\t0", 8) == 0) {
+			retval = true;
+			break;
 		}
-		fclose(fp);
 	}
-	free(buffer);
+	fclose(fp);
+	free(line);
 	return retval;
 }
 
 static bool
-pid_is_argv(pid_t pid, const char *const *argv)
+pid_in_container(pid_t pid)
 {
-	char *cmdline = NULL;
+	char file[PATH_MAX];
+	FILE *fp;
+	char *line = NULL;
+	size_t len = 0;
+	bool retval = false;
+
+	snprintf(file, sizeof(file), "/proc/%d/status", pid);
+	if (!(fp = fopen(file, "r")))
+		return false;
+	while (! feof(fp)) {
+		rc_getline(&line, &len, fp);
+		if (strncmp(line, "envID:", 6) == 0) {
+			retval = ! (strncmp(line, "envID:\t0", 8) == 0);
+			break;
+		}
+	}
+	fclose(fp);
+	free(line);
+	return retval;
+}
+
+static uint32_t
+procs_string(char **strs, size_t *len, size_t *size, const char *str,
+    size_t slen)
+{
+	uint32_t off = (uint32_t)*len;
+
+	while (*len + slen + 1 > *size) {
+		*size = *size ? *size * 2 : 65536;
+		*strs = xrealloc(*strs, *size);
+	}
+	memcpy(*strs + *len, str, slen);
+	(*strs)[*len + slen] = '\0';
+	*len += slen + 1;
+	return off;
+}
+
+static int
+procs_cmp(const void *a, const void *b)
+{
+	const struct procs_entry *pa = a, *pb = b;
+
+	return (pa->pid > pb->pid) - (pa->pid < pb->pid);
+}
+
+bool
+rc_proc_snapshot_begin(void)
+{
+	DIR *procdir;
+	struct dirent *entry;
+	struct procs_header hdr;
+	struct procs_entry *procs = NULL, *e;
+	size_t count = 0, nprocs = 0, slen = 0, ssize = 0;
+	char *strs = NULL;
+	char file[PATH_MAX], comm[PATH_MAX], cmdline[PATH_MAX], ns[30];
+	char tmp[] = RC_PROCS_SNAPSHOT ".XXXXXX";
+	char gen[32];
+	unsigned long long start;
+	ssize_t bytes;
+	struct stat sb;
+	bool openvz = openvz_host();
+	bool retval = false;
+	pid_t p;
+	FILE *fp;
 	int fd;
+
+	if ((procdir = opendir("/proc")) == NULL)
+		return false;
+	while ((entry = readdir(procdir)) != NULL) {
+		if (sscanf(entry->d_name, "%d", &p) != 1)
+			continue;
+		if (!pid_stat(p, comm, sizeof(comm), &start))
+			continue;
+		snprintf(file, sizeof(file), "/proc/%d", p);
+		if (stat(file, &sb) != 0)
+			continue;
+		if (count == nprocs) {
+			nprocs = nprocs ? nprocs * 2 : 1024;
+			procs = xrealloc(procs, sizeof(*procs) * nprocs);
+		}
+		e = &procs[count++];
+		memset(e, 0, sizeof(*e));
+		e->pid = p;
+		e->uid = sb.st_uid;
+		e->start = start;
+		e->comm = procs_string(&strs, &slen, &ssize, comm, strlen(comm));
+		if ((bytes = pid_cmdline(p, cmdline, sizeof(cmdline))) == -1)
+			bytes = 0;
+		e->cmdline = procs_string(&strs, &slen, &ssize, cmdline,
+		    (size_t)bytes);
+		e->cmdlen = (uint32_t)bytes;
+		snprintf(file, sizeof(file), "/proc/%d/ns/pid", p);
+		if ((bytes = readlink(file, ns, sizeof(ns) - 1)) <= 0)
+			bytes = 0;
+		e->ns = procs_string(&strs, &slen, &ssize, ns, (size_t)bytes);
+		e->container = openvz && pid_in_container(p);
+	}
+	closedir(procdir);
+	if (count)
+		qsort(procs, count, sizeof(*procs), procs_cmp);
+
+	procs_generation = ((uint64_t)getpid() << 32) + procs_generation + 1;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PROCS_MAGIC, sizeof(PROCS_MAGIC));
+	hdr.generation = procs_generation;
+	hdr.count = (uint32_t)count;
+	hdr.size = (uint32_t)(sizeof(hdr) + sizeof(*procs) * count + slen);
+
+	if ((fd = mkstemp(tmp)) == -1)
+		goto out;
+	if (!(fp = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	fchmod(fd, 0644);
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+	    (!count || fwrite(procs, sizeof(*procs), count, fp) == count) &&
+	    (!slen || fwrite(strs, slen, 1, fp) == 1) &&
+	    fclose(fp) == 0)
+	{
+		if (rename(tmp, RC_PROCS_SNAPSHOT) == 0) {
+			snprintf(gen, sizeof(gen), "%" PRIu64, procs_generation);
+			setenv("RC_PROCS", gen, 1);
+			retval = true;
+		} else
+			unlink(tmp);
+	} else
+		unlink(tmp);
+
+out:
+	free(procs);
+	free(strs);
+	return retval;
+}
+
+void
+rc_proc_snapshot_end(void)
+{
+	unsetenv("RC_PROCS");
+	unlink(RC_PROCS_SNAPSHOT);
+}
+
+/* Does the running process p match what rc_find_pids was asked for */
+static bool
+pid_matches(pid_t p, const char *exec, const char *const *argv, uid_t uid,
+    pid_t openrc_pid, const char *my_ns, bool openvz)
+{
 	char buffer[PATH_MAX];
-	char *p;
-	ssize_t bytes;
+	char proc_ns[30];
+	struct stat sb;
+	int rc;
 
-	xasprintf(&cmdline, "/proc/%u/cmdline", pid);
-	if ((fd = open(cmdline, O_RDONLY)) < 0) {
-		free(cmdline);
+	if (openrc_pid != 0 && openrc_pid == p)
 		return false;
+	memset(proc_ns, 0, sizeof(proc_ns));
+	snprintf(buffer, sizeof(buffer), "/proc/%d/ns/pid", p);
+	if (exists(buffer)) {
+		rc = readlink(buffer, proc_ns, sizeof(proc_ns)-1);
+		if (rc <= 0)
+			proc_ns[0] = '\0';
 	}
-	bytes = read(fd, buffer, sizeof(buffer) - 1);
+	if (strlen(my_ns) && strlen (proc_ns) && strcmp(my_ns, proc_ns))
+		return false;
+	if (uid) {
+		snprintf(buffer, sizeof(buffer), "/proc/%d", p);
+		if (stat(buffer, &sb) != 0 || sb.st_uid != uid)
+			return false;
+	}
+	if (exec && !pid_is_exec(p, exec))
+		return false;
+	if (argv &&
+	    !pid_is_argv(p, (const char *const *)argv))
+		return false;
+	/* If this is an OpenVZ host, filter out container processes */
+	if (openvz && pid_in_container(p))
+		return false;
+	return true;
+}
+
+static void
+pids_add(RC_PIDLIST **pids, pid_t p)
+{
+	RC_PID *pi;
+
+	if (!*pids) {
+		*pids = xmalloc(sizeof(**pids));
+		LIST_INIT(*pids);
+	}
+	pi = xmalloc(sizeof(*pi));
+	pi->pid = p;
+	LIST_INSERT_HEAD(*pids, pi, entries);
+}
+
+/* Search the snapshot rc took for us, if there is one.
+ * Returns false when there is no usable snapshot. */
+static bool
+find_pids_snapshot(const char *exec, const char *const *argv, uid_t uid,
+    pid_t openrc_pid, const char *my_ns, RC_PIDLIST **pids)
+{
+	const char *value = getenv("RC_PROCS");
+	const struct procs_header *hdr;
+	const struct procs_entry *e, *entries, *found;
+	struct procs_entry key;
+	const char *strs;
+	unsigned long long start;
+	struct stat sb;
+	DIR *procdir;
+	struct dirent *entry;
+	bool openvz = false, checked_openvz = false;
+	void *map;
+	uint64_t gen;
+	uint32_t i;
+	char *end;
+	pid_t p;
+	int fd;
+
+	*pids = NULL;
+	if (!value || !*value)
+		return false;
+	errno = 0;
+	gen = strtoull(value, &end, 10);
+	if (errno || *end)
+		return false;
+
+	if ((fd = open(RC_PROCS_SNAPSHOT, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	if (fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(*hdr)) {
+		close(fd);
+		return false;
+	}
+	map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
 	close(fd);
-	free(cmdline);
-	if (bytes == -1)
+	if (map == MAP_FAILED)
+		return false;
+	hdr = map;
+	if (memcmp(hdr->magic, PROCS_MAGIC, sizeof(PROCS_MAGIC)) != 0 ||
+	    hdr->generation != gen || hdr->size != (uint64_t)sb.st_size ||
+	    sizeof(*hdr) + sizeof(*e) * (uint64_t)hdr->count > hdr->size)
+	{
+		munmap(map, (size_t)sb.st_size);
 		return false;
+	}
+	if ((procdir = opendir("/proc")) == NULL) {
+		munmap(map, (size_t)sb.st_size);
+		return false;
+	}
+	entries = e = (const struct procs_entry *)(hdr + 1);
+	strs = (const char *)(e + hdr->count);
 
-	buffer[bytes] = '\0';
-	p = buffer;
-	while (*argv) {
-		if (strcmp(*argv, p) != 0)
-			return false;
-		argv++;
-		p += strlen(p) + 1;
-		if ((unsigned)(p - buffer) > sizeof(buffer))
-			return false;
+	for (i = 0; i < hdr->count; i++, e++) {
+		if (openrc_pid != 0 && openrc_pid == e->pid)
+			continue;
+		if (*my_ns && strs[e->ns] && strcmp(my_ns, strs + e->ns) != 0)
+			continue;
+		if (uid && e->uid != uid)
+			continue;
+		if (exec && !comm_is_exec(strs + e->comm, exec))
+			continue;
+		if (argv && (!e->cmdlen ||
+			!cmdline_is_argv(strs + e->cmdline, e->cmdlen, argv)))
+			continue;
+		if (e->container)
+			continue;
+		/* Only these few are read again, to make sure it's still the
+		 * same process. If the pid was reused, look at the new one. */
+		if (!pid_stat(e->pid, NULL, 0, &start))
+			continue;
+		if (start != e->start) {
+			if (!checked_openvz) {
+				openvz = openvz_host();
+				checked_openvz = true;
+			}
+			if (!pid_matches(e->pid, exec, argv, uid, openrc_pid,
+				my_ns, openvz))
+				continue;
+		}
+		pids_add(pids, e->pid);
+	}
+
+	/* Anything started since we look at properly. Everything else is
+	 * just a lookup, readdir hands us the names a buffer at a time. */
+	memset(&key, 0, sizeof(key));
+	while ((entry = readdir(procdir)) != NULL) {
+		if (!isdigit((unsigned char)entry->d_name[0]))
+			continue;
+		key.pid = p = (pid_t)strtol(entry->d_name, NULL, 10);
+		found = bsearch(&key, entries, hdr->count, sizeof(*entries),
+		    procs_cmp);
+		if (found)
+			continue;
+		if (!checked_openvz) {
+			openvz = openvz_host();
+			checked_openvz = true;
+		}
+		if (pid_matches(p, exec, argv, uid, openrc_pid, my_ns, openvz))
+			pids_add(pids, p);
 	}
+	closedir(procdir);
+	munmap(map, (size_t)sb.st_size);
 	return true;
 }
 
@@ -83,24 +498,15 @@ rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
 {
 	DIR *procdir;
 	struct dirent *entry;
-	FILE *fp;
 	int rc;
-	bool container_pid = false;
-	bool openvz_host = false;
-	char *line = NULL;
+	bool openvz = false;
 	char my_ns[30];
-	char proc_ns[30];
-	size_t len = 0;
 	pid_t p;
 	char *buffer = NULL;
-	struct stat sb;
 	pid_t openrc_pid = 0;
 	char *pp;
 	RC_PIDLIST *pids = NULL;
-	RC_PID *pi;
-
-	if ((procdir = opendir("/proc")) == NULL)
-		return NULL;
+	bool looked = false;
 
 	/*
 	  We never match RC_OPENRC_PID if present so we avoid the below
@@ -118,94 +524,53 @@ rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
 			openrc_pid = 0;
 	}
 
-	/*
-	If /proc/self/status contains EnvID: 0, then we are an OpenVZ host,
-	and we will need to filter out processes that are inside containers
-	from our list of pids.
-	*/
-
-	if (exists("/proc/self/status")) {
-		fp = fopen("/proc/self/status", "r");
-		if (fp) {
-			while (! feof(fp)) {
-				rc_getline(&line, &len, fp);
-				if (strncmp(line, "envID:\t0", 8) == 0) {
-					openvz_host = true;
-					break;
-				}
-			}
-			fclose(fp);
-		}
-	}
-
 	memset(my_ns, 0, sizeof(my_ns));
-	memset(proc_ns, 0, sizeof(proc_ns));
 	if (exists("/proc/self/ns/pid")) {
 		rc = readlink("/proc/self/ns/pid", my_ns, sizeof(my_ns)-1);
 		if (rc <= 0)
 			my_ns[0] = '\0';
 	}
 
-	while ((entry = readdir(procdir)) != NULL) {
-		if (sscanf(entry->d_name, "%d", &p) != 1)
-			continue;
-		if (openrc_pid != 0 && openrc_pid == p)
-			continue;
-		if (pid != 0 && pid != p)
-			continue;
-		xasprintf(&buffer, "/proc/%d/ns/pid", p);
-		if (exists(buffer)) {
-			rc = readlink(buffer, proc_ns, sizeof(proc_ns)-1);
-			if (rc <= 0)
-				proc_ns[0] = '\0';
-		}
-		free(buffer);
-		if (strlen(my_ns) && strlen (proc_ns) && strcmp(my_ns, proc_ns))
-			continue;
-		if (uid) {
+	if (pid == 0 &&
+	    find_pids_snapshot(exec, argv, uid, openrc_pid, my_ns, &pids))
+		return pids;
+
+	/* When we know the pid there is no need to walk all of /proc */
+	if (pid != 0)
+		procdir = NULL;
+	else if ((procdir = opendir("/proc")) == NULL)
+		return NULL;
+
+	/*
+	If /proc/self/status contains EnvID: 0, then we are an OpenVZ host,
+	and we will need to filter out processes that are inside containers
+	from our list of pids.
+	*/
+	openvz = openvz_host();
+
+	for (;;) {
+		if (procdir) {
+			if ((entry = readdir(procdir)) == NULL)
+				break;
+			if (sscanf(entry->d_name, "%d", &p) != 1)
+				continue;
+		} else {
+			if (looked)
+				break;
+			looked = true;
+			p = pid;
 			xasprintf(&buffer, "/proc/%d", p);
-			if (stat(buffer, &sb) != 0 || sb.st_uid != uid) {
+			if (!exists(buffer)) {
 				free(buffer);
 				continue;
 			}
 			free(buffer);
 		}
-		if (exec && !pid_is_exec(p, exec))
-			continue;
-		if (argv &&
-		    !pid_is_argv(p, (const char *const *)argv))
-			continue;
-		/* If this is an OpenVZ host, filter out container processes */
-		if (openvz_host) {
-			xasprintf(&buffer, "/proc/%d/status", p);
-			if (exists(buffer)) {
-				fp = fopen(buffer, "r");
-				free(buffer);
-				if (! fp)
-					continue;
-				while (! feof(fp)) {
-					rc_getline(&line, &len, fp);
-					if (strncmp(line, "envID:", 6) == 0) {
-						container_pid = ! (strncmp(line, "envID:\t0", 8) == 0);
-						break;
-					}
-				}
-				fclose(fp);
-			}
-		}
-		if (container_pid)
-			continue;
-		if (!pids) {
-			pids = xmalloc(sizeof(*pids));
-			LIST_INIT(pids);
-		}
-		pi = xmalloc(sizeof(*pi));
-		pi->pid = p;
-		LIST_INSERT_HEAD(pids, pi, entries);
+		if (pid_matches(p, exec, argv, uid, openrc_pid, my_ns, openvz))
+			pids_add(&pids, p);
 	}
-	if (line != NULL)
-		free(line);
-	closedir(procdir);
+	if (procdir)
+		closedir(procdir);
 	return pids;
 }
 
@@ -317,6 +682,65 @@ rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
 #  error "Platform not supported!"
 #endif
 
+#if !(defined(__linux__) || (defined (__FreeBSD_kernel__) && defined(__GLIBC__)) \
+	|| defined(__GNU__))
+/* kvm already hands us the whole process table in one go */
+static bool
+pid_start(pid_t pid _unused, unsigned long long *start _unused)
+{
+	return false;
+}
+
+bool
+rc_proc_snapshot_begin(void)
+{
+	return false;
+}
+
+void
+rc_proc_snapshot_end(void)
+{
+}
+#endif
+
+/* Is pid still the process that was started at start? */
+static bool
+pid_started(pid_t pid, unsigned long long start)
+{
+	unsigned long long now;
+
+	if (kill(pid, 0) == -1 && errno != EPERM)
+		return false;
+	return pid_start(pid, &now) && now == start;
+}
+
+/* Work out the one process we just started from how we will look for it
+ * in rc_service_daemons_crashed, so that it can check just that later. */
+static pid_t
+daemon_pid(const char *exec, const char *const *argv,
+    unsigned long long *start)
+{
+	const char *const eargv[] = { exec, NULL };
+	RC_PIDLIST *pids;
+	RC_PID *p1, *p2;
+	pid_t pid = 0;
+
+	if (!argv || !argv[0])
+		argv = eargv;
+	if (!argv[0] || !(pids = rc_find_pids(NULL, argv, 0, 0)))
+		return 0;
+	p1 = LIST_FIRST(pids);
+	if (p1 && !LIST_NEXT(p1, entries) && pid_start(p1->pid, start))
+		pid = p1->pid;
+	while (p1) {
+		p2 = LIST_NEXT(p1, entries);
+		free(p1);
+		p1 = p2;
+	}
+	free(pids);
+	return pid;
+}
+
 static bool
 _match_daemon(const char *path, const char *file, RC_STRINGLIST *match)
 {
@@ -392,6 +816,8 @@ rc_service_daemon_set(const char *service, const char *exec,
 	RC_STRINGLIST *match;
 	int i = 0;
 	FILE *fp;
+	pid_t pid;
+	unsigned long long start;
 
 	if (!exec && !pidfile) {
 		errno = EINVAL;
@@ -442,6 +868,12 @@ rc_service_daemon_set(const char *service, const char *exec,
 				if (pidfile)
 					fprintf(fp, "%s", pidfile);
 				fprintf(fp, "\n");
+				/* Without a pidfile we would have to search
+				 * for it, so note who it is right now */
+				if (!pidfile &&
+				    (pid = daemon_pid(exec, argv, &start)) > 0)
+					fprintf(fp, "pid=%d\nstart=%llu\n",
+					    pid, start);
 				fclose(fp);
 				retval = true;
 			}
@@ -519,6 +951,8 @@ rc_service_daemons_crashed(const char *service)
 	size_t i;
 	char *ch_root;
 	char *spidfile;
+	pid_t rpid;
+	unsigned long long rstart;
 
 	path += snprintf(dirpath, sizeof(dirpath), RC_SVCDIR "/daemons/%s",
 	    basename_c(service));
@@ -536,6 +970,8 @@ rc_service_daemons_crashed(const char *service)
 		if (!fp)
 			break;
 
+		rpid = 0;
+		rstart = 0;
 		while ((rc_getline(&line, &len, fp))) {
 			p = line;
 			if ((token = strsep(&p, "=")) == NULL || !p)
@@ -559,6 +995,12 @@ rc_service_daemons_crashed(const char *service)
 			} else if (strcmp(token, "pidfile") == 0) {
 				pidfile = xstrdup(p);
 				break;
+			} else if (strcmp(token, "pid") == 0) {
+				if (sscanf(p, "%d", &rpid) != 1)
+					rpid = 0;
+			} else if (strcmp(token, "start") == 0) {
+				if (sscanf(p, "%llu", &rstart) != 1)
+					rpid = 0;
 			}
 		}
 		fclose(fp);
@@ -619,6 +1061,9 @@ rc_service_daemons_crashed(const char *service)
 			if (pid != 0) {
 				if (kill(pid, 0) == -1 && errno == ESRCH)
 					retval = true;
+			} else if (rpid > 0 && pid_started(rpid, rstart)) {
+				/* Still the process we started, otherwise
+				 * it may have forked again so search */
 			} else if ((pids = rc_find_pids(exec,
 				    (const char *const *)argv,
 				    0, pid)))
@@ -0,0 +1,745 @@
+/*
+ * librc-gendep.c
+ * Work out what gendepends.sh would print for an init script without
+ * starting a shell, for the scripts simple enough that we can be sure.
+ *
+ * We only understand files made of comments, plain assignments,
+ * : ${var:=default} lines and function definitions, where depend() only
+ * calls need, use and friends with literal service names.
+ * Anything else, or any doubt at all, is left to the shell.
+ */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include "librc.h"
+#include "helpers.h"
+
+struct gendep_var {
+	const char *name;
+	const char *value;	/* NULL if only a shell knows what it is */
+	struct gendep_var *next;
+};
+
+/* The variables and functions a set of sourced files leave behind */
+struct gendep_conf {
+	RC_ARENA *arena;
+	struct gendep_var *vars;	/* the last one assigned comes first */
+	const char *depend;		/* the body of depend() */
+	bool status;			/* it answers status itself */
+};
+
+typedef struct gendep_out {
+	char *buf;
+	size_t len;
+	size_t size;
+} GENDEP_OUT;
+
+/* The dependency types in the order _depend adds the user defined ones,
+ * and what gendepends.sh calls them */
+static const char *const dep_types[][2] = {
+	{ "config", "config" },
+	{ "need", "ineed" },
+	{ "use", "iuse" },
+	{ "want", "iwant" },
+	{ "after", "iafter" },
+	{ "before", "ibefore" },
+	{ "provide", "iprovide" },
+	{ "listen", "listen" },
+	{ "keyword", "keyword" },
+};
+#define NDEP_TYPES (sizeof(dep_types) / sizeof(dep_types[0]))
+
+/* Redefining any of these changes what gendepends.sh does */
+static const char *const shell_funcs[] = {
+	"_depend", "_status", "_get_containers", "_get_containers_remove",
+	"shell_var", "echo", "eval", "local", "set", "shift", "test",
+	"type", "unset", "[", NULL
+};
+
+/* Defining any of these means the init script answers status itself */
+static const char *const status_funcs[] = {
+	"status", "status_pre", "status_post", NULL
+};
+
+#define DEP_WORD_CHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZ" \
+	"abcdefghijklmnopqrstuvwxyz0123456789_./:+@%,=!-"
+
+static bool
+is_name(int c)
+{
+	return isalnum((unsigned char)c) || c == '_';
+}
+
+static bool
+is_blank(int c)
+{
+	return c == ' ' || c == '\t';
+}
+
+/* Skip blanks and any comment, returning the end of the line or NULL
+ * if there is more on it */
+static const char *
+line_end(const char *p)
+{
+	while (is_blank(*p))
+		p++;
+	if (*p == '#')
+		while (*p && *p != '\n')
+			p++;
+	return *p == '\n' || *p == '\0' ? p : NULL;
+}
+
+static const char *
+next_line(const char *p)
+{
+	return *p ? p + 1 : p;
+}
+
+/* p points just past a $. Returns where the expansion ends, p itself if
+ * the $ is just a $, or NULL if expanding it could run or assign
+ * anything. */
+static const char *
+skip_expansion(const char *p)
+{
+	const char *e;
+
+	if (*p == '{') {
+		if (*++p == '#')
+			p++;
+		while (is_name(*p))
+			p++;
+		if (*p == ':')
+			p++;
+		if (*p == '=' || *p == '?')
+			return NULL;
+		for (; *p != '}'; p++) {
+			if (*p == '$') {
+				if (!(e = skip_expansion(p + 1)))
+					return NULL;
+				p = e - 1;
+			} else if (*p == '\0' || strchr("`\\\"'\n", *p))
+				return NULL;
+		}
+		return p + 1;
+	}
+	if (*p == '(')
+		return NULL;
+	if (isalpha((unsigned char)*p) || *p == '_') {
+		while (is_name(*p))
+			p++;
+		return p;
+	}
+	if (*p != '\0' && strchr("@*#?$!-0123456789", *p))
+		return p + 1;
+	return p;
+}
+
+/* Unquote the word at p into buf as the shell would before expanding
+ * parameters, noting if it would expand any. Returns where the word
+ * ends or NULL if it is more than a word. */
+static const char *
+parse_word(const char *p, char *buf, bool *dynamic)
+{
+	const char *e;
+
+	*dynamic = false;
+	for (;;) {
+		switch (*p) {
+		case '\0':
+		case '\n':
+		case ' ':
+		case '\t':
+			*buf = '\0';
+			return p;
+		case '\'':
+			for (p++; *p != '\''; p++) {
+				if (*p == '\0')
+					return NULL;
+				*buf++ = *p;
+			}
+			p++;
+			break;
+		case '"':
+			for (p++; *p != '"';) {
+				if (*p == '\0' || *p == '`')
+					return NULL;
+				if (*p == '\\') {
+					if (p[1] == '\n') {
+						p += 2;
+						continue;
+					}
+					if (p[1] && strchr("$`\"\\", p[1]))
+						p++;
+				} else if (*p == '$') {
+					if (!(e = skip_expansion(p + 1)))
+						return NULL;
+					if (e != p + 1) {
+						*dynamic = true;
+						p = e;
+						continue;
+					}
+				}
+				*buf++ = *p++;
+			}
+			p++;
+			break;
+		case '\\':
+			if (p[1] == '\0')
+				return NULL;
+			if (p[1] != '\n')
+				*buf++ = p[1];
+			p += 2;
+			break;
+		case '$':
+			/* bash and dash disagree on these */
+			if (p[1] == '\'' || p[1] == '"')
+				return NULL;
+			if (!(e = skip_expansion(p + 1)))
+				return NULL;
+			if (e != p + 1) {
+				*dynamic = true;
+				p = e;
+				break;
+			}
+			*buf++ = *p++;
+			break;
+		case '~':
+			*dynamic = true;
+			*buf++ = *p++;
+			break;
+		default:
+			if (strchr("`;&|<>()", *p))
+				return NULL;
+			*buf++ = *p++;
+		}
+	}
+}
+
+static bool
+set_var(GENDEP_CONF *conf, const char *name, size_t len, const char *value)
+{
+	struct gendep_var *v;
+	char *n;
+
+	/* Word splitting has to work as gendepends.sh expects */
+	if (len == 3 && strncmp(name, "IFS", 3) == 0)
+		return false;
+	n = arena_alloc(conf->arena, len + 1);
+	memcpy(n, name, len);
+	n[len] = '\0';
+	v = arena_alloc(conf->arena, sizeof(*v));
+	v->name = n;
+	v->value = value ? arena_strdup(conf->arena, value) : NULL;
+	v->next = conf->vars;
+	conf->vars = v;
+	return true;
+}
+
+/* : ${var:=default} only matters for the variables it may assign */
+static const char *
+parse_colon(GENDEP_CONF *conf, const char *p)
+{
+	const char *e, *name;
+	size_t quotes = 0;
+
+	for (e = p; *e && *e != '\n'; e++) {
+		if (strchr("`'\\;&|<>?", *e) || (*e == '$' && e[1] == '('))
+			return NULL;
+		if (*e == '"')
+			quotes++;
+	}
+	if (quotes % 2)
+		return NULL;
+	for (; p < e; p++) {
+		if (p[0] != '$' || p[1] != '{')
+			continue;
+		for (name = p += 2; is_name(*p); p++)
+			;
+		if ((*p == ':' && p[1] == '=') || *p == '=')
+			if (!set_var(conf, name, (size_t)(p - name), NULL))
+				return NULL;
+	}
+	return e;
+}
+
+static bool
+is_listed(const char *const *list, const char *name, size_t len)
+{
+	for (; *list; list++)
+		if (strncmp(*list, name, len) == 0 && (*list)[len] == '\0')
+			return true;
+	return false;
+}
+
+/* Define the function name() whose body starts at p, just past the {.
+ * Returns the end of its last line or NULL. */
+static const char *
+parse_function(GENDEP_CONF *conf, const char *name, size_t len,
+    const char *p)
+{
+	const char *body, *end, *e;
+	size_t i;
+	char *b;
+
+	if (!is_blank(*p) && *p != '\n')
+		return NULL;
+	if ((e = line_end(p))) {
+		/* The body runs to a } at the start of a line. If we find
+		 * another function first then this one did not end like that
+		 * and we could miss the next depend(). */
+		body = p = next_line(e);
+		for (;;) {
+			if (*p == '\0')
+				return NULL;
+			if (*p == '}' && (e = line_end(p + 1)))
+				break;
+			for (e = p; is_name(*e); e++)
+				;
+			while (e > p && is_blank(*e))
+				e++;
+			if (e > p && *e == '(')
+				return NULL;
+			if (!(p = strchr(p, '\n')))
+				return NULL;
+			p++;
+		}
+		end = p;
+	} else {
+		/* or all on one line, to the last } on it */
+		body = p;
+		if (!(e = strchr(p, '\n')))
+			e = p + strlen(p);
+		for (end = e; end > body && *end != '}'; end--)
+			;
+		if (end == body || !(e = line_end(end + 1)))
+			return NULL;
+	}
+
+	for (i = 0; i < NDEP_TYPES; i++)
+		if (strncmp(dep_types[i][0], name, len) == 0 &&
+		    dep_types[i][0][len] == '\0')
+			return NULL;
+	if (is_listed(shell_funcs, name, len))
+		return NULL;
+	if (is_listed(status_funcs, name, len))
+		conf->status = true;
+	if (len == 6 && strncmp(name, "depend", 6) == 0) {
+		b = arena_alloc(conf->arena, (size_t)(end - body) + 1);
+		memcpy(b, body, (size_t)(end - body));
+		b[end - body] = '\0';
+		conf->depend = b;
+	}
+	return e;
+}
+
+/* Read the assignments and functions in file into conf.
+ * Returns false if it has anything else in it. */
+static bool
+parse_file(GENDEP_CONF *conf, const char *file)
+{
+	char *buffer = NULL, *scratch = NULL;
+	size_t len;
+	const char *p, *e, *name;
+	size_t nlen;
+	bool dynamic, assigned, ok = false;
+
+	if (!rc_getfile(file, &buffer, &len))
+		return false;
+	scratch = xmalloc(len + 1);
+	for (p = buffer; *p; p = next_line(e)) {
+		while (is_blank(*p))
+			p++;
+		if ((e = line_end(p)))
+			continue;
+		if (*p == ':' && is_blank(p[1])) {
+			if (!(e = parse_colon(conf, p + 1)))
+				goto out;
+			continue;
+		}
+		for (assigned = false;; assigned = true) {
+			name = p;
+			if (!isalpha((unsigned char)*p) && *p != '_')
+				goto out;
+			while (is_name(*p))
+				p++;
+			nlen = (size_t)(p - name);
+			if (*p != '=')
+				break;
+			if (!(p = parse_word(p + 1, scratch, &dynamic)) ||
+			    !set_var(conf, name, nlen, dynamic ? NULL : scratch))
+				goto out;
+			/* a=1 b=2 is fine, a=1 cmd is not */
+			if ((e = line_end(p)))
+				break;
+			while (is_blank(*p))
+				p++;
+		}
+		if (e)
+			continue;
+
+		/* name() { or name() and { on the next line */
+		if (assigned)
+			goto out;
+		while (is_blank(*p))
+			p++;
+		if (*p++ != '(')
+			goto out;
+		while (is_blank(*p))
+			p++;
+		if (*p++ != ')')
+			goto out;
+		while ((e = line_end(p)) && *e)
+			p = e + 1;
+		while (is_blank(*p))
+			p++;
+		if (*p != '{' ||
+		    !(e = parse_function(conf, name, nlen, p + 1)))
+			goto out;
+	}
+	ok = true;
+out:
+	free(scratch);
+	free(buffer);
+	return ok;
+}
+
+static void
+out_add(GENDEP_OUT *out, const char *s, size_t len)
+{
+	if (out->len + len + 1 > out->size) {
+		out->size = (out->len + len + 1) * 2;
+		out->buf = xrealloc(out->buf, out->size);
+	}
+	memcpy(out->buf + out->len, s, len);
+	out->len += len;
+	out->buf[out->len] = '\0';
+}
+
+static void
+out_str(GENDEP_OUT *out, const char *s)
+{
+	out_add(out, s, strlen(s));
+}
+
+/* Start a line for a call to the dependency function type.
+ * Returns the index of it or -1. */
+static int
+dep_start(GENDEP_OUT *out, const char *svc, const char *type, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < NDEP_TYPES; i++)
+		if (strncmp(dep_types[i][0], type, len) == 0 &&
+		    dep_types[i][0][len] == '\0')
+			break;
+	if (i == NDEP_TYPES)
+		return -1;
+	out_str(out, svc);
+	out_str(out, " ");
+	out_str(out, dep_types[i][1]);
+	if (strcmp(dep_types[i][1], "keyword") == 0)
+		out_str(out, " ");
+	return (int)i;
+}
+
+/* Add a word to it. keyword puts a space after each word and
+ * has its own ideas about containers, which we leave to the shell. */
+static bool
+dep_word(GENDEP_OUT *out, int type, const char *word, size_t len)
+{
+	if (strcmp(dep_types[type][1], "keyword") == 0) {
+		if ((len == 11 && strncmp(word, "-containers", len) == 0) ||
+		    (len == 12 && strncmp(word, "!-containers", len) == 0))
+			return false;
+		out_add(out, word, len);
+		out_str(out, " ");
+	} else {
+		out_str(out, " ");
+		out_add(out, word, len);
+	}
+	return true;
+}
+
+/* With no words nothing is printed at all */
+static void
+dep_end(GENDEP_OUT *out, size_t start, size_t nwords)
+{
+	if (nwords == 0) {
+		out->len = start;
+		if (out->buf)
+			out->buf[start] = '\0';
+	} else
+		out_str(out, "\n");
+}
+
+/* Each statement in depend() has to be a call to a dependency function,
+ * or :, with nothing but plain words */
+static bool
+eval_depend(GENDEP_OUT *out, const char *svc, const char *body)
+{
+	const char *p = body, *word;
+	size_t start, nwords;
+	int type;
+	bool colon;
+
+	for (;;) {
+		start = out->len;
+		nwords = 0;
+		type = -1;
+		colon = false;
+		for (;;) {
+			while (is_blank(*p) || (p[0] == '\\' && p[1] == '\n'))
+				p += *p == '\\' ? 2 : 1;
+			if (*p == '#')
+				while (*p && *p != '\n')
+					p++;
+			if (*p == '\0' || *p == '\n' || *p == ';')
+				break;
+			word = p;
+			while (*p && strchr(DEP_WORD_CHARS, *p))
+				p++;
+			if (*p && !is_blank(*p) && *p != '\n' && *p != ';')
+				return false;
+			if (colon)
+				continue;
+			if (type == -1) {
+				if (p - word == 1 && *word == ':') {
+					colon = true;
+					continue;
+				}
+				if ((type = dep_start(out, svc, word,
+				    (size_t)(p - word))) == -1)
+					return false;
+				continue;
+			}
+			if (!dep_word(out, type, word, (size_t)(p - word)))
+				return false;
+			nwords++;
+		}
+		if (type != -1)
+			dep_end(out, start, nwords);
+		if (*p == '\0')
+			return true;
+		p++;
+	}
+}
+
+/* Find a variable as the shell would after sourcing everything.
+ * Returns false if we cannot know it. */
+static bool
+lookup(const GENDEP_CONF *const *scopes, const char *name, const char **value)
+{
+	const struct gendep_var *v;
+
+	for (; *scopes; scopes++)
+		for (v = (*scopes)->vars; v; v = v->next)
+			if (strcmp(v->name, name) == 0) {
+				*value = v->value;
+				return v->value != NULL;
+			}
+	*value = getenv(name);
+	return true;
+}
+
+/* _depend adds the user defined dependencies from rc_svc_need and the
+ * like */
+static bool
+eval_user_depends(GENDEP_OUT *out, const GENDEP_CONF *const *scopes,
+    const char *svc)
+{
+	char *svcvar = xstrdup(svc), *name, *upper, *p;
+	const char *value = NULL, *word, *e;
+	size_t i, start, nwords;
+	int try;
+	bool ok = false;
+
+	for (p = svcvar; *p; p++)
+		if (!isalnum((unsigned char)*p))
+			*p = '_';
+	for (i = 0; i < NDEP_TYPES; i++) {
+		upper = xstrdup(dep_types[i][0]);
+		for (p = upper; *p; p++)
+			*p = (char)toupper((unsigned char)*p);
+		for (try = 0; try < 4; try++) {
+			switch (try) {
+			case 0:
+				xasprintf(&name, "rc_%s_%s", svcvar,
+				    dep_types[i][0]);
+				break;
+			case 1:
+				xasprintf(&name, "rc_%s", dep_types[i][0]);
+				break;
+			case 2:
+				xasprintf(&name, "RC_%s_%s", svcvar, upper);
+				break;
+			default:
+				xasprintf(&name, "RC_%s", upper);
+			}
+			ok = lookup(scopes, name, &value);
+			free(name);
+			if (!ok || (value && *value))
+				break;
+		}
+		free(upper);
+		if (!ok)
+			goto out;
+		if (!value || !*value)
+			continue;
+
+		start = out->len;
+		nwords = 0;
+		dep_start(out, svc, dep_types[i][0], strlen(dep_types[i][0]));
+		for (p = UNCONST(value); *p; ) {
+			while (*p && strchr(" \t\n", *p))
+				p++;
+			if (!*p)
+				break;
+			word = p;
+			while (*p && !strchr(" \t\n", *p))
+				p++;
+			/* No globbing, and echo must not see any escapes */
+			for (e = word; e < p; e++)
+				if (strchr("*?[\\", *e)) {
+					ok = false;
+					goto out;
+				}
+			if (!(ok = dep_word(out, (int)i, word,
+			    (size_t)(p - word))))
+				goto out;
+			nwords++;
+		}
+		dep_end(out, start, nwords);
+	}
+	ok = true;
+out:
+	free(svcvar);
+	return ok;
+}
+
+/* rc.conf and rc.conf.d, which every init script sees */
+GENDEP_CONF *
+gendep_conf_load(void)
+{
+	GENDEP_CONF *conf = xmalloc(sizeof(*conf));
+	struct dirent **files = NULL;
+	char *path;
+	int n, i;
+	bool ok = true;
+
+	memset(conf, 0, sizeof(*conf));
+	conf->arena = arena_new();
+	if (exists(RC_CONF))
+		ok = parse_file(conf, RC_CONF);
+	if (ok && (n = scandir(RC_CONF_D, &files, NULL, alphasort)) > 0) {
+		for (i = 0; i < n; i++) {
+			if (ok && files[i]->d_name[0] != '.' &&
+			    strlen(files[i]->d_name) > 5 &&
+			    strcmp(files[i]->d_name +
+			    strlen(files[i]->d_name) - 5, ".conf") == 0)
+			{
+				xasprintf(&path, "%s/%s", RC_CONF_D,
+				    files[i]->d_name);
+				if (exists(path))
+					ok = parse_file(conf, path);
+				free(path);
+			}
+			free(files[i]);
+		}
+		free(files);
+	}
+	if (!ok || conf->depend) {
+		gendep_conf_free(conf);
+		return NULL;
+	}
+	return conf;
+}
+
+void
+gendep_conf_free(GENDEP_CONF *conf)
+{
+	if (!conf)
+		return;
+	arena_free(conf->arena);
+	free(conf);
+}
+
+/* The output of gendepends.sh for the init script at path, not
+ * counting the line with its path, or NULL if we need a shell to say */
+char *
+gendep_native(const GENDEP_CONF *conf, const char *path, size_t *len)
+{
+	GENDEP_CONF svc, script;
+	const GENDEP_CONF *scopes[] = { &script, conf, &svc, NULL };
+	GENDEP_OUT out = { NULL, 0, 0 };
+	const char *name, *e, *supervisor;
+	char *file;
+	bool ok = false;
+
+	if (!conf || !(name = strrchr(path, '/')) || !*++name)
+		return NULL;
+	memset(&svc, 0, sizeof(svc));
+	memset(&script, 0, sizeof(script));
+	svc.arena = script.arena = arena_new();
+
+	/* conf.d in the order gendepends.sh sources it */
+	if ((e = strchr(name, '.')) && e != name) {
+		xasprintf(&file, "%.*s/../conf.d/%.*s", (int)(name - path - 1),
+		    path, (int)(e - name), name);
+		ok = !exists(file) || parse_file(&svc, file);
+		free(file);
+		if (!ok)
+			goto out;
+	}
+	xasprintf(&file, "%.*s/../conf.d/%s", (int)(name - path - 1),
+	    path, name);
+	ok = !exists(file) || parse_file(&svc, file);
+	free(file);
+	if (!ok || svc.depend || !(ok = parse_file(&script, path)))
+		goto out;
+
+	/* dash lets keyword see the value of c, bash does not */
+	if (!(ok = lookup(scopes, "c", &e)) || (e && *e)) {
+		ok = false;
+		goto out;
+	}
+
+	out_str(&out, name);
+	out_str(&out, "\n");
+	if ((script.depend && !(ok = eval_depend(&out, name, script.depend))) ||
+	    !(ok = eval_user_depends(&out, scopes, name)))
+		goto out;
+
+	if (!script.status && !conf->status && !svc.status) {
+		if (!(ok = lookup(scopes, "supervisor", &supervisor)))
+			goto out;
+		if (!supervisor || !*supervisor)
+			supervisor = "start-stop-daemon";
+		if (strcmp(supervisor, "start-stop-daemon") == 0 ||
+		    strcmp(supervisor, "supervise-daemon") == 0)
+		{
+			out_str(&out, name);
+			out_str(&out, " status ");
+			out_str(&out, supervisor);
+			out_str(&out, "\n");
+		}
+	}
+
+out:
+	arena_free(svc.arena);
+	if (!ok) {
+		free(out.buf);
+		return NULL;
+	}
+	*len = out.len;
+	return out.buf;
+}
@@ -15,7 +15,10 @@
  *    except according to the terms contained in the LICENSE file.
  */
 
+#include <sys/mman.h>
+
 #include <fnmatch.h>
+#include <stdint.h>
 
 #include "queue.h"
 #include "librc.h"
@@ -264,23 +267,24 @@ static void rc_config_set_value(RC_STRINGLIST *config, char *value)
  * a patch for this on *BSD or tell me how to write the code to do this,
  * any suggestions are welcome.
  */
+/* A list of variables which may be overridden on the kernel command line */
+static const char *const kcl_overrides[] = {
+	"rc_parallel",
+	NULL
+};
+
 static RC_STRINGLIST *rc_config_kcl(RC_STRINGLIST *config)
 {
 #ifdef __linux__
-	RC_STRINGLIST *overrides;
-	RC_STRING *cline, *override, *config_np;
+	RC_STRING *cline, *config_np;
+	const char *const *override;
 	char *tmp = NULL;
 	char *value = NULL;
 	size_t varlen = 0;
 
-	overrides = rc_stringlist_new();
-
-	/* A list of variables which may be overridden on the kernel command line */
-	rc_stringlist_add(overrides, "rc_parallel");
-
-	TAILQ_FOREACH(override, overrides, entries) {
-		varlen = strlen(override->value);
-		value = rc_proc_getent(override->value);
+	for (override = kcl_overrides; *override; override++) {
+		varlen = strlen(*override);
+		value = rc_proc_getent(*override);
 
 		/* No need to continue if there's nothing to override */
 		if (!value) {
@@ -289,7 +293,7 @@ static RC_STRINGLIST *rc_config_kcl(RC_STRINGLIST *config)
 		}
 
 		if (value != NULL) {
-			xasprintf(&tmp, "%s=%s", override->value, value);
+			xasprintf(&tmp, "%s=%s", *override, value);
 		}
 
 		/*
@@ -297,7 +301,7 @@ static RC_STRINGLIST *rc_config_kcl(RC_STRINGLIST *config)
 		 * duplicates
 		 */
 		TAILQ_FOREACH_SAFE(cline, config, entries, config_np) {
-			if (strncmp(override->value, cline->value, varlen) == 0
+			if (strncmp(*override, cline->value, varlen) == 0
 				&& cline->value[varlen] == '=') {
 				rc_stringlist_delete(config, cline->value);
 				break;
@@ -310,8 +314,6 @@ static RC_STRINGLIST *rc_config_kcl(RC_STRINGLIST *config)
 		free(tmp);
 		free(value);
 	}
-
-	rc_stringlist_free(overrides);
 #endif
 	return config;
 }
@@ -397,14 +399,343 @@ _free_rc_conf(void)
 	rc_stringlist_free(rc_conf);
 }
 
+/* Binary rc.conf cache.
+ * Every process that looks at a setting would otherwise parse rc.conf and
+ * rc.conf.d for itself, so the first one to do so leaves the merged
+ * settings in RC_CONF_CACHE sorted by name, for the rest to map and
+ * search. It lists every file they came from and we only trust it while
+ * they still match. Kernel command line overrides are not cached. */
+#define CONF_BIN_MAGIC		"RCCONF"
+#define CONF_BIN_VERSION	1
+
+struct conf_bin_header {
+	char magic[8];
+	uint64_t size;
+	uint32_t version;
+	uint32_t nfile;
+	uint32_t nvar;
+	uint32_t strsize;
+};
+
+struct conf_bin_file {
+	uint64_t ino;
+	int64_t mtime;
+	int64_t size;
+	uint32_t path;
+	uint32_t exists;
+};
+
+struct conf_bin_var {
+	uint32_t name;
+	uint32_t value;
+};
+
+static const struct conf_bin_header *conf_map;
+static const struct conf_bin_var *conf_vars;
+static const char *conf_strtab;
+
+static uint64_t
+conf_bin_size(const struct conf_bin_header *hdr)
+{
+	return sizeof(*hdr) +
+	    (uint64_t)hdr->nfile * sizeof(struct conf_bin_file) +
+	    (uint64_t)hdr->nvar * sizeof(struct conf_bin_var) +
+	    hdr->strsize;
+}
+
+static void
+conf_bin_stat(struct conf_bin_file *f, const char *path)
+{
+	struct stat st;
+
+	memset(f, 0, sizeof(*f));
+	if (stat(path, &st) != 0)
+		return;
+	f->exists = 1;
+	f->ino = (uint64_t)st.st_ino;
+	f->mtime = (int64_t)st.st_mtime;
+	f->size = (int64_t)st.st_size;
+}
+
+/* Everything rc_conf_value reads from */
+static RC_STRINGLIST *
+conf_sources(void)
+{
+	RC_STRINGLIST *files = rc_stringlist_new();
+	RC_STRINGLIST *confd = rc_stringlist_new();
+	RC_STRING *s;
+	DIR *dp;
+	struct dirent *d;
+	char *path;
+
+	rc_stringlist_add(files, RC_CONF);
+	rc_stringlist_add(files, RC_CONF_OLD);
+	rc_stringlist_add(files, RC_CONF_D);
+	if ((dp = opendir(RC_CONF_D)) != NULL) {
+		while ((d = readdir(dp)) != NULL)
+			if (fnmatch("*.conf", d->d_name, FNM_PATHNAME) == 0)
+				rc_stringlist_addu(confd, d->d_name);
+		closedir(dp);
+	}
+	rc_stringlist_sort(&confd);
+	TAILQ_FOREACH(s, confd, entries) {
+		xasprintf(&path, "%s/%s", RC_CONF_D, s->value);
+		rc_stringlist_add(files, path);
+		free(path);
+	}
+	rc_stringlist_free(confd);
+	return files;
+}
+
+static bool
+conf_load_binary(void)
+{
+	const struct conf_bin_header *hdr;
+	const struct conf_bin_file *files;
+	struct conf_bin_file f;
+	struct stat st;
+	void *map;
+	size_t size;
+	uint32_t i;
+	int fd;
+
+	if ((fd = open(RC_CONF_CACHE, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return false;
+	}
+	size = (size_t)st.st_size;
+	/* Private and writable, as callers have always been able to
+	 * scribble on what we return */
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	hdr = map;
+	if (memcmp(hdr->magic, CONF_BIN_MAGIC, sizeof(CONF_BIN_MAGIC)) != 0 ||
+	    hdr->version != CONF_BIN_VERSION ||
+	    hdr->size != size ||
+	    conf_bin_size(hdr) != size ||
+	    hdr->strsize == 0)
+		goto bad;
+	files = (const void *)(hdr + 1);
+	conf_vars = (const void *)(files + hdr->nfile);
+	conf_strtab = (const char *)(conf_vars + hdr->nvar);
+	if (conf_strtab[hdr->strsize - 1] != '\0')
+		goto bad;
+
+	for (i = 0; i < hdr->nfile; i++) {
+		if (files[i].path >= hdr->strsize)
+			goto bad;
+		conf_bin_stat(&f, conf_strtab + files[i].path);
+		if (f.exists != files[i].exists || f.ino != files[i].ino ||
+		    f.mtime != files[i].mtime || f.size != files[i].size)
+			goto bad;
+	}
+	for (i = 0; i < hdr->nvar; i++)
+		if (conf_vars[i].name >= hdr->strsize ||
+		    conf_vars[i].value >= hdr->strsize ||
+		    (i > 0 && strcmp(conf_strtab + conf_vars[i - 1].name,
+			    conf_strtab + conf_vars[i].name) >= 0))
+			goto bad;
+
+	conf_map = hdr;
+	return true;
+
+bad:
+	munmap(map, size);
+	return false;
+}
+
+struct conf_var {
+	const char *name;
+	const char *value;
+	size_t order;
+};
+
+static int
+conf_var_cmp(const void *a, const void *b)
+{
+	const struct conf_var *va = a;
+	const struct conf_var *vb = b;
+	int r = strcmp(va->name, vb->name);
+
+	if (r != 0)
+		return r;
+	return va->order < vb->order ? -1 : va->order > vb->order;
+}
+
+static uint32_t
+conf_strtab_add(char **buf, size_t *len, const char *str)
+{
+	size_t l = strlen(str) + 1;
+	uint32_t off = (uint32_t)*len;
+
+	*buf = xrealloc(*buf, *len + l);
+	memcpy(*buf + *len, str, l);
+	*len += l;
+	return off;
+}
+
+/* Save config, which we loaded from sources we stat'ed as files
+ * beforehand so that anything changed since is noticed.
+ * We write to a temporary file and rename it so anyone with the old one
+ * mapped is unaffected. */
+static void
+conf_save_binary(RC_STRINGLIST *config, RC_STRINGLIST *sources,
+    struct conf_bin_file *files)
+{
+	struct conf_bin_header hdr;
+	struct conf_bin_var *bvars;
+	struct conf_var *vars;
+	RC_STRING *s;
+	char *buf = NULL;
+	char *tmp;
+	char *p;
+	size_t len = 0, nvars = 0, i, n;
+	int fd;
+	FILE *fp;
+	bool ok = false;
+
+	/* We cannot tell a change later in the same second from what we
+	 * read, so wait for things to settle before caching them */
+	i = 0;
+	TAILQ_FOREACH(s, sources, entries)
+		if (files[i++].mtime >= (int64_t)time(NULL) - 1)
+			return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	TAILQ_FOREACH(s, config, entries)
+		nvars++;
+	vars = xmalloc(sizeof(*vars) * (nvars + 1));
+	bvars = xmalloc(sizeof(*bvars) * (nvars + 1));
+
+	i = 0;
+	TAILQ_FOREACH(s, sources, entries)
+		files[i++].path = conf_strtab_add(&buf, &len, s->value);
+	hdr.nfile = (uint32_t)i;
+
+	/* The first of any duplicates is the one rc_config_value finds */
+	n = 0;
+	TAILQ_FOREACH(s, config, entries) {
+		if (!(p = strchr(s->value, '=')))
+			continue;
+		*p = '\0';
+		vars[n].name = xstrdup(s->value);
+		*p = '=';
+		vars[n].value = p + 1;
+		vars[n].order = n;
+		n++;
+	}
+	qsort(vars, n, sizeof(*vars), conf_var_cmp);
+	for (i = 0; i < n; i++) {
+		if (i == 0 || strcmp(vars[i].name, vars[i - 1].name) != 0) {
+			bvars[hdr.nvar].name = conf_strtab_add(&buf, &len,
+			    vars[i].name);
+			bvars[hdr.nvar].value = conf_strtab_add(&buf, &len,
+			    vars[i].value);
+			hdr.nvar++;
+		}
+	}
+
+	memcpy(hdr.magic, CONF_BIN_MAGIC, sizeof(CONF_BIN_MAGIC));
+	hdr.version = CONF_BIN_VERSION;
+	hdr.strsize = (uint32_t)len;
+	hdr.size = conf_bin_size(&hdr);
+
+	xasprintf(&tmp, "%s.XXXXXX", RC_CONF_CACHE);
+	if ((fd = mkstemp(tmp)) == -1)
+		goto out;
+	fchmod(fd, 0644);
+	if (!(fp = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+	    fwrite(files, sizeof(*files), hdr.nfile, fp) == hdr.nfile &&
+	    fwrite(bvars, sizeof(*bvars), hdr.nvar, fp) == hdr.nvar &&
+	    fwrite(buf, 1, len, fp) == len)
+		ok = true;
+	if (fclose(fp) != 0)
+		ok = false;
+	if (!ok || rename(tmp, RC_CONF_CACHE) != 0)
+		unlink(tmp);
+
+out:
+	free(tmp);
+	for (i = 0; i < n; i++)
+		free(UNCONST(vars[i].name));
+	free(vars);
+	free(bvars);
+	free(buf);
+}
+
+static char *
+conf_bin_value(const char *setting)
+{
+#ifdef __linux__
+	static char *kcl_values[ARRAY_SIZE(kcl_overrides)];
+	static bool kcl_loaded[ARRAY_SIZE(kcl_overrides)];
+	size_t i;
+#endif
+	size_t lo = 0, hi = conf_map->nvar, mid;
+	int r;
+
+#ifdef __linux__
+	for (i = 0; kcl_overrides[i]; i++)
+		if (strcmp(setting, kcl_overrides[i]) == 0)
+			break;
+	if (kcl_overrides[i]) {
+		if (!kcl_loaded[i]) {
+			kcl_values[i] = rc_proc_getent(kcl_overrides[i]);
+			kcl_loaded[i] = true;
+		}
+		if (kcl_values[i])
+			return kcl_values[i];
+	}
+#endif
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		r = strcmp(setting, conf_strtab + conf_vars[mid].name);
+		if (r == 0)
+			return UNCONST(conf_strtab + conf_vars[mid].value);
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
 char *
 rc_conf_value(const char *setting)
 {
 	RC_STRINGLIST *old;
+	RC_STRINGLIST *sources;
 	RC_STRING *s;
+	struct conf_bin_file *files;
+	size_t nfiles = 0;
 	char *p;
 
+	if (conf_map)
+		return conf_bin_value(setting);
+
 	if (! rc_conf) {
+		if (conf_load_binary())
+			return conf_bin_value(setting);
+
+		sources = conf_sources();
+		TAILQ_FOREACH(s, sources, entries)
+			nfiles++;
+		files = xmalloc(sizeof(*files) * nfiles);
+		nfiles = 0;
+		TAILQ_FOREACH(s, sources, entries)
+			conf_bin_stat(&files[nfiles++], s->value);
+
 		rc_conf = rc_config_load(RC_CONF);
 		atexit(_free_rc_conf);
 
@@ -416,7 +747,6 @@ rc_conf_value(const char *setting)
 		}
 
 		rc_conf = rc_config_directory(rc_conf);
-		rc_conf = rc_config_kcl(rc_conf);
 
 		/* Convert old uppercase to lowercase */
 		TAILQ_FOREACH(s, rc_conf, entries) {
@@ -427,6 +757,12 @@ rc_conf_value(const char *setting)
 				p++;
 			}
 		}
+
+		conf_save_binary(rc_conf, sources, files);
+		rc_stringlist_free(sources);
+		free(files);
+
+		rc_conf = rc_config_kcl(rc_conf);
 	}
 
 	return rc_config_value(rc_conf, setting);
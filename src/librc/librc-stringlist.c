@@ -94,33 +94,48 @@ rc_stringlist_split(const char *value, const char *sep)
 	return list;
 }
 
+struct sortent {
+	RC_STRING *s;
+	size_t n;
+};
+
+static int
+sortent_cmp(const void *a, const void *b)
+{
+	const struct sortent *sa = a, *sb = b;
+	int r = strcmp(sa->s->value, sb->s->value);
+
+	/* Keep equal items in the order we found them */
+	if (r == 0)
+		r = (sa->n > sb->n) - (sa->n < sb->n);
+	return r;
+}
+
 void
 rc_stringlist_sort(RC_STRINGLIST **list)
 {
 	RC_STRINGLIST *l = *list;
-	RC_STRINGLIST *new = rc_stringlist_new();
 	RC_STRING *s;
-	RC_STRING *sn;
-	RC_STRING *n;
-	RC_STRING *last;
-
-	TAILQ_FOREACH_SAFE(s, l, entries, sn) {
-		TAILQ_REMOVE(l, s, entries);
-		last = NULL;
-		TAILQ_FOREACH(n, new, entries) {
-			if (strcmp(s->value, n->value) < 0)
-				break;
-			last = n;
-		}
-		if (last)
-			TAILQ_INSERT_AFTER(new, last, s, entries);
-		else
-			TAILQ_INSERT_HEAD(new, s, entries);
-	}
+	struct sortent *ents;
+	size_t i, n = 0;
+
+	TAILQ_FOREACH(s, l, entries)
+		n++;
+	if (n < 2)
+		return;
 
-	/* Now we've sorted the list, copy across the new head */
-	free(l);
-	*list = new;
+	ents = xmalloc(sizeof(*ents) * n);
+	i = 0;
+	TAILQ_FOREACH(s, l, entries) {
+		ents[i].s = s;
+		ents[i].n = i;
+		i++;
+	}
+	qsort(ents, n, sizeof(*ents), sortent_cmp);
+	TAILQ_INIT(l);
+	for (i = 0; i < n; i++)
+		TAILQ_INSERT_TAIL(l, ents[i].s, entries);
+	free(ents);
 }
 
 void
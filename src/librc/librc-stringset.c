@@ -0,0 +1,252 @@
+/*
+ * librc-stringset.c
+ * String sets for when a TAILQ is too slow to search.
+ * Strings are interned in an arena owned by the set and found through an
+ * open addressing hash table, entries keep the order they were added in.
+ */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <stdint.h>
+
+#include "queue.h"
+#include "librc.h"
+#include "helpers.h"
+
+#define SLOT_EMPTY	0
+#define SLOT_DELETED	UINT32_MAX
+
+struct entry {
+	const char *value;
+	void *data;
+	uint32_t hash;
+};
+
+struct rc_stringset {
+	RC_ARENA *pool;
+	struct entry *entries;
+	size_t nentries;	/* used, including deleted ones */
+	size_t sentries;
+	size_t count;
+	/* Index into entries plus one, or one of the SLOT values */
+	uint32_t *slots;
+	size_t nslots;		/* always a power of two */
+	size_t ndeleted;	/* slots marked deleted */
+};
+
+static uint32_t
+set_hash(const char *value)
+{
+	uint32_t h = 2166136261U;
+
+	for (; *value; value++) {
+		h ^= (unsigned char)*value;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/* Return the slot holding value, or the free slot it would go in */
+static size_t
+set_slot(const RC_STRINGSET *set, const char *value, uint32_t hash,
+    bool *found)
+{
+	size_t mask = set->nslots - 1;
+	size_t i = hash & mask;
+	size_t avail = SIZE_MAX;
+	const struct entry *e;
+	uint32_t slot;
+
+	*found = false;
+	for (;; i = (i + 1) & mask) {
+		slot = set->slots[i];
+		if (slot == SLOT_EMPTY)
+			return avail == SIZE_MAX ? i : avail;
+		if (slot == SLOT_DELETED) {
+			if (avail == SIZE_MAX)
+				avail = i;
+			continue;
+		}
+		e = &set->entries[slot - 1];
+		if (e->hash == hash && strcmp(e->value, value) == 0) {
+			*found = true;
+			return i;
+		}
+	}
+}
+
+/* Size the table for count entries plus room to grow, dropping deleted
+ * entries as we go */
+static void
+set_rehash(RC_STRINGSET *set)
+{
+	size_t i, j, n;
+	bool found;
+
+	for (i = j = 0; i < set->nentries; i++)
+		if (set->entries[i].value)
+			set->entries[j++] = set->entries[i];
+	set->nentries = j;
+
+	n = 16;
+	while (n < (set->count + 1) * 2)
+		n *= 2;
+	free(set->slots);
+	set->slots = xmalloc(sizeof(*set->slots) * n);
+	memset(set->slots, 0, sizeof(*set->slots) * n);
+	set->nslots = n;
+	set->ndeleted = 0;
+	for (i = 0; i < set->nentries; i++) {
+		j = set_slot(set, set->entries[i].value,
+		    set->entries[i].hash, &found);
+		set->slots[j] = (uint32_t)(i + 1);
+	}
+}
+
+RC_STRINGSET *
+rc_stringset_new(void)
+{
+	RC_STRINGSET *set = xmalloc(sizeof(*set));
+
+	memset(set, 0, sizeof(*set));
+	set->pool = arena_new();
+	set_rehash(set);
+	return set;
+}
+
+bool
+rc_stringset_put(RC_STRINGSET *set, const char *value, void *data)
+{
+	uint32_t hash = set_hash(value);
+	struct entry *e;
+	size_t i;
+	bool found;
+
+	i = set_slot(set, value, hash, &found);
+	if (found) {
+		set->entries[set->slots[i] - 1].data = data;
+		return false;
+	}
+
+	/* Keep at least half the table empty so probes stay short */
+	if ((set->count + set->ndeleted + 1) * 2 > set->nslots) {
+		set_rehash(set);
+		i = set_slot(set, value, hash, &found);
+	}
+	if (set->nentries == set->sentries) {
+		set->sentries = set->sentries ? set->sentries * 2 : 16;
+		set->entries = xrealloc(set->entries,
+		    sizeof(*set->entries) * set->sentries);
+	}
+	if (set->slots[i] == SLOT_DELETED)
+		set->ndeleted--;
+	e = &set->entries[set->nentries++];
+	e->value = arena_strdup(set->pool, value);
+	e->data = data;
+	e->hash = hash;
+	set->slots[i] = (uint32_t)set->nentries;
+	set->count++;
+	return true;
+}
+
+bool
+rc_stringset_add(RC_STRINGSET *set, const char *value)
+{
+	if (rc_stringset_find(set, value)) {
+		errno = EEXIST;
+		return false;
+	}
+	return rc_stringset_put(set, value, NULL);
+}
+
+bool
+rc_stringset_delete(RC_STRINGSET *set, const char *value)
+{
+	size_t i;
+	bool found;
+
+	i = set_slot(set, value, set_hash(value), &found);
+	if (!found) {
+		errno = EEXIST;
+		return false;
+	}
+	set->entries[set->slots[i] - 1].value = NULL;
+	set->slots[i] = SLOT_DELETED;
+	set->ndeleted++;
+	set->count--;
+	return true;
+}
+
+bool
+rc_stringset_find(const RC_STRINGSET *set, const char *value)
+{
+	bool found = false;
+
+	if (set)
+		set_slot(set, value, set_hash(value), &found);
+	return found;
+}
+
+void *
+rc_stringset_get(const RC_STRINGSET *set, const char *value)
+{
+	size_t i;
+	bool found;
+
+	if (!set)
+		return NULL;
+	i = set_slot(set, value, set_hash(value), &found);
+	return found ? set->entries[set->slots[i] - 1].data : NULL;
+}
+
+size_t
+rc_stringset_count(const RC_STRINGSET *set)
+{
+	return set ? set->count : 0;
+}
+
+RC_STRINGSET *
+rc_stringset_from_list(const RC_STRINGLIST *list)
+{
+	RC_STRINGSET *set = rc_stringset_new();
+	RC_STRING *s;
+
+	if (list)
+		TAILQ_FOREACH(s, list, entries)
+			rc_stringset_put(set, s->value, NULL);
+	return set;
+}
+
+RC_STRINGLIST *
+rc_stringset_to_list(const RC_STRINGSET *set)
+{
+	RC_STRINGLIST *list = rc_stringlist_new();
+	size_t i;
+
+	if (set)
+		for (i = 0; i < set->nentries; i++)
+			if (set->entries[i].value)
+				rc_stringlist_add(list, set->entries[i].value);
+	return list;
+}
+
+void
+rc_stringset_free(RC_STRINGSET *set)
+{
+	if (!set)
+		return;
+	arena_free(set->pool);
+	free(set->entries);
+	free(set->slots);
+	free(set);
+}
@@ -20,6 +20,8 @@ static const char librc_copyright[] = "Copyright (c) 2007-2008 Roy Marples";
 #include "queue.h"
 #include "librc.h"
 #include <helpers.h>
+#include "rc-events.h"
+#include <sys/file.h>
 #ifdef __FreeBSD__
 #  include <sys/sysctl.h>
 #endif
@@ -56,53 +58,80 @@ static const rc_service_state_name_t rc_service_state_names[] = {
 
 #define LS_INITD	0x01
 #define LS_DIR		0x02
+#define LS_SORT		0x04
+
+/* Check that entry d in the directory open as dfd is what options want.
+ * We trust d_type where the filesystem gives us one and only stat for
+ * symlinks, which may dangle or point to a directory, and for entries
+ * of unknown type. */
+static bool
+ls_want(int dfd, const struct dirent *d, int options)
+{
+	struct stat buf;
+	size_t l;
+	bool isdir = false, check = true;
+
+	if (options & LS_INITD) {
+		/* .sh files are not init scripts */
+		l = strlen(d->d_name);
+		if (l > 2 && d->d_name[l - 3] == '.' &&
+		    d->d_name[l - 2] == 's' &&
+		    d->d_name[l - 1] == 'h')
+			return false;
+	}
+	if (!(options & (LS_INITD | LS_DIR)))
+		return true;
+
+#ifdef DT_UNKNOWN
+	if (d->d_type != DT_UNKNOWN && d->d_type != DT_LNK) {
+		isdir = d->d_type == DT_DIR;
+		check = false;
+	}
+#endif
+	if (check) {
+		/* Check that our file really exists.
+		 * This is important as a service maybe in a
+		 * runlevel, but could have been removed. */
+		if (fstatat(dfd, d->d_name, &buf, 0) != 0)
+			return false;
+		isdir = S_ISDIR(buf.st_mode);
+	}
+	return !(options & LS_DIR) || isdir;
+}
+
+/* List dir, relative to the directory open as dfd */
 static RC_STRINGLIST *
-ls_dir(const char *dir, int options)
+ls_dirat(int dfd, const char *dir, int options)
 {
 	DIR *dp;
 	struct dirent *d;
-	RC_STRINGLIST *list = NULL;
-	struct stat buf;
-	size_t l;
-	char file[PATH_MAX];
-	int r;
+	RC_STRINGLIST *list;
+	int fd;
 
 	list = rc_stringlist_new();
-	if ((dp = opendir(dir)) == NULL)
+	if ((fd = openat(dfd, dir,
+		    O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
 		return list;
+	if ((dp = fdopendir(fd)) == NULL) {
+		close(fd);
+		return list;
+	}
 	while (((d = readdir(dp)) != NULL)) {
-		if (d->d_name[0] != '.') {
-			if (options & LS_INITD) {
-				/* Check that our file really exists.
-				 * This is important as a service maybe in a
-				 * runlevel, but could have been removed. */
-				snprintf(file, sizeof(file), "%s/%s",
-				    dir, d->d_name);
-				r = stat(file, &buf);
-				if (r != 0)
-					continue;
-
-				/* .sh files are not init scripts */
-				l = strlen(d->d_name);
-				if (l > 2 && d->d_name[l - 3] == '.' &&
-				    d->d_name[l - 2] == 's' &&
-				    d->d_name[l - 1] == 'h')
-					continue;
-			}
-			if (options & LS_DIR) {
-				snprintf(file, sizeof(file), "%s/%s",
-				    dir, d->d_name);
-				if (stat(file, &buf) != 0 ||
-				    !S_ISDIR(buf.st_mode))
-					continue;
-			}
+		if (d->d_name[0] != '.' && ls_want(fd, d, options))
 			rc_stringlist_add(list, d->d_name);
-		}
 	}
 	closedir(dp);
+	if (options & LS_SORT)
+		rc_stringlist_sort(&list);
 	return list;
 }
 
+static RC_STRINGLIST *
+ls_dir(const char *dir, int options)
+{
+	return ls_dirat(AT_FDCWD, dir, options);
+}
+
 static bool
 rm_dir(const char *pathname, bool top)
 {
@@ -434,7 +463,7 @@ rc_runlevel_stopping(void)
 
 RC_STRINGLIST *rc_runlevel_list(void)
 {
-	return ls_dir(RC_RUNLEVELDIR, LS_DIR);
+	return ls_dir(RC_RUNLEVELDIR, LS_DIR | LS_SORT);
 }
 
 char *
@@ -693,8 +722,8 @@ rc_service_in_runlevel(const char *service, const char *runlevel)
 	return exists(file);
 }
 
-bool
-rc_service_mark(const char *service, const RC_SERVICE state)
+static bool
+service_mark(const char *service, const RC_SERVICE state)
 {
 	char file[PATH_MAX];
 	int i = 0;
@@ -788,6 +817,10 @@ rc_service_mark(const char *service, const RC_SERVICE state)
 		    "daemons", base);
 		rm_dir(file, true);
 
+		/* Our sockets went with our daemon */
+		snprintf(file, sizeof(file), RC_SVCDIR_LISTENING "/%s", base);
+		unlink(file);
+
 		rc_service_schedule_clear(service);
 	}
 
@@ -812,15 +845,15 @@ rc_service_mark(const char *service, const RC_SERVICE state)
 	return true;
 }
 
-RC_SERVICE
-rc_service_state(const char *service)
+/* Work out the state of a service from the state directories */
+static int
+state_scan(const char *base)
 {
 	int i;
 	int state = RC_SERVICE_STOPPED;
 	char file[PATH_MAX];
 	RC_STRINGLIST *dirs;
 	RC_STRING *dir;
-	const char *base = basename_c(service);
 
 	for (i = 0; rc_service_state_names[i].name; i++) {
 		snprintf(file, sizeof(file), RC_SVCDIR "/%s/%s",
@@ -833,16 +866,12 @@ rc_service_state(const char *service)
 		}
 	}
 
-	if (state & RC_SERVICE_STARTED) {
-		if (rc_service_daemons_crashed(service) && errno != EACCES)
-			state |= RC_SERVICE_CRASHED;
-	}
 	if (state & RC_SERVICE_STOPPED) {
 		dirs = ls_dir(RC_SVCDIR "/scheduled", 0);
 		TAILQ_FOREACH(dir, dirs, entries) {
 			snprintf(file, sizeof(file),
 			    RC_SVCDIR "/scheduled/%s/%s",
-			    dir->value, service);
+			    dir->value, base);
 			if (exists(file)) {
 				state |= RC_SERVICE_SCHEDULED;
 				break;
@@ -854,6 +883,117 @@ rc_service_state(const char *service)
 	return state;
 }
 
+/* We also record the state of each service as the target of a symlink
+ * in RC_SVCDIR_STATE so that looking it up is a single readlink.
+ * The state directories are still the real thing; we rewrite the record
+ * whenever we change them and anything else that does just removes it.
+ * Only writers replace the record, readers will only create a missing one
+ * so they cannot overwrite a newer state with the one they scanned. */
+static void
+state_record(const char *base, int state, bool replace)
+{
+	char file[PATH_MAX], tmp[PATH_MAX], value[16];
+	int serrno = errno;
+
+	snprintf(value, sizeof(value), "%d", state);
+	snprintf(file, sizeof(file), RC_SVCDIR_STATE "/%s", base);
+	if (replace) {
+		snprintf(tmp, sizeof(tmp), RC_SVCDIR_STATE "/.%s.%d",
+		    base, (int)getpid());
+		unlink(tmp);
+		if (symlink(value, tmp) == 0 && rename(tmp, file) != 0)
+			unlink(tmp);
+	} else
+		symlink(value, file);
+	errno = serrno;
+}
+
+/* Writers hold this from changing the state directories until they
+ * have recorded the result, so that two of them cannot record what they
+ * scanned in the other order. We may take it again while holding it. */
+static int state_lock_fd = -1;
+static int state_lock_depth;
+
+static void
+state_lock(void)
+{
+	int serrno = errno;
+
+	if (state_lock_depth++ > 0)
+		return;
+	state_lock_fd = open(RC_SVCDIR_STATE_LOCK,
+	    O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (state_lock_fd != -1)
+		while (flock(state_lock_fd, LOCK_EX) == -1 && errno == EINTR)
+			;
+	errno = serrno;
+}
+
+static void
+state_unlock(void)
+{
+	if (--state_lock_depth > 0)
+		return;
+	if (state_lock_fd != -1) {
+		close(state_lock_fd);
+		state_lock_fd = -1;
+	}
+}
+
+static void
+state_update(const char *base)
+{
+	state_lock();
+	state_record(base, state_scan(base), true);
+	state_unlock();
+}
+
+bool
+rc_service_mark(const char *service, const RC_SERVICE state)
+{
+	bool retval;
+
+	state_lock();
+	retval = service_mark(service, state);
+	state_update(basename_c(service));
+	state_unlock();
+	if (retval)
+		event_add(basename_c(service), "state",
+		    rc_parse_service_state(state), NULL);
+	return retval;
+}
+
+RC_SERVICE
+rc_service_state(const char *service)
+{
+	int state;
+	char file[PATH_MAX], value[16], *end;
+	ssize_t len;
+	long l;
+	const char *base = basename_c(service);
+
+	snprintf(file, sizeof(file), RC_SVCDIR_STATE "/%s", base);
+	len = readlink(file, value, sizeof(value) - 1);
+	if (len > 0) {
+		value[len] = '\0';
+		l = strtol(value, &end, 10);
+		if (*end != '\0' || l <= 0)
+			len = -1;
+		state = (int)l;
+	}
+	if (len <= 0) {
+		state = state_scan(base);
+		state_record(base, state, false);
+	}
+
+	if (state & RC_SERVICE_STARTED) {
+		if (rc_service_daemons_crashed(service) && errno != EACCES)
+			state |= RC_SERVICE_CRASHED;
+	}
+
+	return state;
+}
+
 char *
 rc_service_value_get(const char *service, const char *option)
 {
@@ -913,7 +1053,10 @@ rc_service_schedule_start(const char *service, const char *service_to_start)
 	init = rc_service_resolve(service_to_start);
 	snprintf(p, sizeof(file) - (p - file),
 	    "/%s", basename_c(service_to_start));
+	state_lock();
 	retval = (exists(file) || symlink(init, file) == 0);
+	state_update(basename_c(service_to_start));
+	state_unlock();
 	free(init);
 	return retval;
 }
@@ -922,12 +1065,21 @@ bool
 rc_service_schedule_clear(const char *service)
 {
 	char dir[PATH_MAX];
+	RC_STRINGLIST *scheduled;
+	RC_STRING *s;
+	bool retval = false;
 
 	snprintf(dir, sizeof(dir), RC_SVCDIR "/scheduled/%s",
 	    basename_c(service));
+	state_lock();
+	scheduled = ls_dir(dir, 0);
 	if (!rm_dir(dir, true) && errno == ENOENT)
-		return true;
-	return false;
+		retval = true;
+	TAILQ_FOREACH(s, scheduled, entries)
+		state_update(s->value);
+	state_unlock();
+	rc_stringlist_free(scheduled);
+	return retval;
 }
 
 RC_STRINGLIST *
@@ -944,7 +1096,7 @@ rc_services_in_runlevel(const char *runlevel)
 		RC_STRINGLIST *local = ls_dir(RC_LOCAL_INITDIR, LS_INITD);
 #endif
 
-		list = ls_dir(RC_INITDIR, LS_INITD);
+		list = ls_dir(RC_INITDIR, LS_INITD | LS_SORT);
 
 #ifdef RC_PKG_INITDIR
 		TAILQ_CONCAT(list, pkg, entries);
@@ -953,6 +1105,9 @@ rc_services_in_runlevel(const char *runlevel)
 #ifdef RC_LOCAL_INITDIR
 		TAILQ_CONCAT(list, local, entries);
 		free(local);
+#endif
+#if defined(RC_PKG_INITDIR) || defined(RC_LOCAL_INITDIR)
+		rc_stringlist_sort(&list);
 #endif
 		return list;
 	}
@@ -960,7 +1115,7 @@ rc_services_in_runlevel(const char *runlevel)
 	/* These special levels never contain any services */
 	if (strcmp(runlevel, RC_LEVEL_SINGLE) != 0) {
 		snprintf(dir, sizeof(dir), RC_RUNLEVELDIR "/%s", runlevel);
-		list = ls_dir(dir, LS_INITD);
+		list = ls_dir(dir, LS_INITD | LS_SORT);
 	}
 	if (!list)
 		list = rc_stringlist_new();
@@ -991,31 +1146,256 @@ rc_services_in_state(RC_SERVICE state)
 	RC_STRINGLIST *dirs;
 	RC_STRING *d;
 	char dir[PATH_MAX];
-	char *p = dir;
+	int fd;
 
-	p += snprintf(dir, sizeof(dir), RC_SVCDIR "/%s",
+	snprintf(dir, sizeof(dir), RC_SVCDIR "/%s",
 	    rc_parse_service_state(state));
 
 	if (state != RC_SERVICE_SCHEDULED)
-		return ls_dir(dir, LS_INITD);
+		return ls_dir(dir, LS_INITD | LS_SORT);
 
-	dirs = ls_dir(dir, 0);
 	list = rc_stringlist_new();
-	if (! dirs)
+	if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
 		return list;
-
+	dirs = ls_dirat(fd, ".", 0);
 	TAILQ_FOREACH(d, dirs, entries) {
-		snprintf(p, sizeof(dir) - (p - dir), "/%s", d->value);
-		services = ls_dir(dir, LS_INITD);
-		if (services) {
-			TAILQ_CONCAT(list, services, entries);
-			free(services);
-		}
+		services = ls_dirat(fd, d->value, LS_INITD);
+		TAILQ_CONCAT(list, services, entries);
+		free(services);
 	}
 	rc_stringlist_free(dirs);
+	close(fd);
+	rc_stringlist_sort(&list);
 	return list;
 }
 
+/* A service in a snapshot of states */
+struct rc_service_snapshot {
+	char *service;
+	int state;
+	/* Where we found it while building the snapshot */
+	int order;
+	/* We have worked out if it crashed */
+	bool checked;
+};
+
+/* Found in a scheduled directory, which only counts when stopped */
+#define SNAPSHOT_KNOWN		-1
+#define SNAPSHOT_SCHEDULED	INT_MAX
+
+static void
+snapshot_add(RC_SERVICE_STATES *states, size_t *size, const char *service,
+    int order)
+{
+	if (states->count == *size) {
+		*size = *size ? *size * 2 : 128;
+		states->services = xrealloc(states->services,
+		    sizeof(*states->services) * *size);
+	}
+	states->services[states->count].service = xstrdup(service);
+	states->services[states->count].state = 0;
+	states->services[states->count].order = order;
+	states->services[states->count].checked = false;
+	states->count++;
+}
+
+static int
+snapshot_cmp(const void *a, const void *b)
+{
+	const struct rc_service_snapshot *sa = a, *sb = b;
+	int r = strcmp(sa->service, sb->service);
+
+	if (r != 0)
+		return r;
+	return sa->order < sb->order ? -1 : sa->order > sb->order;
+}
+
+static int
+snapshot_find(const void *key, const void *svc)
+{
+	return strcmp(key, ((const struct rc_service_snapshot *)svc)->service);
+}
+
+/* Add every entry of dir that exists, like rc_service_state checks */
+static void
+snapshot_dir(RC_SERVICE_STATES *states, size_t *size, const char *dir,
+    int order)
+{
+	DIR *dp;
+	struct dirent *d;
+
+	if (!(dp = opendir(dir)))
+		return;
+	while ((d = readdir(dp))) {
+		if (d->d_name[0] == '.' || !ls_want(dirfd(dp), d, LS_INITD))
+			continue;
+		snapshot_add(states, size, d->d_name, order);
+	}
+	closedir(dp);
+}
+
+RC_SERVICE_STATES *
+rc_services_state_all(void)
+{
+	RC_SERVICE_STATES *states = xmalloc(sizeof(*states));
+	struct rc_service_snapshot *svc, *last;
+	RC_STRINGLIST *list;
+	RC_STRING *s;
+	char dir[PATH_MAX];
+	size_t size = 0, i, n;
+	int state;
+	bool scheduled;
+
+	states->services = NULL;
+	states->count = 0;
+
+	list = rc_services_in_runlevel(NULL);
+	TAILQ_FOREACH(s, list, entries)
+		snapshot_add(states, &size, s->value, SNAPSHOT_KNOWN);
+	rc_stringlist_free(list);
+
+	for (i = 0; rc_service_state_names[i].name; i++) {
+		snprintf(dir, sizeof(dir), RC_SVCDIR "/%s",
+		    rc_service_state_names[i].name);
+		snapshot_dir(states, &size, dir, (int)i);
+	}
+	list = ls_dir(RC_SVCDIR "/scheduled", 0);
+	TAILQ_FOREACH(s, list, entries) {
+		snprintf(dir, sizeof(dir), RC_SVCDIR "/scheduled/%s", s->value);
+		snapshot_dir(states, &size, dir, SNAPSHOT_SCHEDULED);
+	}
+	rc_stringlist_free(list);
+
+	/* Join what we found for each service in the order
+	 * rc_service_state would have found it */
+	if (states->count)
+		qsort(states->services, states->count,
+		    sizeof(*states->services), snapshot_cmp);
+	n = 0;
+	for (i = 0; i < states->count; ) {
+		last = &states->services[i];
+		state = RC_SERVICE_STOPPED;
+		scheduled = false;
+		for (; i < states->count; i++) {
+			svc = &states->services[i];
+			if (svc != last) {
+				if (strcmp(svc->service, last->service) != 0)
+					break;
+				free(svc->service);
+			}
+			if (svc->order == SNAPSHOT_SCHEDULED)
+				scheduled = true;
+			else if (svc->order != SNAPSHOT_KNOWN) {
+				if (rc_service_state_names[svc->order].state <= 0x10)
+					state = rc_service_state_names[svc->order].state;
+				else
+					state |= rc_service_state_names[svc->order].state;
+			}
+		}
+		if (scheduled && state & RC_SERVICE_STOPPED)
+			state |= RC_SERVICE_SCHEDULED;
+		states->services[n].service = last->service;
+		states->services[n].state = state;
+		n++;
+	}
+	states->count = n;
+	return states;
+}
+
+RC_SERVICE
+rc_services_state_get(RC_SERVICE_STATES *states, const char *service)
+{
+	struct rc_service_snapshot *svc = NULL;
+
+	if (states && states->count)
+		svc = bsearch(basename_c(service), states->services,
+		    states->count, sizeof(*states->services), snapshot_find);
+	if (!svc)
+		return rc_service_state(service);
+
+	/* Only work out if it crashed when asked, it's expensive */
+	if (svc->state & RC_SERVICE_STARTED && !svc->checked) {
+		svc->checked = true;
+		errno = 0;
+		if (rc_service_daemons_crashed(service) && errno != EACCES)
+			svc->state |= RC_SERVICE_CRASHED;
+	}
+	return svc->state;
+}
+
+void
+rc_services_state_free(RC_SERVICE_STATES *states)
+{
+	size_t i;
+
+	if (!states)
+		return;
+	for (i = 0; i < states->count; i++)
+		free(states->services[i].service);
+	free(states->services);
+	free(states);
+}
+
+RC_RUNLEVEL_MEMBERS *
+rc_runlevel_members(const RC_STRINGLIST *runlevels)
+{
+	RC_RUNLEVEL_MEMBERS *members = xmalloc(sizeof(*members));
+	RC_STRINGLIST *list;
+	const RC_STRING *s;
+	char dir[PATH_MAX];
+
+	if (runlevels) {
+		members->runlevels = rc_stringlist_new();
+		TAILQ_FOREACH(s, runlevels, entries)
+			rc_stringlist_addu(members->runlevels, s->value);
+	} else
+		members->runlevels = rc_runlevel_list();
+	members->members = rc_stringset_new();
+	TAILQ_FOREACH(s, members->runlevels, entries) {
+		snprintf(dir, sizeof(dir), RC_RUNLEVELDIR "/%s", s->value);
+		list = ls_dir(dir, LS_INITD);
+		rc_stringset_put(members->members, s->value,
+		    rc_stringset_from_list(list));
+		rc_stringlist_free(list);
+	}
+	return members;
+}
+
+bool
+rc_runlevel_members_has(const RC_RUNLEVEL_MEMBERS *members,
+    const char *runlevel, const char *service)
+{
+	return rc_stringset_find(rc_stringset_get(members->members, runlevel),
+	    basename_c(service));
+}
+
+RC_STRINGLIST *
+rc_runlevel_members_get(const RC_RUNLEVEL_MEMBERS *members,
+    const char *service)
+{
+	RC_STRINGLIST *list = rc_stringlist_new();
+	const RC_STRING *s;
+
+	TAILQ_FOREACH(s, members->runlevels, entries)
+		if (rc_runlevel_members_has(members, s->value, service))
+			rc_stringlist_add(list, s->value);
+	return list;
+}
+
+void
+rc_runlevel_members_free(RC_RUNLEVEL_MEMBERS *members)
+{
+	const RC_STRING *s;
+
+	if (!members)
+		return;
+	TAILQ_FOREACH(s, members->runlevels, entries)
+		rc_stringset_free(rc_stringset_get(members->members, s->value));
+	rc_stringset_free(members->members);
+	rc_stringlist_free(members->runlevels);
+	free(members);
+}
+
 bool
 rc_service_add(const char *runlevel, const char *service)
 {
@@ -1098,5 +1478,5 @@ rc_services_scheduled(const char *service)
 
 	snprintf(dir, sizeof(dir), RC_SVCDIR "/scheduled/%s",
 	    basename_c(service));
-	return ls_dir(dir, LS_INITD);
+	return ls_dir(dir, LS_INITD | LS_SORT);
 }
@@ -56,4 +56,24 @@
 #include "rc.h"
 #include "rc-misc.h"
 
+/* Arenas hand out memory from a few large blocks and free it all at once.
+ * Lists from an arena must not be passed to rc_stringlist_free or
+ * rc_stringlist_delete, and arena_stringlist_add does not copy value. */
+typedef struct rc_arena RC_ARENA;
+
+RC_ARENA *arena_new(void);
+void *arena_alloc(RC_ARENA *, size_t);
+char *arena_strdup(RC_ARENA *, const char *);
+RC_STRINGLIST *arena_stringlist_new(RC_ARENA *);
+RC_STRING *arena_stringlist_add(RC_ARENA *, RC_STRINGLIST *, char *);
+void arena_free(RC_ARENA *);
+
+/* Dependencies of simple init scripts without a shell, or NULL if
+ * gendepends.sh has to source them after all. */
+typedef struct gendep_conf GENDEP_CONF;
+
+GENDEP_CONF *gendep_conf_load(void);
+char *gendep_native(const GENDEP_CONF *, const char *, size_t *);
+void gendep_conf_free(GENDEP_CONF *);
+
 #endif
@@ -25,13 +25,16 @@
 #include <getopt.h>
 #include <grp.h>
 #include <libgen.h>
+#include <limits.h>
 #include <pwd.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "einfo.h"
+#include "queue.h"
 #include "rc.h"
 #include "rc-misc.h"
 #include "rc-selinux.h"
@@ -46,8 +49,9 @@ typedef enum {
 
 const char *applet = NULL;
 const char *extraopts ="path1 [path2] [...]";
-const char *getoptstring = "dDfFpm:o:sW" getoptstring_COMMON;
+const char *getoptstring = "b:dDfFpm:o:sW" getoptstring_COMMON;
 const struct option longopts[] = {
+	{ "batch",              1, NULL, 'b'},
 	{ "directory",          0, NULL, 'd'},
 	{ "directory-truncate", 0, NULL, 'D'},
 	{ "file",               0, NULL, 'f'},
@@ -60,6 +64,7 @@ const struct option longopts[] = {
 	longopts_COMMON
 };
 const char * const longopts_help[] = {
+	"Check each `type path [mode [owner]]' line of a file, - for stdin",
 	"Create a directory if not exists",
 	"Create/empty directory",
 	"Create a file if not exists",
@@ -73,78 +78,162 @@ const char * const longopts_help[] = {
 };
 const char *usagestring = NULL;
 
+/* In batch mode, the directories we already walked to, by path.
+ * Each fd was checked when we opened it, so entries sharing a parent
+ * start from there rather than from / again.
+ * We hold at most DIRCACHE_MAX of them open, so a long batch cannot
+ * run us out of fds. */
+#define DIRCACHE_MAX	64
+static RC_STRINGSET *dircache;
+
+/* Close every directory we hold and start again. Paths in a batch tend
+ * to be grouped, so this costs little over evicting the oldest. */
+static void dircache_clear(void)
+{
+	RC_STRINGLIST *names = rc_stringset_to_list(dircache);
+	RC_STRING *s;
+
+	TAILQ_FOREACH(s, names, entries)
+		close((int)(intptr_t)rc_stringset_get(dircache, s->value) - 1);
+	rc_stringlist_free(names);
+	rc_stringset_free(dircache);
+	dircache = rc_stringset_new();
+}
+
+/* Open the directory path is in, checking every symlink on the way.
+ * On error we say why and return -1, so a batch can carry on. */
 static int get_dirfd(char *path, bool symlinks) {
-	char *ch;
 	char *item;
 	char *linkpath = NULL;
-	char *path_dupe;
+	char *parent;
 	char *str;
-	int components = 0;
-	int dirfd;
+	char key[PATH_MAX];
+	char c;
+	int dirfd = -1;
 	int flags = 0;
 	int new_dirfd;
 	struct stat st;
 	ssize_t linksize;
+	size_t done = 0, end;
 
-	if (!path || *path != '/')
-		eerrorx("%s: empty or relative path", applet);
-	dirfd = openat(dirfd, "/", O_RDONLY);
-	if (dirfd == -1)
-		eerrorx("%s: unable to open the root directory: %s",
-				applet, strerror(errno));
-	path_dupe = xstrdup(path);
-	ch = path_dupe;
-	while (*ch) {
-		if (*ch == '/')
-			components++;
-		ch++;
+	if (!path || *path != '/') {
+		eerror("%s: empty or relative path", applet);
+		return -1;
 	}
-	item = strtok(path_dupe, "/");
+	parent = xstrdup(path);
+	*strrchr(parent, '/') = '\0';
+	if (strlen(parent) >= sizeof(key)) {
+		eerror("%s: %s: %s", applet, path, strerror(ENAMETOOLONG));
+		free(parent);
+		return -1;
+	}
+
+	if (dircache && rc_stringset_count(dircache) >= DIRCACHE_MAX)
+		dircache_clear();
+
+	/* Start from the longest parent we already have open */
+	if (dircache) {
+		end = strlen(parent);
+		for (;;) {
+			c = parent[end];
+			parent[end] = '\0';
+			new_dirfd = (int)(intptr_t)rc_stringset_get(dircache,
+			    parent);
+			parent[end] = c;
+			if (new_dirfd) {
+				dirfd = new_dirfd - 1;
+				done = end;
+				break;
+			}
+			if (end == 0)
+				break;
+			while (end > 0 && parent[--end] != '/')
+				;
+		}
+	}
+	if (dirfd == -1) {
+		dirfd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dirfd == -1) {
+			eerror("%s: unable to open the root directory: %s",
+					applet, strerror(errno));
+			goto fail;
+		}
+		if (dircache)
+			rc_stringset_put(dircache, "",
+			    (void *)(intptr_t)(dirfd + 1));
+	}
+	memcpy(key, parent, done);
+	key[done] = '\0';
+
+	item = strtok(parent + done, "/");
 #ifdef O_PATH
 	flags |= O_PATH;
 #endif
 	if (!symlinks)
 		flags |= O_NOFOLLOW;
-	flags |= O_RDONLY;
-	while (dirfd > 0 && item && components > 1) {
-		str = xstrdup(linkpath ? linkpath : item);
+	flags |= O_RDONLY | O_CLOEXEC;
+	while (dirfd > 0 && item) {
+		str = linkpath ? linkpath : item;
 		new_dirfd = openat(dirfd, str, flags);
-		if (new_dirfd == -1)
-			eerrorx("%s: %s: could not open %s: %s", applet, path, str,
+		if (new_dirfd == -1) {
+			eerror("%s: %s: could not open %s: %s", applet, path, str,
 					strerror(errno));
-		if (fstat(new_dirfd, &st) == -1)
-			eerrorx("%s: %s: unable to stat %s: %s", applet, path, item,
+			goto fail;
+		}
+		if (fstat(new_dirfd, &st) == -1) {
+			eerror("%s: %s: unable to stat %s: %s", applet, path, item,
 					strerror(errno));
+			close(new_dirfd);
+			goto fail;
+		}
 		if (S_ISLNK(st.st_mode) ) {
-			if (st.st_uid != 0)
-				eerrorx("%s: %s: symbolic link %s not owned by root",
+			if (st.st_uid != 0) {
+				eerror("%s: %s: symbolic link %s not owned by root",
 						applet, path, str);
+				close(new_dirfd);
+				goto fail;
+			}
 			linksize = st.st_size+1;
-			if (linkpath)
-				free(linkpath);
-			linkpath = xmalloc(linksize);
-			memset(linkpath, 0, linksize);
-			if (readlinkat(new_dirfd, "", linkpath, linksize) != st.st_size)
-				eerrorx("%s: symbolic link destination changed", applet);
+			str = xmalloc(linksize);
+			memset(str, 0, linksize);
+			if (readlinkat(new_dirfd, "", str, linksize) != st.st_size) {
+				eerror("%s: symbolic link destination changed", applet);
+				free(str);
+				close(new_dirfd);
+				goto fail;
+			}
+			free(linkpath);
+			linkpath = str;
 			/*
 			 * now follow the symlink.
 			 */
 			close(new_dirfd);
 		} else {
-			close(dirfd);
+			/* Cached fds stay open until the batch is done */
+			if (dircache) {
+				strcat(key, "/");
+				strcat(key, item);
+				rc_stringset_put(dircache, key,
+				    (void *)(intptr_t)(new_dirfd + 1));
+			} else
+				close(dirfd);
 			dirfd = new_dirfd;
 			free(linkpath);
 			linkpath = NULL;
 			item = strtok(NULL, "/");
-			components--;
 		}
 	}
-	free(path_dupe);
-	if (linkpath) {
-		free(linkpath);
-		linkpath = NULL;
-	}
+	free(parent);
+	free(linkpath);
 	return dirfd;
+
+fail:
+	/* Anything in the cache stays there for the next path */
+	if (!dircache && dirfd != -1)
+		close(dirfd);
+	free(parent);
+	free(linkpath);
+	return -1;
 }
 
 static int do_check(char *path, uid_t uid, gid_t gid, mode_t mode,
@@ -175,6 +264,10 @@ static int do_check(char *path, uid_t uid, gid_t gid, mode_t mode,
 		flags |= O_TRUNC;
 	xasprintf(&name, "%s", basename_c(path));
 	dirfd = get_dirfd(path, symlinks);
+	if (dirfd == -1) {
+		free(name);
+		return -1;
+	}
 	readfd = openat(dirfd, name, readflags);
 	if (readfd == -1 || (type == inode_file && trunc)) {
 		if (type == inode_file) {
@@ -329,6 +422,157 @@ static int parse_owner(struct passwd **user, struct group **group,
 	return retval;
 }
 
+/* Work out who should own a path, defaulting to who we are */
+static int get_owner(const char *owner, uid_t *uid, gid_t *gid)
+{
+	struct passwd *pw = NULL;
+	struct group *gr = NULL;
+
+	*uid = geteuid();
+	*gid = getgid();
+	if (parse_owner(&pw, &gr, owner) != 0)
+		return -1;
+	if (pw) {
+		*uid = pw->pw_uid;
+		*gid = pw->pw_gid;
+	}
+	if (gr)
+		*gid = gr->gr_gid;
+	return 0;
+}
+
+/* Turn each \ooo in a batch path into the character with that octal
+ * code, as in fstab, so \040 is a space */
+static void unescape_path(char *path)
+{
+	char *p = path;
+	int c;
+
+	while (*path) {
+		if (path[0] == '\\' &&
+		    path[1] >= '0' && path[1] <= '3' &&
+		    path[2] >= '0' && path[2] <= '7' &&
+		    path[3] >= '0' && path[3] <= '7' &&
+		    (c = (path[1] - '0') << 6 | (path[2] - '0') << 3 |
+			(path[3] - '0')) != 0)
+		{
+			*p++ = (char)c;
+			path += 4;
+		} else
+			*p++ = *path++;
+	}
+	*p = '\0';
+}
+
+/*
+ * Check every path listed in file, one per line as
+ *   type path [mode [owner]]
+ * where type is d, D, f, F or p as for the options, and mode or owner
+ * may be - to leave them alone. Blank lines and # comments are skipped.
+ * Fields are split on blanks, so a blank in a path is written \040.
+ */
+static int do_batch(const char *file, bool symlinks, bool selinux_on)
+{
+	FILE *fp;
+	char *line = NULL;
+	char *p, *type, *path, *modestr, *owner;
+	size_t len = 0;
+	size_t lineno = 0;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	inode_t itype;
+	bool trunc;
+	int retval = EXIT_SUCCESS;
+
+	if (strcmp(file, "-") == 0)
+		fp = stdin;
+	else if (!(fp = fopen(file, "r")))
+		eerrorx("%s: fopen `%s': %s", applet, file, strerror(errno));
+
+	dircache = rc_stringset_new();
+	while (rc_getline(&line, &len, fp)) {
+		lineno++;
+		/* Nothing carries over from the line before */
+		uid = geteuid();
+		gid = getgid();
+		p = line;
+		type = path = modestr = owner = NULL;
+		while (*p && (!type || !path || !modestr || !owner)) {
+			p += strspn(p, " \t");
+			if (!*p || *p == '#')
+				break;
+			if (!type)
+				type = p;
+			else if (!path)
+				path = p;
+			else if (!modestr)
+				modestr = p;
+			else
+				owner = p;
+			p += strcspn(p, " \t");
+			if (*p)
+				*p++ = '\0';
+		}
+		if (!type)
+			continue;
+
+		trunc = type[0] == 'D' || type[0] == 'F';
+		switch (type[1] ? '\0' : type[0]) {
+		case 'd':
+		case 'D':
+			itype = inode_dir;
+			break;
+		case 'f':
+		case 'F':
+			itype = inode_file;
+			break;
+		case 'p':
+			itype = inode_fifo;
+			break;
+		default:
+			eerror("%s: %s:%zu: unknown type `%s'",
+			    applet, file, lineno, type);
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		if (!path) {
+			eerror("%s: %s:%zu: no path", applet, file, lineno);
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		unescape_path(path);
+		mode = 0;
+		if (modestr && strcmp(modestr, "-") != 0 &&
+		    parse_mode(&mode, modestr) != 0)
+		{
+			eerror("%s: %s:%zu: invalid mode `%s'",
+			    applet, file, lineno, modestr);
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		if (owner && strcmp(owner, "-") == 0)
+			owner = NULL;
+		if (owner && get_owner(owner, &uid, &gid) != 0) {
+			eerror("%s: %s:%zu: owner `%s' not found",
+			    applet, file, lineno, owner);
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		if (do_check(path, uid, gid, mode, itype, trunc, owner != NULL,
+			symlinks, selinux_on))
+		{
+			eerror("%s: %s:%zu: unable to check `%s'",
+			    applet, file, lineno, path);
+			retval = EXIT_FAILURE;
+		}
+	}
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	return retval;
+}
+
 int main(int argc, char **argv)
 {
 	int opt;
@@ -344,12 +588,16 @@ int main(int argc, char **argv)
 	bool symlinks = false;
 	bool writable = false;
 	bool selinux_on = false;
+	const char *batch = NULL;
 
 	applet = basename_c(argv[0]);
 	while ((opt = getopt_long(argc, argv, getoptstring,
 		    longopts, (int *) 0)) != -1)
 	{
 		switch (opt) {
+		case 'b':
+			batch = optarg;
+			break;
 		case 'D':
 			trunc = true;
 			/* falls through */
@@ -389,7 +637,7 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (optind >= argc)
+	if (optind >= argc && !batch)
 		usage(EXIT_FAILURE);
 
 	if (writable && type != inode_unknown)
@@ -405,6 +653,9 @@ int main(int argc, char **argv)
 	if (selinux_util_open() == 1)
 		selinux_on = true;
 
+	if (batch && do_batch(batch, symlinks, selinux_on) != EXIT_SUCCESS)
+		retval = EXIT_FAILURE;
+
 	while (optind < argc) {
 		if (writable)
 			exit(!is_writable(argv[optind]));
@@ -18,14 +18,18 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -36,17 +40,22 @@
 
 const char *applet = NULL;
 const char *extraopts = "[signal number]";
-const char *getoptstring = "do:" getoptstring_COMMON;
+const char *getoptstring = "do:w:" getoptstring_COMMON;
 const struct option longopts[] = {
 	{ "dry-run",        0, NULL, 'd' },
 	{ "omit",        1, NULL, 'o' },
+	{ "wait",        1, NULL, 'w' },
 	longopts_COMMON
 };
 const char * const longopts_help[] = {
 	"print what would be done",
 	"omit this pid (can be repeated)",
+	"wait this many seconds for them to exit, then SIGKILL the rest",
 	longopts_help_COMMON
 };
+
+/* How often we look at processes we could not get a pidfd for */
+#define POLL_MS		10
 const char *usagestring = NULL;
 
 static int mount_proc(void)
@@ -85,63 +94,96 @@ static int mount_proc(void)
 	return 0;
 }
 
-static bool is_user_process(pid_t pid)
+/* What we know about a process, read once from /proc/<pid>/stat */
+struct proc {
+	pid_t pid;
+	pid_t ppid;
+	pid_t sid;
+	enum { PROC_UNKNOWN, PROC_CHECKING, PROC_USER, PROC_KERNEL } type;
+};
+
+static int proc_cmp(const void *a, const void *b)
 {
-	char *buf = NULL;
-	FILE *fp;
-	char *path = NULL;
-	pid_t temp_pid;
-	size_t size;
-	bool user_process = true;
-
-	while (pid >0 && user_process) {
-		if (pid == 2) {
-			user_process = false;
-			continue;
-		}
-		xasprintf(&path, "/proc/%d/status", pid);
-		fp = fopen(path, "r");
-		free(path);
-		/*
-		 * if we could not open the file, the process disappeared, which
-		 * leaves us no way to determine for sure whether it was a user
-		 * process or kernel thread, so we say it is a kernel thread to
-		 * avoid accidentally killing it.
-		 */
-		if (!fp) {
-			user_process = false;
-			continue;
-		}
-		temp_pid = -1;
-		while (! feof(fp)) {
-			buf = NULL;
-			if (getline(&buf, &size, fp) != -1) {
-				sscanf(buf, "PPid: %d", &temp_pid);
-				free(buf);
-			} else {
-				free(buf);
-				break;
-			}
-		}
-		fclose(fp);
-		if (temp_pid == -1) {
-			syslog(LOG_ERR, "Unable to read pid from /proc/%d/status", pid);
-			user_process = false;
-			continue;
-		}
-		pid = temp_pid;
+	const struct proc *pa = a, *pb = b;
+
+	return pa->pid < pb->pid ? -1 : pa->pid > pb->pid;
+}
+
+/* Read the parent and session of pid, relative to our cwd of /proc */
+static bool read_proc(pid_t pid, struct proc *p)
+{
+	char path[32], buf[512];
+	char *e;
+	ssize_t len;
+	int fd, ppid, sid;
+
+	snprintf(path, sizeof(path), "%d/stat", pid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return false;
+	buf[len] = '\0';
+	/* The command name may have anything in it, so we look for the
+	 * fields we want after the last ')' */
+	if (!(e = strrchr(buf, ')')) ||
+	    sscanf(e + 1, " %*c %d %*d %d", &ppid, &sid) != 2)
+	{
+		syslog(LOG_ERR, "Unable to read pid from /proc/%d/stat", pid);
+		return false;
+	}
+	p->pid = pid;
+	p->ppid = ppid;
+	p->sid = sid;
+	p->type = PROC_UNKNOWN;
+	return true;
+}
+
+/*
+ * A user process is one whose ancestry reaches pid 0 without going
+ * through kthreadd (pid 2). Each answer is remembered so that every
+ * process is looked at once, however deep the tree is.
+ * If any ancestor disappeared, we have no way to determine for sure
+ * whether it was a user process or kernel thread, so we say it is a
+ * kernel thread to avoid accidentally killing it.
+ */
+static bool is_user_process(struct proc *procs, size_t nprocs,
+		struct proc *p)
+{
+	struct proc key, *parent;
+
+	if (p->type == PROC_UNKNOWN) {
+		p->type = PROC_CHECKING;
+		key.pid = p->ppid;
+		if (p->pid == 2)
+			p->type = PROC_KERNEL;
+		else if (p->ppid <= 0)
+			p->type = PROC_USER;
+		else if (!(parent = bsearch(&key, procs, nprocs,
+			    sizeof(*procs), proc_cmp)))
+			p->type = PROC_KERNEL;
+		else
+			p->type = is_user_process(procs, nprocs, parent) ?
+			    PROC_USER : PROC_KERNEL;
 	}
-	return user_process;
+	/* Still checking means our ancestry loops, so leave it alone */
+	return p->type == PROC_USER;
 }
 
-static int signal_processes(int sig, RC_STRINGLIST *omits, bool dryrun)
+/* Signal every user process outside our session, adding the ones
+ * signalled to pids if it is given */
+static int signal_processes(int sig, RC_STRINGSET *omits, bool dryrun,
+		pid_t **pids)
 {
 	sigset_t signals;
 	sigset_t oldsigs;
 	DIR *dir;
 	struct dirent	*d;
-	char *buf = NULL;
-	pid_t pid;
+	struct proc *procs = NULL, *p;
+	size_t nprocs = 0, sprocs = 0, i;
+	char buf[16];
+	pid_t pid, sid;
 	int sendcount = 0;
 
 	kill(-1, SIGSTOP);
@@ -167,48 +209,182 @@ static int signal_processes(int sig, RC_STRINGLIST *omits, bool dryrun)
 		return -1;
 	}
 
-	/* Walk through the directory. */
+	/* Walk through the directory once to find every process. */
 	while ((d = readdir(dir)) != NULL) {
 		/* Is this a process? */
 		pid = (pid_t) atoi(d->d_name);
 		if (pid == 0)
 			continue;
+		if (nprocs == sprocs) {
+			sprocs = sprocs ? sprocs * 2 : 256;
+			procs = xrealloc(procs, sizeof(*procs) * sprocs);
+		}
+		if (read_proc(pid, &procs[nprocs]))
+			nprocs++;
+	}
+	closedir(dir);
+	qsort(procs, nprocs, sizeof(*procs), proc_cmp);
+	if (pids)
+		*pids = xmalloc(sizeof(**pids) * (nprocs + 1));
+
+	sid = getsid(0);
+	for (i = 0; i < nprocs; i++) {
+		p = &procs[i];
 
 		/* Is this a process we have been requested to omit? */
-		if (buf) {
-			free(buf);
-			buf = NULL;
-		}
-		xasprintf(&buf, "%d", pid);
-		if (rc_stringlist_find(omits, buf))
+		snprintf(buf, sizeof(buf), "%d", p->pid);
+		if (rc_stringset_find(omits, buf))
 			continue;
 
 		/* Is this process in our session? */
-		if (getsid(getpid()) == getsid(pid))
+		if (p->sid == sid)
 			continue;
 
 		/* Is this a kernel thread? */
-		if (!is_user_process(pid))
+		if (!is_user_process(procs, nprocs, p))
 			continue;
 
 		if (dryrun)
-			einfo("Would send signal %d to process %d", sig, pid);
-		else if (kill(pid, sig) == 0)
+			einfo("Would send signal %d to process %d", sig, p->pid);
+		else if (kill(p->pid, sig) == 0) {
+			if (pids)
+				(*pids)[sendcount] = p->pid;
 			sendcount++;
+		}
 	}
-	closedir(dir);
+	free(procs);
 	sigprocmask(SIG_SETMASK, &oldsigs, NULL);
 	kill(-1, SIGCONT);
 	return sendcount;
 }
 
+/* Zombies count as gone, they only wait for their parent to reap them */
+static bool is_running(pid_t pid)
+{
+	char path[32], buf[512];
+	char *e;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%d/stat", pid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return false;
+	buf[len] = '\0';
+	if (!(e = strrchr(buf, ')')))
+		return false;
+	return e[1] == ' ' && e[2] != 'Z' && e[2] != 'X';
+}
+
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void kill_pidfd(int fd, pid_t pid)
+{
+#ifdef SYS_pidfd_send_signal
+	/* The pidfd is sure to still be the process we signalled */
+	if (syscall(SYS_pidfd_send_signal, fd, SIGKILL, NULL, 0) == 0 ||
+	    errno != ENOSYS)
+		return;
+#else
+	(void)fd;
+#endif
+	kill(pid, SIGKILL);
+}
+
+static long ms_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	    (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Wait up to timeout seconds for the processes in pids to exit and then
+ * SIGKILL whatever is left, so we never wait longer than we need to.
+ * A pidfd becomes readable as soon as its process exits, we fall back to
+ * looking in /proc every POLL_MS for the ones we can't get a pidfd for.
+ */
+static void wait_processes(pid_t *pids, size_t npids, int timeout)
+{
+	struct pollfd *fds;
+	pid_t *fdpids;
+	struct timespec start;
+	size_t nfds = 0, npolled = 0, i;
+	long left;
+	int fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fds = xmalloc(sizeof(*fds) * (npids + 1));
+	fdpids = xmalloc(sizeof(*fdpids) * (npids + 1));
+	for (i = 0; i < npids; i++) {
+		if ((fd = open_pidfd(pids[i])) != -1) {
+			fds[nfds].fd = fd;
+			fds[nfds].events = POLLIN;
+			fds[nfds].revents = 0;
+			fdpids[nfds++] = pids[i];
+		} else if (errno != ESRCH && is_running(pids[i]))
+			pids[npolled++] = pids[i];
+	}
+
+	while ((nfds || npolled) &&
+	    (left = (long)timeout * 1000 - ms_since(&start)) > 0)
+	{
+		if (npolled && left > POLL_MS)
+			left = POLL_MS;
+		if (poll(fds, nfds, (int)left) == -1 && errno != EINTR)
+			break;
+		for (i = 0; i < nfds;) {
+			if (fds[i].revents) {
+				close(fds[i].fd);
+				fds[i] = fds[--nfds];
+				fdpids[i] = fdpids[nfds];
+			} else
+				i++;
+		}
+		for (i = 0; i < npolled;) {
+			if (!is_running(pids[i]))
+				pids[i] = pids[--npolled];
+			else
+				i++;
+		}
+	}
+
+	if (nfds || npolled)
+		einfov("%zu processes did not exit in %d seconds, killing them",
+		    nfds + npolled, timeout);
+	for (i = 0; i < nfds; i++) {
+		kill_pidfd(fds[i].fd, fdpids[i]);
+		close(fds[i].fd);
+	}
+	for (i = 0; i < npolled; i++)
+		kill(pids[i], SIGKILL);
+	free(fds);
+	free(fdpids);
+}
+
 int main(int argc, char **argv)
 {
 	char *arg = NULL;
 	int opt;
 	bool dryrun = false;
-	RC_STRINGLIST *omits = rc_stringlist_new();
+	RC_STRINGSET *omits = rc_stringset_new();
 	int sig = SIGKILL;
+	int timeout = -1;
+	int count;
+	pid_t *pids = NULL;
 	char *here;
 	char *token;
 
@@ -216,7 +392,7 @@ int main(int argc, char **argv)
 	unsetenv("EINFO_QUIET");
 
 	applet = basename_c(argv[0]);
-	rc_stringlist_addu(omits, "1");
+	rc_stringset_add(omits, "1");
 	while ((opt = getopt_long(argc, argv, getoptstring,
 		    longopts, (int *) 0)) != -1)
 	{
@@ -228,13 +404,20 @@ int main(int argc, char **argv)
 				here = optarg;
 				while ((token = strsep(&here, ",;:"))) {
 					if ((pid_t) atoi(token) > 0)
-						rc_stringlist_addu(omits, token);
+						rc_stringset_add(omits, token);
 					else {
 						eerror("Invalid omit pid value %s", token);
 						usage(EXIT_FAILURE);
 					}
 				}
 				break;
+			case 'w':
+				timeout = atoi(optarg);
+				if (timeout < 0) {
+					eerror("Invalid wait value %s", optarg);
+					usage(EXIT_FAILURE);
+				}
+				break;
 			case_RC_COMMON_GETOPT
 		}
 	}
@@ -243,7 +426,7 @@ int main(int argc, char **argv)
 	arg = argv[optind];
 	sig = atoi(arg);
 	if (sig <= 0 || sig > 31) {
-		rc_stringlist_free(omits);
+		rc_stringset_free(omits);
 		eerror("Invalid signal %s", arg);
 		usage(EXIT_FAILURE);
 	}
@@ -251,10 +434,18 @@ int main(int argc, char **argv)
 
 	openlog(applet, LOG_CONS|LOG_PID, LOG_DAEMON);
 	if (mount_proc() != 0) {
-		rc_stringlist_free(omits);
+		rc_stringset_free(omits);
 		eerrorx("Unable to mount /proc file system");
 	}
-	signal_processes(sig, omits, dryrun);
-	rc_stringlist_free(omits);
+	/* There is no point waiting on SIGKILL or on what we didn't send */
+	if (timeout < 0 || sig == SIGKILL || dryrun) {
+		signal_processes(sig, omits, dryrun, NULL);
+	} else {
+		count = signal_processes(sig, omits, dryrun, &pids);
+		if (count > 0)
+			wait_processes(pids, (size_t)count, timeout);
+		free(pids);
+	}
+	rc_stringset_free(omits);
 	return 0;
 }
@@ -35,6 +35,7 @@
 #include <getopt.h>
 #include <limits.h>
 #include <regex.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -47,6 +48,7 @@
 
 const char *applet = NULL;
 const char *procmounts = "/proc/mounts";
+const char *procmountinfo = "/proc/self/mountinfo";
 const char *extraopts = "[mount1] [mount2] ...";
 const char *getoptstring = "f:F:n:N:o:O:p:P:iste:E:" getoptstring_COMMON;
 const struct option longopts[] = {
@@ -103,7 +105,9 @@ struct args {
 	regex_t *skip_fstype_regex;
 	regex_t *options_regex;
 	regex_t *skip_options_regex;
-	RC_STRINGLIST *mounts;
+	regex_t *point_regex;
+	regex_t *skip_point_regex;
+	RC_STRINGSET *mounts;
 	mount_type mount_type;
 	net_opts netdev;
 };
@@ -114,7 +118,6 @@ process_mount(RC_STRINGLIST *list, struct args *args,
     int netdev)
 {
 	char *p;
-	RC_STRING *s;
 
 	errno = ENOENT;
 
@@ -125,12 +128,12 @@ process_mount(RC_STRINGLIST *list, struct args *args,
 #endif
 
 	if (args->netdev == net_yes &&
-	    (netdev != -1 || TAILQ_FIRST(args->mounts)))
+	    (netdev != -1 || rc_stringset_count(args->mounts)))
 	{
 		if (netdev != 0)
 			return 1;
 	} else if (args->netdev == net_no &&
-	    (netdev != -1 || TAILQ_FIRST(args->mounts)))
+	    (netdev != -1 || rc_stringset_count(args->mounts)))
 	{
 		if (netdev != 1)
 			return 1;
@@ -157,13 +160,9 @@ process_mount(RC_STRINGLIST *list, struct args *args,
 			return -1;
 	}
 
-	if (TAILQ_FIRST(args->mounts)) {
-		TAILQ_FOREACH(s, args->mounts, entries)
-		    if (strcmp(s->value, to) == 0)
-			    break;
-		if (! s)
-			return -1;
-	}
+	if (rc_stringset_count(args->mounts) &&
+	    !rc_stringset_find(args->mounts, to))
+		return -1;
 
 	switch (args->mount_type) {
 	case mount_from:
@@ -185,6 +184,13 @@ process_mount(RC_STRINGLIST *list, struct args *args,
 	}
 
 	if (p) {
+		/* Only keep what we are going to print */
+		if (args->point_regex &&
+		    regexec(args->point_regex, p, 0, NULL, 0) != 0)
+			return -1;
+		if (args->skip_point_regex &&
+		    regexec(args->skip_point_regex, p, 0, NULL, 0) == 0)
+			return -1;
 		errno = 0;
 		rc_stringlist_add(list, p);
 		return 0;
@@ -287,66 +293,154 @@ find_mounts(struct args *args)
 
 #elif defined(__linux__) || (defined(__FreeBSD_kernel__) && \
 	defined(__GLIBC__)) || defined(__GNU__)
-static struct mntent *
-getmntfile(const char *file)
+#define FSTAB_NETDEV	((void *)(intptr_t)1)
+#define FSTAB_LOCAL	((void *)(intptr_t)2)
+
+/* Load the mount points in fstab once, noting which are _netdev,
+ * so we don't have to scan it again for every mount. */
+static RC_STRINGSET *
+load_fstab(void)
 {
-	struct mntent *ent = NULL;
+	RC_STRINGSET *fstab = rc_stringset_new();
+	struct mntent *ent;
 	FILE *fp;
 
-	if (!exists("/etc/fstab"))
-		return NULL;
-
-	fp = setmntent("/etc/fstab", "r");
+	if (!exists("/etc/fstab") || !(fp = setmntent("/etc/fstab", "r")))
+		return fstab;
+	/* Like getmntent lookups, the first entry for a point wins */
 	while ((ent = getmntent(fp)))
-		if (strcmp(file, ent->mnt_dir) == 0)
-			break;
+		if (!rc_stringset_find(fstab, ent->mnt_dir))
+			rc_stringset_put(fstab, ent->mnt_dir,
+			    strstr(ent->mnt_opts, "_netdev") ?
+			    FSTAB_NETDEV : FSTAB_LOCAL);
 	endmntent(fp);
+	return fstab;
+}
+
+/* The kernel escapes space, tab, newline and backslash as \ooo */
+static char *
+unescape(char *s)
+{
+	char *p, *d;
+
+	if (!s)
+		return NULL;
+	for (p = d = s; *p; d++) {
+		if (p[0] == '\\' &&
+		    p[1] >= '0' && p[1] <= '3' &&
+		    p[2] >= '0' && p[2] <= '7' &&
+		    p[3] >= '0' && p[3] <= '7')
+		{
+			*d = (char)(((p[1] - '0') << 6) |
+			    ((p[2] - '0') << 3) | (p[3] - '0'));
+			p += 4;
+		} else
+			*d = *p++;
+	}
+	*d = '\0';
+	return s;
+}
+
+/*
+ * Split a line of /proc/self/mountinfo, which looks like
+ *   id parent major:minor root point mount-opts [optional...] - fstype from super-opts
+ * The options /proc/mounts would show are the mount options followed by
+ * the superblock ones, less the ro or rw they both start with.
+ * Returns false if the line is not one we understand.
+ */
+static bool
+split_mountinfo(char *line, char **from, char **to, char **fst,
+    char **opts, char **buf, size_t *bufsize)
+{
+	char *p = line, *f, *mopts, *sopts;
+	size_t len;
+	int i;
 
-	return ent;
+	for (i = 0; i < 4; i++)
+		if (!strsep(&p, " "))
+			return false;
+	*to = strsep(&p, " ");
+	mopts = strsep(&p, " ");
+	while ((f = strsep(&p, " ")) && strcmp(f, "-") != 0)
+		;
+	if (!f || !*to || !mopts)
+		return false;
+	*fst = strsep(&p, " ");
+	*from = strsep(&p, " ");
+	sopts = strsep(&p, " \n");
+	if (!*fst || !*from || !sopts)
+		return false;
+
+	if (strncmp(sopts, "rw", 2) == 0 || strncmp(sopts, "ro", 2) == 0)
+		if (sopts[2] == ',' || sopts[2] == '\0')
+			sopts += sopts[2] ? 3 : 2;
+	len = strlen(mopts) + strlen(sopts) + 2;
+	if (*bufsize < len) {
+		*bufsize = len;
+		*buf = xrealloc(*buf, len);
+	}
+	snprintf(*buf, *bufsize, "%s%s%s", mopts, *sopts ? "," : "", sopts);
+	*opts = *buf;
+	return true;
 }
 
 static RC_STRINGLIST *
 find_mounts(struct args *args)
 {
 	FILE *fp;
-	char *buffer;
-	size_t size;
+	char *buffer = NULL;
+	char *optbuf = NULL;
+	size_t size = 0;
+	size_t optsize = 0;
 	char *p;
 	char *from;
 	char *to;
 	char *fst;
 	char *opts;
-	struct mntent *ent;
+	void *ent;
 	int netdev;
+	bool info = true;
+	RC_STRINGSET *fstab = NULL;
 	RC_STRINGLIST *list;
 
-	if ((fp = fopen(procmounts, "r")) == NULL)
-		eerrorx("getmntinfo: %s", strerror(errno));
+	if ((fp = fopen(procmountinfo, "r")) == NULL) {
+		info = false;
+		if ((fp = fopen(procmounts, "r")) == NULL)
+			eerrorx("getmntinfo: %s", strerror(errno));
+	}
+
+	/* We only need fstab to know what is a network mount */
+	if (args->netdev != net_ignore)
+		fstab = load_fstab();
 
 	list = rc_stringlist_new();
-
-	buffer = NULL;
 	while (getline(&buffer, &size, fp) != -1) {
-		netdev = -1;
-		p = buffer;
-		from = strsep(&p, " ");
-		to = strsep(&p, " ");
-		fst = strsep(&p, " ");
-		opts = strsep(&p, " ");
-
-		if ((ent = getmntfile(to))) {
-			if (strstr(ent->mnt_opts, "_netdev"))
-				netdev = 0;
-			else
-				netdev = 1;
+		if (info) {
+			if (!split_mountinfo(buffer, &from, &to, &fst, &opts,
+				&optbuf, &optsize))
+				continue;
+		} else {
+			p = buffer;
+			from = strsep(&p, " ");
+			to = strsep(&p, " ");
+			fst = strsep(&p, " ");
+			opts = strsep(&p, " ");
+			if (!from || !to || !fst || !opts)
+				continue;
 		}
+		unescape(from);
+		unescape(to);
+
+		netdev = -1;
+		if ((ent = rc_stringset_get(fstab, to)))
+			netdev = ent == FSTAB_NETDEV ? 0 : 1;
 
 		process_mount(list, args, from, to, fst, opts, netdev);
-		free(buffer);
-		buffer = NULL;
 	}
 	free(buffer);
+	free(optbuf);
 	fclose(fp);
+	rc_stringset_free(fstab);
 
 	return list;
 }
@@ -374,8 +468,6 @@ get_regex(const char *string)
 int main(int argc, char **argv)
 {
 	struct args args;
-	regex_t *point_regex = NULL;
-	regex_t *skip_point_regex = NULL;
 	RC_STRINGLIST *nodes;
 	RC_STRING *s;
 	char *real_path = NULL;
@@ -393,7 +485,7 @@ int main(int argc, char **argv)
 	memset (&args, 0, sizeof(args));
 	args.mount_type = mount_to;
 	args.netdev = net_ignore;
-	args.mounts = rc_stringlist_new();
+	args.mounts = rc_stringset_new();
 
 	while ((opt = getopt_long(argc, argv, getoptstring,
 		    longopts, (int *) 0)) != -1)
@@ -424,10 +516,10 @@ int main(int argc, char **argv)
 			DO_REG(args.skip_options_regex);
 			break;
 		case 'p':
-			DO_REG(point_regex);
+			DO_REG(args.point_regex);
 			break;
 		case 'P':
-			DO_REG(skip_point_regex);
+			DO_REG(args.skip_point_regex);
 			break;
 		case 'i':
 			args.mount_type = mount_options;
@@ -451,12 +543,12 @@ int main(int argc, char **argv)
 		real_path = realpath(this_path, NULL);
 		if (real_path)
 			this_path = real_path;
-		rc_stringlist_add(args.mounts, this_path);
+		rc_stringset_put(args.mounts, this_path, NULL);
 		free(real_path);
 		real_path = NULL;
 	}
 	nodes = find_mounts(&args);
-	rc_stringlist_free(args.mounts);
+	rc_stringset_free(args.mounts);
 
 	REG_FREE(args.fstype_regex);
 	REG_FREE(args.skip_fstype_regex);
@@ -464,25 +556,18 @@ int main(int argc, char **argv)
 	REG_FREE(args.skip_node_regex);
 	REG_FREE(args.options_regex);
 	REG_FREE(args.skip_options_regex);
+	REG_FREE(args.point_regex);
+	REG_FREE(args.skip_point_regex);
 
 	result = EXIT_FAILURE;
 
 	/* We should report the mounts in reverse order to ease unmounting */
 	TAILQ_FOREACH_REVERSE(s, nodes, rc_stringlist, entries) {
-		if (point_regex &&
-		    regexec(point_regex, s->value, 0, NULL, 0) != 0)
-			continue;
-		if (skip_point_regex &&
-		    regexec(skip_point_regex, s->value, 0, NULL, 0) == 0)
-			continue;
 		if (! rc_yesno(getenv("EINFO_QUIET")))
 			printf("%s\n", s->value);
 		result = EXIT_SUCCESS;
 	}
 	rc_stringlist_free(nodes);
 
-	REG_FREE(point_regex);
-	REG_FREE(skip_point_regex);
-
 	return result;
 }
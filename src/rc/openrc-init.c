@@ -18,7 +18,10 @@
  *    except according to the terms contained in the LICENSE file.
  */
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -28,8 +31,11 @@
 #include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/reboot.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #ifdef HAVE_SELINUX
@@ -45,15 +51,54 @@
 static const char *path_default = "/sbin:/usr/sbin:/bin:/usr/bin";
 static const char *rc_default_runlevel = "default";
 
+/* From the kernel's sched.h, set in the flags of kernel threads */
+#define PF_KTHREAD	0x00200000
+#define SHUTDOWN_TIMEOUT	3
+#define SHUTDOWN_POLL_MS	20
+
+/*
+ * We keep every signal blocked and take the ones we handle from a
+ * signalfd in the main loop, so we never do any work in signal context.
+ * While we wait for one of our children we reap every orphan that
+ * exits in the meantime as well.
+ */
+static int wait_child(pid_t pid)
+{
+	pid_t p;
+	int status;
+
+	for (;;) {
+		p = waitpid(-1, &status, 0);
+		if (p == pid)
+			return status;
+		if (p == -1 && errno != EINTR)
+			return -1;
+	}
+}
+
+static void reap_zombies(void)
+{
+	pid_t pid;
+
+	for (;;) {
+		pid = waitpid(-1, NULL, WNOHANG);
+		if (pid == 0)
+			break;
+		else if (pid == -1) {
+			if (errno == ECHILD)
+				break;
+			if (errno != EINTR)
+				perror("waitpid");
+			continue;
+		}
+	}
+}
+
 static void do_openrc(const char *runlevel)
 {
 	pid_t pid;
-	sigset_t all_signals;
-	sigset_t our_signals;
+	sigset_t signals;
 
-	sigfillset(&all_signals);
-	/* block all signals */
-	sigprocmask(SIG_BLOCK, &all_signals, &our_signals);
 	pid = fork();
 	switch (pid) {
 		case -1:
@@ -63,26 +108,48 @@ static void do_openrc(const char *runlevel)
 		case 0:
 			setsid();
 			/* unblock all signals */
-			sigprocmask(SIG_UNBLOCK, &all_signals, NULL);
+			sigemptyset(&signals);
+			sigprocmask(SIG_SETMASK, &signals, NULL);
 			printf("Starting %s runlevel\n", runlevel);
 			execlp("openrc", "openrc", runlevel, NULL);
 			perror("exec");
 			exit(1);
 			break;
 		default:
-			/* restore our signal mask */
-			sigprocmask(SIG_SETMASK, &our_signals, NULL);
-			while (waitpid(pid, NULL, 0) != pid)
-				if (errno == ECHILD)
-					break;
+			wait_child(pid);
 			break;
 	}
 }
 
+/* Start rc-depwatch so we don't have to check if the deptree is
+ * current by hand every time. RC_SVCDIR is only there after sysinit. */
+static void start_depwatch(void)
+{
+	pid_t pid;
+	sigset_t signals;
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return;
+	}
+	if (pid == 0) {
+		setsid();
+		/* unblock all signals */
+		sigemptyset(&signals);
+		sigprocmask(SIG_SETMASK, &signals, NULL);
+		execl(RC_LIBEXECDIR "/sbin/rc-depwatch", "rc-depwatch",
+		    (char *) NULL);
+		perror("exec");
+		exit(1);
+	}
+}
+
 static void init(const char *default_runlevel)
 {
 	const char *runlevel = NULL;
 	do_openrc("sysinit");
+	start_depwatch();
 	do_openrc("boot");
 	if (default_runlevel)
 		runlevel = default_runlevel;
@@ -104,16 +171,79 @@ static void handle_reexec(char *my_name)
 	return;
 }
 
-static void handle_shutdown(const char *runlevel, int cmd)
+/* Is anything besides us and kernel threads still running?
+ * Zombies don't count, the caller reaps the ones that are ours. */
+static bool user_processes_left(void)
 {
-	struct timespec ts;
+	char path[32], buf[512];
+	char *e;
+	DIR *dp;
+	struct dirent *d;
+	ssize_t len;
+	unsigned int flags;
+	char state;
+	pid_t pid;
+	int fd;
+	bool found = false;
+
+	/* In a pid namespace there are no kernel threads to get in
+	 * the way, so the kernel can just tell us */
+	if (kill(-1, 0) == -1 && errno == ESRCH)
+		return false;
+	if (!(dp = opendir("/proc")))
+		return true;
+	while (!found && (d = readdir(dp))) {
+		pid = (pid_t)atoi(d->d_name);
+		if (pid <= 1)
+			continue;
+		snprintf(path, sizeof(path), "%d/stat", (int)pid);
+		if ((fd = openat(dirfd(dp), path, O_RDONLY | O_CLOEXEC)) == -1)
+			continue;
+		len = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (len <= 0)
+			continue;
+		buf[len] = '\0';
+		if (!(e = strrchr(buf, ')')) ||
+		    sscanf(e + 1, " %c %*d %*d %*d %*d %*d %u",
+			&state, &flags) != 2)
+			continue;
+		if (state != 'Z' && state != 'X' && !(flags & PF_KTHREAD))
+			found = true;
+	}
+	closedir(dp);
+	return found;
+}
+
+/* Give everything up to rc_shutdown_timeout seconds to exit after the
+ * final term signal, but no longer than it actually takes */
+static void wait_for_processes(void)
+{
+	const char *value = rc_conf_value("rc_shutdown_timeout");
+	struct timespec start, now, ts;
+	long timeout = value ? atol(value) : SHUTDOWN_TIMEOUT;
+
+	if (timeout < 0)
+		timeout = SHUTDOWN_TIMEOUT;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ts.tv_sec = 0;
+	ts.tv_nsec = SHUTDOWN_POLL_MS * 1000000L;
+	while (user_processes_left()) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec - start.tv_sec +
+		    (now.tv_nsec - start.tv_nsec) / 1e9 >= timeout)
+			break;
+		nanosleep(&ts, NULL);
+		reap_zombies();
+	}
+}
 
+static void handle_shutdown(const char *runlevel, int cmd)
+{
 	do_openrc(runlevel);
 	printf("Sending the final term signal\n");
 	kill(-1, SIGTERM);
-	ts.tv_sec = 3;
-	ts.tv_nsec = 0;
-	nanosleep(&ts, NULL);
+	wait_for_processes();
 	printf("Sending the final kill signal\n");
 	kill(-1, SIGKILL);
 	sync();
@@ -122,13 +252,9 @@ static void handle_shutdown(const char *runlevel, int cmd)
 
 static void run_program(const char *prog)
 {
-	sigset_t full;
-	sigset_t old;
+	sigset_t signals;
 	pid_t pid;
 
-	/* We need to block signals until we have forked */
-	sigfillset(&full);
-	sigprocmask(SIG_SETMASK, &full, &old);
 	pid = fork();
 	if (pid == -1) {
 		perror("init");
@@ -136,14 +262,13 @@ static void run_program(const char *prog)
 	}
 	if (pid == 0) {
 		/* Unmask signals */
-		sigprocmask(SIG_SETMASK, &old, NULL);
+		sigemptyset(&signals);
+		sigprocmask(SIG_SETMASK, &signals, NULL);
 		execl(prog, prog, (char *)NULL);
 		perror("init");
 		exit(1);
 	}
-	/* Unmask signals and wait for child */
-	sigprocmask(SIG_SETMASK, &old, NULL);
-	if (rc_waitpid(pid) == -1)
+	if (wait_child(pid) == -1)
 		perror("init");
 }
 
@@ -184,47 +309,104 @@ static void handle_single(void)
 	do_openrc("single");
 }
 
-static void reap_zombies(void)
+static void handle_signals(int fd)
 {
-	pid_t pid;
+	struct signalfd_siginfo si;
 
-	for (;;) {
-		pid = waitpid(-1, NULL, WNOHANG);
-		if (pid == 0)
-			break;
-		else if (pid == -1) {
-			if (errno == ECHILD)
+	while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+		switch (si.ssi_signo) {
+			case SIGINT:
+				handle_shutdown("reboot", RB_AUTOBOOT);
+				break;
+			case SIGCHLD:
+				/* One SIGCHLD may stand for many children */
+				reap_zombies();
+				break;
+			default:
+				printf("Unknown signal received, %d\n",
+				    (int)si.ssi_signo);
 				break;
-			perror("waitpid");
-			continue;
 		}
 	}
 }
 
-static void signal_handler(int sig)
+static void handle_command(const char *cmd, char *my_name,
+		const char *default_runlevel)
 {
-	switch (sig) {
-		case SIGINT:
-			handle_shutdown("reboot", RB_AUTOBOOT);
-			break;
-		case SIGCHLD:
-			reap_zombies();
-			break;
-		default:
-			printf("Unknown signal received, %d\n", sig);
-			break;
+	printf("PID1: Received \"%s\"...\n", cmd);
+	if (strcmp(cmd, "halt") == 0)
+		handle_shutdown("shutdown", RB_HALT_SYSTEM);
+	else if (strcmp(cmd, "kexec") == 0)
+		handle_shutdown("reboot", RB_KEXEC);
+	else if (strcmp(cmd, "poweroff") == 0)
+		handle_shutdown("shutdown", RB_POWER_OFF);
+	else if (strcmp(cmd, "reboot") == 0)
+		handle_shutdown("reboot", RB_AUTOBOOT);
+	else if (strcmp(cmd, "reexec") == 0)
+		handle_reexec(my_name);
+	else if (strcmp(cmd, "single") == 0) {
+		handle_single();
+		open_shell();
+		init(default_runlevel);
+	}
+}
+
+/* Commands come in as one datagram each on our socket */
+static int open_socket(void)
+{
+	struct sockaddr_un sun;
+	mode_t mask;
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1) {
+		perror("socket");
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", RC_INIT_SOCKET);
+	unlink(RC_INIT_SOCKET);
+	/* Only root may talk to us */
+	mask = umask(0077);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		perror("bind");
+		close(fd);
+		fd = -1;
+	}
+	umask(mask);
+	return fd;
+}
+
+/*
+ * An older openrc-shutdown writes to the fifo, and will until it is
+ * upgraded along with us. We hold a writer open ourselves so that it
+ * never reaches EOF and we don't have to reopen it after every command.
+ */
+static int open_fifo(void)
+{
+	int fd;
+
+	if (mkfifo(RC_INIT_FIFO, 0600) == -1 && errno != EEXIST)
+		perror("mkfifo");
+	if ((fd = open(RC_INIT_FIFO, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) == -1) {
+		perror("open");
+		return -1;
 	}
+	if (open(RC_INIT_FIFO, O_WRONLY | O_CLOEXEC) == -1)
+		perror("open");
+	return fd;
 }
 
 int main(int argc, char **argv)
 {
 	char *default_runlevel;
 	char buf[2048];
-	int count;
-	FILE *fifo;
+	ssize_t count;
 	bool reexec = false;
 	sigset_t signals;
-	struct sigaction sa;
+	struct pollfd fds[3];
+	int sigfd;
+	size_t i;
 #ifdef HAVE_SELINUX
 	int			enforce = 0;
 #endif
@@ -265,17 +447,15 @@ int main(int argc, char **argv)
 	if (default_runlevel && strcmp(default_runlevel, "reexec") == 0)
 		reexec = true;
 
-	/* block all signals we do not handle */
+	/* block all signals, the ones we handle are read from sigfd */
 	sigfillset(&signals);
-	sigdelset(&signals, SIGCHLD);
-	sigdelset(&signals, SIGINT);
 	sigprocmask(SIG_SETMASK, &signals, NULL);
-
-	/* install signal  handler */
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = signal_handler;
-	sigaction(SIGCHLD, &sa, NULL);
-	sigaction(SIGINT, &sa, NULL);
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGCHLD);
+	sigaddset(&signals, SIGINT);
+	sigfd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sigfd == -1)
+		perror("signalfd");
 	reboot(RB_DISABLE_CAD);
 
 	/* set default path */
@@ -284,35 +464,32 @@ int main(int argc, char **argv)
 	if (! reexec)
 		init(default_runlevel);
 
-	if (mkfifo(RC_INIT_FIFO, 0600) == -1 && errno != EEXIST)
-		perror("mkfifo");
+	/* Children that exited while we were busy booting */
+	reap_zombies();
+
+	fds[0].fd = sigfd;
+	fds[1].fd = open_socket();
+	fds[2].fd = open_fifo();
+	for (i = 0; i < 3; i++)
+		fds[i].events = POLLIN;
 
 	for (;;) {
-		/* This will block until a command is sent down the pipe... */
-		fifo = fopen(RC_INIT_FIFO, "r");
-		if (!fifo) {
+		/* This will block until we get a signal or a command */
+		if (poll(fds, 3, -1) == -1) {
 			if (errno != EINTR)
-				perror("fopen");
+				perror("poll");
 			continue;
 		}
-		count = fread(buf, 1, sizeof(buf) - 1, fifo);
-		buf[count] = 0;
-		fclose(fifo);
-		printf("PID1: Received \"%s\" from FIFO...\n", buf);
-		if (strcmp(buf, "halt") == 0)
-			handle_shutdown("shutdown", RB_HALT_SYSTEM);
-		else if (strcmp(buf, "kexec") == 0)
-			handle_shutdown("reboot", RB_KEXEC);
-		else if (strcmp(buf, "poweroff") == 0)
-			handle_shutdown("shutdown", RB_POWER_OFF);
-		else if (strcmp(buf, "reboot") == 0)
-			handle_shutdown("reboot", RB_AUTOBOOT);
-		else if (strcmp(buf, "reexec") == 0)
-			handle_reexec(argv[0]);
-		else if (strcmp(buf, "single") == 0) {
-			handle_single();
-			open_shell();
-			init(default_runlevel);
+		if (fds[0].revents & POLLIN)
+			handle_signals(sigfd);
+		for (i = 1; i < 3; i++) {
+			if (!(fds[i].revents & POLLIN))
+				continue;
+			count = read(fds[i].fd, buf, sizeof(buf) - 1);
+			if (count <= 0)
+				continue;
+			buf[count] = 0;
+			handle_command(buf, argv[0], default_runlevel);
 		}
 	}
 	return 0;
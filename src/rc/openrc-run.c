@@ -20,6 +20,7 @@
 #include <sys/file.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 
 #include <ctype.h>
@@ -50,20 +51,25 @@
 #include "einfo.h"
 #include "queue.h"
 #include "rc.h"
+#include "rc-hotplug.h"
 #include "rc-misc.h"
 #include "rc-plugin.h"
+#include "rc-readahead.h"
 #include "rc-selinux.h"
+#include "rc-sockets.h"
+#include "rc-zygote.h"
 #include "_usage.h"
 
 #define PREFIX_LOCK	RC_SVCDIR "/prefix.lock"
+#define PREFIX_MAX	(BUFSIZ * 4)	/* most we hold back waiting for a newline */
+#define PREFIX_WAIT	100		/* ms to wait for the rest of a line */
 
-#define WAIT_INTERVAL	20000000	/* usecs to poll the lock file */
 #define WAIT_TIMEOUT	60		/* seconds until we timeout */
 #define WARN_TIMEOUT	10		/* warn about this every N seconds */
 
 const char *applet = NULL;
 const char *extraopts = "stop | start | restart | describe | zap";
-const char *getoptstring = "dDsSvl:Z" getoptstring_COMMON;
+const char *getoptstring = "dDsSvl:T:Z" getoptstring_COMMON;
 const struct option longopts[] = {
 	{ "debug",      0, NULL, 'd'},
 	{ "dry-run",    0, NULL, 'Z'},
@@ -71,6 +77,7 @@ const struct option longopts[] = {
 	{ "ifstopped",  0, NULL, 'S'},
 	{ "nodeps",     0, NULL, 'D'},
 	{ "lockfd",     1, NULL, 'l'},
+	{ "deptreefd",  1, NULL, 'T'},
 	longopts_COMMON
 };
 const char *const longopts_help[] = {
@@ -80,12 +87,17 @@ const char *const longopts_help[] = {
 	"only run commands when stopped",
 	"ignore dependencies",
 	"fd of the exclusive lock from rc",
+	"fd of the deptree from rc",
 	longopts_help_COMMON
 };
 const char *usagestring = NULL;
 
 static char *service, *runlevel, *ibsave, *prefix;
+static char *prefix_buf;
+static size_t prefix_len, prefix_size;
+static int prefix_lock = -1;
 static RC_DEPTREE *deptree;
+static int deptree_fd = -1;	/* rc loaded the deptree for us */
 static RC_STRINGLIST *applet_list, *services, *tmplist;
 static RC_STRINGLIST *restart_services;
 static RC_STRINGLIST *need_services;
@@ -95,7 +107,11 @@ static RC_HOOK hook_out;
 static int exclusive_fd = -1, master_tty = -1;
 static bool sighup, in_background, deps, dry_run;
 static pid_t service_pid;
+static bool service_zygote;
 static int signal_pipe[2] = { -1, -1 };
+static int listen_fds[RC_LISTEN_FDS_MAX];
+static int nlisten;
+static int listen_notify = -1;	/* rc wants to know when we listen */
 
 static RC_STRINGLIST *deptypes_b;	/* broken deps */
 static RC_STRINGLIST *deptypes_n;	/* needed deps */
@@ -123,7 +139,10 @@ handle_signal(int sig)
 				eerror("%s: send: %s",
 				    service, strerror(errno));
 		} else
-			rc_waitpid(-1);
+			/* Only reap what has exited, the plugin host
+			 * stays around */
+			while (waitpid(-1, NULL, WNOHANG) > 0)
+				;
 		break;
 
 	case SIGWINCH:
@@ -144,9 +163,10 @@ handle_signal(int sig)
 	case SIGQUIT:
 		if (!signame)
 			xasprintf(&signame, "SIGQUIT");
-		/* Send the signal to our children too */
+		/* Send the signal to our children too. A shell from the
+		 * zygote ignores SIGINT and SIGQUIT as background jobs do. */
 		if (service_pid > 0)
-			kill(service_pid, sig);
+			kill(service_pid, service_zygote ? SIGTERM : sig);
 		eerror("%s: caught %s, aborting", applet, signame);
 		free(signame);
 		exit(EXIT_FAILURE);
@@ -169,6 +189,11 @@ unhotplug()
 	if (exists(file) && unlink(file) != 0)
 		eerror("%s: unlink `%s': %s", applet, file, strerror(errno));
 	free(file);
+
+	/* The recorded state is now out of date */
+	xasprintf(&file, RC_SVCDIR_STATE "/%s", applet);
+	unlink(file);
+	free(file);
 }
 
 static void
@@ -202,6 +227,98 @@ start_services(RC_STRINGLIST *list)
 	}
 }
 
+/* Is the service listening for its daemon yet? */
+static bool
+svc_listening(const char *svc)
+{
+	char file[PATH_MAX];
+
+	snprintf(file, sizeof(file), RC_SVCDIR_LISTENING "/%s", svc);
+	return exists(file);
+}
+
+/* The deptree rc gave us if it did, otherwise the cached one */
+static RC_DEPTREE *
+load_deptree(void)
+{
+	if (!deptree && deptree_fd != -1)
+		deptree = rc_deptree_load_fd(deptree_fd);
+	if (!deptree)
+		deptree = _rc_deptree_load(0, NULL);
+	return deptree;
+}
+
+/*
+ * Bind the sockets the service listens on before its daemon starts, so
+ * that anything depending on it can start and connect right away.
+ * The connections wait in the backlog until the daemon accepts them.
+ * The shell passes the sockets on through RC_LISTEN_FDS.
+ */
+static void
+svc_listen(void)
+{
+	RC_STRINGLIST *addrs;
+	RC_STRING *addr;
+	char *fds = NULL, *tmp, file[PATH_MAX];
+	pid_t pid = getpid();
+	int fd;
+
+	if (!load_deptree())
+		return;
+	addrs = rc_deptree_depend(deptree, applet, "listen");
+	TAILQ_FOREACH(addr, addrs, entries) {
+		if (nlisten == RC_LISTEN_FDS_MAX)
+			eerrorx("%s: too many sockets to listen on", applet);
+		if ((fd = rc_listen_bind(addr->value)) == -1)
+			eerrorx("%s: unable to listen on `%s': %s",
+			    applet, addr->value, strerror(errno));
+		listen_fds[nlisten++] = fd;
+		tmp = fds;
+		if (tmp)
+			xasprintf(&fds, "%s,%d", tmp, fd);
+		else
+			xasprintf(&fds, "%d", fd);
+		free(tmp);
+	}
+	rc_stringlist_free(addrs);
+	if (!fds)
+		return;
+	setenv("RC_LISTEN_FDS", fds, 1);
+	free(fds);
+
+	snprintf(file, sizeof(file), RC_SVCDIR_LISTENING "/%s", applet);
+	if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1)
+		close(fd);
+	if (listen_notify != -1 &&
+	    write(listen_notify, &pid, sizeof(pid)) != sizeof(pid))
+		ewarn("%s: unable to tell rc we are listening: %s",
+		    applet, strerror(errno));
+}
+
+/* The daemon has its own copies of the sockets now, or has gone.
+ * Once it has been stopped nobody should find its sockets either. */
+static void
+svc_unlisten(bool stopped)
+{
+	RC_STRINGLIST *addrs;
+	RC_STRING *addr;
+	char file[PATH_MAX];
+
+	while (nlisten > 0)
+		close(listen_fds[--nlisten]);
+	unsetenv("RC_LISTEN_FDS");
+	if (!stopped || !svc_listening(applet))
+		return;
+	snprintf(file, sizeof(file), RC_SVCDIR_LISTENING "/%s", applet);
+	unlink(file);
+	if (!load_deptree())
+		return;
+	addrs = rc_deptree_depend(deptree, applet, "listen");
+	TAILQ_FOREACH(addr, addrs, entries)
+		rc_listen_unlink(addr->value);
+	rc_stringlist_free(addrs);
+}
+
 static void
 restore_state(void)
 {
@@ -218,6 +335,7 @@ restore_state(void)
 		if (rc_runlevel_stopping())
 			rc_service_mark(applet, RC_SERVICE_FAILED);
 	} else if (state & RC_SERVICE_STARTING) {
+		svc_unlisten(true);
 		if (state & RC_SERVICE_WASINACTIVE)
 			rc_service_mark(applet, RC_SERVICE_INACTIVE);
 		else
@@ -268,6 +386,9 @@ cleanup(void)
 	free(ibsave);
 	free(service);
 	free(prefix);
+	free(prefix_buf);
+	if (prefix_lock != -1)
+		close(prefix_lock);
 	free(runlevel);
 }
 
@@ -278,23 +399,35 @@ cleanup(void)
  * Why don't we use (f)printf, as it is thread-safe through POSIX already?
  * Bug: 360013
  */
-static int
-write_prefix(const char *buffer, size_t bytes, bool *prefixed)
+static void
+prefix_add(const char *buffer, size_t bytes)
 {
-	size_t i, j;
-	const char *ec = ecolor(ECOLOR_HILITE);
-	const char *ec_normal = ecolor(ECOLOR_NORMAL);
-	ssize_t ret = 0;
-	int fd = fileno(stdout), lock_fd = -1;
+	if (prefix_len + bytes > prefix_size) {
+		prefix_size = prefix_len + bytes + BUFSIZ;
+		prefix_buf = xrealloc(prefix_buf, prefix_size);
+	}
+	memcpy(prefix_buf + prefix_len, buffer, bytes);
+	prefix_len += bytes;
+}
+
+/* Write out the first bytes of our buffered output in one go */
+static ssize_t
+prefix_flush(size_t bytes)
+{
+	ssize_t ret;
+
+	if (bytes == 0)
+		return 0;
 
 	/*
 	 * Lock the prefix.
 	 * open() may fail here when running as user, as RC_SVCDIR may not be writable.
 	 */
-	lock_fd = open(PREFIX_LOCK, O_WRONLY | O_CREAT, 0664);
-
-	if (lock_fd != -1) {
-		while (flock(lock_fd, LOCK_EX) != 0) {
+	if (prefix_lock == -1)
+		prefix_lock = open(PREFIX_LOCK,
+		    O_WRONLY | O_CREAT | O_CLOEXEC, 0664);
+	if (prefix_lock != -1) {
+		while (flock(prefix_lock, LOCK_EX) != 0) {
 			if (errno != EINTR) {
 				ewarnv("flock() failed: %s", strerror(errno));
 				break;
@@ -304,7 +437,28 @@ write_prefix(const char *buffer, size_t bytes, bool *prefixed)
 	else
 		ewarnv("Couldn't open the prefix lock, please make sure you have enough permissions");
 
-	for (i = 0; i < bytes; i++) {
+	ret = write(fileno(stdout), prefix_buf, bytes);
+
+	/* Release the lock */
+	if (prefix_lock != -1)
+		flock(prefix_lock, LOCK_UN);
+
+	prefix_len -= bytes;
+	memmove(prefix_buf, prefix_buf + bytes, prefix_len);
+	return ret;
+}
+
+/* Prefix each line of output with our name. Lines are only written out
+ * once they are complete so that they do not get mixed with those of
+ * other services. */
+static int
+write_prefix(const char *buffer, size_t bytes, bool *prefixed)
+{
+	size_t i, j, from, eol = 0;
+	const char *ec = ecolor(ECOLOR_HILITE);
+	const char *ec_normal = ecolor(ECOLOR_NORMAL);
+
+	for (i = from = 0; i < bytes; i++) {
 		/* We don't prefix eend calls (cursor up) */
 		if (buffer[i] == '\033' && !*prefixed) {
 			for (j = i + 1; j < bytes; j++) {
@@ -316,22 +470,27 @@ write_prefix(const char *buffer, size_t bytes, bool *prefixed)
 		}
 
 		if (!*prefixed) {
-			ret += write(fd, ec, strlen(ec));
-			ret += write(fd, prefix, strlen(prefix));
-			ret += write(fd, ec_normal, strlen(ec_normal));
-			ret += write(fd, "|", 1);
+			prefix_add(buffer + from, i - from);
+			from = i;
+			prefix_add(ec, strlen(ec));
+			prefix_add(prefix, strlen(prefix));
+			prefix_add(ec_normal, strlen(ec_normal));
+			prefix_add("|", 1);
 			*prefixed = true;
 		}
 
-		if (buffer[i] == '\n')
+		if (buffer[i] == '\n') {
 			*prefixed = false;
-		ret += write(fd, buffer + i, 1);
+			eol = prefix_len + i + 1 - from;
+		}
 	}
+	prefix_add(buffer + from, bytes - from);
 
-	/* Release the lock */
-	close(lock_fd);
-
-	return ret;
+	if (eol)
+		return (int)prefix_flush(eol);
+	if (prefix_len >= PREFIX_MAX)
+		return (int)prefix_flush(prefix_len);
+	return 0;
 }
 
 static int
@@ -345,9 +504,11 @@ svc_exec(const char *arg1, const char *arg2)
 	struct pollfd fd[2];
 	int s;
 	char *buffer;
-	size_t bytes;
+	ssize_t bytes;
 	bool prefixed = false;
 	int slave_tty;
+	int relay[2];
+	int zygote;
 	sigset_t sigchldmask;
 	sigset_t oldmask;
 
@@ -359,35 +520,50 @@ svc_exec(const char *arg1, const char *arg2)
 			fcntl(signal_pipe[i], F_SETFD, flags | FD_CLOEXEC) == -1))
 			eerrorx("%s: fcntl: %s", service, strerror(errno));
 
-	/* Open a pty for our prefixed output
-	 * We do this instead of mapping pipes to stdout, stderr so that
-	 * programs can tell if they're attached to a tty or not.
-	 * The only loss is that we can no longer tell the difference
-	 * between the childs stdout or stderr */
+	/* Prefixed output has to pass through us.
+	 * If someone can type at the service we give it a pty, so that
+	 * programs can tell if they're attached to a tty or not. Otherwise
+	 * a pipe does the job for less. Either way we can no longer tell
+	 * the difference between the childs stdout or stderr.
+	 * Without a prefix the child just writes to ours. */
 	master_tty = slave_tty = -1;
+	relay[0] = relay[1] = -1;
 	if (prefix && isatty(fdout)) {
-		tcgetattr(fdout, &tt);
-		ioctl(fdout, TIOCGWINSZ, &ws);
-
-		/* If the below call fails due to not enough ptys then we don't
-		 * prefix the output, but we still work */
-		openpty(&master_tty, &slave_tty, NULL, &tt, &ws);
-		if (master_tty >= 0 &&
-		    (flags = fcntl(master_tty, F_GETFD, 0)) == 0)
-			fcntl(master_tty, F_SETFD, flags | FD_CLOEXEC);
-
-		if (slave_tty >=0 &&
-		    (flags = fcntl(slave_tty, F_GETFD, 0)) == 0)
-			fcntl(slave_tty, F_SETFD, flags | FD_CLOEXEC);
+		if (isatty(STDIN_FILENO)) {
+			tcgetattr(fdout, &tt);
+			ioctl(fdout, TIOCGWINSZ, &ws);
+
+			/* If the below call fails due to not enough ptys
+			 * then we fall back to a pipe */
+			if (openpty(&master_tty, &slave_tty,
+				NULL, &tt, &ws) == 0)
+			{
+				relay[0] = master_tty;
+				relay[1] = slave_tty;
+			}
+		}
+		if (relay[0] == -1 && pipe(relay) == -1)
+			relay[0] = relay[1] = -1;
+		for (i = 0; i < 2; i++)
+			if (relay[i] >= 0 &&
+			    (flags = fcntl(relay[i], F_GETFD, 0)) != -1)
+				fcntl(relay[i], F_SETFD, flags | FD_CLOEXEC);
+		if (relay[0] >= 0 &&
+		    (flags = fcntl(relay[0], F_GETFL, 0)) != -1)
+			fcntl(relay[0], F_SETFL, flags | O_NONBLOCK);
 	}
 
-	service_pid = fork();
+	/* rc may have a shell ready for us */
+	zygote = rc_zygote_spawn(service, arg1, arg2, relay[1], &service_pid);
+	service_zygote = zygote != -1;
+	if (!service_zygote)
+		service_pid = fork();
 	if (service_pid == -1)
 		eerrorx("%s: fork: %s", service, strerror(errno));
 	if (service_pid == 0) {
-		if (slave_tty >= 0) {
-			dup2(slave_tty, STDOUT_FILENO);
-			dup2(slave_tty, STDERR_FILENO);
+		if (relay[1] >= 0) {
+			dup2(relay[1], STDOUT_FILENO);
+			dup2(relay[1], STDERR_FILENO);
 		}
 
 		if (exists(RC_SVCDIR "/openrc-run.sh")) {
@@ -425,18 +601,20 @@ svc_exec(const char *arg1, const char *arg2)
 		}
 	}
 
+	if (relay[1] >= 0)
+		close(relay[1]);
 	buffer = xmalloc(sizeof(char) * BUFSIZ);
-	fd[0].fd = signal_pipe[0];
+	/* The zygote tells us when its shell is done */
+	fd[0].fd = service_zygote ? zygote : signal_pipe[0];
 	fd[0].events = fd[1].events = POLLIN;
 	fd[0].revents = fd[1].revents = 0;
-	if (master_tty >= 0) {
-		fd[1].fd = master_tty;
-		fd[1].events = POLLIN;
-		fd[1].revents = 0;
-	}
+	fd[1].fd = relay[0];
 
 	for (;;) {
-		if ((s = poll(fd, master_tty >= 0 ? 2 : 1, -1)) == -1) {
+		/* Don't hold back the start of a line for too long */
+		if ((s = poll(fd, fd[1].fd >= 0 ? 2 : 1,
+			    prefix_len ? PREFIX_WAIT : -1)) == -1)
+		{
 			if (errno != EINTR) {
 				eerror("%s: poll: %s",
 				    service, strerror(errno));
@@ -444,19 +622,32 @@ svc_exec(const char *arg1, const char *arg2)
 			}
 		}
 
+		if (s == 0)
+			prefix_flush(prefix_len);
 		if (s > 0) {
 			if (fd[1].revents & (POLLIN | POLLHUP)) {
-				bytes = read(master_tty, buffer, BUFSIZ);
-				write_prefix(buffer, bytes, &prefixed);
+				bytes = read(fd[1].fd, buffer, BUFSIZ);
+				if (bytes > 0)
+					write_prefix(buffer, (size_t)bytes,
+					    &prefixed);
+				else if (bytes == 0 || errno != EAGAIN)
+					/* Nobody is left to write to us */
+					fd[1].fd = -1;
 			}
 
-			/* Only SIGCHLD signals come down this pipe */
+			/* Only SIGCHLD signals come down this pipe,
+			 * and only the status down the zygote's */
 			if (fd[0].revents & (POLLIN | POLLHUP))
 				break;
 		}
 	}
 
+	/* Pick up whatever the child said on its way out */
+	while (fd[1].fd >= 0 &&
+	    (bytes = read(fd[1].fd, buffer, BUFSIZ)) > 0)
+		write_prefix(buffer, (size_t)bytes, &prefixed);
 	free(buffer);
+	prefix_flush(prefix_len);
 
 	sigemptyset (&sigchldmask);
 	sigaddset (&sigchldmask, SIGCHLD);
@@ -468,31 +659,114 @@ svc_exec(const char *arg1, const char *arg2)
 
 	sigprocmask (SIG_SETMASK, &oldmask, NULL);
 
-	if (master_tty >= 0) {
+	if (relay[0] >= 0) {
 		/* Why did we do this? */
 		/* signal (SIGWINCH, SIG_IGN); */
-		close(master_tty);
+		close(relay[0]);
 		master_tty = -1;
 	}
 
-	ret = rc_waitpid(service_pid);
-	ret = WEXITSTATUS(ret);
-	if (ret != 0 && errno == ECHILD)
-		/* killall5 -9 could cause this */
-		ret = 0;
+	if (service_zygote) {
+		ret = rc_zygote_wait(zygote);
+	} else {
+		ret = rc_waitpid(service_pid);
+		ret = WEXITSTATUS(ret);
+		if (ret != 0 && errno == ECHILD)
+			/* killall5 -9 could cause this */
+			ret = 0;
+	}
 	service_pid = 0;
+	service_zygote = false;
 
 	return ret;
 }
 
+/* Services that leave status to start-stop-daemon or supervise-daemon
+ * only get told what librc already knows, so we can do that without a
+ * shell. gendepends tells us which ones those are.
+ * Returns -1 if the script has to answer. */
+static int
+svc_status(void)
+{
+	RC_STRINGLIST *types;
+	RC_SERVICE state;
+	bool supervised;
+	bool crashed;
+	bool recorded;
+	char *child_pid;
+	char *start_time;
+
+	if (!load_deptree())
+		return -1;
+	types = rc_deptree_depend(deptree, applet, "status");
+	if (TAILQ_EMPTY(types)) {
+		rc_stringlist_free(types);
+		return -1;
+	}
+	supervised = rc_stringlist_find(types, "supervise-daemon") != NULL;
+	rc_stringlist_free(types);
+
+	state = rc_service_state(applet);
+	if (state & RC_SERVICE_STOPPING) {
+		ewarn("status: stopping");
+		return 4;
+	}
+	if (state & RC_SERVICE_STARTING) {
+		ewarn("status: starting");
+		return 8;
+	}
+	if (state & RC_SERVICE_INACTIVE) {
+		ewarn("status: inactive");
+		return 16;
+	}
+
+	/* Only check for crashes where the script would */
+	crashed = false;
+	if (!supervised || state & RC_SERVICE_STARTED)
+		crashed = rc_service_daemons_crashed(applet) &&
+		    errno != EACCES;
+	if (crashed && supervised) {
+		child_pid = rc_service_value_get(applet, "child_pid");
+		start_time = rc_service_value_get(applet, "start_time");
+		recorded = child_pid && *child_pid &&
+		    start_time && *start_time;
+		free(child_pid);
+		free(start_time);
+		if (recorded) {
+			eerror("status: unsupervised");
+			return 64;
+		}
+	}
+	if (crashed) {
+		eerror("status: crashed");
+		return 32;
+	}
+	if (state & RC_SERVICE_STARTED) {
+		einfo("status: started");
+		return 0;
+	}
+	einfo("status: stopped");
+	return 3;
+}
+
+static void
+handle_alarm(_unused int sig)
+{
+	/* Nothing to do, we only want flock interrupted */
+}
+
 static bool
 svc_wait(const char *svc)
 {
 	char *file = NULL;
 	int fd;
 	bool forever = false;
+	bool retval = false;
 	RC_STRINGLIST *keywords;
-	struct timespec interval, timeout, warn;
+	struct timespec now;
+	time_t timeout, warn;
+	struct itimerval it;
+	struct sigaction sa, oldsa;
 
 	/* Some services don't have a timeout, like fsck */
 	keywords = rc_deptree_depend(deptree, svc, "keyword");
@@ -502,53 +776,62 @@ svc_wait(const char *svc)
 	rc_stringlist_free(keywords);
 
 	xasprintf(&file, RC_SVCDIR "/exclusive/%s", basename_c(svc));
-
-	interval.tv_sec = 0;
-	interval.tv_nsec = WAIT_INTERVAL;
-	timeout.tv_sec = WAIT_TIMEOUT;
-	timeout.tv_nsec = 0;
-	warn.tv_sec = WARN_TIMEOUT;
-	warn.tv_nsec = 0;
-	for (;;) {
-		fd = open(file, O_RDONLY | O_NONBLOCK);
-		if (fd != -1) {
-			if (flock(fd, LOCK_SH | LOCK_NB) == 0) {
-				close(fd);
-				free(file);
-				return true;
-			}
-			close(fd);
-		}
+	fd = open(file, O_RDONLY | O_NONBLOCK);
+	if (fd == -1) {
 		if (errno == ENOENT) {
 			free(file);
 			return true;
 		}
-		if (errno != EWOULDBLOCK) {
-			eerror("%s: open `%s': %s", applet, file,
-			    strerror(errno));
-			free(file);
-			exit(EXIT_FAILURE);
-		}
-		if (nanosleep(&interval, NULL) == -1) {
-			if (errno != EINTR)
-				goto finish;
-		}
+		eerror("%s: open `%s': %s", applet, file, strerror(errno));
+		free(file);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Block on the lock the service holds while it's changing state,
+	 * using a timer to wake us up to warn or give up. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_alarm;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGALRM, &sa, &oldsa);
+	memset(&it, 0, sizeof(it));
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timeout = now.tv_sec + WAIT_TIMEOUT;
+	warn = now.tv_sec + WARN_TIMEOUT;
+	for (;;) {
 		if (!forever) {
-			timespecsub(&timeout, &interval, &timeout);
-			if (timeout.tv_sec <= 0)
-				goto finish;
-			timespecsub(&warn, &interval, &warn);
-			if (warn.tv_sec <= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec >= timeout)
+				break;
+			if (now.tv_sec >= warn) {
 				ewarn("%s: waiting for %s (%d seconds)",
-				    applet, svc, (int)timeout.tv_sec);
-				warn.tv_sec = WARN_TIMEOUT;
-				warn.tv_nsec = 0;
+				    applet, svc, (int)(timeout - now.tv_sec));
+				warn = now.tv_sec + WARN_TIMEOUT;
 			}
+			/* Wake at whichever comes first, then every second
+			 * in case it went off before we got into flock */
+			it.it_value.tv_sec = (warn < timeout ? warn : timeout) -
+			    now.tv_sec;
+			it.it_interval.tv_sec = 1;
+			setitimer(ITIMER_REAL, &it, NULL);
+		}
+		if (flock(fd, LOCK_SH) == 0) {
+			retval = true;
+			break;
+		}
+		if (errno != EINTR) {
+			eerror("%s: flock `%s': %s", applet, file,
+			    strerror(errno));
+			break;
 		}
 	}
-finish:
+
+	memset(&it, 0, sizeof(it));
+	setitimer(ITIMER_REAL, &it, NULL);
+	sigaction(SIGALRM, &oldsa, NULL);
+	close(fd);
 	free(file);
-	return false;
+	return retval;
 }
 
 static void
@@ -654,7 +937,7 @@ svc_start_deps(void)
 	if (rc_conf_yesno("rc_depend_strict") || errno == ENOENT)
 		depoptions |= RC_DEP_STRICT;
 
-	if (!deptree && ((deptree = _rc_deptree_load(0, NULL)) == NULL))
+	if (!load_deptree())
 		eerrorx("failed to load deptree");
 	if (!deptypes_b)
 		setup_deptypes();
@@ -729,6 +1012,10 @@ svc_start_deps(void)
 				continue;
 		}
 
+		/* Once it is listening we can talk to it */
+		if (state & RC_SERVICE_STARTING && svc_listening(svc->value))
+			continue;
+
 		if (!svc_wait(svc->value))
 			eerror("%s: timed out waiting for %s",
 			    applet, svc->value);
@@ -793,11 +1080,16 @@ static void svc_start_real()
 	bool started;
 	RC_STRING *svc, *svc2;
 
+	timing_mark(applet, "start", "ready");
 	if (ibsave)
 		setenv("IN_BACKGROUND", ibsave, 1);
 	hook_out = RC_HOOK_SERVICE_START_DONE;
 	rc_plugin_run(RC_HOOK_SERVICE_START_NOW, applet);
+	svc_listen();
+	timing_mark(applet, "start", "begin");
 	started = (svc_exec("start", NULL) == 0);
+	timing_mark(applet, "start", "end");
+	svc_unlisten(!started);
 	if (ibsave)
 		unsetenv("IN_BACKGROUND");
 
@@ -912,7 +1204,7 @@ svc_stop_deps(RC_SERVICE state)
 	if (rc_conf_yesno("rc_depend_strict") || errno == ENOENT)
 		depoptions |= RC_DEP_STRICT;
 
-	if (!deptree && ((deptree = _rc_deptree_load(0, NULL)) == NULL))
+	if (!load_deptree())
 		eerrorx("failed to load deptree");
 
 	if (!deptypes_m)
@@ -999,16 +1291,20 @@ svc_stop_real(void)
 	if (strcmp(applet, "localmount") == 0)
 		setenv("LC_ALL", "C", 1);
 
+	timing_mark(applet, "stop", "ready");
 	if (ibsave)
 		setenv("IN_BACKGROUND", ibsave, 1);
 	hook_out = RC_HOOK_SERVICE_STOP_DONE;
 	rc_plugin_run(RC_HOOK_SERVICE_STOP_NOW, applet);
+	timing_mark(applet, "stop", "begin");
 	stopped = (svc_exec("stop", NULL) == 0);
+	timing_mark(applet, "stop", "end");
 	if (ibsave)
 		unsetenv("IN_BACKGROUND");
 
 	if (!stopped)
 		eerrorx("ERROR: %s failed to stop", applet);
+	svc_unlisten(true);
 
 	if (in_background)
 		rc_service_mark(service, RC_SERVICE_INACTIVE);
@@ -1109,6 +1405,64 @@ service_plugable(void)
 	return allow;
 }
 
+/* Leave a hotplug start for openrc to do along with all the others
+ * coming in, and become the openrc that does them if there is none */
+static bool
+hotplug_queue(void)
+{
+	char *file = rc_service_resolve(applet);
+	bool queued = file && strcmp(file, service) == 0 &&
+	    rc_hotplug_queue(applet);
+	int fd;
+
+	free(file);
+	if (!queued)
+		return false;
+	if ((fd = rc_hotplug_lock()) != -1) {
+		rc_hotplug_unlock(fd);
+		execlp("openrc", "openrc", "--hotplug", (char *)NULL);
+		/* Start it ourselves then, openrc will find it started */
+		return false;
+	}
+	return true;
+}
+
+/* Note the files openrc-run.sh will source for us, as it finds them */
+static void
+readahead_record(void)
+{
+	char *dir, *base, *file;
+	const char *p;
+	int i;
+
+	if (!rc_readahead_recording())
+		return;
+	rc_readahead_record(service);
+	/* The conf.d beside the init.d the script is in */
+	dir = xstrdup(service);
+	for (i = 0; i < 2; i++)
+		if ((file = strrchr(dir, '/')))
+			*file = '\0';
+	if ((p = strchr(applet, '.')) && p != applet) {
+		base = xstrdup(applet);
+		base[p - applet] = '\0';
+		xasprintf(&file, "%s/conf.d/%s.%s", dir, base, runlevel);
+		rc_readahead_record(file);
+		free(file);
+		xasprintf(&file, "%s/conf.d/%s", dir, base);
+		rc_readahead_record(file);
+		free(file);
+		free(base);
+	}
+	xasprintf(&file, "%s/conf.d/%s.%s", dir, applet, runlevel);
+	rc_readahead_record(file);
+	free(file);
+	xasprintf(&file, "%s/conf.d/%s", dir, applet);
+	rc_readahead_record(file);
+	free(file);
+	free(dir);
+}
+
 int main(int argc, char **argv)
 {
 	bool doneone = false;
@@ -1191,9 +1545,12 @@ int main(int argc, char **argv)
 		env_config();
 		runlevel = rc_runlevel_get();
 	}
+	/* Our service script runs the einfo applets a lot */
+	eterm_export();
 
 	setenv("EINFO_LOG", service, 1);
 	setenv("RC_SVCNAME", applet, 1);
+	readahead_record();
 
 	/* Set an env var so that we always know our pid regardless of any
 	   subshells the init script may create so that our mark_service_*
@@ -1250,6 +1607,13 @@ int main(int argc, char **argv)
 			fcntl(exclusive_fd, F_SETFD,
 			    fcntl(exclusive_fd, F_GETFD, 0) | FD_CLOEXEC);
 			break;
+		case 'T':
+			deptree_fd = atoi(optarg);
+			fcntl(deptree_fd, F_SETFD,
+			    fcntl(deptree_fd, F_GETFD, 0) | FD_CLOEXEC);
+			/* and pass it on to the services we start */
+			exec_service_deptree(deptree_fd);
+			break;
 		case 's':
 			if (!(rc_service_state(service) & RC_SERVICE_STARTED))
 				exit(EXIT_FAILURE);
@@ -1270,6 +1634,14 @@ int main(int argc, char **argv)
 	if (rc_yesno(getenv("RC_NODEPS")))
 		deps = false;
 
+	/* rc tells us where to say we are listening, but we don't want
+	 * anything we start to say so as well */
+	if ((file = getenv("RC_LISTEN_NOTIFY"))) {
+		listen_notify = atoi(file);
+		fcntl(listen_notify, F_SETFD, FD_CLOEXEC);
+		unsetenv("RC_LISTEN_NOTIFY");
+	}
+
 	/* If we're changing runlevels and not called by rc then we cannot
 	   work with any dependencies */
 	if (deps && getenv("RC_PID") == NULL &&
@@ -1290,6 +1662,10 @@ int main(int argc, char **argv)
 		if (!service_plugable())
 			eerrorx("%s: not allowed to be hotplugged", applet);
 		in_background = true;
+		if (getenv("RC_PID") == NULL && argc - optind == 1 &&
+		    strcmp(argv[optind], "start") == 0 &&
+		    rc_conf_yesno("rc_hotplug_queue") && hotplug_queue())
+			exit(EXIT_SUCCESS);
 	}
 
 	/* Setup a signal handler */
@@ -1351,8 +1727,7 @@ int main(int argc, char **argv)
 			    errno == ENOENT)
 				depoptions |= RC_DEP_STRICT;
 
-			if (!deptree &&
-			    ((deptree = _rc_deptree_load(0, NULL)) == NULL))
+			if (!load_deptree())
 				eerrorx("failed to load deptree");
 
 			tmplist = rc_stringlist_new();
@@ -1371,7 +1746,8 @@ int main(int argc, char **argv)
 			save = prefix;
 			eprefix(NULL);
 			prefix = NULL;
-			retval = svc_exec("status", NULL);
+			if ((retval = svc_status()) == -1)
+				retval = svc_exec("status", NULL);
 		} else {
 			if (strcmp(optarg, "conditionalrestart") == 0 ||
 			    strcmp(optarg, "condrestart") == 0)
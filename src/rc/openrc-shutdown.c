@@ -28,6 +28,8 @@
 #include <syslog.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/utsname.h>
 
 #include "broadcast.h"
@@ -125,6 +127,27 @@ static void create_nologin(int mins)
 	}
 }
 
+/*
+ * Send a command to init over its socket. This fails when init is a
+ * version from before it had one, which only listens on the fifo.
+ */
+static bool send_socket(const char *cmd)
+{
+	struct sockaddr_un sun;
+	ssize_t len;
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1)
+		return false;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", RC_INIT_SOCKET);
+	len = sendto(fd, cmd, strlen(cmd), 0, (struct sockaddr *)&sun,
+	    sizeof(sun));
+	close(fd);
+	return len == (ssize_t)strlen(cmd);
+}
+
 /*
  * Send a command to our init
  */
@@ -139,6 +162,8 @@ static void send_cmd(const char *cmd)
 	}
 	if (do_wtmp && (do_halt || do_kexec || do_reboot || do_poweroff))
 		log_wtmp("shutdown", "~~", 0, RUN_LVL, "~~");
+	if (send_socket(cmd))
+		return;
 	fifo = fopen(RC_INIT_FIFO, "w");
 	if (!fifo) {
 		perror("fopen");
@@ -0,0 +1,299 @@
+/*
+ * rc-depwatch.c
+ * Watches everything the dependency tree is generated from and bumps a
+ * generation number in RC_DEPWATCH whenever any of it changes.
+ * This lets librc tell that the deptree is still current without having
+ * to walk and stat all of our init and conf.d directories.
+ */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "einfo.h"
+#include "queue.h"
+#include "rc.h"
+#include "rc-misc.h"
+#include "_usage.h"
+
+#define WATCH_MASK	(IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+			 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+			 IN_MOVE_SELF)
+
+const char *applet = NULL;
+const char *extraopts = NULL;
+const char *getoptstring = getoptstring_COMMON;
+const struct option longopts[] = {
+	longopts_COMMON
+};
+const char * const longopts_help[] = {
+	longopts_help_COMMON
+};
+const char *usagestring = NULL;
+
+/* A watched directory. We either care about everything in it or only
+ * about the names listed. */
+struct watch {
+	int wd;
+	bool all;
+	bool depconfig;
+	RC_STRINGLIST *names;
+};
+
+static const char *const watch_paths[] = {
+	RC_INITDIR,
+	RC_CONFDIR,
+#ifdef RC_PKG_INITDIR
+	RC_PKG_INITDIR,
+#endif
+#ifdef RC_PKG_CONFDIR
+	RC_PKG_CONFDIR,
+#endif
+#ifdef RC_LOCAL_INITDIR
+	RC_LOCAL_INITDIR,
+#endif
+#ifdef RC_LOCAL_CONFDIR
+	RC_LOCAL_CONFDIR,
+#endif
+	RC_CONF,
+	RC_CONF_D,
+	NULL
+};
+
+static int ifd = -1;
+static struct watch *watches;
+static size_t nwatches;
+static unsigned long generation;
+static volatile sig_atomic_t done;
+
+static void
+handle_signal(int sig _unused)
+{
+	done = 1;
+}
+
+static struct watch *
+find_watch(int wd)
+{
+	size_t i;
+
+	for (i = 0; i < nwatches; i++)
+		if (watches[i].wd == wd)
+			return &watches[i];
+	return NULL;
+}
+
+/* Watch dir, or just name in it if name is given */
+static struct watch *
+add_watch(const char *dir, const char *name)
+{
+	struct watch *w;
+	int wd;
+
+	if ((wd = inotify_add_watch(ifd, dir, WATCH_MASK)) == -1)
+		return NULL;
+	if (!(w = find_watch(wd))) {
+		watches = xrealloc(watches, sizeof(*watches) * (nwatches + 1));
+		w = &watches[nwatches++];
+		w->wd = wd;
+		w->all = false;
+		w->depconfig = false;
+		w->names = rc_stringlist_new();
+	}
+	if (name)
+		rc_stringlist_addu(w->names, name);
+	else
+		w->all = true;
+	return w;
+}
+
+/* Watch path and, if it's a directory, everything below it.
+ * We also watch for its name in the parent directory so that we notice
+ * it being created, removed or replaced. */
+static void
+watch_path(const char *path, bool top)
+{
+	char sub[PATH_MAX];
+	char *dir, *p;
+	struct stat st;
+	DIR *dp;
+	struct dirent *d;
+
+	if (top) {
+		dir = xstrdup(path);
+		if ((p = strrchr(dir, '/')) && p != dir) {
+			*p = '\0';
+			add_watch(dir, p + 1);
+		}
+		free(dir);
+	}
+
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+		return;
+	add_watch(path, NULL);
+	if (!(dp = opendir(path)))
+		return;
+	while ((d = readdir(dp))) {
+		if (d->d_name[0] == '.')
+			continue;
+		snprintf(sub, sizeof(sub), "%s/%s", path, d->d_name);
+		if (stat(sub, &st) == 0 && S_ISDIR(st.st_mode))
+			watch_path(sub, false);
+	}
+	closedir(dp);
+}
+
+/* Add watches for everything we care about.
+ * Watches are only ever added to so that we never miss an event, the
+ * kernel drops the ones for anything removed. */
+static void
+setup_watches(void)
+{
+	RC_STRINGLIST *config;
+	RC_STRING *s;
+	struct watch *w;
+	size_t i;
+
+	for (i = 0; watch_paths[i]; i++)
+		watch_path(watch_paths[i], true);
+
+	/* Config files init scripts told us they depend on */
+	config = rc_config_list(RC_DEPCONFIG);
+	TAILQ_FOREACH(s, config, entries)
+		watch_path(s->value, true);
+	rc_stringlist_free(config);
+
+	/* We need to follow changes to that list, but it is written by
+	 * updating the deptree so it does not make it dirty itself */
+	if ((w = add_watch(RC_SVCDIR, basename_c(RC_DEPCONFIG))))
+		w->depconfig = true;
+}
+
+static void
+write_generation(void)
+{
+	FILE *fp;
+
+	if (!(fp = fopen(RC_DEPWATCH ".tmp", "w"))) {
+		eerror("%s: fopen `%s': %s", applet, RC_DEPWATCH ".tmp",
+		    strerror(errno));
+		return;
+	}
+	fprintf(fp, "%d %lu\n", getpid(), generation);
+	if (fclose(fp) == 0)
+		rename(RC_DEPWATCH ".tmp", RC_DEPWATCH);
+	else
+		unlink(RC_DEPWATCH ".tmp");
+}
+
+int main(int argc, char **argv)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+	    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct watch *w;
+	ssize_t len;
+	char *p;
+	bool dirty, rebuild;
+	int opt, lfd;
+
+	applet = basename_c(argv[0]);
+	while ((opt = getopt_long(argc, argv, getoptstring,
+		    longopts, (int *) 0)) != -1)
+	{
+		switch (opt) {
+		case_RC_COMMON_GETOPT
+		}
+	}
+
+	signal_setup(SIGTERM, handle_signal);
+	signal_setup(SIGINT, handle_signal);
+	signal_setup(SIGHUP, SIG_IGN);
+
+	/* Held for as long as we run, so librc can tell we are still here */
+	lfd = open(RC_DEPWATCH_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lfd == -1)
+		eerrorx("%s: open `%s': %s", applet, RC_DEPWATCH_LOCK,
+		    strerror(errno));
+	if (flock(lfd, LOCK_EX | LOCK_NB) == -1) {
+		if (errno == EWOULDBLOCK)
+			eerrorx("%s: already running", applet);
+		eerrorx("%s: flock `%s': %s", applet, RC_DEPWATCH_LOCK,
+		    strerror(errno));
+	}
+
+	if ((ifd = inotify_init1(IN_CLOEXEC)) == -1)
+		eerrorx("%s: inotify_init1: %s", applet, strerror(errno));
+	setup_watches();
+	generation = 1;
+	write_generation();
+
+	while (!done) {
+		len = read(ifd, buf, sizeof(buf));
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			eerror("%s: read: %s", applet, strerror(errno));
+			break;
+		}
+
+		dirty = rebuild = false;
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				dirty = true;
+				continue;
+			}
+			if (!(w = find_watch(ev->wd)))
+				continue;
+			if (!w->all &&
+			    (!ev->len || !rc_stringlist_find(w->names, ev->name)))
+				continue;
+			if (w->depconfig && ev->len &&
+			    strcmp(ev->name, basename_c(RC_DEPCONFIG)) == 0)
+			{
+				rebuild = true;
+				continue;
+			}
+			dirty = true;
+			/* New directories need watching too */
+			if (ev->mask & IN_ISDIR)
+				rebuild = true;
+		}
+
+		if (rebuild)
+			setup_watches();
+		if (dirty) {
+			generation++;
+			write_generation();
+		}
+	}
+
+	unlink(RC_DEPWATCH);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,124 @@
+/*
+ * rc-hotplug.c
+ * A queue of services hotplugged while a storm of devices comes in.
+ * openrc-run just leaves the name of its service in HOTPLUG_DIR, and
+ * whichever openrc holds the lock starts everything in there at once.
+ * A service asked for twice before we get to it is only started once.
+ */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "helpers.h"
+#include "rc.h"
+#include "rc-hotplug.h"
+
+#define HOTPLUG_DIR	RC_SVCDIR "/hotplugq"
+#define HOTPLUG_LOCK	HOTPLUG_DIR "/.lock"
+
+bool
+rc_hotplug_queue(const char *service)
+{
+	char *file;
+	int fd;
+
+	if (mkdir(HOTPLUG_DIR, 0755) == -1 && errno != EEXIST)
+		return false;
+	xasprintf(&file, HOTPLUG_DIR "/%s", service);
+	fd = open(file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	free(file);
+	if (fd == -1)
+		return false;
+	close(fd);
+	return true;
+}
+
+/* Only one openrc drains the queue at a time. Returns -1 if another
+ * already is. */
+int
+rc_hotplug_lock(void)
+{
+	int fd;
+
+	if (mkdir(HOTPLUG_DIR, 0755) == -1 && errno != EEXIST)
+		return -1;
+	if ((fd = open(HOTPLUG_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1)
+		return -1;
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void
+rc_hotplug_unlock(int fd)
+{
+	if (fd == -1)
+		return;
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+/* Whoever queues after the lock is let go will take it again, so
+ * after letting go we only have to look once more */
+bool
+rc_hotplug_pending(void)
+{
+	DIR *dp;
+	struct dirent *d;
+	bool pending = false;
+
+	if (!(dp = opendir(HOTPLUG_DIR)))
+		return false;
+	while (!pending && (d = readdir(dp)))
+		pending = d->d_name[0] != '.';
+	closedir(dp);
+	return pending;
+}
+
+/* Take everything off the queue. A service queued again while we start
+ * it is just found started next time round. */
+RC_STRINGLIST *
+rc_hotplug_drain(void)
+{
+	RC_STRINGLIST *list = rc_stringlist_new();
+	DIR *dp;
+	struct dirent *d;
+	char *file;
+
+	if (!(dp = opendir(HOTPLUG_DIR)))
+		return list;
+	while ((d = readdir(dp))) {
+		if (d->d_name[0] == '.')
+			continue;
+		xasprintf(&file, HOTPLUG_DIR "/%s", d->d_name);
+		if (unlink(file) == 0)
+			rc_stringlist_add(list, d->d_name);
+		free(file);
+	}
+	closedir(dp);
+	rc_stringlist_sort(&list);
+	return list;
+}
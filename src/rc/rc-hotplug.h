@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#ifndef RC_HOTPLUG_H
+#define RC_HOTPLUG_H
+
+#include <stdbool.h>
+
+#include "rc.h"
+
+bool rc_hotplug_queue(const char *service);
+int rc_hotplug_lock(void);
+void rc_hotplug_unlock(int fd);
+bool rc_hotplug_pending(void);
+RC_STRINGLIST *rc_hotplug_drain(void);
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * rc-limits.c
+ * Put a daemon in its cgroup, set its cgroup v2 limits and pin it to
+ * its cpus from the child, just before it execs. Then the daemon never
+ * runs unconfined, not even for a moment.
+ */
+
+/*
+ * Copyright (c) 2018 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
+
+#include "helpers.h"
+#include "rc-limits.h"
+
+static const char *const limit_keys[RC_LIMITS_MAX] = {
+	"cpu.max",
+	"cpu.weight",
+	"io.weight",
+	"memory.high",
+	"memory.max",
+};
+
+void rc_limits_init(struct rc_limits *l)
+{
+	memset(l, 0, sizeof(*l));
+}
+
+/* Take one limit as key=value, such as cpu.max=50000 100000 */
+bool rc_limits_add(struct rc_limits *l, const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	size_t len;
+	int i, j;
+
+	if (!eq || !eq[1])
+		return false;
+	len = eq - arg;
+	for (i = 0; i < RC_LIMITS_MAX; i++)
+		if (strlen(limit_keys[i]) == len &&
+		    strncmp(limit_keys[i], arg, len) == 0)
+			break;
+	if (i == RC_LIMITS_MAX)
+		return false;
+
+	/* The last one given wins */
+	for (j = 0; j < l->nlimits; j++)
+		if (l->key[j] == limit_keys[i])
+			break;
+	l->key[j] = limit_keys[i];
+	l->value[j] = eq + 1;
+	if (j == l->nlimits)
+		l->nlimits++;
+	return true;
+}
+
+/* Take a cpu list as taskset(1) does, such as 2-3,6 */
+bool rc_limits_parse_cpus(struct rc_limits *l, const char *arg)
+{
+	const size_t bits = 8 * sizeof(unsigned long);
+	const char *p = arg;
+	char *end;
+	long first, last;
+
+	memset(l->cpus, 0, sizeof(l->cpus));
+	while (*p) {
+		errno = 0;
+		first = last = strtol(p, &end, 10);
+		if (errno || end == p || first < 0)
+			return false;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (errno || end == p || last < first)
+				return false;
+		}
+		if (last >= RC_LIMITS_CPUS || (*end && *end != ','))
+			return false;
+		for (; first <= last; first++)
+			l->cpus[first / bits] |= 1UL << (first % bits);
+		p = *end ? end + 1 : end;
+	}
+	if (p == arg)
+		return false;
+	l->affinity = true;
+	return true;
+}
+
+bool rc_limits_wanted(const struct rc_limits *l)
+{
+	return l->cgroup || l->nlimits > 0 || l->affinity;
+}
+
+static int write_cgroup(const char *cgroup, const char *file,
+		const char *value)
+{
+	char *path;
+	int fd, serrno;
+	ssize_t len = (ssize_t)strlen(value);
+
+	xasprintf(&path, "%s/%s", cgroup, file);
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	free(path);
+	if (fd == -1)
+		return -1;
+	if (write(fd, value, len) != len) {
+		serrno = errno;
+		close(fd);
+		errno = serrno;
+		return -1;
+	}
+	return close(fd);
+}
+
+/*
+ * In the daemon, before anything else can happen to it.
+ * The limits go on the cgroup before we join it, so nothing in there
+ * runs without them. On failure *what says which step went wrong.
+ */
+int rc_limits_child(struct rc_limits *l, const char **what)
+{
+	int i;
+
+	if (l->cgroup) {
+		*what = l->cgroup;
+		if (mkdir(l->cgroup, 0755) == -1 && errno != EEXIST)
+			return -1;
+		/* As rc-cgroup.sh does, skip what the controllers
+		 * enabled here do not offer */
+		for (i = 0; i < l->nlimits; i++) {
+			*what = l->key[i];
+			if (write_cgroup(l->cgroup, l->key[i], l->value[i]) == -1 &&
+			    errno != ENOENT)
+				return -1;
+		}
+		*what = "cgroup.procs";
+		if (write_cgroup(l->cgroup, "cgroup.procs", "0") == -1)
+			return -1;
+	}
+
+	if (l->affinity) {
+		*what = "sched_setaffinity";
+#ifdef SYS_sched_setaffinity
+		if (syscall(SYS_sched_setaffinity, 0, sizeof(l->cpus),
+			    l->cpus) == -1)
+			return -1;
+#else
+		errno = ENOSYS;
+		return -1;
+#endif
+	}
+	return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2018 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#ifndef RC_LIMITS_H
+#define RC_LIMITS_H
+
+#include <stdbool.h>
+
+/* The cgroup v2 limits we know how to set */
+#define RC_LIMITS_MAX		5
+/* Enough cpus for anything we are likely to boot on */
+#define RC_LIMITS_CPUS		1024
+
+struct rc_limits {
+	const char *cgroup;	/* the daemon joins this, made if need be */
+	const char *key[RC_LIMITS_MAX];
+	const char *value[RC_LIMITS_MAX];
+	int nlimits;
+	bool affinity;
+	unsigned long cpus[RC_LIMITS_CPUS / (8 * sizeof(unsigned long))];
+};
+
+void rc_limits_init(struct rc_limits *l);
+bool rc_limits_add(struct rc_limits *l, const char *arg);
+bool rc_limits_parse_cpus(struct rc_limits *l, const char *arg);
+bool rc_limits_wanted(const struct rc_limits *l);
+int rc_limits_child(struct rc_limits *l, const char **what);
+
+#endif
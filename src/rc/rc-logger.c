@@ -18,6 +18,7 @@
 
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
 #include <ctype.h>
@@ -48,6 +49,7 @@
 
 #define TMPLOG RC_SVCDIR "/rc.log"
 #define DEFAULTLOG "/var/log/rc.log"
+#define LOG_IOV 64
 
 static int signal_pipe[2] = { -1, -1 };
 static int fd_stdout = -1;
@@ -64,41 +66,72 @@ pid_t rc_logger_pid = -1;
 int rc_logger_tty = -1;
 bool rc_in_logger = false;
 
+/* Queue len bytes at p for writing, writing the queue out if it is full */
 static void
-write_log(int logfd, const char *buffer, size_t bytes)
+log_add(int logfd, struct iovec *iov, int *n, char *p, size_t len)
 {
-	const char *p = buffer;
+	if (*n > 0 && (char *)iov[*n - 1].iov_base +
+	    iov[*n - 1].iov_len == p)
+	{
+		iov[*n - 1].iov_len += len;
+		return;
+	}
+	if (*n == LOG_IOV) {
+		if (writev(logfd, iov, *n) == -1)
+			eerror("writev: %s", strerror(errno));
+		*n = 0;
+	}
+	iov[*n].iov_base = p;
+	iov[*n].iov_len = len;
+	(*n)++;
+}
+
+/* Log what we read with any terminal escape sequences and other control
+ * characters removed. The text between them is passed to writev as is. */
+static void
+write_log(int logfd, char *buffer, size_t bytes)
+{
+	struct iovec iov[LOG_IOV];
+	char *p = buffer, *end = buffer + bytes, *run;
+	int n = 0;
+
+	while (p < end) {
+		if (!in_escape) {
+			for (run = p; p < end; p++)
+				if (!isprint((unsigned char)*p) && *p != '\n')
+					break;
+			if (p > run) {
+				log_add(logfd, iov, &n, run, (size_t)(p - run));
+				continue;
+			}
+			if (*p == '\033')
+				in_escape = true;
+			p++;
+			continue;
+		}
 
-	while ((size_t)(p - buffer) < bytes) {
 		switch (*p) {
 		case '\r':
-			goto cont;
+			break;
 		case '\033':
-			in_escape = true;
 			in_term = false;
-			goto cont;
+			break;
 		case '\n':
 			in_escape = in_term = false;
+			log_add(logfd, iov, &n, p, 1);
 			break;
 		case '[':
-			if (in_escape)
-				in_term = true;
+			in_term = true;
+			break;
+		default:
+			if (!in_term || isalpha((unsigned char)*p))
+				in_escape = in_term = false;
 			break;
 		}
-
-		if (!in_escape) {
-			if (!isprint((int) *p) && *p != '\n')
-				goto cont;
-			if (write(logfd, p++, 1) == -1)
-				eerror("write: %s", strerror(errno));
-			continue;
-		}
-
-		if (! in_term || isalpha((unsigned char)*p))
-			in_escape = in_term = false;
-cont:
 		p++;
 	}
+	if (n > 0 && writev(logfd, iov, n) == -1)
+		eerror("writev: %s", strerror(errno));
 }
 
 static void
@@ -54,7 +54,7 @@ static const char *const env_whitelist[] = {
 	"IN_BACKGROUND", "IN_DRYRUN", "IN_HOTPLUG",
 	"RC_DEBUG", "RC_NODEPS",
 	"LANG", "LC_MESSAGES", "TERM",
-	"EINFO_COLOR", "EINFO_VERBOSE",
+	"EINFO_COLOR", "EINFO_VERBOSE", "EINFO_EVENTS", "EINFO_TERMCAP",
 	NULL
 };
 
@@ -201,6 +201,8 @@ env_config(void)
 		setenv("EINFO_QUIET", "YES", 1);
 	if (rc_conf_yesno("rc_verbose"))
 		setenv("EINFO_VERBOSE", "YES", 1);
+	if (rc_conf_yesno("rc_log_events"))
+		setenv("EINFO_EVENTS", RC_EVENTLOG, 1);
 
 	errno = 0;
 	if ((! rc_conf_yesno("rc_color") && errno == 0) ||
@@ -256,16 +258,30 @@ svc_unlock(const char *applet, int fd)
 	char *file = NULL;
 
 	xasprintf(&file, RC_SVCDIR "/exclusive/%s", applet);
+	/* rc keeps its copy of the lock we were handed, so closing ours
+	 * is not enough to wake up anyone blocked in svc_wait */
+	flock(fd, LOCK_UN);
 	close(fd);
 	unlink(file);
 	free(file);
 	return -1;
 }
 
+/* The deptree every service we start can adopt instead of loading its own */
+static int service_deptree_fd = -1;
+
+void
+exec_service_deptree(int fd)
+{
+	if (service_deptree_fd != -1 && service_deptree_fd != fd)
+		close(service_deptree_fd);
+	service_deptree_fd = fd;
+}
+
 pid_t
 exec_service(const char *service, const char *arg)
 {
-	char *file, sfd[32];
+	char *file, sfd[32], dfd[32];
 	int fd;
 	pid_t pid = -1;
 	sigset_t full;
@@ -284,6 +300,7 @@ exec_service(const char *service, const char *arg)
 		return 0;
 	}
 	snprintf(sfd, sizeof(sfd), "%d", fd);
+	snprintf(dfd, sizeof(dfd), "%d", service_deptree_fd);
 
 	/* We need to block signals until we have forked */
 	memset(&sa, 0, sizeof (sa));
@@ -306,7 +323,12 @@ exec_service(const char *service, const char *arg)
 		sigprocmask(SIG_SETMASK, &old, NULL);
 
 		/* Safe to run now */
-		execl(file, file, "--lockfd", sfd, arg, (char *) NULL);
+		if (service_deptree_fd != -1 &&
+		    fcntl(service_deptree_fd, F_SETFD, 0) == 0)
+			execl(file, file, "--lockfd", sfd,
+			    "--deptreefd", dfd, arg, (char *) NULL);
+		else
+			execl(file, file, "--lockfd", sfd, arg, (char *) NULL);
 		fprintf(stderr, "unable to exec `%s': %s\n",
 		    file, strerror(errno));
 		svc_unlock(basename_c(service), fd);
@@ -379,6 +401,10 @@ RC_DEPTREE * _rc_deptree_load(int force, int *regen)
 
 		if (regen)
 			*regen = 1;
+		/* Asked for, so source every init script again in case one
+		 * depends on something we cannot see change */
+		if (force != 0)
+			unlink(RC_DEPCACHE);
 		ebegin("Caching service dependencies");
 		retval = rc_deptree_update() ? 0 : -1;
 		eend (retval, "Failed to update the dependency tree");
@@ -400,6 +426,7 @@ RC_DEPTREE * _rc_deptree_load(int force, int *regen)
 				ut.actime = t;
 				ut.modtime = t;
 				utime(RC_DEPTREE_CACHE, &ut);
+				utime(RC_DEPTREE_BINARY, &ut);
 			} else {
 				if (exists(RC_DEPTREE_SKEWED))
 					unlink(RC_DEPTREE_SKEWED);
@@ -490,3 +517,58 @@ pid_t get_pid(const char *applet,const char *pidfile)
 
 	return pid;
 }
+
+/* Append an event to the boot timing trace. Lines are short enough for
+ * O_APPEND to keep the ones written by services starting in parallel
+ * apart. */
+void
+timing_mark(const char *service, const char *action, const char *phase)
+{
+	struct timespec ts;
+	char buf[PATH_MAX];
+	int fd, len;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	len = snprintf(buf, sizeof(buf), "%lld %s %s %s\n",
+	    (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000,
+	    basename_c(service), action, phase);
+	if (len < 0 || (size_t)len >= sizeof(buf))
+		return;
+	fd = open(RC_TIMING, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return;
+	if (write(fd, buf, (size_t)len) != len)
+		ewarnv("write `%s': %s", RC_TIMING, strerror(errno));
+	close(fd);
+}
+
+/* Services restarted between boots keep appending to the trace, so each
+ * runlevel change trims it back to its newest lines once it gets big.
+ * A reader sees either the old file or the new one. */
+#define RC_TIMING_MAX	(64 * 1024)
+
+void
+timing_trim(void)
+{
+	char *buf = NULL, *p;
+	size_t len = 0;
+	FILE *fp;
+
+	/* rc_getfile counts the NUL it appends */
+	if (!rc_getfile(RC_TIMING, &buf, &len) || --len <= RC_TIMING_MAX) {
+		free(buf);
+		return;
+	}
+	p = memchr(buf + len - RC_TIMING_MAX / 2, '\n', RC_TIMING_MAX / 2);
+	if (p && (fp = fopen(RC_TIMING ".new", "we"))) {
+		p++;
+		if (fwrite(p, 1, len - (size_t)(p - buf), fp) !=
+		    len - (size_t)(p - buf) || fclose(fp) != 0 ||
+		    rename(RC_TIMING ".new", RC_TIMING) == -1)
+		{
+			ewarnv("trim `%s': %s", RC_TIMING, strerror(errno));
+			unlink(RC_TIMING ".new");
+		}
+	}
+	free(buf);
+}
@@ -16,6 +16,8 @@
  */
 
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <dirent.h>
@@ -24,9 +26,11 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "einfo.h"
@@ -36,6 +40,13 @@
 #include "rc-plugin.h"
 
 #define RC_PLUGIN_HOOK "rc_plugin_hook"
+#define RC_PLUGIN_BATCH "rc_plugin_hook_batch"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+extern char **environ;
 
 bool rc_in_plugin = false;
 
@@ -44,10 +55,40 @@ typedef struct plugin
 	char *name;
 	void *handle;
 	int (*hook)(RC_HOOK, const char *);
+	int (*batch)(const RC_HOOK_EVENT *, size_t);
 	TAILQ_ENTRY(plugin) entries;
 } PLUGIN;
 TAILQ_HEAD(, plugin) plugins;
 
+/*
+ * Plugins with a batch entry point get the hooks run by the services rc
+ * starts and stops spooled to RC_PLUGIN_SPOOL, which rc hands over to
+ * them in one go when it has stopped or started a runlevel, at unload,
+ * and while starting or stopping services once the running ones are all
+ * done or FLUSH_MS has gone by. Anyone else calls them with each hook
+ * as it happens.
+ */
+#define FLUSH_MS	100
+static size_t nbatch;
+static pid_t spool_owner;
+static off_t spool_off;
+static struct timespec spool_flushed;
+
+/*
+ * With rc_plugin_host set, all hooks are run in one plugin host process
+ * that we fork the first time we need it and keep until we unload our
+ * plugins, instead of one new process per plugin per hook.
+ * Each request is the hook, its value and our environment, so plugins
+ * see the same variables they would had we forked them. The host replies
+ * once per plugin with the variables that plugin set.
+ * Should a plugin take the host down we carry on with the plugins after
+ * it in their own processes and start a new host for the next hook.
+ */
+static bool host_mode;
+static int host_fd = -1;
+static pid_t host_pid;
+static pid_t host_parent;
+
 #ifndef __FreeBSD__
 dlfunc_t
 dlfunc(void * __restrict handle, const char * __restrict symbol)
@@ -71,12 +112,15 @@ rc_plugin_load(void)
 	char *file = NULL;
 	void *h;
 	int (*fptr)(RC_HOOK, const char *);
+	int (*bptr)(const RC_HOOK_EVENT *, size_t);
 
 	/* Don't load plugins if we're in one */
 	if (rc_in_plugin)
 		return;
 
 	TAILQ_INIT(&plugins);
+	nbatch = 0;
+	host_mode = rc_yesno(rc_conf_value("rc_plugin_host"));
 
 	if (!(dp = opendir(RC_PLUGINDIR)))
 		return;
@@ -93,9 +137,11 @@ rc_plugin_load(void)
 			continue;
 		}
 
-		fptr = (int (*)(RC_HOOK, const char *))
+		fptr = (int (*)(RC_HOOK, const char *))(void (*)(void))
 		    dlfunc(h, RC_PLUGIN_HOOK);
-		if (fptr == NULL) {
+		bptr = (int (*)(const RC_HOOK_EVENT *, size_t))(void (*)(void))
+		    dlfunc(h, RC_PLUGIN_BATCH);
+		if (fptr == NULL && bptr == NULL) {
 			eerror("%s: cannot find symbol `%s'",
 			    d->d_name, RC_PLUGIN_HOOK);
 			dlclose(h);
@@ -104,6 +150,9 @@ rc_plugin_load(void)
 			plugin->name = xstrdup(d->d_name);
 			plugin->handle = h;
 			plugin->hook = fptr;
+			plugin->batch = bptr;
+			if (bptr)
+				nbatch++;
 			TAILQ_INSERT_TAIL(&plugins, plugin, entries);
 		}
 	}
@@ -124,107 +173,543 @@ rc_waitpid(pid_t pid)
 	return status;
 }
 
-void
-rc_plugin_run(RC_HOOK hook, const char *value)
+/* Apply the NAME=value pairs a plugin wrote to rc_environ_fd */
+static void
+plugin_setenv(char *buffer, size_t len)
+{
+	char *token;
+	char *p = buffer;
+
+	while (*p && (size_t)(p - buffer) < len) {
+		token = strsep(&p, "=");
+		if (!p)
+			break;
+		if (token) {
+			unsetenv(token);
+			if (*p) {
+				setenv(token, p, 1);
+				p += strlen(p) + 1;
+			} else
+				p++;
+		}
+	}
+}
+
+static void
+plugin_signals(const sigset_t *old)
 {
-	PLUGIN *plugin;
 	struct sigaction sa;
-	sigset_t empty;
-	sigset_t full;
-	sigset_t old;
+
+	/* Restore default handlers */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+	sigaction(SIGHUP,  &sa, NULL);
+	sigaction(SIGINT,  &sa, NULL);
+	sigaction(SIGQUIT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGWINCH, &sa, NULL);
+	sigprocmask(SIG_SETMASK, old, NULL);
+}
+
+static int
+plugin_pipe(int pfd[2], bool socket)
+{
 	int i;
 	int flags;
+
+	if (socket) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pfd) == -1) {
+			eerror("socketpair: %s", strerror(errno));
+			return -1;
+		}
+	} else if (pipe(pfd) == -1) {
+		eerror("pipe: %s", strerror(errno));
+		return -1;
+	}
+
+	/* Stop any scripts from inheriting us.
+	 * This is actually quite important as without this, the splash
+	 * plugin will probably hang when running in silent mode. */
+	for (i = 0; i < 2; i++)
+		if ((flags = fcntl (pfd[i], F_GETFD, 0)) < 0 ||
+		    fcntl (pfd[i], F_SETFD, flags | FD_CLOEXEC) < 0)
+			eerror("fcntl: %s", strerror(errno));
+	return 0;
+}
+
+/* Run the plugin hook, or its batch hook if we have events for it */
+static void
+plugin_fork(PLUGIN *plugin, RC_HOOK hook, const char *value,
+    const RC_HOOK_EVENT *events, size_t nevents)
+{
+	sigset_t full;
+	sigset_t old;
 	int pfd[2];
 	pid_t pid;
 	char *buffer;
-	char *token;
-	char *p;
 	ssize_t nr;
 	int retval;
 
-	/* Don't run plugins if we're in one */
-	if (rc_in_plugin)
+	/* We create a pipe so that plugins can affect our environment
+	 * vars, which in turn influence our scripts. */
+	if (plugin_pipe(pfd, false) == -1)
 		return;
 
 	/* We need to block signals until we have forked */
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = SIG_DFL;
-	sigemptyset(&sa.sa_mask);
-	sigemptyset(&empty);
 	sigfillset(&full);
+	sigprocmask(SIG_SETMASK, &full, &old);
 
-	TAILQ_FOREACH(plugin, &plugins, entries) {
-		/* We create a pipe so that plugins can affect our environment
-		 * vars, which in turn influence our scripts. */
-		if (pipe(pfd) == -1) {
-			eerror("pipe: %s", strerror(errno));
-			return;
+	/* We run the plugin in a new process so we never crash
+	 * or otherwise affected by it */
+	if ((pid = fork()) == -1) {
+		eerror("fork: %s", strerror(errno));
+		sigprocmask(SIG_SETMASK, &old, NULL);
+		close(pfd[0]);
+		close(pfd[1]);
+		return;
+	}
+
+	if (pid == 0) {
+		plugin_signals(&old);
+
+		rc_in_plugin = true;
+		close(pfd[0]);
+		rc_environ_fd = fdopen(pfd[1], "w");
+		if (events)
+			retval = plugin->batch(events, nevents);
+		else
+			retval = plugin->hook(hook, value);
+		fclose(rc_environ_fd);
+		rc_environ_fd = NULL;
+
+		/* Just in case the plugin sets this to false */
+		rc_in_plugin = true;
+		exit(retval);
+	}
+
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	close(pfd[1]);
+	buffer = xmalloc(sizeof(char) * BUFSIZ);
+	memset(buffer, 0, BUFSIZ);
+
+	while ((nr = read(pfd[0], buffer, BUFSIZ)) > 0)
+		plugin_setenv(buffer, (size_t)nr);
+
+	free(buffer);
+	close(pfd[0]);
+
+	rc_waitpid(pid);
+}
+
+static bool
+host_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t nr;
+
+	while (len > 0) {
+		if ((nr = send(fd, p, len, MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
 		}
+		p += nr;
+		len -= (size_t)nr;
+	}
+	return true;
+}
 
-		/* Stop any scripts from inheriting us.
-		 * This is actually quite important as without this, the splash
-		 * plugin will probably hang when running in silent mode. */
-		for (i = 0; i < 2; i++)
-			if ((flags = fcntl (pfd[i], F_GETFD, 0)) < 0 ||
-			    fcntl (pfd[i], F_SETFD, flags | FD_CLOEXEC) < 0)
-				eerror("fcntl: %s", strerror(errno));
+static bool
+host_read(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t nr;
 
-		sigprocmask(SIG_SETMASK, &full, &old);
+	while (len > 0) {
+		if ((nr = read(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (nr == 0)
+			return false;
+		p += nr;
+		len -= (size_t)nr;
+	}
+	return true;
+}
 
-		/* We run the plugin in a new process so we never crash
-		 * or otherwise affected by it */
-		if ((pid = fork()) == -1) {
-			eerror("fork: %s", strerror(errno));
-			break;
+static bool
+host_send(int fd, const char *buf, size_t len)
+{
+	uint32_t l = (uint32_t)len;
+
+	return host_write(fd, &l, sizeof(l)) && host_write(fd, buf, len);
+}
+
+/* Returns a NUL terminated message which the caller must free */
+static char *
+host_recv(int fd, size_t *len)
+{
+	uint32_t l;
+	char *buf;
+
+	if (!host_read(fd, &l, sizeof(l)))
+		return NULL;
+	buf = xmalloc(l + 1);
+	if (!host_read(fd, buf, l)) {
+		free(buf);
+		return NULL;
+	}
+	buf[l] = '\0';
+	*len = l;
+	return buf;
+}
+
+/* Make our environment match the NAME=value list in env */
+static void
+host_environ(char *env, const char *end)
+{
+	RC_STRINGLIST *names = rc_stringlist_new();
+	char *e;
+	char *p;
+	size_t i;
+
+	for (p = env; p < end; p += strlen(p) + 1) {
+		if (!(e = strchr(p, '=')))
+			continue;
+		*e = '\0';
+		rc_stringlist_add(names, p);
+		if (!getenv(p) || strcmp(getenv(p), e + 1) != 0)
+			setenv(p, e + 1, 1);
+		*e = '=';
+	}
+
+	for (i = 0; environ[i];) {
+		p = xstrdup(environ[i]);
+		if (!(e = strchr(p, '='))) {
+			free(p);
+			i++;
+			continue;
 		}
+		*e = '\0';
+		/* unsetenv shifts the rest of environ down over it */
+		if (rc_stringlist_find(names, p))
+			i++;
+		else
+			unsetenv(p);
+		free(p);
+	}
 
-		if (pid == 0) {
-			/* Restore default handlers */
-			sigaction(SIGCHLD, &sa, NULL);
-			sigaction(SIGHUP,  &sa, NULL);
-			sigaction(SIGINT,  &sa, NULL);
-			sigaction(SIGQUIT, &sa, NULL);
-			sigaction(SIGTERM, &sa, NULL);
-			sigaction(SIGUSR1, &sa, NULL);
-			sigaction(SIGWINCH, &sa, NULL);
-			sigprocmask(SIG_SETMASK, &old, NULL);
+	rc_stringlist_free(names);
+}
 
-			rc_in_plugin = true;
-			close(pfd[0]);
-			rc_environ_fd = fdopen(pfd[1], "w");
-			retval = plugin->hook(hook, value);
-			fclose(rc_environ_fd);
+static void
+host_main(int fd)
+{
+	PLUGIN *plugin;
+	RC_HOOK hook;
+	char *req;
+	char *value;
+	char *env;
+	char *out;
+	size_t len;
+	size_t outlen;
+
+	while ((req = host_recv(fd, &len))) {
+		if (len < sizeof(hook) + 1) {
+			free(req);
+			break;
+		}
+		memcpy(&hook, req, sizeof(hook));
+		value = req + sizeof(hook) + 1;
+		env = value + strlen(value) + 1;
+		host_environ(env, req + len);
+		if (req[sizeof(hook)] == '\0')
+			value = NULL;
+
+		TAILQ_FOREACH(plugin, &plugins, entries) {
+			if (plugin->batch)
+				continue;
+			out = NULL;
+			outlen = 0;
+			rc_environ_fd = open_memstream(&out, &outlen);
+			plugin->hook(hook, value);
+			if (rc_environ_fd)
+				fclose(rc_environ_fd);
 			rc_environ_fd = NULL;
-
-			/* Just in case the plugin sets this to false */
 			rc_in_plugin = true;
-			exit(retval);
+
+			if (!host_send(fd, out ? out : "", outlen))
+				exit(EXIT_FAILURE);
+			/* Later plugins see what this one set, as they
+			 * would have when forked from our parent */
+			if (out)
+				plugin_setenv(out, outlen);
+			free(out);
 		}
+		free(req);
+	}
+	exit(EXIT_SUCCESS);
+}
 
+static bool
+host_start(void)
+{
+	sigset_t full;
+	sigset_t old;
+	int sv[2];
+
+	if (plugin_pipe(sv, true) == -1)
+		return false;
+
+	sigfillset(&full);
+	sigprocmask(SIG_SETMASK, &full, &old);
+	if ((host_pid = fork()) == -1) {
+		eerror("fork: %s", strerror(errno));
 		sigprocmask(SIG_SETMASK, &old, NULL);
-		close(pfd[1]);
-		buffer = xmalloc(sizeof(char) * BUFSIZ);
-		memset(buffer, 0, BUFSIZ);
-
-		while ((nr = read(pfd[0], buffer, BUFSIZ)) > 0) {
-			p = buffer;
-			while (*p && p - buffer < nr) {
-				token = strsep(&p, "=");
-				if (token) {
-					unsetenv(token);
-					if (*p) {
-						setenv(token, p, 1);
-						p += strlen(p) + 1;
-					} else
-						p++;
-				}
-			}
+		close(sv[0]);
+		close(sv[1]);
+		return false;
+	}
+
+	if (host_pid == 0) {
+		plugin_signals(&old);
+		/* Keep out of the way of anyone waiting on our
+		 * process group, such as rc waiting for its services */
+		setpgid(0, 0);
+		rc_in_plugin = true;
+		close(sv[0]);
+		host_main(sv[1]);
+	}
+
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	close(sv[1]);
+	host_fd = sv[0];
+	host_parent = getpid();
+	return true;
+}
+
+static void
+host_stop(void)
+{
+	if (host_fd == -1)
+		return;
+	/* A child of ours must leave the host to us */
+	if (host_parent != getpid()) {
+		close(host_fd);
+		host_fd = -1;
+		return;
+	}
+	/* Other processes may have inherited the socket, so make sure
+	 * the host sees us go away */
+	shutdown(host_fd, SHUT_RDWR);
+	close(host_fd);
+	host_fd = -1;
+	/* Our SIGCHLD handler may have beaten us to it */
+	waitpid(host_pid, NULL, 0);
+}
+
+/* Returns false if the host could not be used at all */
+static bool
+host_run(RC_HOOK hook, const char *value)
+{
+	PLUGIN *plugin;
+	char *req;
+	char *reply;
+	char *p;
+	size_t len;
+	size_t i;
+
+	if (host_fd == -1 && !host_start())
+		return false;
+
+	len = sizeof(hook) + 1 + (value ? strlen(value) : 0) + 1;
+	for (i = 0; environ[i]; i++)
+		len += strlen(environ[i]) + 1;
+	req = xmalloc(len);
+	memcpy(req, &hook, sizeof(hook));
+	p = req + sizeof(hook);
+	*p++ = value ? 1 : 0;
+	p = stpcpy(p, value ? value : "") + 1;
+	for (i = 0; environ[i]; i++)
+		p = stpcpy(p, environ[i]) + 1;
+
+	if (!host_send(host_fd, req, len)) {
+		free(req);
+		host_stop();
+		return false;
+	}
+	free(req);
+
+	TAILQ_FOREACH(plugin, &plugins, entries) {
+		if (plugin->batch)
+			continue;
+		if (!(reply = host_recv(host_fd, &len))) {
+			eerror("%s: plugin host died", plugin->name);
+			host_stop();
+			/* Don't run the plugin that crashed it again */
+			while ((plugin = TAILQ_NEXT(plugin, entries)))
+				if (!plugin->batch)
+					plugin_fork(plugin, hook, value,
+					    NULL, 0);
+			return true;
 		}
+		plugin_setenv(reply, len);
+		free(reply);
+	}
+	return true;
+}
+
+static void
+batch_run(const RC_HOOK_EVENT *events, size_t nevents)
+{
+	PLUGIN *plugin;
+
+	TAILQ_FOREACH(plugin, &plugins, entries)
+		if (plugin->batch)
+			plugin_fork(plugin, 0, NULL, events, nevents);
+}
 
+static void
+batch_add(RC_HOOK hook, const char *value)
+{
+	RC_HOOK_EVENT event;
+	const char *spool = getenv("RC_PLUGIN_SPOOL");
+	char *line = NULL;
+	int fd;
+	int len;
+
+	event.hook = hook;
+	event.name = value;
+	clock_gettime(CLOCK_MONOTONIC, &event.time);
+	if (!spool) {
+		batch_run(&event, 1);
+		return;
+	}
+
+	/* One write, so lines from different services never mix */
+	len = xasprintf(&line, "%d %lld %ld %s\n", (int)hook,
+	    (long long)event.time.tv_sec, event.time.tv_nsec,
+	    value ? value : "");
+	if ((fd = open(spool, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+		    0644)) == -1 ||
+	    write(fd, line, (size_t)len) != len)
+	{
+		/* Better late than never */
+		batch_run(&event, 1);
+	}
+	if (fd != -1)
+		close(fd);
+	free(line);
+}
+
+void
+rc_plugin_spool(void)
+{
+	if (rc_in_plugin || nbatch == 0)
+		return;
+	spool_owner = getpid();
+	spool_off = 0;
+	unlink(RC_PLUGIN_SPOOL);
+	setenv("RC_PLUGIN_SPOOL", RC_PLUGIN_SPOOL, 1);
+}
+
+static void
+spool_flush(void)
+{
+	RC_HOOK_EVENT *events = NULL;
+	size_t nevents = 0;
+	char *buffer;
+	char *line;
+	char *end;
+	char *p;
+	struct stat st;
+	ssize_t nr;
+	int fd;
+
+	if (spool_owner != getpid())
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &spool_flushed);
+	if ((fd = open(RC_PLUGIN_SPOOL, O_RDONLY | O_CLOEXEC)) == -1)
+		return;
+	if (fstat(fd, &st) == -1 || st.st_size <= spool_off) {
+		close(fd);
+		return;
+	}
+
+	/* Services keep adding to the spool, so we remember how far we
+	 * got and only take whole lines */
+	buffer = xmalloc((size_t)(st.st_size - spool_off) + 1);
+	nr = pread(fd, buffer, (size_t)(st.st_size - spool_off), spool_off);
+	close(fd);
+	for (end = buffer + (nr > 0 ? nr : 0); end > buffer; end--)
+		if (end[-1] == '\n')
+			break;
+	if (end == buffer) {
 		free(buffer);
-		close(pfd[0]);
+		return;
+	}
+	end--;
+	spool_off += end - buffer + 1;
+	*end = '\0';
+
+	for (line = buffer; line; line = p) {
+		if ((p = strchr(line, '\n')))
+			*p++ = '\0';
+		events = xrealloc(events, sizeof(*events) * (nevents + 1));
+		events[nevents].hook = (RC_HOOK)strtol(line, &line, 10);
+		events[nevents].time.tv_sec = (time_t)strtoll(line, &line, 10);
+		events[nevents].time.tv_nsec = strtol(line, &line, 10);
+		if (*line == ' ')
+			line++;
+		events[nevents].name = *line ? line : NULL;
+		nevents++;
+	}
+	batch_run(events, nevents);
+	free(events);
+	free(buffer);
+}
+
+void
+rc_plugin_flush(bool idle)
+{
+	struct timespec now;
+
+	if (spool_owner != getpid())
+		return;
+	if (!idle) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - spool_flushed.tv_sec) * 1000 +
+		    (now.tv_nsec - spool_flushed.tv_nsec) / 1000000 < FLUSH_MS)
+			return;
+	}
+	spool_flush();
+}
 
-		rc_waitpid(pid);
+void
+rc_plugin_run(RC_HOOK hook, const char *value)
+{
+	PLUGIN *plugin;
+
+	/* Don't run plugins if we're in one */
+	if (rc_in_plugin || TAILQ_EMPTY(&plugins))
+		return;
+
+	if (!host_mode || !host_run(hook, value))
+		TAILQ_FOREACH(plugin, &plugins, entries)
+			if (!plugin->batch)
+				plugin_fork(plugin, hook, value, NULL, 0);
+
+	if (nbatch) {
+		batch_add(hook, value);
+		/* Hand everything over once a runlevel is done with */
+		if (hook == RC_HOOK_RUNLEVEL_STOP_OUT ||
+		    hook == RC_HOOK_RUNLEVEL_START_OUT)
+			spool_flush();
 	}
 }
 
@@ -234,6 +719,13 @@ rc_plugin_unload(void)
 	PLUGIN *plugin = TAILQ_FIRST(&plugins);
 	PLUGIN *next;
 
+	host_stop();
+	if (spool_owner == getpid()) {
+		spool_flush();
+		unlink(RC_PLUGIN_SPOOL);
+		unsetenv("RC_PLUGIN_SPOOL");
+		spool_owner = 0;
+	}
 	while (plugin) {
 		next = TAILQ_NEXT(plugin, entries);
 		dlclose(plugin->handle);
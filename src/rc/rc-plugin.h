@@ -26,6 +26,12 @@ int rc_waitpid(pid_t pid);
 void rc_plugin_load(void);
 void rc_plugin_unload(void);
 void rc_plugin_run(RC_HOOK, const char *value);
+/* Collect the hooks of everything we start for batch plugins and
+ * hand them over at the end of each runlevel */
+void rc_plugin_spool(void);
+/* Hand the hooks collected so far over now if nothing is running,
+ * otherwise only if we have not done so for a little while */
+void rc_plugin_flush(bool idle);
 
 /* dlfunc defines needed to avoid ISO errors. FreeBSD has this right :) */
 #if !defined(__FreeBSD__) && !defined(__DragonFly__)
@@ -0,0 +1,196 @@
+/*
+ * rc-readahead.c
+ * Read the files services need at boot into the page cache before they
+ * ask for them.
+ * While booting, openrc-run notes each init script and conf.d file it
+ * runs in READAHEAD_LOG. Once the default runlevel is up, rc keeps them,
+ * along with rc.conf and the shell libraries, as the profile in
+ * READAHEAD_PROFILE. On the next boot rc hands the profile to a
+ * background process that asks the kernel to read each file in, while
+ * sysinit gets on with other things.
+ */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "helpers.h"
+#include "queue.h"
+#include "rc.h"
+#include "rc-readahead.h"
+
+#define READAHEAD_DIR		RC_LIBEXECDIR "/cache"
+#define READAHEAD_PROFILE	READAHEAD_DIR "/readahead"
+#define READAHEAD_LOG		RC_SVCDIR "/readahead.log"
+
+static void
+readahead_file(const char *path)
+{
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) == -1)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+}
+
+/* Nothing waits for this, so let init have the process */
+void
+rc_readahead_start(void)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t len = 0;
+	pid_t pid;
+	int i;
+
+	if (!exists(READAHEAD_PROFILE))
+		return;
+	if ((pid = fork()) == -1)
+		return;
+	if (pid != 0) {
+		while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+			;
+		return;
+	}
+	if (fork() != 0)
+		_exit(EXIT_SUCCESS);
+
+	/* Do not keep rc's logger or scheduler pipes open behind its back */
+	for (i = getdtablesize() - 1; i >= 3; --i)
+		close(i);
+	nice(19);
+	if ((fp = fopen(READAHEAD_PROFILE, "re")) == NULL)
+		_exit(EXIT_FAILURE);
+	while (rc_getline(&line, &len, fp))
+		if (*line == '/')
+			readahead_file(line);
+	fclose(fp);
+	_exit(EXIT_SUCCESS);
+}
+
+/* Until the log exists, openrc-run records nothing */
+void
+rc_readahead_record_begin(void)
+{
+	int fd;
+
+	fd = open(READAHEAD_LOG, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd != -1)
+		close(fd);
+}
+
+bool
+rc_readahead_recording(void)
+{
+	return exists(READAHEAD_LOG);
+}
+
+/* Lines shorter than PIPE_BUF go in whole, so parallel services do not
+ * need to take turns */
+void
+rc_readahead_record(const char *path)
+{
+	char buf[PATH_MAX + 1];
+	int fd, len;
+
+	if (access(path, R_OK) != 0)
+		return;
+	len = snprintf(buf, sizeof(buf), "%s\n", path);
+	if (len <= 0 || (size_t)len >= sizeof(buf))
+		return;
+	if ((fd = open(READAHEAD_LOG, O_WRONLY | O_APPEND | O_CLOEXEC)) == -1)
+		return;
+	if (write(fd, buf, len) == -1)
+		errno = 0;
+	close(fd);
+}
+
+static void
+readahead_add_dir(RC_STRINGSET *set, const char *dir, const char *suffix)
+{
+	DIR *dp;
+	struct dirent *d;
+	char *path;
+	size_t l, sl = strlen(suffix);
+
+	if ((dp = opendir(dir)) == NULL)
+		return;
+	while ((d = readdir(dp))) {
+		l = strlen(d->d_name);
+		if (d->d_name[0] == '.' || l <= sl ||
+		    strcmp(d->d_name + l - sl, suffix) != 0)
+			continue;
+		xasprintf(&path, "%s/%s", dir, d->d_name);
+		rc_stringset_add(set, path);
+		free(path);
+	}
+	closedir(dp);
+}
+
+/* Turn what this boot recorded into the profile for the next one.
+ * The profile lists each file once, in the order they were first used. */
+bool
+rc_readahead_save(void)
+{
+	RC_STRINGSET *set;
+	RC_STRINGLIST *list;
+	RC_STRING *s;
+	FILE *fp;
+	char *line = NULL, *tmp;
+	size_t len = 0;
+	bool retval = false;
+
+	if ((fp = fopen(READAHEAD_LOG, "re")) == NULL)
+		return false;
+	set = rc_stringset_new();
+	rc_stringset_add(set, RC_CONF);
+	readahead_add_dir(set, RC_CONF_D, ".conf");
+	readahead_add_dir(set, RC_LIBEXECDIR "/sh", ".sh");
+	while (rc_getline(&line, &len, fp))
+		if (*line == '/')
+			rc_stringset_add(set, line);
+	free(line);
+	fclose(fp);
+	unlink(READAHEAD_LOG);
+	list = rc_stringset_to_list(set);
+	rc_stringset_free(set);
+
+	if (mkdir(READAHEAD_DIR, 0755) == -1 && errno != EEXIST)
+		goto out;
+	xasprintf(&tmp, READAHEAD_PROFILE ".%d", (int)getpid());
+	if ((fp = fopen(tmp, "we"))) {
+		TAILQ_FOREACH(s, list, entries)
+			if (exists(s->value))
+				fprintf(fp, "%s\n", s->value);
+		if (fclose(fp) == 0 && rename(tmp, READAHEAD_PROFILE) == 0)
+			retval = true;
+		else
+			unlink(tmp);
+	}
+	free(tmp);
+out:
+	rc_stringlist_free(list);
+	return retval;
+}
@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#ifndef RC_READAHEAD_H
+#define RC_READAHEAD_H
+
+#include <stdbool.h>
+
+void rc_readahead_start(void);
+void rc_readahead_record_begin(void);
+bool rc_readahead_recording(void);
+void rc_readahead_record(const char *path);
+bool rc_readahead_save(void);
+
+#endif
@@ -0,0 +1,255 @@
+/*
+ * rc-ready.c
+ * Wait for a daemon we started to tell us it is ready.
+ *
+ * The daemon either writes a line to an fd it inherits from us, which is
+ * the protocol s6 uses for its notification-fd, or we run a command
+ * given by the service until it succeeds.
+ */
+
+/*
+ * Copyright (c) 2018 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "einfo.h"
+#include "rc-ready.h"
+
+/* The check command is retried with a back off between these */
+#define CHECK_MIN_MS	10
+#define CHECK_MAX_MS	250
+
+void rc_ready_init(struct rc_ready *r)
+{
+	r->fd = -1;
+	r->pipe[0] = r->pipe[1] = -1;
+	r->check = NULL;
+	r->timeout = RC_READY_TIMEOUT;
+}
+
+/* We take fd:N like s6, anything below 3 would clobber stdio */
+bool rc_ready_parse_notify(struct rc_ready *r, const char *arg)
+{
+	char *end;
+	long fd;
+
+	if (strncmp(arg, "fd:", 3) != 0)
+		return false;
+	errno = 0;
+	fd = strtol(arg + 3, &end, 10);
+	if (errno || *end || end == arg + 3 || fd < 3 || fd > 1023)
+		return false;
+	r->fd = (int)fd;
+	return true;
+}
+
+bool rc_ready_wanted(const struct rc_ready *r)
+{
+	return r->fd != -1 || r->check;
+}
+
+/* Make the pipe before forking the daemon */
+int rc_ready_open(struct rc_ready *r)
+{
+	if (r->fd == -1)
+		return 0;
+	if (pipe(r->pipe) == -1)
+		return -1;
+	fcntl(r->pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(r->pipe[1], F_SETFD, FD_CLOEXEC);
+	return 0;
+}
+
+/*
+ * In the daemon, put the write end of the pipe where it expects it.
+ * If we have no pipe, as when a supervisor respawns it, it gets
+ * /dev/null so that telling nobody it is ready still works.
+ * Returns the fd, which the caller must leave open, or -1.
+ */
+int rc_ready_child(struct rc_ready *r, int devnull_fd)
+{
+	int fd = r->pipe[1] != -1 ? r->pipe[1] : devnull_fd;
+
+	if (r->fd == -1)
+		return -1;
+	if (fd == r->fd)
+		fcntl(fd, F_SETFD, 0);
+	else if (dup2(fd, r->fd) == -1)
+		return -1;
+	if (r->pipe[0] != -1 && r->pipe[0] != r->fd)
+		close(r->pipe[0]);
+	if (r->pipe[1] != -1 && r->pipe[1] != r->fd)
+		close(r->pipe[1]);
+	r->pipe[0] = r->pipe[1] = -1;
+	return r->fd;
+}
+
+void rc_ready_close(struct rc_ready *r)
+{
+	if (r->pipe[0] != -1)
+		close(r->pipe[0]);
+	if (r->pipe[1] != -1)
+		close(r->pipe[1]);
+	r->pipe[0] = r->pipe[1] = -1;
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool is_alive(pid_t pid)
+{
+	pid_t p;
+
+	if (pid <= 0)
+		return true;
+	if ((p = waitpid(pid, NULL, WNOHANG)) == 0)
+		return true;
+	/* Not ours to reap, so all we can do is ask */
+	if (p == -1 && errno == ECHILD)
+		return kill(pid, 0) == 0;
+	return false;
+}
+
+/* Wait for the daemon to write a newline, anything before it is
+ * ignored. EOF means it went away or closed the fd without doing so. */
+static bool wait_notify(struct rc_ready *r, long long deadline,
+		const char *applet, const char *exec)
+{
+	struct pollfd pfd;
+	char buf[128];
+	ssize_t len;
+	long long left;
+
+	pfd.fd = r->pipe[0];
+	pfd.events = POLLIN;
+	while ((left = deadline - now_ms()) > 0) {
+		if (poll(&pfd, 1, (int)left) == -1) {
+			if (errno == EINTR)
+				continue;
+			eerror("%s: poll: %s", applet, strerror(errno));
+			return false;
+		}
+		if (!pfd.revents)
+			continue;
+		len = read(pfd.fd, buf, sizeof(buf));
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			eerror("%s: %s exited before it was ready",
+			    applet, exec);
+			return false;
+		}
+		if (memchr(buf, '\n', (size_t)len))
+			return true;
+	}
+	eerror("%s: %s did not say it was ready in %d seconds",
+	    applet, exec, r->timeout);
+	return false;
+}
+
+static int run_check(const char *check)
+{
+	pid_t pid;
+	int status, fd;
+
+	if ((pid = fork()) == -1)
+		return -1;
+	if (pid == 0) {
+		if ((fd = open("/dev/null", O_RDWR)) != -1) {
+			dup2(fd, STDIN_FILENO);
+			if (fd > STDERR_FILENO)
+				close(fd);
+		}
+		execl("/bin/sh", "sh", "-c", check, (char *)NULL);
+		_exit(127);
+	}
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			return -1;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static bool wait_check(struct rc_ready *r, pid_t pid, long long deadline,
+		const char *applet, const char *exec)
+{
+	struct timespec ts;
+	long long left;
+	long step = CHECK_MIN_MS;
+
+	for (;;) {
+		if (run_check(r->check) == 0)
+			return true;
+		if (!is_alive(pid)) {
+			eerror("%s: %s exited before it was ready",
+			    applet, exec);
+			return false;
+		}
+		if ((left = deadline - now_ms()) <= 0)
+			break;
+		if (step > left)
+			step = (long)left;
+		ts.tv_sec = step / 1000;
+		ts.tv_nsec = (step % 1000) * 1000000;
+		nanosleep(&ts, NULL);
+		if (step < CHECK_MAX_MS)
+			step *= 2;
+	}
+	eerror("%s: %s was not ready in %d seconds",
+	    applet, exec, r->timeout);
+	return false;
+}
+
+/*
+ * Block until the daemon is ready or the timeout runs out.
+ * pid is our child to watch for dying early, or 0 for none.
+ * We hold SIGCHLD back while waiting so that we can reap our
+ * check commands ourselves.
+ */
+bool rc_ready_wait(struct rc_ready *r, pid_t pid, const char *applet,
+		const char *exec)
+{
+	long long deadline = now_ms() + (long long)r->timeout * 1000;
+	sigset_t chld, old;
+	bool ready = true;
+
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &old);
+	if (r->pipe[1] != -1) {
+		/* Only the daemon may hold the write end, or we never
+		 * see it go away */
+		close(r->pipe[1]);
+		r->pipe[1] = -1;
+	}
+	if (r->pipe[0] != -1)
+		ready = wait_notify(r, deadline, applet, exec);
+	if (ready && r->check)
+		ready = wait_check(r, pid, deadline, applet, exec);
+	rc_ready_close(r);
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	return ready;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2018 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#ifndef RC_READY_H
+#define RC_READY_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Seconds we wait for a daemon to be ready unless told otherwise */
+#define RC_READY_TIMEOUT	60
+
+struct rc_ready {
+	int fd;			/* the daemon writes a line here when ready */
+	int pipe[2];
+	const char *check;	/* or we run this until it succeeds */
+	int timeout;		/* seconds */
+};
+
+void rc_ready_init(struct rc_ready *r);
+bool rc_ready_parse_notify(struct rc_ready *r, const char *arg);
+bool rc_ready_wanted(const struct rc_ready *r);
+int rc_ready_open(struct rc_ready *r);
+int rc_ready_child(struct rc_ready *r, int devnull_fd);
+void rc_ready_close(struct rc_ready *r);
+bool rc_ready_wait(struct rc_ready *r, pid_t pid, const char *applet,
+		const char *exec);
+
+#endif
@@ -23,6 +23,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -36,6 +37,18 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#ifdef __linux__
+# include <poll.h>
+# include <sys/syscall.h>
+# if defined(SYS_pidfd_open) && defined(SYS_pidfd_send_signal)
+#  define HAVE_PIDFD
+# endif
+#elif defined(__FreeBSD__) || defined(__DragonFly__) || \
+    defined(__NetBSD__) || defined(__OpenBSD__)
+# include <sys/event.h>
+# define HAVE_KQUEUE
+#endif
+
 #include "einfo.h"
 #include "queue.h"
 #include "rc.h"
@@ -44,12 +57,7 @@
 #include "helpers.h"
 
 typedef struct scheduleitem {
-	enum {
-		SC_TIMEOUT,
-		SC_SIGNAL,
-		SC_GOTO,
-		SC_FOREVER,
-	} type;
+	enum schedule_type type;
 	int value;
 	struct scheduleitem *gotoitem;
 	TAILQ_ENTRY(scheduleitem) entries;
@@ -248,17 +256,422 @@ void parse_schedule(const char *applet, const char *string, int timeout)
 	return;
 }
 
-/* return number of processes killed, -1 on error */
-int do_stop(const char *applet, const char *exec, const char *const *argv,
-    pid_t pid, uid_t uid,int sig, bool test, bool quiet)
+/*
+ * Copy the schedule parse_schedule made into an array.
+ * Nothing comes after forever, as we wait on that until the process
+ * goes, so we can leave out the goto back to it.
+ */
+int copy_schedule(struct schedule_step **steps)
+{
+	SCHEDULEITEM *item;
+	int n = 0;
+
+	TAILQ_FOREACH(item, &schedule, entries)
+		n++;
+	*steps = xmalloc(sizeof(**steps) * (n + 1));
+	n = 0;
+	TAILQ_FOREACH(item, &schedule, entries) {
+		if (item->type == SC_GOTO)
+			continue;
+		(*steps)[n].type = item->type;
+		(*steps)[n].value = item->value;
+		n++;
+	}
+	return n;
+}
+
+/* Send a signal to pid, through its pidfd if we have one */
+static bool signal_pid(const char *applet, pid_t pid, int pidfd, int sig,
+		bool quiet)
+{
+	bool killed;
+
+	if (sig) {
+		syslog(LOG_DEBUG, "Sending signal %d to PID %d", sig, pid);
+		if (!quiet)
+			ebeginv("Sending signal %d to PID %d", sig, pid);
+	}
+	errno = 0;
+#ifdef HAVE_PIDFD
+	if (pidfd != -1)
+		killed = (syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0) == 0 ||
+		    errno == ESRCH ? true : false);
+	else
+#endif
+		killed = (kill(pid, sig) == 0 ||
+		    errno == ESRCH ? true : false);
+	if (! quiet)
+		eendv(killed ? 0 : 1,
+		"%s: failed to send signal %d to PID %d: %s",
+		applet, sig, pid, strerror(errno));
+	else if (!killed)
+		syslog(LOG_ERR, "Failed to send signal %d to PID %d: %s",
+				sig, pid, strerror(errno));
+	return killed;
+}
+
+#ifdef HAVE_PIDFD
+/* When we know the pid we are stopping we hold a pidfd for it.
+ * Then we can signal it without racing against the pid being reused and
+ * wait for it to exit without looking through /proc again. */
+static int open_pidfd(pid_t pid)
+{
+	RC_PIDLIST *pids;
+	RC_PID *pi, *np;
+	int fd = -1;
+
+	/* Only if it is one rc_find_pids would have found */
+	if (!(pids = rc_find_pids(NULL, NULL, 0, pid)))
+		return -1;
+	if (LIST_FIRST(pids))
+		fd = (int)syscall(SYS_pidfd_open, pid, 0);
+	LIST_FOREACH_SAFE(pi, pids, entries, np)
+		free(pi);
+	free(pids);
+	return fd;
+}
+
+/* Wait up to timeout ms for the process to exit */
+static bool pidfd_exited(int pidfd, int timeout)
+{
+	struct pollfd pfd;
+
+	pfd.fd = pidfd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, timeout) > 0;
+}
+#endif
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / ONE_MS;
+}
+
+/* Wait up to timeout ms for all of pids to exit.
+ * Returns 1 once they have, 0 if any are still running at the timeout
+ * and -1 if we cannot wait for them to exit here and have to poll. */
+static int wait_pids(RC_PIDLIST *pids, int timeout)
+{
+#if defined(HAVE_PIDFD)
+	struct pollfd *fds;
+	RC_PID *pi;
+	size_t n = 0, i;
+	long long deadline = now_ms() + timeout, left;
+	int r, retval = -1;
+
+	LIST_FOREACH(pi, pids, entries)
+		n++;
+	fds = xmalloc(sizeof(*fds) * (n ? n : 1));
+	n = 0;
+	LIST_FOREACH(pi, pids, entries) {
+		fds[n].fd = (int)syscall(SYS_pidfd_open, pi->pid, 0);
+		if (fds[n].fd == -1) {
+			if (errno == ESRCH)
+				continue;
+			goto out;
+		}
+		fds[n].events = POLLIN;
+		n++;
+	}
+
+	/* Zombies have exited but stay around until they are reaped,
+	 * so when there is nothing else we can only poll for them */
+	if (n == 0 || poll(fds, n, 0) == (int)n)
+		goto out;
+
+	retval = 0;
+	while (n > 0) {
+		left = deadline - now_ms();
+		r = poll(fds, n, left > 0 ? (int)left : 0);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			retval = -1;
+			goto out;
+		}
+		if (r == 0)
+			goto out;
+		for (i = 0; i < n; ) {
+			if (fds[i].revents) {
+				close(fds[i].fd);
+				fds[i] = fds[--n];
+			} else
+				i++;
+		}
+	}
+	retval = 1;
+
+out:
+	for (i = 0; i < n; i++)
+		close(fds[i].fd);
+	free(fds);
+	return retval;
+#elif defined(HAVE_KQUEUE)
+	struct kevent kev;
+	struct timespec ts;
+	RC_PID *pi;
+	long long deadline = now_ms() + timeout, left;
+	int kq, n = 0, r, retval = -1;
+
+	if ((kq = kqueue()) == -1)
+		return -1;
+	LIST_FOREACH(pi, pids, entries) {
+		EV_SET(&kev, pi->pid, EVFILT_PROC, EV_ADD | EV_ONESHOT,
+		    NOTE_EXIT, 0, NULL);
+		if (kevent(kq, &kev, 1, NULL, 0, NULL) == -1) {
+			if (errno == ESRCH)
+				continue;
+			goto out;
+		}
+		n++;
+	}
+	/* Nothing we could wait for, they must be zombies */
+	if (n == 0)
+		goto out;
+
+	retval = 0;
+	while (n > 0) {
+		left = deadline - now_ms();
+		if (left < 0)
+			left = 0;
+		ts.tv_sec = left / 1000;
+		ts.tv_nsec = (left % 1000) * ONE_MS;
+		r = kevent(kq, NULL, 0, &kev, 1, &ts);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			retval = -1;
+			goto out;
+		}
+		if (r == 0)
+			goto out;
+		n--;
+	}
+	retval = 1;
+
+out:
+	close(kq);
+	return retval;
+#else
+	(void)pids;
+	(void)timeout;
+	return -1;
+#endif
+}
+
+/* When set, we stop every process in this cgroup directory instead of
+ * looking for them through /proc */
+static const char *stop_cgroup;
+/* Whether we, or a process above us, are in stop_cgroup too.
+ * The service script puts itself there on cgroup v1. */
+static bool cgroup_shared;
+
+void set_stop_cgroup(const char *path)
+{
+	stop_cgroup = path;
+}
+
+static pid_t parent_of(pid_t pid)
+{
+	char path[32], buf[512], *p;
+	FILE *fp;
+	int ppid = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if (!(fp = fopen(path, "r")))
+		return 0;
+	if (fgets(buf, sizeof(buf), fp) && (p = strrchr(buf, ')')))
+		if (sscanf(p + 1, " %*c %d", &ppid) != 1)
+			ppid = 0;
+	fclose(fp);
+	return (pid_t)ppid;
+}
+
+/* The processes in stop_cgroup, leaving out ourselves and our parents */
+static RC_PIDLIST *cgroup_pids(void)
 {
 	RC_PIDLIST *pids;
 	RC_PID *pi;
-	RC_PID *np;
+	pid_t self[32];
+	size_t nself = 0, i;
+	char *path;
+	FILE *fp;
+	int p;
+
+	xasprintf(&path, "%s/cgroup.procs", stop_cgroup);
+	fp = fopen(path, "r");
+	free(path);
+	if (!fp)
+		return NULL;
+
+	for (self[0] = getpid(); self[nself] > 1 && nself + 1 < ARRAY_SIZE(self);
+	    nself++)
+		self[nself + 1] = parent_of(self[nself]);
+
+	pids = xmalloc(sizeof(*pids));
+	LIST_INIT(pids);
+	cgroup_shared = false;
+	while (fscanf(fp, "%d", &p) == 1) {
+		for (i = 0; i < nself; i++)
+			if (self[i] == (pid_t)p)
+				break;
+		if (i < nself) {
+			cgroup_shared = true;
+			continue;
+		}
+		pi = xmalloc(sizeof(*pi));
+		pi->pid = (pid_t)p;
+		LIST_INSERT_HEAD(pids, pi, entries);
+	}
+	fclose(fp);
+	return pids;
+}
+
+/* cgroup v2 can kill everything in it in one go, so long as that
+ * does not include us */
+static bool cgroup_kill(void)
+{
+	char *path;
+	int fd;
 	bool killed;
+
+	if (cgroup_shared)
+		return false;
+	xasprintf(&path, "%s/cgroup.kill", stop_cgroup);
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	free(path);
+	if (fd == -1)
+		return false;
+	killed = write(fd, "1", 1) == 1;
+	close(fd);
+	return killed;
+}
+
+#ifdef __linux__
+/* cgroup v2 tells us when its last process has gone through
+ * cgroup.events, so we sleep until it does rather than scanning.
+ * Returns 0 once it is empty, 1 if not at the timeout and -1 if we
+ * cannot wait on it. */
+static int cgroup_wait(int timeout)
+{
+	struct pollfd pfd;
+	char *path, buf[256], *p;
+	long long deadline = now_ms() + timeout, left;
+	ssize_t len;
+	int retval = -1;
+
+	if (cgroup_shared)
+		return -1;
+	xasprintf(&path, "%s/cgroup.events", stop_cgroup);
+	pfd.fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (pfd.fd == -1)
+		return -1;
+	pfd.events = POLLPRI;
+
+	for (;;) {
+		if ((len = pread(pfd.fd, buf, sizeof(buf) - 1, 0)) <= 0)
+			break;
+		buf[len] = '\0';
+		if (!(p = strstr(buf, "populated ")))
+			break;
+		if (p[10] == '0') {
+			retval = 0;
+			break;
+		}
+		retval = 1;
+		if ((left = deadline - now_ms()) <= 0 ||
+		    (poll(&pfd, 1, (int)left) == -1 && errno != EINTR))
+			break;
+	}
+	close(pfd.fd);
+	return retval;
+}
+#endif
+
+/* Wait up to timeout ms for the processes we are stopping to exit.
+ * We sleep on exit events where the system has them and only scan for
+ * the processes again when they fire, otherwise we poll.
+ * Returns how many were still running when we last looked. */
+static int wait_stop(const char *exec, const char *const *argv,
+		pid_t pid, int pidfd, uid_t uid, int timeout)
+{
+	RC_PIDLIST *pids;
+	RC_PID *pi, *np;
+	struct timespec ts;
+	long long deadline = now_ms() + timeout, left;
+	int nrunning, r;
+
+#ifdef HAVE_PIDFD
+	if (pidfd != -1)
+		return pidfd_exited(pidfd, timeout) ? 0 : 1;
+#else
+	(void)pidfd;
+#endif
+#ifdef __linux__
+	if (stop_cgroup && (r = cgroup_wait(timeout)) != -1)
+		return r;
+#endif
+
+	for (;;) {
+		if (stop_cgroup)
+			pids = cgroup_pids();
+		else if (pid > 0)
+			pids = rc_find_pids(NULL, NULL, 0, pid);
+		else
+			pids = rc_find_pids(exec, argv, uid, 0);
+		nrunning = 0;
+		if (pids)
+			LIST_FOREACH(pi, pids, entries)
+				nrunning++;
+		left = deadline - now_ms();
+		r = 0;
+		if (nrunning > 0 && left > 0)
+			r = wait_pids(pids, (int)left);
+		if (pids) {
+			LIST_FOREACH_SAFE(pi, pids, entries, np)
+				free(pi);
+			free(pids);
+		}
+		if (nrunning == 0 || left <= 0 || r == 0)
+			return nrunning;
+		if (r == -1) {
+			ts.tv_sec = 0;
+			ts.tv_nsec = left * ONE_MS < POLL_INTERVAL ?
+			    left * ONE_MS : POLL_INTERVAL;
+			nanosleep(&ts, NULL);
+		}
+	}
+}
+
+static int stop_pids(const char *applet, const char *exec,
+		const char *const *argv, pid_t pid, int pidfd, uid_t uid, int sig,
+		bool test, bool quiet)
+{
+	RC_PIDLIST *pids;
+	RC_PID *pi;
+	RC_PID *np;
 	int nkilled = 0;
 
-	if (pid > 0)
+#ifdef HAVE_PIDFD
+	if (pidfd != -1) {
+		if (pidfd_exited(pidfd, 0))
+			return 0;
+		if (test) {
+			einfo("Would send signal %d to PID %d", sig, pid);
+			return 1;
+		}
+		return signal_pid(applet, pid, pidfd, sig, quiet) ? 1 : -1;
+	}
+#endif
+
+	if (stop_cgroup)
+		pids = cgroup_pids();
+	else if (pid > 0)
 		pids = rc_find_pids(NULL, NULL, 0, pid);
 	else
 		pids = rc_find_pids(exec, argv, uid, 0);
@@ -266,31 +679,35 @@ int do_stop(const char *applet, const char *exec, const char *const *argv,
 	if (!pids)
 		return 0;
 
+	if (stop_cgroup && sig == SIGKILL && !test &&
+	    LIST_FIRST(pids) && cgroup_kill())
+	{
+		syslog(LOG_DEBUG, "Killed all processes in %s", stop_cgroup);
+		if (!quiet)
+			einfov("Killed all processes in %s", stop_cgroup);
+		LIST_FOREACH_SAFE(pi, pids, entries, np) {
+			nkilled++;
+			free(pi);
+		}
+		free(pids);
+		return nkilled;
+	}
+
 	LIST_FOREACH_SAFE(pi, pids, entries, np) {
 		if (test) {
 			einfo("Would send signal %d to PID %d", sig, pi->pid);
 			nkilled++;
 		} else {
-			if (sig) {
-				syslog(LOG_DEBUG, "Sending signal %d to PID %d", sig, pi->pid);
-				if (!quiet)
-					ebeginv("Sending signal %d to PID %d", sig, pi->pid);
-			}
-			errno = 0;
-			killed = (kill(pi->pid, sig) == 0 ||
-			    errno == ESRCH ? true : false);
-			if (! quiet)
-				eendv(killed ? 0 : 1,
-				"%s: failed to send signal %d to PID %d: %s",
-				applet, sig, pi->pid, strerror(errno));
-			else if (!killed)
-				syslog(LOG_ERR, "Failed to send signal %d to PID %d: %s",
-						sig, pi->pid, strerror(errno));
-			if (!killed) {
+			if (!signal_pid(applet, pi->pid, -1, sig, quiet)) {
 				nkilled = -1;
 			} else {
 				if (nkilled != -1)
 					nkilled++;
+				/* Anything stopped in the cgroup has to
+				 * carry on to act on the signal */
+				if (stop_cgroup && sig != SIGKILL &&
+				    sig != SIGCONT)
+					kill(pi->pid, SIGCONT);
 			}
 		}
 		free(pi);
@@ -300,23 +717,33 @@ int do_stop(const char *applet, const char *exec, const char *const *argv,
 	return nkilled;
 }
 
-int run_stop_schedule(const char *applet,
+/* return number of processes killed, -1 on error */
+int do_stop(const char *applet, const char *exec, const char *const *argv,
+    pid_t pid, uid_t uid,int sig, bool test, bool quiet)
+{
+	return stop_pids(applet, exec, argv, pid, -1, uid, sig, test, quiet);
+}
+
+static int stop_schedule(const char *applet,
 		const char *exec, const char *const *argv,
-		pid_t pid, uid_t uid,
-    bool test, bool progress, bool quiet)
+		pid_t pid, int pidfd, uid_t uid,
+		bool test, bool progress, bool quiet)
 {
 	SCHEDULEITEM *item = TAILQ_FIRST(&schedule);
 	int nkilled = 0;
 	int tkilled = 0;
 	int nrunning = 0;
-	long nloops, nsecs;
-	struct timespec ts;
+	long nsecs;
 	const char *const *p;
 	bool progressed = false;
 
-	if (!(pid > 0 || exec || uid || (argv && *argv)))
+	if (!(stop_cgroup || pid > 0 || exec || uid || (argv && *argv)))
 		return 0;
 
+	if (stop_cgroup) {
+		einfov("Will stop processes in %s", stop_cgroup);
+		syslog(LOG_DEBUG, "Will stop processes in %s", stop_cgroup);
+	}
 	if (exec) {
 		einfov("Will stop %s", exec);
 		syslog(LOG_DEBUG, "Will stop %s", exec);
@@ -349,8 +776,8 @@ int run_stop_schedule(const char *applet,
 
 		case SC_SIGNAL:
 			nrunning = 0;
-			nkilled = do_stop(applet, exec, argv, pid, uid, item->value, test,
-					quiet);
+			nkilled = stop_pids(applet, exec, argv, pid, pidfd, uid,
+					item->value, test, quiet);
 			if (nkilled == 0) {
 				if (tkilled == 0) {
 					if (progressed)
@@ -371,31 +798,10 @@ int run_stop_schedule(const char *applet,
 				break;
 			}
 
-			ts.tv_sec = 0;
-			ts.tv_nsec = POLL_INTERVAL;
-
 			for (nsecs = 0; item->type == SC_FOREVER || nsecs < item->value; nsecs++) {
-				for (nloops = 0;
-				     nloops < ONE_SECOND / POLL_INTERVAL;
-				     nloops++)
-				{
-					if ((nrunning = do_stop(applet, exec, argv,
-						    pid, uid, 0, test, quiet)) == 0)
-						return 0;
-
-
-					if (nanosleep(&ts, NULL) == -1) {
-						if (progressed) {
-							printf("\n");
-							progressed = false;
-						}
-						if (errno != EINTR) {
-							eerror("%s: nanosleep: %s",
-							    applet, strerror(errno));
-							return 0;
-						}
-					}
-				}
+				if ((nrunning = wait_stop(exec, argv, pid, pidfd,
+					    uid, ONE_SECOND / ONE_MS)) == 0)
+					return 0;
 				if (progress) {
 					printf(".");
 					fflush(stdout);
@@ -431,3 +837,22 @@ int run_stop_schedule(const char *applet,
 
 	return -nrunning;
 }
+
+int run_stop_schedule(const char *applet,
+		const char *exec, const char *const *argv,
+		pid_t pid, uid_t uid,
+		bool test, bool progress, bool quiet)
+{
+	int pidfd = -1;
+	int retval;
+
+#ifdef HAVE_PIDFD
+	if (pid > 0 && !stop_cgroup)
+		pidfd = open_pidfd(pid);
+#endif
+	retval = stop_schedule(applet, exec, argv, pid, pidfd, uid,
+	    test, progress, quiet);
+	if (pidfd != -1)
+		close(pidfd);
+	return retval;
+}
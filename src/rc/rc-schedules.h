@@ -13,9 +13,25 @@
 #ifndef __RC_SCHEDULES_H
 #define __RC_SCHEDULES_H
 
+enum schedule_type {
+	SC_TIMEOUT,
+	SC_SIGNAL,
+	SC_GOTO,
+	SC_FOREVER,
+};
+
+/* One step of a parsed schedule, for callers that work through it
+ * themselves rather than waiting in run_stop_schedule */
+struct schedule_step {
+	enum schedule_type type;
+	int value;
+};
+
 void free_schedulelist(void);
 int parse_signal(const char *applet, const char *sig);
 void parse_schedule(const char *applet, const char *string, int timeout);
+int copy_schedule(struct schedule_step **steps);
+void set_stop_cgroup(const char *path);
 int do_stop(const char *applet, const char *exec, const char *const *argv,
 		pid_t pid, uid_t uid,int sig, bool test, bool quiet);
 int run_stop_schedule(const char *applet,
@@ -116,7 +116,6 @@ int main(int argc, char **argv)
 			list = rc_services_in_runlevel(NULL);
 			if (TAILQ_FIRST(list) == NULL)
 				return EXIT_FAILURE;
-			rc_stringlist_sort(&list);
 			TAILQ_FOREACH(s, list, entries)
 			    printf("%s\n", s->value);
 			rc_stringlist_free(list);
@@ -0,0 +1,234 @@
+/*
+ * rc-sockets.c
+ * Open the sockets a service listens on before its daemon starts, and
+ * hand them to the daemon as sd_listen_fds(3) expects.
+ *
+ * Addresses look like
+ *   /path or unix:/path       a unix stream socket
+ *   unix-dgram:/path          a unix datagram socket, such as /dev/log
+ *   tcp:[host:]port           tcp, where host may be [v6] or *
+ *   udp:[host:]port           udp, likewise
+ */
+
+/*
+ * Copyright (c) 2018 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "helpers.h"
+#include "rc-sockets.h"
+
+/* Split off the kind of socket, returning the rest of the address */
+static const char *listen_kind(const char *addr, int *family, int *type)
+{
+	*family = AF_UNIX;
+	*type = SOCK_STREAM;
+	if (strncmp(addr, "unix:", 5) == 0)
+		return addr + 5;
+	if (strncmp(addr, "unix-dgram:", 11) == 0) {
+		*type = SOCK_DGRAM;
+		return addr + 11;
+	}
+	*family = AF_UNSPEC;
+	if (strncmp(addr, "tcp:", 4) == 0)
+		return addr + 4;
+	if (strncmp(addr, "udp:", 4) == 0) {
+		*type = SOCK_DGRAM;
+		return addr + 4;
+	}
+	*family = AF_UNIX;
+	return addr;
+}
+
+static int listen_unix(const char *path, int type)
+{
+	struct sockaddr_un sun;
+	struct stat st;
+	int fd, serrno;
+
+	if (*path != '/' || strlen(path) >= sizeof(sun.sun_path)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	/* A socket left behind by the last daemon is no use to anyone */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	if ((fd = socket(AF_UNIX, type, 0)) == -1)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	    (type == SOCK_STREAM && listen(fd, SOMAXCONN) == -1))
+	{
+		serrno = errno;
+		close(fd);
+		errno = serrno;
+		return -1;
+	}
+	return fd;
+}
+
+static int listen_inet(const char *addr, int type)
+{
+	struct addrinfo hints, *res, *ai;
+	char *buf, *host, *port, *p;
+	int fd = -1, on = 1, serrno = EADDRNOTAVAIL;
+
+	host = buf = xstrdup(addr);
+	if ((port = strrchr(host, ':'))) {
+		*port++ = '\0';
+		if (*host == '[' && (p = strchr(host, ']'))) {
+			*p = '\0';
+			memmove(host, host + 1, strlen(host));
+		}
+	} else {
+		port = host;
+		host = NULL;
+	}
+	if (host && (*host == '\0' || strcmp(host, "*") == 0))
+		p = NULL;
+	else
+		p = host;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = type;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(p, port, &hints, &res) != 0) {
+		free(buf);
+		errno = EINVAL;
+		return -1;
+	}
+	free(buf);
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+			    ai->ai_protocol)) == -1)
+		{
+			serrno = errno;
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    (type != SOCK_STREAM || listen(fd, SOMAXCONN) == 0))
+			break;
+		serrno = errno;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd == -1)
+		errno = serrno;
+	return fd;
+}
+
+/* Returns a socket the daemon will inherit, or -1 */
+int rc_listen_bind(const char *addr)
+{
+	int family, type;
+	const char *rest = listen_kind(addr, &family, &type);
+
+	if (family == AF_UNIX)
+		return listen_unix(rest, type);
+	return listen_inet(rest, type);
+}
+
+/* Once the daemon has gone, so should the paths it was listening on */
+void rc_listen_unlink(const char *addr)
+{
+	int family, type;
+	const char *rest = listen_kind(addr, &family, &type);
+	struct stat st;
+
+	if (family == AF_UNIX && *rest == '/' &&
+	    lstat(rest, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(rest);
+}
+
+/* Parse the fds openrc-run gives us as 5,6,7.
+ * fds must have room for RC_LISTEN_FDS_MAX. */
+int rc_listen_parse(const char *arg, int *fds)
+{
+	const char *p = arg;
+	char *end;
+	long fd;
+	int n = 0;
+
+	while (*p) {
+		errno = 0;
+		fd = strtol(p, &end, 10);
+		if (errno || end == p || fd < 0 || fd > 1023 ||
+		    (*end && *end != ',') || n == RC_LISTEN_FDS_MAX)
+			return -1;
+		fds[n++] = (int)fd;
+		p = *end ? end + 1 : end;
+	}
+	return n;
+}
+
+/* Would the daemon's sockets land on top of fd? */
+bool rc_listen_conflicts(int nfds, int fd)
+{
+	return fd >= RC_LISTEN_FDS_START && fd < RC_LISTEN_FDS_START + nfds;
+}
+
+/*
+ * In the daemon, first get the sockets clear of where they are going and
+ * of fd, which the caller is about to put something else on. Then
+ * moving one into place cannot clobber another.
+ */
+int rc_listen_lift(int *fds, int nfds, int fd)
+{
+	int i, min = RC_LISTEN_FDS_START + nfds;
+
+	if (fd >= min)
+		min = fd + 1;
+	for (i = 0; i < nfds; i++)
+		if ((fds[i] = fcntl(fds[i], F_DUPFD, min)) == -1)
+			return -1;
+	return 0;
+}
+
+/* Then move them to 3 and up and say how many there are.
+ * The caller must leave those fds open. */
+int rc_listen_child(int *fds, int nfds)
+{
+	char buf[16];
+	int i;
+
+	if (nfds == 0)
+		return 0;
+	for (i = 0; i < nfds; i++) {
+		if (dup2(fds[i], RC_LISTEN_FDS_START + i) == -1)
+			return -1;
+		close(fds[i]);
+		fds[i] = RC_LISTEN_FDS_START + i;
+	}
+	snprintf(buf, sizeof(buf), "%d", nfds);
+	setenv("LISTEN_FDS", buf, 1);
+	snprintf(buf, sizeof(buf), "%d", (int)getpid());
+	setenv("LISTEN_PID", buf, 1);
+	return nfds;
+}
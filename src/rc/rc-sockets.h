@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2018 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#ifndef RC_SOCKETS_H
+#define RC_SOCKETS_H
+
+#include <stdbool.h>
+
+/* The daemon finds its sockets from here on, as sd_listen_fds(3) expects */
+#define RC_LISTEN_FDS_START	3
+/* More than any daemon should want */
+#define RC_LISTEN_FDS_MAX	64
+
+int rc_listen_bind(const char *addr);
+void rc_listen_unlink(const char *addr);
+int rc_listen_parse(const char *arg, int *fds);
+bool rc_listen_conflicts(int nfds, int fd);
+int rc_listen_lift(int *fds, int nfds, int fd);
+int rc_listen_child(int *fds, int nfds);
+
+#endif
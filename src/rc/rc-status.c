@@ -15,10 +15,18 @@
  *    except according to the terms contained in the LICENSE file.
  */
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "einfo.h"
@@ -34,7 +42,7 @@ enum format_t {
 
 const char *applet = NULL;
 const char *extraopts = NULL;
-const char *getoptstring = "acf:lmrsSu" getoptstring_COMMON;
+const char *getoptstring = "acf:lmrsSTuw" getoptstring_COMMON;
 const struct option longopts[] = {
 	{"all",         0, NULL, 'a'},
 	{"crashed",     0, NULL, 'c'},
@@ -44,7 +52,9 @@ const struct option longopts[] = {
 	{"runlevel",    0, NULL, 'r'},
 	{"servicelist", 0, NULL, 's'},
 	{"supervised", 0, NULL, 'S'},
+	{"timing",      0, NULL, 'T'},
 	{"unused",      0, NULL, 'u'},
+	{"watch",       0, NULL, 'w'},
 	longopts_COMMON
 };
 const char * const longopts_help[] = {
@@ -56,18 +66,23 @@ const char * const longopts_help[] = {
 	"Show the name of the current runlevel",
 	"Show service list",
 	"show supervised services",
+	"Show how long services took to start and stop",
 	"Show services not assigned to any runlevel",
+	"Then keep printing services as they change state",
 	longopts_help_COMMON
 };
 const char *usagestring = ""						\
 	"Usage: rc-status [options] -f ini <runlevel>...\n"		\
-	"   or: rc-status [options] [-a | -c | -l | -m | -r | -s | -u]";
+	"   or: rc-status [options] [-a | -c | -l | -m | -r | -s | -u]\n" \
+	"   or: rc-status [options] -w [-f ini] [<runlevel>...]";
 
 static RC_DEPTREE *deptree;
 static RC_STRINGLIST *types;
 
 static RC_STRINGLIST *levels, *services, *tmp, *alist;
-static RC_STRINGLIST *sservices, *nservices, *needsme;
+static RC_STRINGLIST *nservices, *needsme;
+static RC_STRINGSET *sservices;
+static RC_SERVICE_STATES *states;
 
 static void print_level(const char *prefix, const char *level,
 		enum format_t format)
@@ -92,9 +107,17 @@ static void print_level(const char *prefix, const char *level,
 	}
 }
 
+/* We look at the state of a lot of services, so read them all at once */
+static RC_SERVICE service_state(const char *service)
+{
+	if (!states)
+		states = rc_services_state_all();
+	return rc_services_state_get(states, service);
+}
+
 static char *get_uptime(const char *service)
 {
-	RC_SERVICE state = rc_service_state(service);
+	RC_SERVICE state = service_state(service);
 	char *start_count;
 	time_t now;
 	char *start_time_string;
@@ -140,15 +163,43 @@ static char *get_uptime(const char *service)
 	return uptime;
 }
 
+/* Summarise what the supervised children of a service have used */
+static char *get_usage(const char *service)
+{
+	char *value, *p, *q;
+	char *maxrss = NULL;
+	bool cpu = false;
+	char *usage = NULL;
+	double secs = 0;
+
+	if (!(value = rc_service_value_get(service, "rusage")))
+		return NULL;
+	p = value;
+	while ((q = strsep(&p, " "))) {
+		if (strncmp(q, "utime=", 6) == 0 ||
+		    strncmp(q, "stime=", 6) == 0)
+		{
+			secs += strtod(q + 6, NULL);
+			cpu = true;
+		} else if (strncmp(q, "maxrss=", 7) == 0)
+			maxrss = q + 7;
+	}
+	if (cpu && maxrss)
+		xasprintf(&usage, "cpu %.2fs rss %sK", secs, maxrss);
+	free(value);
+	return usage;
+}
+
 static void print_service(const char *service, enum format_t format)
 {
 	char *status = NULL;
 	char *uptime = NULL;
+	char *usage = NULL;
 	char *child_pid = NULL;
 	char *start_time = NULL;
 	int cols;
 	const char *c = ecolor(ECOLOR_GOOD);
-	RC_SERVICE state = rc_service_state(service);
+	RC_SERVICE state = service_state(service);
 	ECOLOR color = ECOLOR_BAD;
 
 	if (state & RC_SERVICE_STOPPING)
@@ -160,9 +211,7 @@ static void print_service(const char *service, enum format_t format)
 		xasprintf(&status, "inactive ");
 		color = ECOLOR_WARN;
 	} else if (state & RC_SERVICE_STARTED) {
-		errno = 0;
-		if (rc_service_daemons_crashed(service) && errno != EACCES)
-		{
+		if (state & RC_SERVICE_CRASHED) {
 			child_pid = rc_service_value_get(service, "child_pid");
 			start_time = rc_service_value_get(service, "start_time");
 			if (start_time && child_pid)
@@ -173,11 +222,16 @@ static void print_service(const char *service, enum format_t format)
 			free(start_time);
 		} else {
 			uptime = get_uptime(service);
-			if (uptime) {
+			usage = get_usage(service);
+			if (uptime && usage)
+				xasprintf(&status, " started %s %s", uptime,
+				    usage);
+			else if (uptime)
 				xasprintf(&status, " started %s", uptime);
-				free(uptime);
-			} else
+			else
 				xasprintf(&status, " started ");
+			free(uptime);
+			free(usage);
 			color = ECOLOR_GOOD;
 		}
 	} else if (state & RC_SERVICE_SCHEDULED) {
@@ -262,13 +316,367 @@ static void print_stacked_services(const char *runlevel, enum format_t format)
 	stackedlevels = NULL;
 }
 
+/* What print_service calls the state, without the details */
+static const char *state_name(RC_SERVICE state)
+{
+	if (state & RC_SERVICE_STOPPING)
+		return "stopping";
+	if (state & RC_SERVICE_STARTING)
+		return "starting";
+	if (state & RC_SERVICE_INACTIVE)
+		return "inactive";
+	if (state & RC_SERVICE_STARTED)
+		return state & RC_SERVICE_CRASHED ? "crashed" : "started";
+	if (state & RC_SERVICE_SCHEDULED)
+		return "scheduled";
+	if (state & RC_SERVICE_FAILED)
+		return "failed";
+	return "stopped";
+}
+
+#ifdef __linux__
+/*
+ * Watching services.
+ * Every state change adds or removes an entry in one of these, so
+ * inotify tells us which services to look at again without listing or
+ * polling anything. librc rewrites the state record only after the
+ * state directories, so watch that as well or we would read the old one.
+ */
+static const char *const watch_dirs[] = {
+	"started", "starting", "stopping", "inactive", "wasinactive",
+	"hotplugged", "failed", "state", NULL
+};
+
+#define WATCH_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+static int watch_fd = -1;
+static int watch_svcdir = -1;
+
+static bool is_watch_dir(const char *name)
+{
+	size_t i;
+
+	for (i = 0; watch_dirs[i]; i++)
+		if (strcmp(watch_dirs[i], name) == 0)
+			return true;
+	return false;
+}
+
+/* Before we print anything, so we miss nothing in between */
+static void watch_start(void)
+{
+	char path[PATH_MAX];
+	size_t i;
+
+	if ((watch_fd = inotify_init1(IN_CLOEXEC)) == -1)
+		eerrorx("%s: inotify_init1: %s", applet, strerror(errno));
+	/* A state directory may only be made once it is needed */
+	watch_svcdir = inotify_add_watch(watch_fd, RC_SVCDIR,
+	    IN_CREATE | IN_MOVED_TO);
+	if (watch_svcdir == -1)
+		eerrorx("%s: inotify_add_watch `%s': %s",
+		    applet, RC_SVCDIR, strerror(errno));
+	for (i = 0; watch_dirs[i]; i++) {
+		snprintf(path, sizeof(path), RC_SVCDIR "/%s", watch_dirs[i]);
+		inotify_add_watch(watch_fd, path, WATCH_MASK);
+	}
+	if (!states)
+		states = rc_services_state_all();
+}
+
+static void print_transition(const char *service, const char *from,
+		const char *to, enum format_t format)
+{
+	char stamp[16];
+	time_t now = time(NULL);
+
+	switch (format) {
+	case FORMAT_DEFAULT:
+		strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+		printf("%s %s: %s -> %s\n", stamp, service, from, to);
+		break;
+	case FORMAT_INI:
+		printf("%s = %s\n", service, to);
+		break;
+	}
+}
+
+/* Print each service whose state changes from what we last printed,
+ * until we are killed. If only is given, just the services in it. */
+static void watch_services(const RC_STRINGSET *only, enum format_t format)
+{
+	char buf[4096]
+	    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	char path[PATH_MAX];
+	RC_STRINGSET *seen = rc_stringset_new();
+	RC_STRINGLIST *changed;
+	RC_STRING *s;
+	RC_SERVICE from, to;
+	ssize_t len;
+	char *p;
+
+	if (format == FORMAT_INI)
+		printf("[watch]\n");
+	fflush(stdout);
+	for (;;) {
+		if ((len = read(watch_fd, buf, sizeof(buf))) == -1) {
+			if (errno == EINTR)
+				continue;
+			eerrorx("%s: read: %s", applet, strerror(errno));
+		}
+		/* Look at each service once for everything it did in one go */
+		changed = rc_stringlist_new();
+		for (p = buf; p < buf + len;
+		     p += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (const struct inotify_event *)p;
+			/* We lost events, so look at every service again */
+			if (ev->mask & IN_Q_OVERFLOW) {
+				rc_stringlist_free(changed);
+				changed = rc_services_in_runlevel(NULL);
+				break;
+			}
+			if (!ev->len || ev->name[0] == '.')
+				continue;
+			if (ev->wd == watch_svcdir) {
+				if (ev->mask & IN_ISDIR && is_watch_dir(ev->name)) {
+					snprintf(path, sizeof(path),
+					    RC_SVCDIR "/%s", ev->name);
+					inotify_add_watch(watch_fd, path,
+					    WATCH_MASK);
+				}
+				continue;
+			}
+			rc_stringlist_addu(changed, ev->name);
+		}
+		TAILQ_FOREACH(s, changed, entries) {
+			if (only && !rc_stringset_find(only, s->value))
+				continue;
+			if (rc_stringset_find(seen, s->value))
+				from = (RC_SERVICE)(intptr_t)
+				    rc_stringset_get(seen, s->value);
+			else
+				from = service_state(s->value);
+			to = rc_service_state(s->value);
+			rc_stringset_delete(seen, s->value);
+			rc_stringset_put(seen, s->value, (void *)(intptr_t)to);
+			if (strcmp(state_name(from), state_name(to)) != 0)
+				print_transition(s->value, state_name(from),
+				    state_name(to), format);
+		}
+		rc_stringlist_free(changed);
+		fflush(stdout);
+	}
+}
+#endif
+
+/*
+ * Boot timing report.
+ * openrc-run and rc append "time service action phase" lines to
+ * RC_TIMING as services are queued, have their dependencies ready, and
+ * begin and end running. We pair them up again here.
+ */
+#define TIMING_QUEUED	0
+#define TIMING_READY	1
+#define TIMING_BEGIN	2
+#define TIMING_END	3
+
+static const char *const timing_phases[] = {
+	"queued", "ready", "begin", "end", NULL
+};
+
+struct timing {
+	char *service;
+	bool stop;
+	long long t[4];
+};
+
+static struct timing *timings;
+static size_t ntimings;
+
+static void read_timing(void)
+{
+	FILE *fp;
+	char *line = NULL, *p, *when, *service, *action, *phase;
+	size_t len = 0, i;
+	struct timing *tm;
+	bool stop;
+	int ph;
+
+	if (!(fp = fopen(RC_TIMING, "r")))
+		return;
+	while (getline(&line, &len, fp) != -1) {
+		p = line;
+		when = strsep(&p, " ");
+		service = strsep(&p, " ");
+		action = strsep(&p, " ");
+		phase = strsep(&p, " \n");
+		if (!when || !service || !action || !phase)
+			continue;
+		for (ph = 0; timing_phases[ph]; ph++)
+			if (strcmp(phase, timing_phases[ph]) == 0)
+				break;
+		if (!timing_phases[ph])
+			continue;
+		stop = strcmp(action, "stop") == 0;
+
+		/* Carry on with the last run of the service unless it is
+		 * finished or already went past this phase */
+		tm = NULL;
+		for (i = ntimings; i > 0; i--)
+			if (timings[i - 1].stop == stop &&
+			    strcmp(timings[i - 1].service, service) == 0)
+			{
+				tm = &timings[i - 1];
+				break;
+			}
+		if (!tm || tm->t[TIMING_END] || tm->t[ph]) {
+			timings = xrealloc(timings,
+			    sizeof(*timings) * (ntimings + 1));
+			tm = &timings[ntimings++];
+			memset(tm, 0, sizeof(*tm));
+			tm->service = xstrdup(service);
+			tm->stop = stop;
+		}
+		tm->t[ph] = strtoll(when, NULL, 10);
+	}
+	free(line);
+	fclose(fp);
+}
+
+/* When we started waiting for the service */
+static long long timing_start(const struct timing *tm)
+{
+	if (tm->t[TIMING_QUEUED])
+		return tm->t[TIMING_QUEUED];
+	if (tm->t[TIMING_READY])
+		return tm->t[TIMING_READY];
+	return tm->t[TIMING_BEGIN];
+}
+
+/* The last time the service finished starting */
+static struct timing *timing_started(const char *service)
+{
+	size_t i;
+
+	for (i = ntimings; i > 0; i--)
+		if (!timings[i - 1].stop && timings[i - 1].t[TIMING_BEGIN] &&
+		    timings[i - 1].t[TIMING_END] &&
+		    strcmp(timings[i - 1].service, service) == 0)
+			return &timings[i - 1];
+	return NULL;
+}
+
+/*
+ * Follow what kept the last service to finish starting waiting: of
+ * everything it depends on, the one that finished last before it began.
+ */
+static void print_critical_path(long long base)
+{
+	RC_STRINGLIST *types_nwua, *list, *deps;
+	RC_STRING *s;
+	struct timing **path = NULL, *tm = NULL, *dep, *d;
+	char *level;
+	size_t i, n = 0;
+
+	for (i = 0; i < ntimings; i++)
+		if (!timings[i].stop && timings[i].t[TIMING_BEGIN] &&
+		    timings[i].t[TIMING_END] &&
+		    (!tm || timings[i].t[TIMING_END] > tm->t[TIMING_END]))
+			tm = &timings[i];
+	if (!tm)
+		return;
+
+	if (!deptree)
+		deptree = _rc_deptree_load(0, NULL);
+	types_nwua = rc_stringlist_new();
+	rc_stringlist_add(types_nwua, "ineed");
+	rc_stringlist_add(types_nwua, "iwant");
+	rc_stringlist_add(types_nwua, "iuse");
+	rc_stringlist_add(types_nwua, "iafter");
+	level = rc_runlevel_get();
+	while (tm) {
+		path = xrealloc(path, sizeof(*path) * (n + 1));
+		path[n++] = tm;
+		if (!deptree || n == ntimings)
+			break;
+		list = rc_stringlist_new();
+		rc_stringlist_add(list, tm->service);
+		deps = rc_deptree_depends(deptree, types_nwua, list, level,
+		    RC_DEP_START | RC_DEP_TRACE);
+		rc_stringlist_free(list);
+		dep = NULL;
+		TAILQ_FOREACH(s, deps, entries) {
+			if (strcmp(s->value, tm->service) == 0 ||
+			    !(d = timing_started(s->value)) ||
+			    d->t[TIMING_END] > tm->t[TIMING_BEGIN])
+				continue;
+			if (!dep || d->t[TIMING_END] > dep->t[TIMING_END])
+				dep = d;
+		}
+		rc_stringlist_free(deps);
+		tm = dep;
+	}
+	free(level);
+	rc_stringlist_free(types_nwua);
+
+	printf("Critical path: %.3fs\n",
+	    (double)(path[0]->t[TIMING_END] - base) / 1000000);
+	for (i = n; i > 0; i--)
+		printf(" %-30s %10.3fs %+10.3fs\n", path[i - 1]->service,
+		    (double)(path[i - 1]->t[TIMING_END] - base) / 1000000,
+		    (double)(path[i - 1]->t[TIMING_END] -
+			path[i - 1]->t[TIMING_BEGIN]) / 1000000);
+	free(path);
+}
+
+static int print_timing(void)
+{
+	struct timing *tm;
+	long long base = 0;
+	size_t i;
+
+	read_timing();
+	if (!ntimings) {
+		eerror("%s: no timing information in `%s'", applet, RC_TIMING);
+		return 1;
+	}
+	/* The trace may have been trimmed in the middle of a run */
+	for (i = 0; i < ntimings; i++)
+		if (timings[i].t[TIMING_BEGIN] &&
+		    (!base || timing_start(&timings[i]) < base))
+			base = timing_start(&timings[i]);
+
+	printf(" %-30s %-6s %11s %11s %11s\n",
+	    "Service", "Action", "At", "Wait", "Run");
+	for (i = 0; i < ntimings; i++) {
+		tm = &timings[i];
+		if (!tm->t[TIMING_BEGIN] || !tm->t[TIMING_END])
+			continue;
+		printf(" %-30s %-6s %10.3fs %10.3fs %10.3fs\n", tm->service,
+		    tm->stop ? "stop" : "start",
+		    (double)(timing_start(tm) - base) / 1000000,
+		    (double)(tm->t[TIMING_BEGIN] - timing_start(tm)) / 1000000,
+		    (double)(tm->t[TIMING_END] - tm->t[TIMING_BEGIN]) / 1000000);
+	}
+	print_critical_path(base);
+
+	for (i = 0; i < ntimings; i++)
+		free(timings[i].service);
+	free(timings);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	RC_SERVICE state;
 	RC_STRING *s, *l, *t, *level;
+	RC_STRINGSET *watch_only = NULL;
 	enum format_t format = FORMAT_DEFAULT;
 	bool levels_given = false;
 	bool show_all = false;
+	bool watch = false;
 	char *p, *runlevel = NULL;
 	int opt, retval = 0;
 
@@ -315,7 +723,7 @@ int main(int argc, char **argv)
 					}
 			}
 			TAILQ_FOREACH_SAFE(s, services, entries, t)
-				if (rc_service_state(s->value) &
+				if (service_state(s->value) &
 					(RC_SERVICE_STOPPED | RC_SERVICE_HOTPLUGGED)) {
 					TAILQ_REMOVE(services, s, entries);
 					free(s->value);
@@ -336,6 +744,10 @@ int main(int argc, char **argv)
 			print_services(NULL, services, FORMAT_DEFAULT);
 			goto exit;
 			/* NOTREACHED */
+		case 'T':
+			retval = print_timing();
+			goto exit;
+			/* NOTREACHED */
 		case 's':
 			services = rc_services_in_runlevel(NULL);
 			print_services(NULL, services, FORMAT_DEFAULT);
@@ -356,6 +768,9 @@ int main(int argc, char **argv)
 			print_services(NULL, services, FORMAT_DEFAULT);
 			goto exit;
 			/* NOTREACHED */
+		case 'w':
+			watch = true;
+			break;
 
 		case_RC_COMMON_GETOPT
 		}
@@ -378,6 +793,26 @@ int main(int argc, char **argv)
 		rc_stringlist_add(levels, runlevel);
 	}
 
+#ifdef __linux__
+	if (watch) {
+		watch_start();
+		/* Only what is in the runlevels we were asked about */
+		if (levels_given && !show_all) {
+			watch_only = rc_stringset_new();
+			TAILQ_FOREACH(l, levels, entries) {
+				nservices = rc_services_in_runlevel_stacked(l->value);
+				TAILQ_FOREACH(s, nservices, entries)
+					rc_stringset_add(watch_only, s->value);
+				rc_stringlist_free(nservices);
+			}
+			nservices = NULL;
+		}
+	}
+#else
+	if (watch)
+		eerrorx("%s: --watch needs inotify", applet);
+#endif
+
 	/* Output the services in the order in which they would start */
 	deptree = _rc_deptree_load(0, NULL);
 
@@ -411,15 +846,17 @@ int main(int argc, char **argv)
 		rc_stringlist_add(levels, RC_LEVEL_SYSINIT);
 		rc_stringlist_add(levels, RC_LEVEL_BOOT);
 		services = rc_services_in_runlevel(NULL);
-		sservices = rc_stringlist_new();
+		sservices = rc_stringset_new();
 		TAILQ_FOREACH(l, levels, entries) {
 			nservices = rc_services_in_runlevel_stacked(l->value);
-			TAILQ_CONCAT(sservices, nservices, entries);
-			free(nservices);
+			TAILQ_FOREACH(s, nservices, entries)
+				rc_stringset_put(sservices, s->value, NULL);
+			rc_stringlist_free(nservices);
+			nservices = NULL;
 		}
 		TAILQ_FOREACH_SAFE(s, services, entries, t) {
-			state = rc_service_state(s->value);
-			if ((rc_stringlist_find(sservices, s->value) ||
+			state = service_state(s->value);
+			if ((rc_stringset_find(sservices, s->value) ||
 			    (state & ( RC_SERVICE_STOPPED | RC_SERVICE_HOTPLUGGED)))) {
 				if (! (state & RC_SERVICE_FAILED)) {
 					TAILQ_REMOVE(services, s, entries);
@@ -459,16 +896,23 @@ int main(int argc, char **argv)
 		print_services(NULL, services, format);
 	}
 
+#ifdef __linux__
+	if (watch)
+		watch_services(watch_only, format);
+#endif
+
 exit:
 	free(runlevel);
 	rc_stringlist_free(alist);
 	rc_stringlist_free(needsme);
-	rc_stringlist_free(sservices);
+	rc_stringset_free(sservices);
+	rc_stringset_free(watch_only);
 	rc_stringlist_free(nservices);
 	rc_stringlist_free(services);
 	rc_stringlist_free(types);
 	rc_stringlist_free(levels);
 	rc_deptree_free(deptree);
+	rc_services_state_free(states);
 
 	return retval;
 }
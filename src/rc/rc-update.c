@@ -162,6 +162,7 @@ static void
 show(RC_STRINGLIST *runlevels, bool verbose)
 {
 	RC_STRINGLIST *services = rc_services_in_runlevel(NULL);
+	RC_RUNLEVEL_MEMBERS *members = rc_runlevel_members(runlevels);
 	RC_STRING *service;
 	RC_STRING *runlevel;
 	RC_STRINGLIST *in;
@@ -169,14 +170,13 @@ show(RC_STRINGLIST *runlevels, bool verbose)
 	char *buffer = NULL;
 	size_t l;
 
-	rc_stringlist_sort(&services);
 	TAILQ_FOREACH(service, services, entries) {
 		in = rc_stringlist_new();
 		inone = false;
 
 		TAILQ_FOREACH(runlevel, runlevels, entries) {
-			if (rc_service_in_runlevel(service->value,
-				runlevel->value))
+			if (rc_runlevel_members_has(members, runlevel->value,
+				service->value))
 			{
 				rc_stringlist_add(in, runlevel->value);
 				inone = true;
@@ -199,6 +199,7 @@ show(RC_STRINGLIST *runlevels, bool verbose)
 		rc_stringlist_free(in);
 	}
 
+	rc_runlevel_members_free(members);
 	rc_stringlist_free (services);
 }
 
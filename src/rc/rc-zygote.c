@@ -0,0 +1,421 @@
+/*
+ * rc-zygote.c
+ * rc can keep a shell around that has already loaded everything
+ * openrc-run.sh needs before it gets to the service. openrc-run then asks
+ * it for a copy instead of starting a shell of its own for every action.
+ * The copy finds our stdin, stdout and stderr through /proc, so this is
+ * Linux only. It has no other file descriptors of ours, and it has the
+ * umask, limits, directory and security context of rc, so openrc-run
+ * runs the service itself when it passes sockets on or when any of
+ * those differ. Anything that goes wrong before the service runs just
+ * means openrc-run runs it the usual way.
+ */
+
+/*
+ * Copyright (c) 2018 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "helpers.h"
+#include "rc.h"
+#include "rc-zygote.h"
+
+#define ZYGOTE_DIR	RC_SVCDIR "/zygote"
+/* How long we wait for the zygote before checking it is still there */
+#define ZYGOTE_CHECK	1000
+
+extern char **environ;
+
+static char *zygote_fifo;
+static char *zygote_ctx;
+static pid_t zygote_pid;
+static pid_t zygote_owner;	/* only the rc that started it stops it */
+
+/* The same script openrc-run would run itself */
+const char *rc_zygote_script(void)
+{
+	if (exists(RC_SVCDIR "/openrc-run.sh"))
+		return RC_SVCDIR "/openrc-run.sh";
+	return RC_LIBEXECDIR "/sh/openrc-run.sh";
+}
+
+#ifdef __linux__
+/* What a process inherits besides its environment and files, as a line
+ * we can compare. */
+static char *
+zygote_context(void)
+{
+	char *ctx = NULL, cwd[PATH_MAX], label[256];
+	size_t len = 0;
+	ssize_t bytes;
+	struct rlimit rl;
+	mode_t mask;
+	FILE *fp;
+	int fd, i;
+
+	if (!(fp = open_memstream(&ctx, &len)))
+		return NULL;
+	mask = umask(0);
+	umask(mask);
+	fprintf(fp, "%04o %s", (unsigned int)mask,
+	    getcwd(cwd, sizeof(cwd)) ? cwd : "-");
+	for (i = 0; i < RLIM_NLIMITS; i++) {
+		if (getrlimit(i, &rl) == -1)
+			fputs(" -", fp);
+		else
+			fprintf(fp, " %ju:%ju", (uintmax_t)rl.rlim_cur,
+			    (uintmax_t)rl.rlim_max);
+	}
+	bytes = 0;
+	if ((fd = open("/proc/self/attr/current", O_RDONLY | O_CLOEXEC)) != -1) {
+		bytes = read(fd, label, sizeof(label) - 1);
+		close(fd);
+	}
+	label[bytes > 0 ? bytes : 0] = '\0';
+	label[strcspn(label, "\n")] = '\0';
+	fprintf(fp, " %s\n", label);
+	fclose(fp);
+	return ctx;
+}
+
+/* Does our context match the one rc gave the zygote? */
+static bool
+zygote_same_context(const char *fifo)
+{
+	char *file, *ctx = NULL, *ours;
+	size_t len;
+	bool same;
+
+	xasprintf(&file, "%s.context", fifo);
+	same = rc_getfile(file, &ctx, &len);
+	free(file);
+	if (!same)
+		return false;
+	ours = zygote_context();
+	same = ours && strcmp(ctx, ours) == 0;
+	free(ours);
+	free(ctx);
+	return same;
+}
+#endif
+
+/* Start the zygote and point the services we run at it */
+pid_t rc_zygote_start(void)
+{
+#ifdef __linux__
+	const char *names[] = { "PATH", "RC_LIBEXECDIR", "RC_SYS", NULL };
+	char *envp[4];
+	const char *script = rc_zygote_script();
+	const char *value;
+	char *fifo, *ctx, *file;
+	FILE *fp;
+	pid_t pid;
+	int fd, i, n;
+	bool ok;
+
+	if (mkdir(ZYGOTE_DIR, 0700) == -1 && errno != EEXIST)
+		return -1;
+	xasprintf(&fifo, ZYGOTE_DIR "/rc.%d", (int)getpid());
+	unlink(fifo);
+	if (mkfifo(fifo, 0600) == -1) {
+		free(fifo);
+		return -1;
+	}
+	/* openrc-run only asks for a copy if it would run the same */
+	xasprintf(&file, "%s.context", fifo);
+	ok = false;
+	if ((ctx = zygote_context()) && (fp = fopen(file, "we"))) {
+		fputs(ctx, fp);
+		ok = fclose(fp) == 0;
+	}
+	free(ctx);
+
+	if (!ok || (pid = fork()) == -1) {
+		unlink(file);
+		unlink(fifo);
+		free(file);
+		free(fifo);
+		return -1;
+	}
+	if (pid == 0) {
+		/* rc waits for its process group between runlevels */
+		setpgid(0, 0);
+		/* Each copy gets the environment of the openrc-run that
+		 * asked for it, so we only need what the libraries look at
+		 * while they load */
+		for (i = n = 0; names[i]; i++)
+			if ((value = getenv(names[i])))
+				xasprintf(&envp[n++], "%s=%s", names[i], value);
+		envp[n] = NULL;
+		if ((fd = open("/dev/null", O_RDWR)) != -1) {
+			dup2(fd, STDIN_FILENO);
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		for (i = getdtablesize() - 1; i >= 3; --i)
+			close(i);
+		execle(script, script, "--zygote", fifo, (char *)NULL, envp);
+		_exit(EXIT_FAILURE);
+	}
+
+	zygote_fifo = fifo;
+	zygote_ctx = file;
+	zygote_pid = pid;
+	zygote_owner = getpid();
+	setenv("RC_ZYGOTE", fifo, 1);
+	return pid;
+#else
+	return -1;
+#endif
+}
+
+/* Copies already made carry on without it */
+void rc_zygote_stop(void)
+{
+	if (zygote_pid <= 0 || zygote_owner != getpid())
+		return;
+	kill(zygote_pid, SIGTERM);
+	unlink(zygote_fifo);
+	unlink(zygote_ctx);
+	free(zygote_fifo);
+	free(zygote_ctx);
+	zygote_fifo = NULL;
+	zygote_ctx = NULL;
+	zygote_pid = 0;
+	unsetenv("RC_ZYGOTE");
+}
+
+static void
+zygote_quote(FILE *fp, const char *s)
+{
+	fputc('\'', fp);
+	for (; *s; s++) {
+		if (*s == '\'')
+			fputs("'\\''", fp);
+		else
+			fputc(*s, fp);
+	}
+	fputc('\'', fp);
+}
+
+/* The shell keeps these to itself */
+static bool
+zygote_exportable(const char *var, size_t len)
+{
+	static const char *const own[] = {
+		"IFS", "OLDPWD", "PPID", "PWD", "SHLVL", "_", NULL
+	};
+	size_t i;
+
+	if (len == 0 || !(var[0] == '_' || isalpha((unsigned char)var[0])))
+		return false;
+	for (i = 1; i < len; i++)
+		if (!(var[i] == '_' || isalnum((unsigned char)var[i])))
+			return false;
+	if (len > 4 && strncmp(var, "BASH", 4) == 0)
+		return false;
+	for (i = 0; own[i]; i++)
+		if (strlen(own[i]) == len && strncmp(var, own[i], len) == 0)
+			return false;
+	return true;
+}
+
+/* Everything the copy needs to become what our own shell would be */
+static bool
+zygote_request(const char *file, const char *service, const char *arg1,
+    const char *arg2, int outfd)
+{
+	char **env;
+	const char *eq;
+	FILE *fp;
+	int pid = (int)getpid();
+
+	if (!(fp = fopen(file, "w")))
+		return false;
+	for (env = environ; *env; env++) {
+		if (!(eq = strchr(*env, '=')) ||
+		    !zygote_exportable(*env, (size_t)(eq - *env)))
+			continue;
+		fprintf(fp, "export %.*s=", (int)(eq - *env), *env);
+		zygote_quote(fp, eq + 1);
+		fputc('\n', fp);
+	}
+	fprintf(fp, "_zy_in=/proc/%d/fd/%d\n", pid, STDIN_FILENO);
+	fprintf(fp, "_zy_out=/proc/%d/fd/%d\n", pid,
+	    outfd >= 0 ? outfd : STDOUT_FILENO);
+	fprintf(fp, "_zy_err=/proc/%d/fd/%d\n", pid,
+	    outfd >= 0 ? outfd : STDERR_FILENO);
+	fputs("set -- ", fp);
+	zygote_quote(fp, service);
+	fputc(' ', fp);
+	zygote_quote(fp, arg1);
+	if (arg2) {
+		fputc(' ', fp);
+		zygote_quote(fp, arg2);
+	}
+	fputc('\n', fp);
+	return fclose(fp) == 0;
+}
+
+/* Write a line to the zygote, which is gone if nobody reads the fifo */
+static bool
+zygote_tell(const char *fifo, const char *line)
+{
+	int fd;
+	ssize_t len = (ssize_t)strlen(line);
+	bool ok;
+
+	if ((fd = open(fifo, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) == -1)
+		return false;
+	ok = write(fd, line, (size_t)len) == len;
+	close(fd);
+	return ok;
+}
+
+/*
+ * Ask the zygote for a shell to run service arg1 arg2 as openrc-run.sh
+ * would, writing to outfd or our own stdout and stderr.
+ * Returns the fd to hand to rc_zygote_wait with the pid of the shell in
+ * pid, or -1 if we have to run it ourselves.
+ */
+int rc_zygote_spawn(const char *service, const char *arg1, const char *arg2,
+    int outfd, pid_t *pid)
+{
+#ifdef __linux__
+	const char *fifo = getenv("RC_ZYGOTE");
+	const char *slash;
+	char *req = NULL, *env = NULL, *status = NULL;
+	char buf[32];
+	struct stat st;
+	struct pollfd pfd;
+	size_t len = 0;
+	ssize_t bytes;
+	int fd = -1, missed = 0;
+	long value;
+	char *end;
+
+	if (!fifo || !(slash = strrchr(fifo, '/')) ||
+	    stat(fifo, &st) == -1 || !S_ISFIFO(st.st_mode) ||
+	    st.st_uid != geteuid())
+		return -1;
+	/* The copy cannot have the sockets we pass on, nor anything else
+	 * rc did not give the zygote */
+	if (getenv("RC_LISTEN_FDS") || !zygote_same_context(fifo))
+		return -1;
+
+	xasprintf(&req, "%.*s/%d", (int)(slash - fifo), fifo, (int)getpid());
+	xasprintf(&env, "%s.env", req);
+	xasprintf(&status, "%s.status", req);
+	unlink(status);
+	if (mkfifo(status, 0600) == -1 ||
+	    (fd = open(status, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) == -1 ||
+	    !zygote_request(env, service, arg1, arg2, outfd))
+		goto fail;
+	snprintf(buf, sizeof(buf), "%d\n", (int)getpid());
+	if (!zygote_tell(fifo, buf))
+		goto fail;
+
+	/* The copy tells us who runs the service once it is all set up.
+	 * If it closes the fifo first, the service never ran.
+	 * We read a byte at a time so the status stays for rc_zygote_wait. */
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (len < sizeof(buf) - 1) {
+		switch (poll(&pfd, 1, ZYGOTE_CHECK)) {
+		case -1:
+			if (errno == EINTR)
+				continue;
+			goto fail;
+		case 0:
+			/* No copy yet, so see if the zygote is still there */
+			if (!zygote_tell(fifo, "") && ++missed == 2)
+				goto fail;
+			continue;
+		}
+		bytes = read(fd, buf + len, 1);
+		if (bytes == -1 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (bytes <= 0)
+			goto fail;
+		if (buf[len++] == '\n')
+			break;
+	}
+	buf[len] = '\0';
+	errno = 0;
+	value = strtol(buf, &end, 10);
+	if (errno || value <= 0 || *end != '\n')
+		goto fail;
+	*pid = (pid_t)value;
+
+	unlink(env);
+	unlink(status);
+	free(req);
+	free(env);
+	free(status);
+	return fd;
+
+fail:
+	if (fd != -1)
+		close(fd);
+	unlink(env);
+	unlink(status);
+	free(req);
+	free(env);
+	free(status);
+#else
+	(void)service;
+	(void)arg1;
+	(void)arg2;
+	(void)outfd;
+	(void)pid;
+#endif
+	return -1;
+}
+
+/* How the service went, as a shell would say */
+int rc_zygote_wait(int fd)
+{
+	char buf[32];
+	size_t len = 0;
+	ssize_t bytes;
+	int flags, ret = EXIT_FAILURE;
+
+	if ((flags = fcntl(fd, F_GETFL)) != -1)
+		fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+	while (len < sizeof(buf) - 1) {
+		bytes = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			break;
+		len += (size_t)bytes;
+	}
+	buf[len] = '\0';
+	if (len)
+		sscanf(buf, "%d", &ret);
+	close(fd);
+	return ret;
+}
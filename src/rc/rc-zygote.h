@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2018 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#ifndef RC_ZYGOTE_H
+#define RC_ZYGOTE_H
+
+#include <sys/types.h>
+
+const char *rc_zygote_script(void);
+pid_t rc_zygote_start(void);
+void rc_zygote_stop(void);
+int rc_zygote_spawn(const char *service, const char *arg1, const char *arg2,
+    int outfd, pid_t *pid);
+int rc_zygote_wait(int fd);
+
+#endif
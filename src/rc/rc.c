@@ -32,9 +32,11 @@ static const char rc_copyright[] = "Copyright (c) 2007-2008 Roy Marples";
 #include <errno.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <limits.h>
+#include <poll.h>
 #include <pwd.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -48,16 +50,20 @@ static const char rc_copyright[] = "Copyright (c) 2007-2008 Roy Marples";
 #include "einfo.h"
 #include "queue.h"
 #include "rc.h"
+#include "rc-hotplug.h"
 #include "rc-logger.h"
 #include "rc-misc.h"
 #include "rc-plugin.h"
+#include "rc-readahead.h"
+#include "rc-zygote.h"
 
 #include "version.h"
 #include "_usage.h"
 
 const char *extraopts = NULL;
-const char *getoptstring = "a:no:s:S" getoptstring_COMMON;
+const char *getoptstring = "a:Hno:s:S" getoptstring_COMMON;
 const struct option longopts[] = {
+	{ "hotplug",     0, NULL, 'H' },
 	{ "no-stop", 0, NULL, 'n' },
 	{ "override",    1, NULL, 'o' },
 	{ "service",     1, NULL, 's' },
@@ -65,6 +71,7 @@ const struct option longopts[] = {
 	longopts_COMMON
 };
 const char * const longopts_help[] = {
+	"start the services queued as they were hotplugged",
 	"do not stop any services",
 	"override the next runlevel to change into\n"
 	"when leaving single user or boot runlevels",
@@ -89,6 +96,9 @@ static RC_STRINGLIST *main_start_services;
 static RC_STRINGLIST *main_types_nw;
 static RC_STRINGLIST *main_types_nwua;
 static RC_DEPTREE *main_deptree;
+static RC_SERVICE_STATES *main_states;
+static bool procs_snapshot;
+static bool hotplugging;
 static char *runlevel;
 static RC_HOOK hook_out;
 
@@ -96,6 +106,9 @@ struct termios *termios_orig = NULL;
 
 RC_PIDLIST service_pids;
 
+/* SIGCHLD writes the pid of every reaped child here while we schedule */
+static int child_pipe[2] = { -1, -1 };
+
 static void
 clean_failed(void)
 {
@@ -116,6 +129,11 @@ clean_failed(void)
 				eerror("%s: unlink `%s': %s",
 				    applet, path, strerror(errno));
 			free(path);
+
+			/* The recorded state is now out of date */
+			xasprintf(&path, RC_SVCDIR_STATE "/%s", d->d_name);
+			unlink(path);
+			free(path);
 		}
 		closedir(dp);
 	}
@@ -134,6 +152,7 @@ cleanup(void)
 			rc_plugin_run(hook_out, runlevel);
 
 		rc_plugin_unload();
+		rc_zygote_stop();
 
 		if (termios_orig) {
 			tcsetattr(STDIN_FILENO, TCSANOW, termios_orig);
@@ -144,6 +163,8 @@ cleanup(void)
 		rmdir(RC_STARTING);
 		rmdir(RC_STOPPING);
 		clean_failed();
+		if (procs_snapshot)
+			rc_proc_snapshot_end();
 		rc_logger_close();
 	}
 
@@ -159,6 +180,7 @@ cleanup(void)
 	rc_stringlist_free(main_types_nw);
 	rc_stringlist_free(main_types_nwua);
 	rc_deptree_free(main_deptree);
+	rc_services_state_free(main_states);
 	free(runlevel);
 }
 
@@ -394,18 +416,16 @@ handle_signal(int sig)
 
 	switch (sig) {
 	case SIGCHLD:
-		do {
-			pid = waitpid(-1, &status, WNOHANG);
-			if (pid < 0) {
-				if (errno != ECHILD)
-					eerror("waitpid: %s", strerror(errno));
-				return;
-			}
-		} while (!WIFEXITED(status) && !WIFSIGNALED(status));
-
-		/* Remove that pid from our list */
-		if (pid > 0)
+		/* Signals merge, so reap everything that has exited */
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			/* Remove that pid from our list */
 			remove_pid(pid);
+			if (child_pipe[1] != -1 &&
+			    write(child_pipe[1], &pid, sizeof(pid)) == -1)
+				break;
+		}
+		if (pid == -1 && errno != ECHILD)
+			eerror("waitpid: %s", strerror(errno));
 		break;
 
 	case SIGWINCH:
@@ -459,6 +479,11 @@ do_sysinit()
 {
 	struct utsname uts;
 	const char *sys;
+	bool readahead = rc_conf_yesno("rc_readahead");
+
+	/* Get the files the last boot needed coming in from disk */
+	if (readahead)
+		rc_readahead_start();
 
 	/* exec init-early.sh if it exists
 	 * This should just setup the console to use the correct
@@ -492,6 +517,10 @@ do_sysinit()
 	setenv("RC_RUNLEVEL", RC_LEVEL_SYSINIT, 1);
 	run_program(INITSH);
 
+	/* Now RC_SVCDIR is there, note what this boot needs for the next */
+	if (readahead)
+		rc_readahead_record_begin();
+
 	/* init may have mounted /proc so we can now detect or real
 	 * sys */
 	if ((sys = rc_sys()))
@@ -517,17 +546,32 @@ runlevel_config(const char *service, const char *level)
 	return retval;
 }
 
+/* Look the service up in the snapshot we took of all of them.
+ * Services in one of the settled states stay that way while we stop or
+ * start the others, so only the rest need checking again. */
+static RC_SERVICE
+service_state(const char *service, RC_SERVICE settled)
+{
+	RC_SERVICE state = rc_services_state_get(main_states, service);
+
+	if (state & settled)
+		return state;
+	return rc_service_state(service);
+}
+
+static bool schedule_stop(const RC_STRINGLIST *stop_services);
+
 static void
-do_stop_services(RC_STRINGLIST *types_nw, RC_STRINGLIST *start_services,
+do_stop_services(RC_STRINGLIST *types_nw, const RC_STRINGLIST *start_services,
 				 const RC_STRINGLIST *stop_services, const RC_DEPTREE *deptree,
 				 const char *newlevel, bool parallel, bool going_down)
 {
 	pid_t pid;
-	RC_STRING *service, *svc1, *svc2;
-	RC_STRINGLIST *deporder, *tmplist, *kwords;
+	RC_STRING *service, *svc;
+	RC_STRINGLIST *deporder, *tmplist, *kwords, *stopping;
 	RC_SERVICE state;
-	RC_STRINGLIST *nostop;
-	bool crashed, nstop;
+	RC_STRINGSET *nostop, *starting;
+	bool crashed, nstop, start;
 
 	if (!types_nw) {
 		types_nw = rc_stringlist_new();
@@ -537,15 +581,25 @@ do_stop_services(RC_STRINGLIST *types_nw, RC_STRINGLIST *start_services,
 
 	crashed = rc_conf_yesno("rc_crashed_stop");
 
-	nostop = rc_stringlist_split(rc_conf_value("rc_nostop"), " ");
+	tmplist = rc_stringlist_split(rc_conf_value("rc_nostop"), " ");
+	nostop = rc_stringset_from_list(tmplist);
+	rc_stringlist_free(tmplist);
+	/* Checked against for every service we could stop, and every
+	 * service those are needed by */
+	starting = rc_stringset_from_list(start_services);
+	/* In parallel we work out what to stop first, then let
+	 * schedule_stop order it */
+	stopping = rc_stringlist_new();
+	main_states = rc_services_state_all();
 	TAILQ_FOREACH_REVERSE(service, stop_services, rc_stringlist, entries)
 	{
-		state = rc_service_state(service->value);
+		state = service_state(service->value,
+		    RC_SERVICE_STOPPED | RC_SERVICE_FAILED);
 		if (state & RC_SERVICE_STOPPED || state & RC_SERVICE_FAILED)
 			continue;
 
 		/* Sometimes we don't ever want to stop a service. */
-		if (rc_stringlist_find(nostop, service->value)) {
+		if (rc_stringset_find(nostop, service->value)) {
 			rc_service_mark(service->value, RC_SERVICE_FAILED);
 			continue;
 		}
@@ -571,8 +625,8 @@ do_stop_services(RC_STRINGLIST *types_nw, RC_STRINGLIST *start_services,
 			goto stop;
 
 		/* If we're in the start list then don't bother stopping us */
-		svc1 = rc_stringlist_find(start_services, service->value);
-		if (svc1) {
+		start = rc_stringset_find(starting, service->value);
+		if (start) {
 			if (newlevel && strcmp(runlevel, newlevel) != 0) {
 				/* So we're in the start list. But we should
 				 * be stopped if we have a runlevel
@@ -588,103 +642,523 @@ do_stop_services(RC_STRINGLIST *types_nw, RC_STRINGLIST *start_services,
 
 		/* We got this far. Last check is to see if any any service
 		 * that going to be started depends on us */
-		if (!svc1) {
+		if (!start) {
 			tmplist = rc_stringlist_new();
 			rc_stringlist_add(tmplist, service->value);
 			deporder = rc_deptree_depends(deptree, types_nw,
 			    tmplist, newlevel ? newlevel : runlevel,
 			    RC_DEP_STRICT | RC_DEP_TRACE);
 			rc_stringlist_free(tmplist);
-			svc2 = NULL;
-			TAILQ_FOREACH(svc1, deporder, entries) {
-				svc2 = rc_stringlist_find(start_services,
-				    svc1->value);
-				if (svc2)
+			TAILQ_FOREACH(svc, deporder, entries)
+				if (rc_stringset_find(starting, svc->value))
 					break;
-			}
 			rc_stringlist_free(deporder);
 
-			if (svc2)
+			if (svc)
 				continue;
 		}
 
 stop:
+		if (parallel) {
+			rc_stringlist_add(stopping, service->value);
+			continue;
+		}
 		/* After all that we can finally stop the blighter! */
+		timing_mark(service->value, "stop", "queued");
 		pid = service_stop(service->value);
 		if (pid > 0) {
 			add_pid(pid);
-			if (!parallel) {
-				rc_waitpid(pid);
-				remove_pid(pid);
+			rc_waitpid(pid);
+			remove_pid(pid);
+		}
+	}
+
+	rc_services_state_free(main_states);
+	main_states = NULL;
+	if (parallel && !schedule_stop(stopping)) {
+		/* Then all at once, and openrc-run orders them */
+		TAILQ_FOREACH(service, stopping, entries) {
+			timing_mark(service->value, "stop", "queued");
+			pid = service_stop(service->value);
+			if (pid > 0)
+				add_pid(pid);
+		}
+	}
+	rc_stringlist_free(stopping);
+	rc_stringset_free(starting);
+	rc_stringset_free(nostop);
+}
+
+/* Work out if we should start the service, asking the user if we are
+ * interactive */
+static bool
+want_start(const char *service, bool crashed, bool *interactive)
+{
+	RC_SERVICE state;
+
+	state = service_state(service, RC_SERVICE_STARTED |
+	    RC_SERVICE_STARTING | RC_SERVICE_INACTIVE | RC_SERVICE_FAILED);
+	if (state & RC_SERVICE_FAILED)
+		return false;
+	if (!(state & RC_SERVICE_STOPPED)) {
+		if (crashed && rc_service_daemons_crashed(service))
+			rc_service_mark(service, RC_SERVICE_STOPPED);
+		else
+			return false;
+	}
+	if (!*interactive)
+		*interactive = want_interactive();
+
+	if (*interactive) {
+interactive_retry:
+		printf("\n");
+		einfo("About to start the service %s", service);
+		eindent();
+		einfo("1) Start the service\t\t2) Skip the service");
+		einfo("3) Continue boot process\t\t4) Exit to shell");
+		eoutdent();
+interactive_option:
+		switch (read_key(true)) {
+		case '1': break;
+		case '2': return false;
+		case '3': *interactive = false; break;
+		case '4': open_shell(); goto interactive_retry;
+		default: goto interactive_option;
+		}
+	}
+	return true;
+}
+
+static size_t
+parallel_jobs(void)
+{
+	const char *value = rc_conf_value("rc_parallel_jobs");
+	char *end;
+	long jobs;
+
+	if (!value || !*value)
+		return 0;
+	errno = 0;
+	jobs = strtol(value, &end, 10);
+	if (errno != 0 || *end != '\0' || jobs < 0) {
+		eerror("%s: invalid rc_parallel_jobs `%s'", applet, value);
+		return 0;
+	}
+	return (size_t)jobs;
+}
+
+/* A service waiting to be started in parallel */
+typedef struct job {
+	const char *service;
+	pid_t pid;
+	bool queued;
+	bool listens;		/* it has sockets to open for its daemon */
+	bool listening;		/* and they are open */
+	size_t pending;
+	size_t *next;
+	size_t nnext;
+	size_t *early;		/* these only need its sockets */
+	size_t nearly;
+} JOB;
+
+/* Work out which services in the list each one has to wait for.
+ * Every service it depends on which we also start is an edge, so the
+ * service only becomes ready once all of those are done.
+ * A service with sockets to listen on is done with as far as its
+ * dependents go once openrc-run has opened them.
+ * When stopping the edges go the other way, so a service only becomes
+ * ready once everything depending on it has stopped. */
+static JOB *
+build_jobs(const RC_STRINGLIST *start_services, const char *level,
+    int options, bool stopping, size_t *njobs)
+{
+	RC_STRINGLIST *one, *deps;
+	RC_STRINGSET *byname;
+	RC_STRING *s;
+	JOB *jobs, *dep;
+	size_t i, n = 0;
+
+	TAILQ_FOREACH(s, start_services, entries)
+		n++;
+	jobs = xmalloc(sizeof(*jobs) * (n ? n : 1));
+	byname = rc_stringset_new();
+	i = 0;
+	TAILQ_FOREACH(s, start_services, entries) {
+		/* If a service is listed twice, the first job is the one waited on */
+		if (!rc_stringset_find(byname, s->value))
+			rc_stringset_put(byname, s->value, &jobs[i]);
+		jobs[i].service = s->value;
+		jobs[i].pid = 0;
+		jobs[i].queued = false;
+		jobs[i].listens = false;
+		if (!stopping) {
+			deps = rc_deptree_depend(main_deptree, s->value,
+			    "listen");
+			jobs[i].listens = TAILQ_FIRST(deps) != NULL;
+			rc_stringlist_free(deps);
+		}
+		jobs[i].listening = false;
+		jobs[i].pending = 0;
+		jobs[i].next = NULL;
+		jobs[i].nnext = 0;
+		jobs[i].early = NULL;
+		jobs[i].nearly = 0;
+		i++;
+	}
+
+	one = rc_stringlist_new();
+	for (i = 0; i < n; i++) {
+		rc_stringlist_add(one, jobs[i].service);
+		deps = rc_deptree_depends(main_deptree, main_types_nwua, one,
+		    level, options);
+		TAILQ_FOREACH(s, deps, entries) {
+			dep = rc_stringset_get(byname, s->value);
+			if (!dep || dep == &jobs[i])
+				continue;
+			if (stopping) {
+				jobs[i].next = xrealloc(jobs[i].next,
+				    sizeof(*jobs[i].next) * (jobs[i].nnext + 1));
+				jobs[i].next[jobs[i].nnext++] = dep - jobs;
+				dep->pending++;
+				continue;
 			}
+			if (dep->listens) {
+				dep->early = xrealloc(dep->early,
+				    sizeof(*dep->early) * (dep->nearly + 1));
+				dep->early[dep->nearly++] = i;
+			} else {
+				dep->next = xrealloc(dep->next,
+				    sizeof(*dep->next) * (dep->nnext + 1));
+				dep->next[dep->nnext++] = i;
+			}
+			jobs[i].pending++;
 		}
+		rc_stringlist_free(deps);
+		rc_stringlist_delete(one, jobs[i].service);
 	}
+	rc_stringlist_free(one);
+	rc_stringset_free(byname);
+
+	*njobs = n;
+	return jobs;
+}
+static void
+release_jobs(JOB *jobs, const size_t *next, size_t nnext, size_t *ready,
+    size_t *tail)
+{
+	size_t j;
 
-	rc_stringlist_free(nostop);
+	for (j = 0; j < nnext; j++) {
+		if (--jobs[next[j]].pending == 0 && !jobs[next[j]].queued) {
+			jobs[next[j]].queued = true;
+			ready[(*tail)++] = next[j];
+		}
+	}
 }
 
+/* A job is listening, so what only needs its sockets can go */
 static void
-do_start_services(const RC_STRINGLIST *start_services, bool parallel)
+listen_job(JOB *jobs, size_t i, size_t *ready, size_t *tail)
+{
+	if (jobs[i].listening)
+		return;
+	jobs[i].listening = true;
+	release_jobs(jobs, jobs[i].early, jobs[i].nearly, ready, tail);
+}
+
+/* Finished with a job, so its dependents have one less to wait for */
+static void
+finish_job(JOB *jobs, size_t i, size_t *ready, size_t *tail)
+{
+	listen_job(jobs, i, ready, tail);
+	release_jobs(jobs, jobs[i].next, jobs[i].nnext, ready, tail);
+}
+
+/* The SIGCHLD handler tells the schedulers which services are done
+ * through this */
+static bool
+open_child_pipe(void)
+{
+	int i, flags;
+
+	if (pipe(child_pipe) == -1) {
+		eerror("%s: pipe: %s", applet, strerror(errno));
+		return false;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(child_pipe[i], F_SETFD, FD_CLOEXEC);
+		flags = fcntl(child_pipe[i], F_GETFL);
+		if (flags != -1 && i == 1)
+			fcntl(child_pipe[i], F_SETFL, flags | O_NONBLOCK);
+	}
+	return true;
+}
+
+static void
+close_child_pipe(void)
+{
+	close(child_pipe[0]);
+	close(child_pipe[1]);
+	child_pipe[0] = child_pipe[1] = -1;
+}
+
+/* Start services in parallel as soon as everything they depend on has
+ * finished starting, running at most rc_parallel_jobs at once.
+ * We learn about finished services from the SIGCHLD handler through
+ * child_pipe instead of forking everything and letting openrc-run wait.
+ * openrc-run tells us through listen_pipe when a service has opened its
+ * sockets. */
+static void
+schedule_start(const RC_STRINGLIST *start_services, const char *level,
+    int options, bool crashed, bool *interactive)
+{
+	JOB *jobs;
+	size_t njobs, i, *ready, head = 0, tail = 0, done = 0, running = 0;
+	size_t max = parallel_jobs();
+	pid_t pid;
+	ssize_t len;
+	int listen_pipe[2] = { -1, -1 };
+	struct pollfd pfd[2];
+	nfds_t npfd = 1;
+	char buf[16];
+
+	if (!open_child_pipe())
+		return;
+
+	jobs = build_jobs(start_services, level, options, false, &njobs);
+	for (i = 0; i < njobs; i++)
+		if (jobs[i].nearly)
+			break;
+	if (i < njobs && pipe(listen_pipe) == 0) {
+		fcntl(listen_pipe[0], F_SETFD, FD_CLOEXEC);
+		snprintf(buf, sizeof(buf), "%d", listen_pipe[1]);
+		setenv("RC_LISTEN_NOTIFY", buf, 1);
+		npfd = 2;
+	}
+	pfd[0].fd = child_pipe[0];
+	pfd[1].fd = listen_pipe[0];
+	pfd[0].events = pfd[1].events = POLLIN;
+
+	ready = xmalloc(sizeof(*ready) * (njobs ? njobs : 1));
+	for (i = 0; i < njobs; i++)
+		if (jobs[i].pending == 0) {
+			jobs[i].queued = true;
+			ready[tail++] = i;
+		}
+
+	while (done < njobs) {
+		while (head < tail && (max == 0 || running < max)) {
+			i = ready[head++];
+			pid = 0;
+			if (want_start(jobs[i].service, crashed, interactive)) {
+				timing_mark(jobs[i].service, "start", "queued");
+				pid = service_start(jobs[i].service);
+			}
+			if (pid > 0) {
+				jobs[i].pid = pid;
+				add_pid(pid);
+				running++;
+				continue;
+			}
+			/* Skipped, or somebody else is already on it */
+			done++;
+			finish_job(jobs, i, ready, &tail);
+		}
+		if (done == njobs)
+			break;
+
+		/* Nothing running and nothing ready means a dependency loop,
+		 * so start the first remaining service in order and let
+		 * openrc-run sort it out as it always has. */
+		if (running == 0 && head == tail) {
+			for (i = 0; i < njobs; i++)
+				if (!jobs[i].queued)
+					break;
+			jobs[i].queued = true;
+			ready[tail++] = i;
+			continue;
+		}
+		if (running == 0)
+			continue;
+
+		if (poll(pfd, npfd, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			eerror("%s: poll: %s", applet, strerror(errno));
+			break;
+		}
+		if (npfd > 1 && pfd[1].revents & POLLIN &&
+		    read(listen_pipe[0], &pid, sizeof(pid)) == sizeof(pid))
+		{
+			for (i = 0; i < njobs; i++)
+				if (jobs[i].pid == pid)
+					break;
+			if (i < njobs)
+				listen_job(jobs, i, ready, &tail);
+		}
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+		len = read(child_pipe[0], &pid, sizeof(pid));
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len != sizeof(pid)) {
+			eerror("%s: read: %s", applet, strerror(errno));
+			break;
+		}
+		for (i = 0; i < njobs; i++)
+			if (jobs[i].pid == pid)
+				break;
+		if (i == njobs)
+			continue;
+		jobs[i].pid = 0;
+		running--;
+		done++;
+		finish_job(jobs, i, ready, &tail);
+		rc_plugin_flush(running == 0);
+	}
+
+	close_child_pipe();
+	if (npfd > 1) {
+		unsetenv("RC_LISTEN_NOTIFY");
+		close(listen_pipe[0]);
+		close(listen_pipe[1]);
+	}
+	for (i = 0; i < njobs; i++) {
+		free(jobs[i].next);
+		free(jobs[i].early);
+	}
+	free(jobs);
+	free(ready);
+}
+
+/* Stop services in parallel, those nothing else depends on first.
+ * Each one goes as soon as every service we are stopping which needs,
+ * wants, uses or comes after it has stopped, running at most
+ * rc_parallel_jobs at once. */
+static bool
+schedule_stop(const RC_STRINGLIST *stop_services)
+{
+	JOB *jobs;
+	size_t njobs, i, *ready, head = 0, tail = 0, done = 0, running = 0;
+	size_t max = parallel_jobs();
+	RC_SERVICE state;
+	pid_t pid;
+	ssize_t len;
+
+	if (!open_child_pipe())
+		return false;
+
+	jobs = build_jobs(stop_services, runlevel,
+	    RC_DEP_TRACE | RC_DEP_STOP, true, &njobs);
+	ready = xmalloc(sizeof(*ready) * (njobs ? njobs : 1));
+	for (i = 0; i < njobs; i++)
+		if (jobs[i].pending == 0) {
+			jobs[i].queued = true;
+			ready[tail++] = i;
+		}
+
+	while (done < njobs) {
+		while (head < tail && (max == 0 || running < max)) {
+			i = ready[head++];
+			pid = 0;
+			/* Stopping what depended on it may have stopped it */
+			state = rc_service_state(jobs[i].service);
+			if (!(state & (RC_SERVICE_STOPPED | RC_SERVICE_FAILED))) {
+				timing_mark(jobs[i].service, "stop", "queued");
+				pid = service_stop(jobs[i].service);
+			}
+			if (pid > 0) {
+				jobs[i].pid = pid;
+				add_pid(pid);
+				running++;
+				continue;
+			}
+			done++;
+			finish_job(jobs, i, ready, &tail);
+		}
+		if (done == njobs)
+			break;
+
+		/* A dependency loop, so stop the first service left in
+		 * order and let openrc-run deal with the rest of it */
+		if (running == 0 && head == tail) {
+			for (i = 0; i < njobs; i++)
+				if (!jobs[i].queued)
+					break;
+			jobs[i].queued = true;
+			ready[tail++] = i;
+			continue;
+		}
+		if (running == 0)
+			continue;
+
+		len = read(child_pipe[0], &pid, sizeof(pid));
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len != sizeof(pid)) {
+			eerror("%s: read: %s", applet, strerror(errno));
+			break;
+		}
+		for (i = 0; i < njobs; i++)
+			if (jobs[i].pid == pid)
+				break;
+		if (i == njobs)
+			continue;
+		jobs[i].pid = 0;
+		running--;
+		done++;
+		finish_job(jobs, i, ready, &tail);
+		rc_plugin_flush(running == 0);
+	}
+
+	close_child_pipe();
+	for (i = 0; i < njobs; i++)
+		free(jobs[i].next);
+	free(jobs);
+	free(ready);
+	return true;
+}
+
+static void
+do_start_services(const RC_STRINGLIST *start_services, const char *level,
+    int options, bool parallel)
 {
 	RC_STRING *service;
 	pid_t pid;
 	bool interactive = false;
-	RC_SERVICE state;
 	bool crashed = false;
 
-	if (!rc_yesno(getenv("EINFO_QUIET")))
+	/* Nobody is there to answer for hotplugged services */
+	if (!rc_yesno(getenv("EINFO_QUIET")) && !hotplugging)
 		interactive = exists(INTERACTIVE);
 	errno = 0;
 	crashed = rc_conf_yesno("rc_crashed_start");
 	if (errno == ENOENT)
 		crashed = true;
 
-	TAILQ_FOREACH(service, start_services, entries) {
-		state = rc_service_state(service->value);
-		if (state & RC_SERVICE_FAILED)
+	main_states = rc_services_state_all();
+	if (parallel)
+		schedule_start(start_services, level, options, crashed,
+		    &interactive);
+	else TAILQ_FOREACH(service, start_services, entries) {
+		if (!want_start(service->value, crashed, &interactive))
 			continue;
-		if (!(state & RC_SERVICE_STOPPED)) {
-			if (crashed &&
-			    rc_service_daemons_crashed(service->value))
-				rc_service_mark(service->value,
-				    RC_SERVICE_STOPPED);
-			else
-			    continue;
-		}
-		if (!interactive)
-			interactive = want_interactive();
-
-		if (interactive) {
-	interactive_retry:
-			printf("\n");
-			einfo("About to start the service %s",
-			    service->value);
-			eindent();
-			einfo("1) Start the service\t\t2) Skip the service");
-			einfo("3) Continue boot process\t\t4) Exit to shell");
-			eoutdent();
-	interactive_option:
-			switch (read_key(true)) {
-			case '1': break;
-			case '2': continue;
-			case '3': interactive = false; break;
-			case '4': open_shell(); goto interactive_retry;
-			default: goto interactive_option;
-			}
-		}
 
+		timing_mark(service->value, "start", "queued");
 		pid = service_start(service->value);
 		if (pid == -1)
 			break;
-		/* Remember the pid if we're running in parallel */
 		if (pid > 0) {
 			add_pid(pid);
-			if (!parallel) {
-				rc_waitpid(pid);
-				remove_pid(pid);
-			}
+			rc_waitpid(pid);
+			remove_pid(pid);
 		}
 	}
+	rc_services_state_free(main_states);
+	main_states = NULL;
+
+	if (hotplugging)
+		return;
 
 	/* Store our interactive status for boot */
 	if (interactive &&
@@ -698,6 +1172,71 @@ do_start_services(const RC_STRINGLIST *start_services, bool parallel)
 
 }
 
+/* Start the services openrc-run queued as they were hotplugged, all at
+ * once in dependency order, until nobody queues any more */
+static void
+do_hotplug(int depoptions)
+{
+	RC_STRINGLIST *queued, *order;
+	RC_STRING *service, *tmp;
+	int lock, regen = 0;
+	bool parallel;
+
+	if ((lock = rc_hotplug_lock()) == -1)
+		return;
+	hotplugging = true;
+	setenv("IN_HOTPLUG", "YES", 1);
+	/* openrc-run cannot use dependencies while changing runlevels
+	 * unless we are the one changing them */
+	if (rc_runlevel_starting() || rc_runlevel_stopping())
+		setenv("RC_NODEPS", "YES", 1);
+	parallel = rc_conf_yesno("rc_parallel");
+
+	main_types_nwua = rc_stringlist_new();
+	rc_stringlist_add(main_types_nwua, "ineed");
+	rc_stringlist_add(main_types_nwua, "iwant");
+	rc_stringlist_add(main_types_nwua, "iuse");
+	rc_stringlist_add(main_types_nwua, "iafter");
+
+	for (;;) {
+		queued = rc_hotplug_drain();
+		if (!TAILQ_FIRST(queued)) {
+			rc_stringlist_free(queued);
+			rc_hotplug_unlock(lock);
+			if (!rc_hotplug_pending() ||
+			    (lock = rc_hotplug_lock()) == -1)
+				break;
+			continue;
+		}
+
+		if (!main_deptree || rc_deptree_update_needed(NULL, NULL)) {
+			rc_deptree_free(main_deptree);
+			if (!(main_deptree = _rc_deptree_load(0, &regen)))
+				eerrorx("failed to load deptree");
+			exec_service_deptree(rc_deptree_memfd(main_deptree));
+		}
+
+		/* Resolve the whole batch at once, but only start what was
+		 * hotplugged. openrc-run starts what they need as always. */
+		order = rc_deptree_depends(main_deptree, main_types_nwua,
+		    queued, runlevel, depoptions | RC_DEP_START);
+		if (!order)
+			order = rc_stringlist_new();
+		TAILQ_FOREACH_SAFE(service, order, entries, tmp)
+			if (!rc_stringlist_find(queued, service->value))
+				rc_stringlist_delete(order, service->value);
+		TAILQ_FOREACH(service, queued, entries)
+			rc_stringlist_addu(order, service->value);
+
+		do_start_services(order, runlevel, depoptions | RC_DEP_START,
+		    parallel);
+		wait_for_services();
+		rc_stringlist_free(order);
+		rc_stringlist_free(queued);
+	}
+	hotplugging = false;
+}
+
 #ifdef RC_DEBUG
 static void
 handle_bad_signal(int sig)
@@ -729,7 +1268,6 @@ int main(int argc, char **argv)
 	const char *bootlevel = NULL;
 	char *newlevel = NULL;
 	const char *systype = NULL;
-	RC_STRINGLIST *deporder = NULL;
 	RC_STRINGLIST *tmplist;
 	RC_STRING *service;
 	bool going_down = false;
@@ -740,6 +1278,7 @@ int main(int argc, char **argv)
 	bool parallel;
 	int regen = 0;
 	bool nostop = false;
+	bool hotplug = false;
 #ifdef __linux__
 	char *proc;
 	char *p;
@@ -783,6 +1322,9 @@ int main(int argc, char **argv)
 		    longopts, (int *) 0)) != -1)
 	{
 		switch (opt) {
+		case 'H':
+			hotplug = true;
+			break;
 		case 'n':
 			nostop = true;
 			break;
@@ -847,7 +1389,12 @@ int main(int argc, char **argv)
 	bootlevel = getenv("RC_BOOTLEVEL");
 	runlevel = rc_runlevel_get();
 
-	rc_logger_open(newlevel ? newlevel : runlevel);
+	/* Hotplugged services are not part of changing runlevels */
+	if (!hotplug)
+		rc_logger_open(newlevel ? newlevel : runlevel);
+
+	/* Save everything we run from probing the terminal again */
+	eterm_export();
 
 	/* Setup a signal handler */
 	signal_setup(SIGINT, handle_signal);
@@ -859,15 +1406,24 @@ int main(int argc, char **argv)
 	/* Run any special sysinit foo */
 	if (newlevel && strcmp(newlevel, RC_LEVEL_SYSINIT) == 0) {
 		do_sysinit();
+		/* A new boot gets a new timing trace */
+		unlink(RC_TIMING);
 		free(runlevel);
 		runlevel = rc_runlevel_get();
-	}
+	} else if (!hotplug)
+		timing_trim();
 
 	rc_plugin_load();
+	rc_plugin_spool();
 
 	/* Now we start handling our children */
 	signal_setup(SIGCHLD, handle_signal);
 
+	if (hotplug) {
+		do_hotplug(depoptions);
+		exit(EXIT_SUCCESS);
+	}
+
 	if (newlevel &&
 	    (strcmp(newlevel, RC_LEVEL_SHUTDOWN) == 0 ||
 		strcmp(newlevel, RC_LEVEL_SINGLE) == 0))
@@ -935,6 +1491,9 @@ int main(int argc, char **argv)
 	/* Load our deptree */
 	if ((main_deptree = _rc_deptree_load(0, &regen)) == NULL)
 		eerrorx("failed to load deptree");
+	/* and hand it to every service we start, so openrc-run does not
+	 * have to load it again */
+	exec_service_deptree(rc_deptree_memfd(main_deptree));
 	if (exists(RC_DEPTREE_SKEWED))
 		ewarn("WARNING: clock skew detected!");
 
@@ -948,6 +1507,10 @@ int main(int argc, char **argv)
 		    applet, RC_STOPPING, strerror(errno));
 	}
 
+	/* Keep a shell with the libraries loaded for the services to use */
+	if (rc_conf_yesno("rc_zygote"))
+		rc_zygote_start();
+
 	/* Create a list of all services which we could stop (assuming
 	* they won't be active in the new or current runlevel) including
 	* all those services which have been started, are inactive or
@@ -1016,11 +1579,18 @@ int main(int argc, char **argv)
 	parallel = rc_conf_yesno("rc_parallel");
 
 	/* Now stop the services that shouldn't be running */
-	if (main_stop_services && !nostop)
+	if (main_stop_services && !nostop) {
+		/* Let them all search the same process table */
+		procs_snapshot = rc_proc_snapshot_begin();
 		do_stop_services(main_types_nw, main_start_services, main_stop_services, main_deptree, newlevel, parallel, going_down);
+	}
 
 	/* Wait for our services to finish */
 	wait_for_services();
+	if (procs_snapshot) {
+		rc_proc_snapshot_end();
+		procs_snapshot = false;
+	}
 
 	/* Notify the plugins we have finished */
 	rc_plugin_run(RC_HOOK_RUNLEVEL_STOP_OUT,
@@ -1074,15 +1644,12 @@ int main(int argc, char **argv)
 		RC_STRING *rlevel;
 		TAILQ_FOREACH_REVERSE(rlevel, runlevel_chain, rc_stringlist, entries)
 		{
-			/* Get a list of all the services in that runlevel */
-			RC_STRINGLIST *run_services = rc_services_in_runlevel(rlevel->value);
+			/* Get the services in that runlevel in start order */
+			RC_STRINGLIST *run_services = rc_deptree_order_runlevel(main_deptree, rlevel->value, depoptions | RC_DEP_START);
 
 			/* Start those services. */
-			rc_stringlist_sort(&run_services);
-			deporder = rc_deptree_depends(main_deptree, main_types_nwua, run_services, rlevel->value, depoptions | RC_DEP_START);
-			rc_stringlist_free(run_services);
-			run_services = deporder;
-			do_start_services(run_services, parallel);
+			do_start_services(run_services, rlevel->value,
+			    depoptions | RC_DEP_START, parallel);
 
 			/* Wait for our services to finish */
 			wait_for_services();
@@ -1113,8 +1680,17 @@ int main(int argc, char **argv)
 	 * we need to delete them so that they are regenerated again in the
 	 * default runlevel as they may depend on things that are now
 	 * available */
-	if (regen && strcmp(runlevel, bootlevel) == 0)
+	if (regen && strcmp(runlevel, bootlevel) == 0) {
 		unlink(RC_DEPTREE_CACHE);
+		unlink(RC_DEPTREE_BINARY);
+		unlink(RC_DEPCACHE);
+	}
+
+	/* By the time we are past boot the root filesystem is writable, so
+	 * we can keep what this boot read for the next one */
+	if (strcmp(runlevel, RC_LEVEL_SYSINIT) != 0 &&
+	    strcmp(runlevel, bootlevel) != 0 && !going_down)
+		rc_readahead_save();
 
 	return EXIT_SUCCESS;
 }
@@ -30,6 +30,7 @@
 #include <sys/wait.h>
 
 #ifdef __linux__
+#include <sys/inotify.h>
 #include <sys/syscall.h> /* For io priority */
 #endif
 
@@ -37,8 +38,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <libgen.h>
 #include <limits.h>
 #include <grp.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stddef.h>
@@ -58,15 +61,18 @@ static struct pam_conv conv = { NULL, NULL};
 #include "einfo.h"
 #include "queue.h"
 #include "rc.h"
+#include "rc-limits.h"
 #include "rc-misc.h"
 #include "rc-pipes.h"
+#include "rc-ready.h"
 #include "rc-schedules.h"
+#include "rc-sockets.h"
 #include "_usage.h"
 #include "helpers.h"
 
 const char *applet = NULL;
 const char *extraopts = NULL;
-const char *getoptstring = "I:KN:PR:Sa:bc:d:e:g:ik:mn:op:s:tu:r:w:x:1:2:3:4:" \
+const char *getoptstring = "I:KN:PR:Sa:bc:d:e:g:ik:mn:op:s:tu:r:w:x:1:2:3:4:5:6:7:8:9:A:L:" \
 	getoptstring_COMMON;
 const struct option longopts[] = {
 	{ "ionice",       1, NULL, 'I'},
@@ -91,11 +97,19 @@ const struct option longopts[] = {
 	{ "user",         1, NULL, 'u'},
 	{ "chroot",       1, NULL, 'r'},
 	{ "wait",         1, NULL, 'w'},
+	{ "wait-pidfile", 0, NULL, 'W'},
 	{ "exec",         1, NULL, 'x'},
 	{ "stdout",       1, NULL, '1'},
 	{ "stderr",       1, NULL, '2'},
 	{ "stdout-logger",1, NULL, '3'},
 	{ "stderr-logger",1, NULL, '4'},
+	{ "notify",       1, NULL, '5'},
+	{ "ready-check",  1, NULL, '6'},
+	{ "ready-timeout",1, NULL, '7'},
+	{ "listen-fds",   1, NULL, '8'},
+	{ "cgroup",       1, NULL, '9'},
+	{ "cpu-affinity", 1, NULL, 'A'},
+	{ "cgroup-limit", 1, NULL, 'L'},
 	{ "progress",     0, NULL, 'P'},
 	longopts_COMMON
 };
@@ -122,11 +136,19 @@ const char * const longopts_help[] = {
 	"Change the process user",
 	"Chroot to this directory",
 	"Milliseconds to wait for daemon start",
+	"Stop waiting once the pidfile names a running process",
 	"Binary to start/stop",
 	"Redirect stdout to file",
 	"Redirect stderr to file",
 	"Redirect stdout to process",
 	"Redirect stderr to process",
+	"Wait for the daemon to write a line to fd:N when ready",
+	"Wait for this command to succeed after starting",
+	"Seconds to wait for the daemon to be ready",
+	"Give the daemon these sockets as LISTEN_FDS",
+	"Start the daemon in, or stop every process in, this cgroup",
+	"Run the daemon on these cpus",
+	"Set a cgroup limit, such as memory.max=512M",
 	"Print dots each second while waiting",
 	longopts_help_COMMON
 };
@@ -168,6 +190,7 @@ handle_signal(int sig)
 	int status;
 	int serrno = errno;
 	char *signame = NULL;
+	pid_t pid;
 
 	switch (sig) {
 	case SIGINT:
@@ -186,7 +209,10 @@ handle_signal(int sig)
 
 	case SIGCHLD:
 		for (;;) {
-			if (waitpid(-1, &status, WNOHANG) < 0) {
+			pid = waitpid(-1, &status, WNOHANG);
+			if (pid == 0)
+				break;
+			if (pid < 0) {
 				if (errno != ECHILD)
 					eerror("%s: waitpid: %s",
 					    applet, strerror(errno));
@@ -206,6 +232,87 @@ handle_signal(int sig)
 	errno = serrno;
 }
 
+/* The pid a daemon wrote, without complaining if it has not yet */
+static pid_t
+pidfile_pid(const char *pidfile)
+{
+	FILE *fp;
+	int pid;
+
+	if (!(fp = fopen(pidfile, "r")))
+		return -1;
+	if (fscanf(fp, "%d", &pid) != 1)
+		pid = -1;
+	fclose(fp);
+	return pid;
+}
+
+/* Give a daemon that writes its own pidfile up to ms milliseconds to do
+ * so, but stop waiting as soon as the pid in it is running.
+ * A pidfile last written before since is a stale one we failed to remove.
+ * On Linux we sleep until the pidfile's directory changes, elsewhere we
+ * look every so often. */
+static void
+wait_pidfile(const char *pidfile, unsigned int ms, time_t since)
+{
+	struct timespec end, now, ts;
+	struct stat st;
+	long left;
+	pid_t pid;
+#ifdef __linux__
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+	    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char *dir = xstrdup(pidfile);
+	struct pollfd pfd;
+
+	pfd.events = POLLIN;
+	if ((pfd.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) != -1 &&
+	    inotify_add_watch(pfd.fd, dirname(dir), IN_CREATE | IN_MOVED_TO |
+	    IN_MODIFY | IN_CLOSE_WRITE) == -1)
+	{
+		close(pfd.fd);
+		pfd.fd = -1;
+	}
+	free(dir);
+#endif
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += ms / 1000;
+	end.tv_nsec += (long)(ms % 1000) * ONE_MS;
+	if (end.tv_nsec >= 1000 * ONE_MS) {
+		end.tv_sec++;
+		end.tv_nsec -= 1000 * ONE_MS;
+	}
+	for (;;) {
+		if (stat(pidfile, &st) == 0 && st.st_mtime >= since &&
+		    (pid = pidfile_pid(pidfile)) > 0 &&
+		    (kill(pid, 0) == 0 || errno == EPERM))
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = (end.tv_sec - now.tv_sec) * 1000 +
+		    (end.tv_nsec - now.tv_nsec) / ONE_MS;
+		if (left <= 0)
+			break;
+#ifdef __linux__
+		if (pfd.fd != -1) {
+			if (poll(&pfd, 1, (int)left) > 0)
+				while (read(pfd.fd, buf, sizeof(buf)) > 0)
+					;
+			continue;
+		}
+#endif
+		if (left > 20)
+			left = 20;
+		ts.tv_sec = 0;
+		ts.tv_nsec = left * ONE_MS;
+		nanosleep(&ts, NULL);
+	}
+#ifdef __linux__
+	if (pfd.fd != -1)
+		close(pfd.fd);
+#endif
+}
+
 static char *
 expand_home(const char *home, const char *path)
 {
@@ -304,9 +411,20 @@ int main(int argc, char **argv)
 	mode_t numask = 022;
 	char **margv;
 	unsigned int start_wait = 0;
+	bool pidfile_wait = false;
+	time_t started;
+	struct rc_ready ready;
+	struct rc_limits limits;
+	const char *what;
+	int ready_fd = -1;
+	int listen_fds[RC_LISTEN_FDS_MAX];
+	int nlisten = 0;
+	char *cgroup = NULL;
 
 	applet = basename_c(argv[0]);
 	atexit(cleanup);
+	rc_ready_init(&ready);
+	rc_limits_init(&limits);
 
 	signal_setup(SIGINT, handle_signal);
 	signal_setup(SIGQUIT, handle_signal);
@@ -497,6 +615,9 @@ int main(int argc, char **argv)
 				eerrorx("%s: `%s' not a number",
 				    applet, optarg);
 			break;
+		case 'W': /* --wait-pidfile */
+			pidfile_wait = true;
+			break;
 		case 'x':  /* --exec <executable> */
 			exec = optarg;
 			break;
@@ -513,10 +634,49 @@ int main(int argc, char **argv)
 			stdout_process = optarg;
 			break;
 
+		case '5':  /* --notify fd:N */
+			if (!rc_ready_parse_notify(&ready, optarg))
+				eerrorx("%s: invalid notify `%s', use fd:N"
+				    " with N of 3 or more", applet, optarg);
+			break;
+
+		case '6':  /* --ready-check "command" */
+			ready.check = optarg;
+			break;
+
+		case '7':  /* --ready-timeout seconds */
+			if (sscanf(optarg, "%d", &ready.timeout) != 1 ||
+			    ready.timeout <= 0)
+				eerrorx("%s: invalid ready timeout `%s'",
+				    applet, optarg);
+			break;
+
 		case '4':  /* --stderr-logger "command to run for stderr logging" */
 			stderr_process = optarg;
 			break;
 
+		case '8':  /* --listen-fds 5,6 */
+			if ((nlisten = rc_listen_parse(optarg, listen_fds)) == -1)
+				eerrorx("%s: invalid listen fds `%s'",
+				    applet, optarg);
+			break;
+
+		case '9':  /* --cgroup /sys/fs/cgroup/service */
+			cgroup = optarg;
+			break;
+
+		case 'A':  /* --cpu-affinity 2-3,6 */
+			if (!rc_limits_parse_cpus(&limits, optarg))
+				eerrorx("%s: invalid cpu list `%s'",
+				    applet, optarg);
+			break;
+
+		case 'L':  /* --cgroup-limit memory.max=512M */
+			if (!rc_limits_add(&limits, optarg))
+				eerrorx("%s: invalid cgroup limit `%s'",
+				    applet, optarg);
+			break;
+
 		case_RC_COMMON_GETOPT
 		}
 
@@ -556,9 +716,9 @@ int main(int argc, char **argv)
 	if (stop || sig != -1) {
 		if (sig == -1)
 			sig = SIGTERM;
-		if (!*argv && !pidfile && !name && !uid)
+		if (!*argv && !pidfile && !name && !uid && !cgroup)
 			eerrorx("%s: --stop needs --exec, --pidfile,"
-			    " --name or --user", applet);
+			    " --name, --user or --cgroup", applet);
 		if (background)
 			eerrorx("%s: --background is only relevant with"
 			    " --start", applet);
@@ -575,11 +735,17 @@ int main(int argc, char **argv)
 			ewarn("using --wait with --stop has no effect,"
 			    " use --retry instead");
 	} else {
+		if (limits.nlimits > 0 && !cgroup)
+			eerrorx("%s: --cgroup-limit needs --cgroup", applet);
+		limits.cgroup = cgroup;
 		if (!exec)
 			eerrorx("%s: nothing to start", applet);
 		if (makepidfile && !pidfile)
 			eerrorx("%s: --make-pidfile is only relevant with"
 			    " --pidfile", applet);
+		if (pidfile_wait && (background || !pidfile))
+			ewarn("%s: --wait-pidfile is only relevant with"
+			    " --pidfile and without --background", applet);
 		if ((redirect_stdout || redirect_stderr) && !background)
 			eerrorx("%s: --stdout and --stderr are only relevant"
 			    " with --background", applet);
@@ -592,6 +758,9 @@ int main(int argc, char **argv)
 		if (redirect_stderr && stderr_process)
 			eerrorx("%s: do not use --stderr and --stderr-logger together",
 					applet);
+		if (rc_listen_conflicts(nlisten, ready.fd))
+			eerrorx("%s: --notify fd:%d is taken by --listen-fds",
+			    applet, ready.fd);
 	}
 
 	/* Expand ~ */
@@ -681,6 +850,7 @@ int main(int argc, char **argv)
 			sig = SIGTERM;
 		if (!stop)
 			oknodo = true;
+		set_stop_cgroup(cgroup);
 		if (retry)
 			parse_schedule(applet, retry, sig);
 		else if (test || oknodo)
@@ -760,10 +930,14 @@ int main(int argc, char **argv)
 	/* Remove existing pidfile */
 	if (pidfile)
 		unlink(pidfile);
+	started = time(NULL);
 
 	if (background)
 		signal_setup(SIGCHLD, handle_signal);
 
+	if (rc_ready_open(&ready) == -1)
+		eerrorx("%s: pipe: %s", applet, strerror(errno));
+
 	if ((pid = fork()) == -1)
 		eerrorx("%s: fork: %s", applet, strerror(errno));
 
@@ -790,6 +964,10 @@ int main(int argc, char **argv)
 			eerrorx("%s: ioprio_set %d %d: %s", applet,
 			    ionicec, ioniced, strerror(errno));
 
+		if (rc_limits_wanted(&limits) &&
+		    rc_limits_child(&limits, &what) == -1)
+			eerrorx("%s: %s: %s", applet, what, strerror(errno));
+
 		if (ch_root && chroot(ch_root) < 0)
 			eerrorx("%s: chroot `%s': %s",
 			    applet, ch_root, strerror(errno));
@@ -945,8 +1123,16 @@ int main(int argc, char **argv)
 				|| rc_yesno(getenv("EINFO_QUIET")))
 			dup2(stderr_fd, STDERR_FILENO);
 
+		if (rc_listen_lift(listen_fds, nlisten, ready.fd) == -1)
+			eerrorx("%s: unable to pass sockets: %s",
+			    applet, strerror(errno));
+		ready_fd = rc_ready_child(&ready, devnull_fd);
+		if (rc_listen_child(listen_fds, nlisten) == -1)
+			eerrorx("%s: unable to pass sockets: %s",
+			    applet, strerror(errno));
 		for (i = getdtablesize() - 1; i >= 3; --i)
-			close(i);
+			if (i != ready_fd && !rc_listen_conflicts(nlisten, i))
+				close(i);
 
 		setsid();
 		execvp(exec, argv);
@@ -996,7 +1182,12 @@ int main(int argc, char **argv)
 
 		ts.tv_sec = start_wait / 1000;
 		ts.tv_nsec = (start_wait % 1000) * ONE_MS;
-		if (nanosleep(&ts, NULL) == -1) {
+		/* With --wait-pidfile a daemon that writes its own pidfile
+		 * tells us when it is up, so then the wait is only as long
+		 * as it takes. We still check it is running below. */
+		if (pidfile_wait && !background && pidfile)
+			wait_pidfile(pidfile, start_wait, started);
+		else if (nanosleep(&ts, NULL) == -1) {
 			if (errno != EINTR) {
 				eerror("%s: nanosleep: %s",
 				    applet, strerror(errno));
@@ -1026,6 +1217,15 @@ int main(int argc, char **argv)
 			eerrorx("%s: %s died", applet, exec);
 	}
 
+	/* Don't say we started until the daemon says it is ready */
+	if (rc_ready_wanted(&ready) &&
+	    !rc_ready_wait(&ready, background ? pid : 0, applet, exec))
+	{
+		if (background)
+			kill(pid, SIGTERM);
+		exit(EXIT_FAILURE);
+	}
+
 	if (svcname)
 		rc_service_daemon_set(svcname, exec,
 		    (const char *const *)margv, pidfile, true);
@@ -24,8 +24,11 @@
 
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/file.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <termios.h>
 #include <sys/time.h>
 #include <sys/wait.h>
@@ -40,8 +43,11 @@
 #include <getopt.h>
 #include <limits.h>
 #include <grp.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -60,15 +66,18 @@ static struct pam_conv conv = { NULL, NULL};
 #include "einfo.h"
 #include "queue.h"
 #include "rc.h"
+#include "rc-limits.h"
 #include "rc-misc.h"
 #include "rc-plugin.h"
+#include "rc-ready.h"
+#include "rc-sockets.h"
 #include "rc-schedules.h"
 #include "_usage.h"
 #include "helpers.h"
 
 const char *applet = NULL;
 const char *extraopts = NULL;
-const char *getoptstring = "A:a:D:d:e:g:H:I:Kk:m:N:p:R:r:s:Su:1:2:3" \
+const char *getoptstring = "A:a:D:d:E:e:g:H:I:KL:k:M:m:N:p:R:r:s:ST:u:W:1:2:3456789:c:f:l:" \
 	getoptstring_COMMON;
 const struct option longopts[] = {
 	{ "healthcheck-timer",        1, NULL, 'a'},
@@ -80,6 +89,7 @@ const struct option longopts[] = {
 	{ "ionice",       1, NULL, 'I'},
 	{ "stop",         0, NULL, 'K'},
 	{ "umask",        1, NULL, 'k'},
+	{ "respawn-delay-max", 1, NULL, 'M'},
 	{ "respawn-max",    1, NULL, 'm'},
 	{ "nicelevel",    1, NULL, 'N'},
 	{ "pidfile",      1, NULL, 'p'},
@@ -88,10 +98,23 @@ const struct option longopts[] = {
 	{ "chroot",       1, NULL, 'r'},
 	{ "signal",       1, NULL, 's'},
 	{ "start",        0, NULL, 'S'},
+	{ "respawn-stable", 1, NULL, 'T'},
 	{ "user",         1, NULL, 'u'},
 	{ "stdout",       1, NULL, '1'},
 	{ "stderr",       1, NULL, '2'},
 	{ "reexec",       0, NULL, '3'},
+	{ "shared",       0, NULL, '4'},
+	{ "shared-child", 0, NULL, '5'},
+	{ "restart",      0, NULL, '6'},
+	{ "status",       0, NULL, '7'},
+	{ "healthcheck",  0, NULL, '8'},
+	{ "notify",       1, NULL, '9'},
+	{ "ready-check",  1, NULL, 'E'},
+	{ "ready-timeout", 1, NULL, 'W'},
+	{ "listen-fds",   1, NULL, 'L'},
+	{ "cgroup",       1, NULL, 'c'},
+	{ "cpu-affinity", 1, NULL, 'f'},
+	{ "cgroup-limit", 1, NULL, 'l'},
 	longopts_COMMON
 };
 const char * const longopts_help[] = {
@@ -104,6 +127,7 @@ const char * const longopts_help[] = {
 	"Set an ionice class:data when starting",
 	"Stop daemon",
 	"Set the umask for the daemon",
+	"Back off respawning up to this delay",
 	"set maximum number of respawn attempts",
 	"Set a nicelevel when starting",
 	"Match pid found in this file",
@@ -112,17 +136,29 @@ const char * const longopts_help[] = {
 	"Chroot to this directory",
 	"Send a signal to the daemon",
 	"Start daemon",
+	"Reset the respawn back off after this uptime",
 	"Change the process user",
 	"Redirect stdout to file",
 	"Redirect stderr to file",
 	"reexec (used internally)",
+	"Use the shared supervisor",
+	"run a shared child (used internally)",
+	"Restart the daemon",
+	"Show the state of the daemon",
+	"Run the health check now",
+	"Wait for the daemon to write a line to fd:N when ready",
+	"Wait for this command to succeed after starting",
+	"Seconds to wait for the daemon to be ready",
+	"Give the daemon these sockets as LISTEN_FDS",
+	"Start the daemon in this cgroup",
+	"Run the daemon on these cpus",
+	"Set a cgroup limit, such as memory.max=512M",
 	longopts_help_COMMON
 };
 const char *usagestring = NULL;
 
 static int healthcheckdelay = 0;
 static int healthchecktimer = 0;
-static volatile sig_atomic_t do_healthcheck = 0;
 static volatile sig_atomic_t exiting = 0;
 static int nicelevel = 0;
 static int ionicec = -1;
@@ -144,11 +180,27 @@ static int respawn_count = 0;
 static int respawn_delay = 0;
 static int respawn_max = 10;
 static int respawn_period = 0;
+static int respawn_delay_max = 0;
+static int respawn_stable = 0;
+static int respawn_step = 0;
 static char *fifopath = NULL;
 static int fifo_fd = 0;
+static char *ctlpath = NULL;
+static int child_status = -1;
+static struct usage child_usage;
+static int signal_pipe[2] = { -1, -1 };
+static bool shared_child = false;
+static bool hosting = false;
 static char *pidfile = NULL;
 static char *svcname = NULL;
 static bool verbose = false;
+/* Only the first child we start can tell us it is ready */
+static struct rc_ready ready;
+/* We keep these open so every daemon we start gets them */
+static int listen_fds[RC_LISTEN_FDS_MAX];
+static int nlisten = 0;
+/* Set up for every daemon we start, before it execs */
+static struct rc_limits limits;
 
 extern char **environ;
 
@@ -185,22 +237,14 @@ static void re_exec_supervisor(void)
 static void handle_signal(int sig)
 {
 	int serrno = errno;
-	pid_t pid;
 
 	switch (sig) {
-	case SIGALRM:
-		do_healthcheck = 1;
-		break;
 	case SIGCHLD:
-		if (exiting)
+		/* While stopping we reap everything in here so that the
+		 * stop schedule sees our child go away. The shared
+		 * supervisor reaps in its loop as it never waits here. */
+		if (exiting && !hosting)
 			while (waitpid((pid_t)(-1), NULL, WNOHANG) > 0) {}
-		else {
-			while ((pid = waitpid((pid_t)(-1), NULL, WNOHANG|WNOWAIT)) > 0) {
-				if (pid == child_pid)
-					break;
-				pid = waitpid(pid, NULL, WNOHANG);
-			}
-		}
 		break;
 	case SIGTERM:
 		exiting = 1;
@@ -209,6 +253,8 @@ static void handle_signal(int sig)
 		syslog(LOG_WARNING, "caught signal %d", sig);
 		re_exec_supervisor();
 	}
+	/* Wake up the main loop */
+	if (write(signal_pipe[1], "", 1) == -1) {}
 	/* Restore errno */
 	errno = serrno;
 }
@@ -268,7 +314,7 @@ static char *make_cmdline(char **argv)
 	return cmdline;
 }
 
-static pid_t exec_command(const char *cmd)
+static pid_t exec_command(const char *service, const char *cmd)
 {
 	char *file;
 	pid_t pid = -1;
@@ -276,7 +322,7 @@ static pid_t exec_command(const char *cmd)
 	sigset_t old;
 	struct sigaction sa;
 
-	file = rc_service_resolve(svcname);
+	file = rc_service_resolve(service);
 	if (!exists(file)) {
 		free(file);
 		return 0;
@@ -329,9 +375,11 @@ static void child_process(char *exec, char **argv)
 	char *newpath;
 	char *np;
 	char *cmdline = NULL;
+	const char *what;
 	time_t start_time;
 	char start_count_string[20];
 	char start_time_string[20];
+	int ready_fd;
 
 #ifdef HAVE_PAM
 	pam_handle_t *pamh = NULL;
@@ -345,8 +393,12 @@ static void child_process(char *exec, char **argv)
 		start_time = time(NULL);
 		from_time_t(start_time_string, start_time);
 		rc_service_value_set(svcname, "start_time", start_time_string);
-		sprintf(start_count_string, "%i", respawn_count);
-		rc_service_value_set(svcname, "start_count", start_count_string);
+		/* The shared supervisor keeps count for us */
+		if (!shared_child) {
+			sprintf(start_count_string, "%i", respawn_count);
+			rc_service_value_set(svcname, "start_count",
+			    start_count_string);
+		}
 		sprintf(start_count_string, "%d", getpid());
 		rc_service_value_set(svcname, "child_pid", start_count_string);
 	}
@@ -361,6 +413,10 @@ static void child_process(char *exec, char **argv)
 		eerrorx("%s: ioprio_set %d %d: %s", applet, ionicec, ioniced,
 				strerror(errno));
 
+	if (rc_limits_wanted(&limits) &&
+	    rc_limits_child(&limits, &what) == -1)
+		eerrorx("%s: %s: %s", applet, what, strerror(errno));
+
 	if (ch_root && chroot(ch_root) < 0)
 		eerrorx("%s: chroot `%s': %s", applet, ch_root, strerror(errno));
 
@@ -486,8 +542,16 @@ static void child_process(char *exec, char **argv)
 	if (redirect_stderr || rc_yesno(getenv("EINFO_QUIET")))
 		dup2(stderr_fd, STDERR_FILENO);
 
+	if (rc_listen_lift(listen_fds, nlisten, ready.fd) == -1)
+		eerrorx("%s: unable to pass sockets: %s",
+		    applet, strerror(errno));
+	ready_fd = rc_ready_child(&ready, devnull_fd);
+	if (rc_listen_child(listen_fds, nlisten) == -1)
+		eerrorx("%s: unable to pass sockets: %s",
+		    applet, strerror(errno));
 	for (i = getdtablesize() - 1; i >= 3; --i)
-		fcntl(i, F_SETFD, FD_CLOEXEC);
+		if (i != ready_fd && !rc_listen_conflicts(nlisten, i))
+			fcntl(i, F_SETFD, FD_CLOEXEC);
 	cmdline = make_cmdline(argv);
 	syslog(LOG_INFO, "Child command line: %s", cmdline);
 	free(cmdline);
@@ -500,30 +564,533 @@ static void child_process(char *exec, char **argv)
 	eerrorx("%s: failed to exec `%s': %s", applet, exec,strerror(errno));
 }
 
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / ONE_MS;
+}
+
+/* When we should next wake up, -1 for never */
+static int next_timeout(long long now, long long health_at,
+		long long respawn_at)
+{
+	long long at = health_at;
+
+	if (respawn_at && (!at || respawn_at < at))
+		at = respawn_at;
+	if (!at)
+		return -1;
+	if (at <= now)
+		return 0;
+	if (at - now > INT_MAX)
+		return INT_MAX;
+	return (int)(at - now);
+}
+
+/*
+ * How long to wait before the next respawn.
+ * Without a maximum delay this is just the respawn delay. With one, the
+ * delay doubles with each crash in a row up to the maximum, and only
+ * half of it is fixed: the rest is random so that clients of something
+ * that went away do not all come back at the same moment. A child that
+ * stayed up for the stable time starts again from the respawn delay.
+ */
+static long long respawn_wait(int delay, int delay_max, int stable,
+		int *step, long long started, long long now)
+{
+	long long wait = delay * 1000LL;
+	long long max = delay_max * 1000LL;
+	int i;
+
+	if (delay_max <= 0)
+		return wait;
+	if (stable <= 0)
+		stable = delay_max;
+	if (started && now - started >= stable * 1000LL)
+		*step = 0;
+	if (wait <= 0)
+		wait = 1000;
+	for (i = 0; i < *step && wait < max; i++)
+		wait *= 2;
+	if (wait > max)
+		wait = max;
+	(*step)++;
+	return wait / 2 + random() % (wait / 2 + 1);
+}
+
+/*
+ * Control socket.
+ * Supervisors listen on a SOCK_SEQPACKET socket in RC_SVCDIR. Each
+ * message is a list of nul terminated strings, the first of which is
+ * the request and the second the service. The reply starts with ok,
+ * followed by any key=value data, or with error and a message.
+ * Requests are sig <signal>, restart, status and healthcheck, and the
+ * shared supervisor also takes start and stop.
+ */
+#define SHARED_SOCKET	RC_SVCDIR "/supervise.sock"
+#define SHARED_LOCK	RC_SVCDIR "/supervise.lock"
+#define MSG_MAX		65536
+
+struct msg {
+	char *buf;
+	size_t len;
+};
+
+_xasprintf(2, 3) static void msg_add(struct msg *m, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	m->buf = xrealloc(m->buf, m->len + len + 1);
+	va_start(ap, fmt);
+	vsnprintf(m->buf + m->len, len + 1, fmt, ap);
+	va_end(ap);
+	m->len += len + 1;
+}
+
+/*
+ * Resources used by the children of a service, summed over each child
+ * lifetime as we reap them with wait4(). maxrss is the largest seen.
+ * They are kept in the rusage value of the service so rc-status can show
+ * them, and are sent back with the status of the service.
+ */
+struct usage {
+	struct timeval utime;
+	struct timeval stime;
+	long maxrss;
+	long minflt;
+	long majflt;
+	long nvcsw;
+	long nivcsw;
+	int lifetimes;
+};
+
+static void usage_add(const char *service, struct usage *u,
+		const struct rusage *ru)
+{
+	char *value;
+
+	timeradd(&u->utime, &ru->ru_utime, &u->utime);
+	timeradd(&u->stime, &ru->ru_stime, &u->stime);
+	if (ru->ru_maxrss > u->maxrss)
+		u->maxrss = ru->ru_maxrss;
+	u->minflt += ru->ru_minflt;
+	u->majflt += ru->ru_majflt;
+	u->nvcsw += ru->ru_nvcsw;
+	u->nivcsw += ru->ru_nivcsw;
+	u->lifetimes++;
+	if (!service)
+		return;
+	xasprintf(&value, "utime=%ld.%03ld stime=%ld.%03ld maxrss=%ld "
+	    "minflt=%ld majflt=%ld nvcsw=%ld nivcsw=%ld lifetimes=%d",
+	    (long)u->utime.tv_sec, (long)u->utime.tv_usec / 1000,
+	    (long)u->stime.tv_sec, (long)u->stime.tv_usec / 1000,
+	    u->maxrss, u->minflt, u->majflt, u->nvcsw, u->nivcsw,
+	    u->lifetimes);
+	rc_service_value_set(service, "rusage", value);
+	free(value);
+}
+
+/* Returns the next string in a message, NULL at the end */
+static char *msg_next(char *buf, size_t len, char **p)
+{
+	char *str = *p;
+
+	if (!str || str >= buf + len)
+		return NULL;
+	*p = str + strlen(str) + 1;
+	return str;
+}
+
+static int control_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1)
+		return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    chmod(path, 0600) == -1 ||
+	    listen(fd, SOMAXCONN) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+#define SHARED_CGROUP	"openrc.supervise-host"
+
+#ifdef __linux__
+/* Where cgroup v2 is mounted, if it is */
+static char *cgroup2_mount(void)
+{
+	FILE *fp;
+	char *line = NULL, *mnt = NULL, *p;
+	char point[PATH_MAX];
+	size_t len = 0;
+
+	if (!(fp = fopen("/proc/self/mountinfo", "re")))
+		return NULL;
+	while (!mnt && rc_getline(&line, &len, fp) > 0) {
+		/* The filesystem type follows the separator */
+		if (!(p = strstr(line, " - ")) ||
+		    strncmp(p + 3, "cgroup2 ", 8) != 0)
+			continue;
+		if (sscanf(line, "%*s %*s %*s %*s %4095s", point) == 1)
+			mnt = xstrdup(point);
+	}
+	free(line);
+	fclose(fp);
+	return mnt;
+}
+#endif
+
+/*
+ * The shared supervisor is started by whichever service wants it first,
+ * so it begins in that service's cgroup. Stopping that service kills
+ * everything in its cgroup, which would take the shared supervisor and
+ * every other service with it, so we move to a cgroup of our own.
+ * If we cannot, we do not run at all.
+ */
+static bool shared_host_cgroup(void)
+{
+#ifdef __linux__
+	struct rc_limits l;
+	const char *what;
+	char *mnt, *path;
+	bool ok = true;
+
+	rc_limits_init(&l);
+	if ((mnt = cgroup2_mount())) {
+		xasprintf(&path, "%s/" SHARED_CGROUP, mnt);
+		l.cgroup = path;
+		if (rc_limits_child(&l, &what) == -1) {
+			eerror("%s: %s: %s", applet, what, strerror(errno));
+			ok = false;
+		}
+		free(path);
+		free(mnt);
+	}
+	/* rc-cgroup.sh puts services here when there is no cgroup v2 */
+	if (ok && exists("/sys/fs/cgroup/openrc/tasks")) {
+		l.cgroup = "/sys/fs/cgroup/openrc/" SHARED_CGROUP;
+		if (rc_limits_child(&l, &what) == -1) {
+			eerror("%s: %s: %s", applet, what, strerror(errno));
+			ok = false;
+		}
+	}
+	return ok;
+#else
+	return true;
+#endif
+}
+
+/* Start the shared supervisor in the background */
+static bool shared_spawn_host(void)
+{
+	pid_t pid;
+	int fd;
+
+	if ((pid = fork()) == -1)
+		eerrorx("%s: fork: %s", applet, strerror(errno));
+	if (pid == 0) {
+		setsid();
+		if (!shared_host_cgroup())
+			_exit(EXIT_FAILURE);
+		if (fork() != 0)
+			_exit(EXIT_SUCCESS);
+		if ((fd = open("/dev/null", O_RDWR)) != -1) {
+			dup2(fd, STDIN_FILENO);
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			if (fd > STDERR_FILENO)
+				close(fd);
+		}
+		if (chdir("/") == -1) {}
+		execlp("supervise-daemon", "supervise-daemon", "--shared-host",
+		    (char *) NULL);
+		_exit(EXIT_FAILURE);
+	}
+	return rc_waitpid(pid) == 0;
+}
+
+static int control_connect(const char *path, bool spawn)
+{
+	struct sockaddr_un addr;
+	struct timespec ts;
+	int fd, i;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1)
+		return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	for (i = 0;; i++) {
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			return fd;
+		if (!spawn || (errno != ENOENT && errno != ECONNREFUSED) ||
+		    i * (POLL_INTERVAL / ONE_MS) >= 5000)
+			break;
+		if (i == 0 && !shared_spawn_host()) {
+			eerror("%s: unable to start the shared supervisor",
+			    applet);
+			break;
+		}
+		ts.tv_sec = 0;
+		ts.tv_nsec = POLL_INTERVAL;
+		nanosleep(&ts, NULL);
+	}
+	close(fd);
+	return -1;
+}
+
+/* Send a request to a supervisor and wait for it to be done.
+ * The reply is returned in reply if given, without the leading ok. */
+static bool control_send(const char *path, struct msg *m, bool spawn,
+		struct msg *reply)
+{
+	char buf[MSG_MAX + 1];
+	char *p = buf, *str;
+	ssize_t len;
+	int fd;
+
+	if (m->len > MSG_MAX) {
+		eerror("%s: request too large", applet);
+		return false;
+	}
+	if ((fd = control_connect(path, spawn)) == -1) {
+		eerror("%s: unable to contact the supervisor: %s",
+				applet, strerror(errno));
+		return false;
+	}
+	if (send(fd, m->buf, m->len, 0) == -1 ||
+	    (len = recv(fd, buf, MSG_MAX, 0)) <= 0)
+	{
+		eerror("%s: talking to the supervisor: %s",
+				applet, strerror(errno));
+		close(fd);
+		return false;
+	}
+	close(fd);
+	buf[len] = '\0';
+	str = msg_next(buf, (size_t)len, &p);
+	if (str && strcmp(str, "ok") == 0) {
+		if (reply)
+			while ((str = msg_next(buf, (size_t)len, &p)))
+				msg_add(reply, "%s", str);
+		return true;
+	}
+	str = msg_next(buf, (size_t)len, &p);
+	eerror("%s: %s", applet, str ? str : "unknown error");
+	return false;
+}
+
+/* Describe a supervised child */
+static void control_status(struct msg *m, const char *name, pid_t pid,
+		int count, int status, long long started, const struct usage *u)
+{
+	msg_add(m, "ok");
+	msg_add(m, "service=%s", name);
+	msg_add(m, "pid=%d", pid);
+	msg_add(m, "respawn_count=%d", count);
+	if (status != -1 && WIFEXITED(status))
+		msg_add(m, "exit_status=%d", WEXITSTATUS(status));
+	else if (status != -1 && WIFSIGNALED(status))
+		msg_add(m, "exit_signal=%d", WTERMSIG(status));
+	if (pid > 0)
+		msg_add(m, "uptime=%lld", (now_ms() - started) / 1000);
+	if (u->lifetimes == 0)
+		return;
+	msg_add(m, "utime=%ld.%03ld", (long)u->utime.tv_sec,
+	    (long)u->utime.tv_usec / 1000);
+	msg_add(m, "stime=%ld.%03ld", (long)u->stime.tv_sec,
+	    (long)u->stime.tv_usec / 1000);
+	msg_add(m, "maxrss=%ld", u->maxrss);
+	msg_add(m, "minflt=%ld", u->minflt);
+	msg_add(m, "majflt=%ld", u->majflt);
+	msg_add(m, "nvcsw=%ld", u->nvcsw);
+	msg_add(m, "nivcsw=%ld", u->nivcsw);
+	msg_add(m, "lifetimes=%d", u->lifetimes);
+}
+
+/* Handle a signal request for pid, returns an error or NULL */
+static const char *control_signal(pid_t pid, char *buf, size_t len, char **p)
+{
+	char *str;
+	int sig;
+
+	if (!(str = msg_next(buf, len, p)) ||
+	    sscanf(str, "%d", &sig) != 1 || sig < 0 || sig >= NSIG)
+		return "bad signal";
+	if (pid <= 0)
+		return "not running";
+	syslog(LOG_INFO, "Sending signal %d to %d", sig, pid);
+	if (kill(pid, sig) == -1)
+		return strerror(errno);
+	return NULL;
+}
+
+static void control_reply(int fd, struct msg *reply, const char *error)
+{
+	struct msg m = { NULL, 0 };
+
+	if (!reply) {
+		reply = &m;
+		if (error) {
+			msg_add(reply, "error");
+			msg_add(reply, "%s", error);
+		} else
+			msg_add(reply, "ok");
+	}
+	if (send(fd, reply->buf, reply->len, 0) == -1 && verbose)
+		syslog(LOG_DEBUG, "send: %s", strerror(errno));
+	free(m.buf);
+}
+
+/* Returns true if the child is healthy or we could not stop it */
+static bool health_check(const char *service, const char *exec, pid_t pid,
+		struct usage *u)
+{
+	struct rusage ru;
+	int health_status;
+	int nkilled;
+	pid_t health_pid;
+
+	if (verbose)
+		syslog(LOG_DEBUG, "running health check for %s", service);
+	health_pid = exec_command(service, "healthcheck");
+	health_status = rc_waitpid(health_pid);
+	if (WIFEXITED(health_status) && WEXITSTATUS(health_status) == 0)
+		return true;
+
+	syslog(LOG_WARNING, "health check for %s failed", service);
+	health_pid = exec_command(service, "unhealthy");
+	rc_waitpid(health_pid);
+	syslog(LOG_INFO, "stopping %s, pid %d", exec, pid);
+	nkilled = run_stop_schedule(applet, NULL, NULL, pid, 0,
+			false, false, true);
+	if (nkilled < 0) {
+		syslog(LOG_INFO, "Unable to kill %d: %s",
+				pid, strerror(errno));
+		return true;
+	}
+	/* It is gone, so this will not block */
+	if (wait4(pid, &health_status, 0, &ru) == pid)
+		usage_add(service, u, &ru);
+	return false;
+}
+
+/* What the main loop has to do after a control request */
+#define REQUEST_NONE		0
+#define REQUEST_RESTART		1
+#define REQUEST_RESPAWN		2
+
+static int supervisor_request(int fd, const char *exec, long long started_at)
+{
+	char buf[MSG_MAX + 1];
+	char *p = buf, *cmd, *name;
+	const char *error = NULL;
+	struct msg reply = { NULL, 0 };
+	struct rusage ru;
+	ssize_t len;
+	int retval = REQUEST_NONE;
+	int nkilled;
+
+	len = recv(fd, buf, MSG_MAX, 0);
+	if (len <= 0)
+		return REQUEST_NONE;
+	buf[len] = '\0';
+	cmd = msg_next(buf, (size_t)len, &p);
+	name = msg_next(buf, (size_t)len, &p);
+	if (verbose && cmd && name)
+		syslog(LOG_DEBUG, "Received %s for %s", cmd, name);
+
+	if (!cmd || !name)
+		error = "bad request";
+	else if (strcmp(cmd, "sig") == 0)
+		error = control_signal(child_pid, buf, (size_t)len, &p);
+	else if (strcmp(cmd, "status") == 0) {
+		control_status(&reply, svcname, child_pid, respawn_count,
+		    child_status, started_at, &child_usage);
+		control_reply(fd, &reply, NULL);
+		free(reply.buf);
+		return REQUEST_NONE;
+	} else if (strcmp(cmd, "restart") == 0) {
+		if (child_pid > 0) {
+			syslog(LOG_INFO, "stopping %s, pid %d", exec, child_pid);
+			nkilled = run_stop_schedule(applet, NULL, NULL,
+			    child_pid, 0, false, false, true);
+			if (nkilled < 0)
+				error = "unable to stop";
+			else if (wait4(child_pid, &child_status, 0, &ru) == -1)
+				child_status = -1;
+			else
+				usage_add(svcname, &child_usage, &ru);
+		}
+		if (!error)
+			retval = REQUEST_RESTART;
+	} else if (strcmp(cmd, "healthcheck") == 0) {
+		if (child_pid <= 0)
+			error = "not running";
+		else if (!health_check(svcname, exec, child_pid,
+		    &child_usage)) {
+			error = "unhealthy";
+			retval = REQUEST_RESPAWN;
+		}
+	} else
+		error = "unknown request";
+
+	control_reply(fd, NULL, error);
+	return retval;
+}
+
 static void supervisor(char *exec, char **argv)
 {
 	FILE *fp;
-	char buf[2048];
-	char cmd[2048];
-	int count;
+	char buf[64];
 	int failing;
-	int health_status;
-	int healthcheck_respawn;
 	int i;
 	int nkilled;
-	int sig_send;
-	pid_t health_pid;
+	int timeout;
+	int flags;
+	int ctl_fd, fd;
 	pid_t wait_pid;
+	struct rusage ru;
 	sigset_t old_signals;
 	sigset_t signals;
 	struct sigaction sa;
-	struct timespec ts;
+	struct pollfd pfd[2];
+	long long now;
+	long long health_at = 0;
+	long long respawn_at = 0;
+	long long started_at;
+	bool respawn;
 	time_t respawn_now= 0;
 	time_t first_spawn= 0;
 
+	/* Signals just wake up the main loop through this */
+	if (pipe(signal_pipe) == -1)
+		eerrorx("%s: pipe: %s", applet, strerror(errno));
+	for (i = 0; i < 2; i++) {
+		flags = fcntl(signal_pipe[i], F_GETFL, 0);
+		fcntl(signal_pipe[i], F_SETFL, flags | O_NONBLOCK);
+		fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+
 	/* block all signals we do not handle */
 	sigfillset(&signals);
-	sigdelset(&signals, SIGALRM);
 	sigdelset(&signals, SIGCHLD);
 	sigdelset(&signals, SIGTERM);
 	sigprocmask(SIG_SETMASK, &signals, &old_signals);
@@ -531,7 +1098,6 @@ static void supervisor(char *exec, char **argv)
 	/* install signal  handler */
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = handle_signal;
-	sigaction(SIGALRM, &sa, NULL);
 	sigaction(SIGCHLD, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
 
@@ -541,9 +1107,11 @@ static void supervisor(char *exec, char **argv)
 	fprintf(fp, "%d\n", getpid());
 	fclose(fp);
 
-	if (svcname)
+	if (svcname) {
 		rc_service_daemon_set(svcname, exec, (const char * const *) argv,
 				pidfile, true);
+		rc_service_value_set(svcname, "rusage", NULL);
+	}
 
 	/* remove the controlling tty */
 #ifdef TIOCNOTTY
@@ -551,84 +1119,82 @@ static void supervisor(char *exec, char **argv)
 	close(tty_fd);
 #endif
 
+	if ((ctl_fd = control_listen(ctlpath)) == -1)
+		syslog(LOG_ERR, "unable to listen on `%s': %s", ctlpath,
+				strerror(errno));
+
 	/*
 	 * Supervisor main loop
 	 */
+	srandom((unsigned int)(getpid() ^ time(NULL)));
+	started_at = now_ms();
 	if (healthcheckdelay)
-		alarm(healthcheckdelay);
+		health_at = now_ms() + healthcheckdelay * 1000LL;
 	else if (healthchecktimer)
-		alarm(healthchecktimer);
+		health_at = now_ms() + healthchecktimer * 1000LL;
 	failing = 0;
 	while (!exiting) {
-		healthcheck_respawn = 0;
-		fifo_fd = open(fifopath, O_RDONLY);
-		if (fifo_fd > 0) {
-			memset(buf, 0, sizeof(buf));
-			count = read(fifo_fd, buf, sizeof(buf) - 1);
-			close(fifo_fd);
-			if (count != -1)
-				buf[count] = 0;
-			if (count == 0)
-				continue;
-			if (verbose)
-				syslog(LOG_DEBUG, "Received %s from fifo", buf);
-			if (strncasecmp(buf, "sig", 3) == 0) {
-				if ((sscanf(buf, "%s %d", cmd, &sig_send) == 2)
-						&& (sig_send >= 0 && sig_send < NSIG)) {
-					syslog(LOG_INFO, "Sending signal %d to %d", sig_send,
-							child_pid);
-					if (kill(child_pid, sig_send) == -1)
-						syslog(LOG_ERR, "Unable to send signal %d to %d",
-								sig_send, child_pid);
-				}
-			}
-			continue;
+		timeout = next_timeout(now_ms(), health_at, respawn_at);
+		pfd[0].fd = signal_pipe[0];
+		pfd[0].events = POLLIN;
+		pfd[1].fd = ctl_fd;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, ctl_fd == -1 ? 1 : 2, timeout) == -1 &&
+		    errno != EINTR)
+		{
+			syslog(LOG_ERR, "poll: %s", strerror(errno));
+			exit(EXIT_FAILURE);
 		}
-		if (do_healthcheck) {
-			do_healthcheck = 0;
-			alarm(0);
-			if (verbose)
-				syslog(LOG_DEBUG, "running health check for %s", svcname);
-			health_pid = exec_command("healthcheck");
-			health_status = rc_waitpid(health_pid);
-			if (WIFEXITED(health_status) && WEXITSTATUS(health_status) == 0)
-				alarm(healthchecktimer);
-			else {
-				syslog(LOG_WARNING, "health check for %s failed", svcname);
-				health_pid = exec_command("unhealthy");
-				rc_waitpid(health_pid);
-				syslog(LOG_INFO, "stopping %s, pid %d", exec, child_pid);
-				nkilled = run_stop_schedule(applet, NULL, NULL, child_pid, 0,
-						false, false, true);
-				if (nkilled < 0)
-					syslog(LOG_INFO, "Unable to kill %d: %s",
-							child_pid, strerror(errno));
-				else
-					healthcheck_respawn = 1;
+		if (pfd[0].revents & POLLIN)
+			while (read(signal_pipe[0], buf, sizeof(buf)) > 0) {}
+		respawn = false;
+		if (ctl_fd != -1 && pfd[1].revents & POLLIN &&
+		    (fd = accept(ctl_fd, NULL, NULL)) != -1)
+		{
+			switch (supervisor_request(fd, exec, started_at)) {
+			case REQUEST_RESTART:
+				/* Not a crash, so start it again right now */
+				child_pid = 0;
+				health_at = 0;
+				respawn_at = now_ms();
+				break;
+			case REQUEST_RESPAWN:
+				respawn = true;
+				break;
 			}
+			close(fd);
 		}
-		if (exiting) {
-			alarm(0);
-			syslog(LOG_INFO, "stopping %s, pid %d", exec, child_pid);
-			nkilled = run_stop_schedule(applet, NULL, NULL, child_pid, 0,
-					false, false, true);
-			if (nkilled > 0)
-				syslog(LOG_INFO, "killed %d processes", nkilled);
-			continue;
-		}
-		wait_pid = waitpid(child_pid, &i, WNOHANG);
-		if (wait_pid == child_pid) {
+		if (exiting)
+			break;
+
+		while ((wait_pid = wait4((pid_t)(-1), &i, WNOHANG, &ru)) > 0) {
+			if (wait_pid != child_pid)
+				continue;
+			child_status = i;
+			usage_add(svcname, &child_usage, &ru);
 			if (WIFEXITED(i))
 				syslog(LOG_WARNING, "%s, pid %d, exited with return code %d",
 						exec, child_pid, WEXITSTATUS(i));
 			else if (WIFSIGNALED(i))
 				syslog(LOG_WARNING, "%s, pid %d, terminated by signal %d",
 						exec, child_pid, WTERMSIG(i));
+			respawn = true;
 		}
-		if (wait_pid == child_pid || healthcheck_respawn) {
-			do_healthcheck = 0;
-			healthcheck_respawn = 0;
-			alarm(0);
+
+		now = now_ms();
+		if (!respawn && child_pid > 0 && health_at && now >= health_at) {
+			health_at = 0;
+			if (health_check(svcname, exec, child_pid,
+			    &child_usage)) {
+				if (healthchecktimer)
+					health_at = now_ms() + healthchecktimer * 1000LL;
+			} else
+				respawn = true;
+		}
+
+		if (respawn) {
+			child_pid = 0;
+			health_at = 0;
 			respawn_now = time(NULL);
 			if (first_spawn == 0)
 				first_spawn = respawn_now;
@@ -645,11 +1211,16 @@ static void supervisor(char *exec, char **argv)
 				failing = 1;
 				continue;
 			}
-			ts.tv_sec = respawn_delay;
-			ts.tv_nsec = 0;
-			nanosleep(&ts, NULL);
-			if (exiting)
-				continue;
+			/* Wait for the delay in the loop so that we still
+			 * answer commands and signals meanwhile */
+			now = now_ms();
+			respawn_at = now + respawn_wait(respawn_delay,
+			    respawn_delay_max, respawn_stable, &respawn_step,
+			    started_at, now);
+		}
+
+		if (respawn_at && now >= respawn_at) {
+			respawn_at = 0;
 			child_pid = fork();
 			if (child_pid == -1) {
 				syslog(LOG_ERR, "%s: fork: %s", applet, strerror(errno));
@@ -659,18 +1230,29 @@ static void supervisor(char *exec, char **argv)
 				sigprocmask(SIG_SETMASK, &old_signals, NULL);
 				memset(&sa, 0, sizeof(sa));
 				sa.sa_handler = SIG_DFL;
-				sigaction(SIGALRM, &sa, NULL);
 				sigaction(SIGCHLD, &sa, NULL);
 				sigaction(SIGTERM, &sa, NULL);
 				child_process(exec, argv);
 			}
+			started_at = now_ms();
 			if (healthcheckdelay)
-				alarm(healthcheckdelay);
+				health_at = now_ms() + healthcheckdelay * 1000LL;
 			else if (healthchecktimer)
-				alarm(healthchecktimer);
+				health_at = now_ms() + healthchecktimer * 1000LL;
 		}
 	}
 
+	if (child_pid > 0) {
+		/* Catch up on anything that exited before we started
+		 * reaping in the signal handler */
+		while (waitpid((pid_t)(-1), NULL, WNOHANG) > 0) {}
+		syslog(LOG_INFO, "stopping %s, pid %d", exec, child_pid);
+		nkilled = run_stop_schedule(applet, NULL, NULL, child_pid, 0,
+				false, false, true);
+		if (nkilled > 0)
+			syslog(LOG_INFO, "killed %d processes", nkilled);
+	}
+
 	if (svcname) {
 		rc_service_daemon_set(svcname, exec, (const char *const *)argv,
 				pidfile, false);
@@ -683,6 +1265,629 @@ static void supervisor(char *exec, char **argv)
 		unlink(pidfile);
 	if (fifopath && exists(fifopath))
 		unlink(fifopath);
+	if (ctl_fd != -1)
+		unlink(ctlpath);
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * Shared supervisor.
+ * Instead of one supervisor per service, services started with --shared
+ * hand themselves to a single supervise-daemon process which runs all of
+ * their children from one poll loop. It is addressed over the control
+ * socket SHARED_SOCKET, picking the service by name.
+ * Children are started by running ourselves again with the command line
+ * and environment the service gave us, so they see no difference.
+ * Nothing here may wait on one service, so health checks and stop
+ * schedules are worked through from the loop as their children exit
+ * and their timeouts pass, and requests that have to wait for them are
+ * answered then.
+ */
+
+/* What to do once a service's child has been stopped */
+#define KILL_STOP		1
+#define KILL_RESTART		2
+#define KILL_RESPAWN		3
+
+struct shared_svc {
+	char *name;
+	char *exec;
+	char *pidfile;
+	char *retry;
+	struct schedule_step *steps;
+	int nsteps;
+	int kill_step;		/* where we are in steps, -1 if not stopping */
+	int kill_then;
+	long long kill_at;	/* when the current timeout in steps ends */
+	int kill_fd;		/* request to answer once it is stopped */
+	pid_t check_pid;	/* health check in progress */
+	int check_fd;		/* request to answer with its result */
+	char **args;
+	char **argv;
+	char **env;
+	int respawn_delay;
+	int respawn_max;
+	int respawn_period;
+	int respawn_delay_max;
+	int respawn_stable;
+	int respawn_step;
+	int healthcheckdelay;
+	int healthchecktimer;
+	int respawn_count;
+	int status;
+	struct usage usage;
+	time_t first_spawn;
+	pid_t pid;
+	long long started_at;
+	long long health_at;
+	long long respawn_at;
+	TAILQ_ENTRY(shared_svc) entries;
+};
+static TAILQ_HEAD(, shared_svc) shared_svcs =
+	TAILQ_HEAD_INITIALIZER(shared_svcs);
+static sigset_t shared_signals;
+
+static char **strv_add(char **strv, const char *str)
+{
+	size_t n = 0;
+
+	while (strv && strv[n])
+		n++;
+	strv = xrealloc(strv, sizeof(*strv) * (n + 2));
+	strv[n] = xstrdup(str);
+	strv[n + 1] = NULL;
+	return strv;
+}
+
+static void strv_free(char **strv)
+{
+	char **p;
+
+	for (p = strv; p && *p; p++)
+		free(*p);
+	free(strv);
+}
+
+static void shared_answer(int *fd, const char *error)
+{
+	if (*fd == -1)
+		return;
+	control_reply(*fd, NULL, error);
+	close(*fd);
+	*fd = -1;
+}
+
+static void shared_free(struct shared_svc *svc)
+{
+	shared_answer(&svc->kill_fd, "not supervised");
+	shared_answer(&svc->check_fd, "not supervised");
+	free(svc->name);
+	free(svc->exec);
+	free(svc->pidfile);
+	free(svc->retry);
+	free(svc->steps);
+	strv_free(svc->args);
+	strv_free(svc->argv);
+	strv_free(svc->env);
+	free(svc);
+}
+
+static struct shared_svc *shared_find(const char *name)
+{
+	struct shared_svc *svc;
+
+	TAILQ_FOREACH(svc, &shared_svcs, entries)
+		if (strcmp(svc->name, name) == 0)
+			return svc;
+	return NULL;
+}
+
+static void shared_spawn(struct shared_svc *svc)
+{
+	char str[20];
+	struct sigaction sa;
+
+	svc->respawn_at = 0;
+	svc->pid = fork();
+	if (svc->pid == -1) {
+		syslog(LOG_ERR, "%s: fork: %s", applet, strerror(errno));
+		svc->pid = 0;
+		svc->respawn_at = now_ms() + ONE_SECOND / ONE_MS;
+		return;
+	}
+	if (svc->pid == 0) {
+		sigprocmask(SIG_SETMASK, &shared_signals, NULL);
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = SIG_DFL;
+		sigaction(SIGCHLD, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+		environ = svc->env;
+		execvp("supervise-daemon", svc->args);
+		syslog(LOG_ERR, "Unable to execute supervise-daemon: %s",
+				strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	svc->started_at = now_ms();
+	snprintf(str, sizeof(str), "%d", svc->respawn_count);
+	rc_service_value_set(svc->name, "start_count", str);
+	if (svc->healthcheckdelay)
+		svc->health_at = now_ms() + svc->healthcheckdelay * 1000LL;
+	else if (svc->healthchecktimer)
+		svc->health_at = now_ms() + svc->healthchecktimer * 1000LL;
+}
+
+/* Forget about a service we are no longer supervising */
+static void shared_remove(struct shared_svc *svc, bool failing)
+{
+	TAILQ_REMOVE(&shared_svcs, svc, entries);
+	rc_service_daemon_set(svc->name, svc->exec,
+	    (const char *const *)svc->argv, svc->pidfile, false);
+	rc_service_value_set(svc->name, "child_pid", NULL);
+	rc_service_mark(svc->name, RC_SERVICE_STOPPED);
+	if (failing)
+		rc_service_mark(svc->name, RC_SERVICE_FAILED);
+	if (svc->pidfile && exists(svc->pidfile))
+		unlink(svc->pidfile);
+	shared_free(svc);
+}
+
+static void shared_respawn(struct shared_svc *svc);
+
+/* The child is gone, or would not go, so carry on with what we stopped
+ * it for. svc may be freed. */
+static void shared_kill_done(struct shared_svc *svc, bool gone)
+{
+	svc->kill_step = -1;
+	svc->kill_at = 0;
+	if (gone)
+		svc->pid = 0;
+	switch (svc->kill_then) {
+	case KILL_STOP:
+		shared_answer(&svc->kill_fd, NULL);
+		shared_remove(svc, false);
+		break;
+	case KILL_RESTART:
+		/* Not a crash, so this does not count as a respawn */
+		if (gone) {
+			shared_answer(&svc->kill_fd, NULL);
+			shared_spawn(svc);
+		} else
+			shared_answer(&svc->kill_fd, "unable to stop");
+		break;
+	case KILL_RESPAWN:
+		shared_answer(&svc->kill_fd, NULL);
+		if (gone)
+			shared_respawn(svc);
+		else if (svc->healthchecktimer)
+			svc->health_at = now_ms() +
+			    svc->healthchecktimer * 1000LL;
+		break;
+	}
+}
+
+/* Work through the stop schedule until we have to wait. svc may be
+ * freed. */
+static void shared_kill_step(struct shared_svc *svc, long long now)
+{
+	const struct schedule_step *step;
+
+	while (svc->kill_step < svc->nsteps) {
+		step = &svc->steps[svc->kill_step];
+		switch (step->type) {
+		case SC_SIGNAL:
+			if (step->value && kill(svc->pid, step->value) == -1)
+				syslog(LOG_ERR, "Unable to kill %d: %s",
+				    svc->pid, strerror(errno));
+			svc->kill_step++;
+			break;
+		case SC_TIMEOUT:
+			if (step->value < 1) {
+				svc->kill_step = svc->nsteps;
+				break;
+			}
+			if (!svc->kill_at)
+				svc->kill_at = now + step->value * 1000LL;
+			if (now < svc->kill_at)
+				return;
+			svc->kill_at = 0;
+			svc->kill_step++;
+			break;
+		case SC_FOREVER:
+			/* Only it exiting moves us on */
+			return;
+		default:
+			svc->kill_step++;
+			break;
+		}
+	}
+	syslog(LOG_ERR, "%s, pid %d, refused to stop", svc->exec, svc->pid);
+	shared_kill_done(svc, false);
+}
+
+/* Start stopping the child, to do then with it once it is gone. fd, if
+ * not -1, is answered then. svc may be freed. */
+static void shared_kill(struct shared_svc *svc, int then, int fd)
+{
+	svc->kill_then = then;
+	svc->kill_fd = fd;
+	svc->health_at = 0;
+	svc->respawn_at = 0;
+	if (svc->pid <= 0) {
+		shared_kill_done(svc, true);
+		return;
+	}
+	syslog(LOG_INFO, "stopping %s, pid %d", svc->exec, svc->pid);
+	svc->kill_step = 0;
+	svc->kill_at = 0;
+	shared_kill_step(svc, now_ms());
+}
+
+/* Run the health check in the background, answering fd with how it
+ * went if fd is not -1 */
+static void shared_check(struct shared_svc *svc, int fd)
+{
+	svc->health_at = 0;
+	svc->check_fd = fd;
+	if (verbose)
+		syslog(LOG_DEBUG, "running health check for %s", svc->name);
+	svc->check_pid = exec_command(svc->name, "healthcheck");
+	if (svc->check_pid > 0)
+		return;
+	/* Nothing to run, so nothing wrong */
+	svc->check_pid = 0;
+	shared_answer(&svc->check_fd, NULL);
+	if (svc->healthchecktimer)
+		svc->health_at = now_ms() + svc->healthchecktimer * 1000LL;
+}
+
+/* svc may be freed */
+static void shared_check_done(struct shared_svc *svc, int status)
+{
+	pid_t pid;
+
+	svc->check_pid = 0;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		shared_answer(&svc->check_fd, NULL);
+		if (svc->healthchecktimer && svc->kill_step == -1)
+			svc->health_at = now_ms() +
+			    svc->healthchecktimer * 1000LL;
+		return;
+	}
+	syslog(LOG_WARNING, "health check for %s failed", svc->name);
+	shared_answer(&svc->check_fd, "unhealthy");
+	/* We reap this along with everything else we do not know */
+	pid = exec_command(svc->name, "unhealthy");
+	if (pid == -1)
+		syslog(LOG_ERR, "unable to run unhealthy for %s", svc->name);
+	if (svc->kill_step == -1 && svc->pid > 0)
+		shared_kill(svc, KILL_RESPAWN, -1);
+}
+
+/* Work out when to start the service again, or give up on it */
+static void shared_respawn(struct shared_svc *svc)
+{
+	time_t respawn_now = time(NULL);
+	long long now;
+
+	svc->pid = 0;
+	svc->health_at = 0;
+	if (svc->first_spawn == 0)
+		svc->first_spawn = respawn_now;
+	if ((svc->respawn_period > 0)
+			&& (respawn_now - svc->first_spawn > svc->respawn_period)) {
+		svc->respawn_count = 0;
+		svc->first_spawn = 0;
+	} else
+		svc->respawn_count++;
+	if (svc->respawn_max > 0 && svc->respawn_count > svc->respawn_max) {
+		syslog(LOG_WARNING, "respawned \"%s\" too many times, giving up",
+				svc->exec);
+		shared_remove(svc, true);
+		return;
+	}
+	now = now_ms();
+	svc->respawn_at = now + respawn_wait(svc->respawn_delay,
+	    svc->respawn_delay_max, svc->respawn_stable, &svc->respawn_step,
+	    svc->started_at, now);
+}
+
+static struct shared_svc *shared_register(char *buf, size_t len, char *p,
+		const char *name, const char **error)
+{
+	struct shared_svc *svc;
+	char *str, *val;
+	FILE *fp;
+
+	if (shared_find(name)) {
+		*error = "already supervised";
+		return NULL;
+	}
+	svc = xmalloc(sizeof(*svc));
+	memset(svc, 0, sizeof(*svc));
+	svc->kill_step = -1;
+	svc->kill_fd = -1;
+	svc->check_fd = -1;
+	svc->name = xstrdup(name);
+	svc->respawn_max = 10;
+	svc->status = -1;
+	svc->args = strv_add(NULL, "supervise-daemon");
+	svc->args = strv_add(svc->args, name);
+	svc->args = strv_add(svc->args, "--shared-child");
+	while ((str = msg_next(buf, len, &p))) {
+		if (!(val = strchr(str, '=')))
+			continue;
+		*val++ = '\0';
+		if (strcmp(str, "arg") == 0)
+			svc->args = strv_add(svc->args, val);
+		else if (strcmp(str, "argv") == 0)
+			svc->argv = strv_add(svc->argv, val);
+		else if (strcmp(str, "env") == 0)
+			svc->env = strv_add(svc->env, val);
+		else if (strcmp(str, "exec") == 0)
+			svc->exec = xstrdup(val);
+		else if (strcmp(str, "pidfile") == 0)
+			svc->pidfile = xstrdup(val);
+		else if (strcmp(str, "retry") == 0)
+			svc->retry = xstrdup(val);
+		else if (strcmp(str, "respawn_delay") == 0)
+			svc->respawn_delay = atoi(val);
+		else if (strcmp(str, "respawn_max") == 0)
+			svc->respawn_max = atoi(val);
+		else if (strcmp(str, "respawn_period") == 0)
+			svc->respawn_period = atoi(val);
+		else if (strcmp(str, "respawn_delay_max") == 0)
+			svc->respawn_delay_max = atoi(val);
+		else if (strcmp(str, "respawn_stable") == 0)
+			svc->respawn_stable = atoi(val);
+		else if (strcmp(str, "healthcheck_delay") == 0)
+			svc->healthcheckdelay = atoi(val);
+		else if (strcmp(str, "healthcheck_timer") == 0)
+			svc->healthchecktimer = atoi(val);
+	}
+	if (!svc->exec || !svc->pidfile) {
+		*error = "incomplete request";
+		shared_free(svc);
+		return NULL;
+	}
+	if (!svc->env)
+		svc->env = strv_add(NULL, "PATH=/sbin:/bin:/usr/sbin:/usr/bin");
+	/* Our own copy, as the schedule parse_schedule makes is shared
+	 * by every service. supervise-daemon --start already checked it. */
+	parse_schedule(applet, svc->retry, SIGTERM);
+	svc->nsteps = copy_schedule(&svc->steps);
+
+	/* The service is running as long as we are */
+	if (!(fp = fopen(svc->pidfile, "w"))) {
+		*error = strerror(errno);
+		shared_free(svc);
+		return NULL;
+	}
+	fprintf(fp, "%d\n", getpid());
+	fclose(fp);
+	rc_service_value_set(svc->name, "rusage", NULL);
+	TAILQ_INSERT_TAIL(&shared_svcs, svc, entries);
+	return svc;
+}
+
+/* Returns true if we kept fd to answer later */
+static bool shared_request(int fd)
+{
+	char buf[MSG_MAX + 1];
+	char *p = buf, *cmd, *name;
+	const char *error = NULL;
+	struct shared_svc *svc;
+	struct msg reply = { NULL, 0 };
+	ssize_t len;
+
+	len = recv(fd, buf, MSG_MAX, 0);
+	if (len <= 0)
+		return false;
+	buf[len] = '\0';
+	cmd = msg_next(buf, (size_t)len, &p);
+	name = msg_next(buf, (size_t)len, &p);
+	if (!cmd || !name) {
+		error = "bad request";
+		goto out;
+	}
+	if (verbose)
+		syslog(LOG_DEBUG, "Received %s for %s", cmd, name);
+
+	if (strcmp(cmd, "start") == 0) {
+		if (exiting)
+			error = "shutting down";
+		else if ((svc = shared_register(buf, (size_t)len, p, name,
+			    &error)))
+			shared_spawn(svc);
+		goto out;
+	}
+
+	if (!(svc = shared_find(name)))
+		error = "not supervised";
+	else if (strcmp(cmd, "stop") == 0) {
+		if (svc->kill_step == -1) {
+			shared_kill(svc, KILL_STOP, fd);
+			return true;
+		}
+		/* Stop it for good once whatever is stopping it is done */
+		if (svc->kill_fd != -1)
+			error = "busy";
+		else {
+			svc->kill_then = KILL_STOP;
+			svc->kill_fd = fd;
+			return true;
+		}
+	} else if (strcmp(cmd, "sig") == 0)
+		error = control_signal(svc->pid, buf, (size_t)len, &p);
+	else if (strcmp(cmd, "status") == 0) {
+		control_status(&reply, svc->name, svc->pid,
+		    svc->respawn_count, svc->status, svc->started_at,
+		    &svc->usage);
+		control_reply(fd, &reply, NULL);
+		free(reply.buf);
+		return false;
+	} else if (strcmp(cmd, "restart") == 0) {
+		if (svc->kill_step != -1)
+			error = "busy";
+		else {
+			shared_kill(svc, KILL_RESTART, fd);
+			return true;
+		}
+	} else if (strcmp(cmd, "healthcheck") == 0) {
+		if (svc->pid <= 0 || svc->kill_step != -1)
+			error = "not running";
+		else if (svc->check_pid > 0)
+			error = "busy";
+		else {
+			shared_check(svc, fd);
+			return true;
+		}
+	} else
+		error = "unknown request";
+
+out:
+	control_reply(fd, NULL, error);
+	return false;
+}
+
+/* When we next have to do something for svc, -1 for never */
+static int shared_timeout(const struct shared_svc *svc, long long now)
+{
+	int timeout = next_timeout(now, svc->health_at, svc->respawn_at);
+	int kill_timeout = next_timeout(now, svc->kill_at, 0);
+
+	if (kill_timeout != -1 && (timeout == -1 || kill_timeout < timeout))
+		timeout = kill_timeout;
+	return timeout;
+}
+
+_dead static void shared_host(void)
+{
+	struct shared_svc *svc, *next;
+	struct pollfd pfd[2];
+	sigset_t signals;
+	struct sigaction sa;
+	struct rusage ru;
+	long long now;
+	char buf[64];
+	int lock_fd, listen_fd, fd;
+	int i, flags, status, timeout;
+	bool stopping = false;
+	pid_t pid;
+
+	applet = "supervise-daemon";
+	hosting = true;
+	openlog(applet, LOG_PID, LOG_DAEMON);
+	verbose = rc_yesno(getenv("EINFO_VERBOSE"));
+
+	/* Only one of us */
+	if ((lock_fd = open(SHARED_LOCK, O_RDWR | O_CREAT, 0600)) == -1)
+		eerrorx("%s: open `%s': %s", applet, SHARED_LOCK,
+				strerror(errno));
+	fcntl(lock_fd, F_SETFD, FD_CLOEXEC);
+	if (flock(lock_fd, LOCK_EX | LOCK_NB) == -1)
+		exit(EXIT_SUCCESS);
+	if ((listen_fd = control_listen(SHARED_SOCKET)) == -1)
+		eerrorx("%s: unable to listen on `%s': %s", applet,
+				SHARED_SOCKET, strerror(errno));
+
+	if (pipe(signal_pipe) == -1)
+		eerrorx("%s: pipe: %s", applet, strerror(errno));
+	for (i = 0; i < 2; i++) {
+		flags = fcntl(signal_pipe[i], F_GETFL, 0);
+		fcntl(signal_pipe[i], F_SETFL, flags | O_NONBLOCK);
+		fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+	sigfillset(&signals);
+	sigdelset(&signals, SIGCHLD);
+	sigdelset(&signals, SIGTERM);
+	sigprocmask(SIG_SETMASK, &signals, &shared_signals);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGCHLD, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	srandom((unsigned int)(getpid() ^ time(NULL)));
+	syslog(LOG_INFO, "shared supervisor started");
+
+	/* Once told to exit, we take everything down with us first */
+	while (!exiting || !TAILQ_EMPTY(&shared_svcs)) {
+		if (exiting && !stopping) {
+			stopping = true;
+			TAILQ_FOREACH_SAFE(svc, &shared_svcs, entries, next) {
+				if (svc->kill_step == -1)
+					shared_kill(svc, KILL_STOP, -1);
+				else
+					svc->kill_then = KILL_STOP;
+			}
+			continue;
+		}
+
+		now = now_ms();
+		timeout = -1;
+		TAILQ_FOREACH(svc, &shared_svcs, entries) {
+			i = shared_timeout(svc, now);
+			if (i != -1 && (timeout == -1 || i < timeout))
+				timeout = i;
+		}
+		pfd[0].fd = signal_pipe[0];
+		pfd[0].events = POLLIN;
+		pfd[1].fd = listen_fd;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, 2, timeout) == -1 && errno != EINTR) {
+			syslog(LOG_ERR, "poll: %s", strerror(errno));
+			break;
+		}
+		if (pfd[0].revents & POLLIN)
+			while (read(signal_pipe[0], buf, sizeof(buf)) > 0) {}
+
+		while ((pid = wait4((pid_t)(-1), &status, WNOHANG, &ru)) > 0) {
+			TAILQ_FOREACH(svc, &shared_svcs, entries)
+				if (svc->pid == pid || svc->check_pid == pid)
+					break;
+			if (!svc)
+				continue;
+			if (svc->check_pid == pid) {
+				shared_check_done(svc, status);
+				continue;
+			}
+			svc->status = status;
+			usage_add(svc->name, &svc->usage, &ru);
+			if (svc->kill_step != -1) {
+				shared_kill_done(svc, true);
+				continue;
+			}
+			if (WIFEXITED(status))
+				syslog(LOG_WARNING, "%s, pid %d, exited with return code %d",
+						svc->exec, pid, WEXITSTATUS(status));
+			else if (WIFSIGNALED(status))
+				syslog(LOG_WARNING, "%s, pid %d, terminated by signal %d",
+						svc->exec, pid, WTERMSIG(status));
+			shared_respawn(svc);
+		}
+
+		if (pfd[1].revents & POLLIN &&
+		    (fd = accept(listen_fd, NULL, NULL)) != -1)
+		{
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+			if (!shared_request(fd))
+				close(fd);
+		}
+
+		TAILQ_FOREACH_SAFE(svc, &shared_svcs, entries, next) {
+			now = now_ms();
+			if (svc->kill_step != -1) {
+				if (svc->kill_at && now >= svc->kill_at)
+					shared_kill_step(svc, now);
+				continue;
+			}
+			if (svc->pid > 0 && svc->health_at &&
+			    now >= svc->health_at && svc->check_pid == 0)
+				shared_check(svc, -1);
+			else if (svc->respawn_at && now >= svc->respawn_at)
+				shared_spawn(svc);
+		}
+	}
+
+	unlink(SHARED_SOCKET);
 	exit(EXIT_SUCCESS);
 }
 
@@ -695,6 +1900,8 @@ int main(int argc, char **argv)
 	bool stop = false;
 	bool reexec = false;
 	bool sendsig = false;
+	bool shared = false;
+	const char *request = NULL;
 	char *exec = NULL;
 	char *retry = NULL;
 	int sig = SIGTERM;
@@ -717,9 +1924,18 @@ int main(int argc, char **argv)
 	char **child_argv = NULL;
 	char *str = NULL;
 	char *cmdline = NULL;
+	char **orig_argv;
+	char *listen_arg = NULL;
+	char *affinity_arg = NULL;
+	struct msg m = { NULL, 0 };
+	struct msg reply = { NULL, 0 };
 
 	applet = basename_c(argv[0]);
 	atexit(cleanup);
+	rc_ready_init(&ready);
+	rc_limits_init(&limits);
+	if (argc == 2 && strcmp(argv[1], "--shared-host") == 0)
+		shared_host();
 	svcname = getenv("RC_SVCNAME");
 	if (!svcname)
 		eerrorx("%s: The RC_SVCNAME environment variable is not set", applet);
@@ -750,6 +1966,9 @@ int main(int argc, char **argv)
 	}
 
 	cmdline = make_cmdline(argv);
+	/* getopt may shuffle argv, but the shared supervisor needs it */
+	orig_argv = xmalloc(sizeof(*orig_argv) * (argc + 1));
+	memcpy(orig_argv, argv, sizeof(*orig_argv) * (argc + 1));
 	if (svcname) {
 		argc--;
 		argv++;
@@ -808,6 +2027,12 @@ int main(int argc, char **argv)
 			start = true;
 			break;
 
+		case 'T':  /* --respawn-stable time */
+			n = sscanf(optarg, "%d", &respawn_stable);
+			if (n	!= 1 || respawn_stable < 1)
+				eerrorx("Invalid respawn-stable value '%s'", optarg);
+			break;
+
 		case 'd':  /* --chdir /new/dir */
 			ch_dir = optarg;
 			break;
@@ -838,6 +2063,12 @@ int main(int argc, char **argv)
 				    applet, optarg);
 			break;
 
+		case 'M':  /* --respawn-delay-max time */
+			n = sscanf(optarg, "%d", &respawn_delay_max);
+			if (n	!= 1 || respawn_delay_max < 1)
+				eerrorx("Invalid respawn-delay-max value '%s'", optarg);
+			break;
+
 		case 'm':  /* --respawn-max count */
 			n = sscanf(optarg, "%d", &respawn_max);
 			if (n	!= 1 || respawn_max < 0)
@@ -906,6 +2137,62 @@ int main(int argc, char **argv)
 		case '3':  /* --reexec */
 			reexec = true;
 			break;
+		case '4':  /* --shared */
+			shared = true;
+			break;
+		case '5':  /* --shared-child */
+			shared_child = true;
+			break;
+		case '6':  /* --restart */
+			request = "restart";
+			break;
+		case '7':  /* --status */
+			request = "status";
+			break;
+		case '8':  /* --healthcheck */
+			request = "healthcheck";
+			break;
+
+		case '9':  /* --notify fd:N */
+			if (!rc_ready_parse_notify(&ready, optarg))
+				eerrorx("%s: invalid notify `%s', use fd:N"
+				    " with N of 3 or more", applet, optarg);
+			break;
+
+		case 'E':  /* --ready-check "command" */
+			ready.check = optarg;
+			break;
+
+		case 'W':  /* --ready-timeout seconds */
+			if (sscanf(optarg, "%d", &ready.timeout) != 1 ||
+			    ready.timeout <= 0)
+				eerrorx("%s: invalid ready timeout `%s'",
+				    applet, optarg);
+			break;
+
+		case 'L':  /* --listen-fds 5,6 */
+			listen_arg = optarg;
+			if ((nlisten = rc_listen_parse(optarg, listen_fds)) == -1)
+				eerrorx("%s: invalid listen fds `%s'",
+				    applet, optarg);
+			break;
+
+		case 'c':  /* --cgroup /sys/fs/cgroup/service */
+			limits.cgroup = optarg;
+			break;
+
+		case 'f':  /* --cpu-affinity 2-3,6 */
+			affinity_arg = optarg;
+			if (!rc_limits_parse_cpus(&limits, optarg))
+				eerrorx("%s: invalid cpu list `%s'",
+				    applet, optarg);
+			break;
+
+		case 'l':  /* --cgroup-limit memory.max=512M */
+			if (!rc_limits_add(&limits, optarg))
+				eerrorx("%s: invalid cgroup limit `%s'",
+				    applet, optarg);
+			break;
 
 		case_RC_COMMON_GETOPT
 		}
@@ -925,12 +2212,35 @@ int main(int argc, char **argv)
 	umask(numask);
 	if (!pidfile)
 		xasprintf(&pidfile, "/var/run/supervise-%s.pid", svcname);
+	if (shared_child) {
+		/* The shared supervisor runs us to start the daemon */
+		devnull_fd = open("/dev/null", O_RDWR);
+		child_process(exec, argv);
+	}
+	if (!shared && (stop || sendsig || request)) {
+		str = rc_service_value_get(svcname, "shared");
+		shared = rc_yesno(str);
+		free(str);
+		str = NULL;
+	}
+	/* The fifo is only used to talk to supervisors started before we
+	 * had the control socket */
 	xasprintf(&fifopath, "%s/supervise-%s.ctl", RC_SVCDIR, svcname);
-	if (mkfifo(fifopath, 0600) == -1 && errno != EEXIST)
-		eerrorx("%s: unable to create control fifo: %s",
-				applet, strerror(errno));
-
-	if (reexec) {
+	if (shared)
+		xasprintf(&ctlpath, "%s", SHARED_SOCKET);
+	else
+		xasprintf(&ctlpath, "%s/supervise-%s.sock", RC_SVCDIR, svcname);
+
+	if (request) {
+		msg_add(&m, "%s", request);
+		msg_add(&m, "%s", svcname);
+		if (!control_send(ctlpath, &m, false, &reply))
+			exit(EXIT_FAILURE);
+		for (p = reply.buf; reply.buf && p < reply.buf + reply.len;
+		    p += strlen(p) + 1)
+			printf("%s\n", p);
+		exit(EXIT_SUCCESS);
+	} else if (reexec) {
 		str = rc_service_value_get(svcname, "argc");
 		sscanf(str, "%d", &child_argc);
 		child_argv = xmalloc((child_argc + 1) * sizeof(char *));
@@ -959,8 +2269,25 @@ int main(int argc, char **argv)
 		sscanf(str, "%d", &respawn_delay);
 		str = rc_service_value_get(svcname, "respawn_max");
 		sscanf(str, "%d", &respawn_max);
+		if ((str = rc_service_value_get(svcname, "respawn_delay_max")))
+			sscanf(str, "%d", &respawn_delay_max);
+		if ((str = rc_service_value_get(svcname, "respawn_stable")))
+			sscanf(str, "%d", &respawn_stable);
+		/* Our sockets survive the exec, we just need their numbers */
+		if ((str = rc_service_value_get(svcname, "listen_fds")) &&
+		    (nlisten = rc_listen_parse(str, listen_fds)) == -1)
+			nlisten = 0;
+		/* The limits stay set on the cgroup, respawns just join it */
+		limits.cgroup = rc_service_value_get(svcname, "cgroup");
+		if ((str = rc_service_value_get(svcname, "cpu_affinity")))
+			rc_limits_parse_cpus(&limits, str);
 		supervisor(exec, child_argv);
 	} else if (start) {
+		if (rc_listen_conflicts(nlisten, ready.fd))
+			eerrorx("%s: --notify fd:%d is taken by --listen-fds",
+			    applet, ready.fd);
+		if (limits.nlimits > 0 && !limits.cgroup)
+			eerrorx("%s: --cgroup-limit needs --cgroup", applet);
 		if (exec) {
 			if (*exec == '~')
 				exec = expand_home(home, exec);
@@ -1040,12 +2367,70 @@ int main(int argc, char **argv)
 		xasprintf(&varbuf, "%i", respawn_period);
 		rc_service_value_set(svcname, "respawn_period", varbuf);
 		free(varbuf);
+		xasprintf(&varbuf, "%i", respawn_delay_max);
+		rc_service_value_set(svcname, "respawn_delay_max", varbuf);
+		free(varbuf);
+		xasprintf(&varbuf, "%i", respawn_stable);
+		rc_service_value_set(svcname, "respawn_stable", varbuf);
+		free(varbuf);
+		rc_service_value_set(svcname, "listen_fds", listen_arg);
+		rc_service_value_set(svcname, "cgroup", limits.cgroup);
+		rc_service_value_set(svcname, "cpu_affinity", affinity_arg);
+		if (shared) {
+			msg_add(&m, "start");
+			msg_add(&m, "%s", svcname);
+			msg_add(&m, "exec=%s", exec);
+			msg_add(&m, "pidfile=%s", pidfile);
+			if (retry)
+				msg_add(&m, "retry=%s", retry);
+			msg_add(&m, "respawn_delay=%d", respawn_delay);
+			msg_add(&m, "respawn_max=%d", respawn_max);
+			msg_add(&m, "respawn_period=%d", respawn_period);
+			msg_add(&m, "respawn_delay_max=%d", respawn_delay_max);
+			msg_add(&m, "respawn_stable=%d", respawn_stable);
+			msg_add(&m, "healthcheck_delay=%d", healthcheckdelay);
+			msg_add(&m, "healthcheck_timer=%d", healthchecktimer);
+			for (c = orig_argv + 2; *c; c++)
+				msg_add(&m, "arg=%s", *c);
+			for (c = argv; *c; c++)
+				msg_add(&m, "argv=%s", *c);
+			for (c = environ; *c; c++)
+				msg_add(&m, "env=%s", *c);
+			if (!control_send(SHARED_SOCKET, &m, true, NULL))
+				exit(EXIT_FAILURE);
+			rc_service_value_set(svcname, "shared", "yes");
+			rc_service_daemon_set(svcname, exec,
+			    (const char *const *)argv, pidfile, true);
+			/* The shared supervisor starts the daemon, so it
+			 * can't inherit a pipe from us */
+			if (ready.fd != -1)
+				ewarn("%s: --notify does not work with --shared",
+				    applet);
+			if (nlisten)
+				ewarn("%s: --listen-fds does not work with"
+				    " --shared", applet);
+			if (rc_ready_wanted(&ready) &&
+			    !rc_ready_wait(&ready, 0, applet, exec))
+				exit(EXIT_FAILURE);
+			exit(EXIT_SUCCESS);
+		}
+		rc_service_value_set(svcname, "shared", NULL);
+		if (rc_ready_open(&ready) == -1)
+			eerrorx("%s: pipe: %s", applet, strerror(errno));
 		child_pid = fork();
 		if (child_pid == -1)
 			eerrorx("%s: fork: %s", applet, strerror(errno));
-		if (child_pid != 0)
-			/* first parent process, do nothing. */
+		if (child_pid != 0) {
+			/* first parent process, we're done once the daemon
+			 * is ready if we were asked to wait for that */
+			if (rc_ready_wanted(&ready) &&
+			    !rc_ready_wait(&ready, child_pid, applet, exec))
+			{
+				kill(child_pid, SIGTERM);
+				exit(EXIT_FAILURE);
+			}
 			exit(EXIT_SUCCESS);
+		}
 #ifdef TIOCNOTTY
 		tty_fd = open("/dev/tty", O_RDWR);
 #endif
@@ -1072,12 +2457,17 @@ int main(int argc, char **argv)
 			rc_service_value_set(svcname, "argc", varbuf);
 			free(varbuf);
 			rc_service_value_set(svcname, "exec", exec);
+			rc_ready_close(&ready);
 			supervisor(exec, argv);
 		} else
 			child_process(exec, argv);
 	} else if (stop) {
-		pid = get_pid(applet, pidfile);
-		if (pid != -1) {
+		if (shared) {
+			msg_add(&m, "stop");
+			msg_add(&m, "%s", svcname);
+			control_send(SHARED_SOCKET, &m, false, NULL);
+			rc_service_value_set(svcname, "shared", NULL);
+		} else if ((pid = get_pid(applet, pidfile)) != -1) {
 			i = kill(pid, SIGTERM);
 			if (i != 0)
 				/* We failed to send the signal */
@@ -1105,6 +2495,12 @@ int main(int argc, char **argv)
 			rc_service_mark(svcname, RC_SERVICE_STOPPED);
 		}
 		exit(EXIT_SUCCESS);
+	} else if (sendsig && (shared || exists(ctlpath))) {
+		msg_add(&m, "sig");
+		msg_add(&m, "%s", svcname);
+		msg_add(&m, "%d", sig);
+		exit(control_send(ctlpath, &m, false, NULL) ?
+		    EXIT_SUCCESS : EXIT_FAILURE);
 	} else if (sendsig) {
 		fifo_fd = open(fifopath, O_WRONLY |O_NONBLOCK);
 		if (fifo_fd < 0)
@@ -0,0 +1,437 @@
+/*
+ * librc-bench.c
+ * Time the librc calls rc and openrc-run lean on, over synthetic service
+ * trees of a few sizes, so that we notice when one of them gets slower.
+ *
+ * Each tree has n services, svc0000 and up, all in the default runlevel.
+ * The shape says what they need:
+ *   chain    each one needs the one before
+ *   fan      each one needs svc0000
+ *   layered  layers of about sqrt(n), each one needs two from the
+ *            layer before and uses one from any layer before that
+ * The provider density is the share of services in the first half that
+ * provide one of a handful of virtual services, which that share of the
+ * second half then use.
+ *
+ * Results are printed one per line, tab separated, after a header line.
+ * Times are in nanoseconds for one call, or one pass over every service
+ * where ops is more than 1.
+ */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "helpers.h"
+#include "queue.h"
+#include "rc.h"
+#include "rc-misc.h"
+
+#define BENCH_FORMAT	"librc-bench 1"
+
+enum shape { SHAPE_CHAIN, SHAPE_FAN, SHAPE_LAYERED };
+
+static const char *const shape_names[] = { "chain", "fan", "layered" };
+
+static const char *const state_dirs[] = {
+	"started", "starting", "stopping", "inactive", "wasinactive",
+	"failed", "hotplugged", "daemons", "options", "exclusive",
+	"scheduled", "tmp", NULL
+};
+
+static enum shape shape = SHAPE_LAYERED;
+static double density = 0.1;
+static int iterations = 10;
+static uint32_t seed = 1;
+
+/* Our own generator, so a seed gives the same tree everywhere */
+static uint32_t
+bench_rand(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 0x7fff;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void
+rm_tree(const char *path)
+{
+	DIR *dp;
+	struct dirent *d;
+	char *file;
+
+	if (unlink(path) == 0 || errno == ENOENT)
+		return;
+	if ((dp = opendir(path))) {
+		while ((d = readdir(dp))) {
+			if (strcmp(d->d_name, ".") == 0 ||
+			    strcmp(d->d_name, "..") == 0)
+				continue;
+			xasprintf(&file, "%s/%s", path, d->d_name);
+			rm_tree(file);
+			free(file);
+		}
+		closedir(dp);
+	}
+	rmdir(path);
+}
+
+static void
+make_dir(const char *path)
+{
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		fprintf(stderr, "mkdir `%s': %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+write_file(const char *path, const char *data, mode_t mode)
+{
+	FILE *fp;
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "fopen `%s': %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fputs(data, fp);
+	fclose(fp);
+	chmod(path, mode);
+}
+
+/* Everything librc will look at, empty */
+static void
+tree_reset(void)
+{
+	char path[PATH_MAX];
+	size_t i;
+
+	rm_tree(RC_SYSCONFDIR);
+	rm_tree(RC_SVCDIR);
+	make_dir(RC_SYSCONFDIR);
+	make_dir(RC_INITDIR);
+	make_dir(RC_CONFDIR);
+	make_dir(RC_RUNLEVELDIR);
+	make_dir(RC_RUNLEVELDIR "/" RC_LEVEL_SYSINIT);
+	make_dir(RC_RUNLEVELDIR "/" RC_LEVEL_BOOT);
+	make_dir(RC_RUNLEVELDIR "/" RC_LEVEL_DEFAULT);
+	make_dir(RC_RUNLEVELDIR "/" RC_LEVEL_SHUTDOWN);
+	write_file(RC_CONF, "", 0644);
+	make_dir(RC_LIBEXECDIR);
+	make_dir(RC_SVCDIR);
+	for (i = 0; state_dirs[i]; i++) {
+		snprintf(path, sizeof(path), RC_SVCDIR "/%s", state_dirs[i]);
+		make_dir(path);
+	}
+	rc_runlevel_set(RC_LEVEL_DEFAULT);
+}
+
+static void
+tree_make(int n)
+{
+	char path[PATH_MAX], link[PATH_MAX];
+	char *script, *p;
+	int i, layer, width, prev, nvirt;
+	bool provider, user;
+	size_t size = 4096;
+
+	tree_reset();
+	for (width = 1; (width + 1) * (width + 1) <= n; width++)
+		;
+	nvirt = (int)(n * density / 8) + 1;
+	script = xmalloc(size);
+	for (i = 0; i < n; i++) {
+		p = script;
+		p += sprintf(p, "#!/sbin/openrc-run\n\n"
+		    "description=\"Synthetic service %d\"\n\n"
+		    "depend()\n{\n", i);
+		switch (shape) {
+		case SHAPE_CHAIN:
+			if (i > 0)
+				p += sprintf(p, "\tneed svc%04d\n", i - 1);
+			break;
+		case SHAPE_FAN:
+			if (i > 0)
+				p += sprintf(p, "\tneed svc0000\n");
+			break;
+		case SHAPE_LAYERED:
+			layer = i / width;
+			if (layer == 0)
+				break;
+			prev = (layer - 1) * width;
+			p += sprintf(p, "\tneed svc%04d svc%04d\n",
+			    prev + (int)(bench_rand() % width),
+			    prev + (int)(bench_rand() % width));
+			p += sprintf(p, "\tuse svc%04d\n",
+			    (int)(bench_rand() % (layer * width)));
+			break;
+		}
+		provider = i < n / 2 && bench_rand() < density * 0x8000;
+		user = i >= n / 2 && bench_rand() < density * 0x8000;
+		if (provider)
+			p += sprintf(p, "\tprovide virt%d\n", i % nvirt);
+		if (user)
+			p += sprintf(p, "\tuse virt%d\n",
+			    (int)(bench_rand() % nvirt));
+		sprintf(p, "}\n");
+
+		snprintf(path, sizeof(path), RC_INITDIR "/svc%04d", i);
+		write_file(path, script, 0755);
+		snprintf(link, sizeof(link),
+		    RC_RUNLEVELDIR "/" RC_LEVEL_DEFAULT "/svc%04d", i);
+		if (symlink(path, link) == -1) {
+			fprintf(stderr, "symlink `%s': %s\n",
+			    link, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(script);
+}
+
+/* Give the services a spread of states, as on a running system */
+static void
+tree_mark(int n)
+{
+	char name[16];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "svc%04d", i);
+		if (i % 7 == 3)
+			rc_service_mark(name, RC_SERVICE_INACTIVE);
+		else if (i % 3 != 0)
+			rc_service_mark(name, RC_SERVICE_STARTED);
+	}
+}
+
+static void
+deptree_forget(bool depcache)
+{
+	unlink(RC_DEPTREE_CACHE);
+	unlink(RC_DEPTREE_BINARY);
+	unlink(RC_DEPCONFIG);
+	if (depcache)
+		unlink(RC_DEPCACHE);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+report(const char *name, int n, int ops, uint64_t *t)
+{
+	qsort(t, (size_t)iterations, sizeof(*t), cmp_u64);
+	printf("%s\t%s\t%d\t%.3f\t%d\t%d\t%llu\t%llu\n",
+	    name, shape_names[shape], n, density, iterations, ops,
+	    (unsigned long long)t[0],
+	    (unsigned long long)t[iterations / 2]);
+	fflush(stdout);
+}
+
+static void
+bench_size(int n, uint64_t *t)
+{
+	RC_DEPTREE *deptree;
+	RC_STRINGLIST *list, *services, *types;
+	RC_STRING *s;
+	uint64_t start;
+	int i;
+
+	tree_make(n);
+
+	for (i = 0; i < iterations; i++) {
+		deptree_forget(true);
+		start = now_ns();
+		if (!rc_deptree_update()) {
+			fprintf(stderr, "rc_deptree_update failed\n");
+			exit(EXIT_FAILURE);
+		}
+		t[i] = now_ns() - start;
+	}
+	report("deptree_update_cold", n, 1, t);
+
+	for (i = 0; i < iterations; i++) {
+		deptree_forget(false);
+		start = now_ns();
+		rc_deptree_update();
+		t[i] = now_ns() - start;
+	}
+	report("deptree_update_cached", n, 1, t);
+
+	for (i = 0; i < iterations; i++) {
+		start = now_ns();
+		deptree = rc_deptree_load_file(RC_DEPTREE_CACHE);
+		t[i] = now_ns() - start;
+		rc_deptree_free(deptree);
+	}
+	report("deptree_load_file", n, 1, t);
+
+	if ((deptree = rc_deptree_load_file(RC_DEPTREE_CACHE)) == NULL) {
+		fprintf(stderr, "rc_deptree_load_file failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	tree_mark(n);
+
+	for (i = 0; i < iterations; i++) {
+		start = now_ns();
+		list = rc_deptree_order(deptree, RC_LEVEL_DEFAULT,
+		    RC_DEP_START);
+		t[i] = now_ns() - start;
+		rc_stringlist_free(list);
+	}
+	report("deptree_order", n, 1, t);
+
+	types = rc_stringlist_new();
+	rc_stringlist_add(types, "ineed");
+	rc_stringlist_add(types, "iuse");
+	rc_stringlist_add(types, "iafter");
+	services = rc_services_in_runlevel(RC_LEVEL_DEFAULT);
+	for (i = 0; i < iterations; i++) {
+		start = now_ns();
+		list = rc_deptree_depends(deptree, types, services,
+		    RC_LEVEL_DEFAULT, RC_DEP_START | RC_DEP_TRACE);
+		t[i] = now_ns() - start;
+		rc_stringlist_free(list);
+	}
+	report("deptree_depends", n, 1, t);
+	rc_stringlist_free(types);
+
+	for (i = 0; i < iterations; i++) {
+		start = now_ns();
+		TAILQ_FOREACH(s, services, entries)
+			rc_service_state(s->value);
+		t[i] = now_ns() - start;
+	}
+	report("service_state", n, n, t);
+	rc_stringlist_free(services);
+
+	for (i = 0; i < iterations; i++) {
+		start = now_ns();
+		list = rc_services_in_runlevel(RC_LEVEL_DEFAULT);
+		t[i] = now_ns() - start;
+		rc_stringlist_free(list);
+	}
+	report("services_in_runlevel", n, 1, t);
+
+	for (i = 0; i < iterations; i++) {
+		start = now_ns();
+		list = rc_services_in_runlevel(NULL);
+		t[i] = now_ns() - start;
+		rc_stringlist_free(list);
+	}
+	report("services_in_runlevel_all", n, 1, t);
+
+	rc_deptree_free(deptree);
+}
+
+static void _dead
+usage(int status)
+{
+	fprintf(status ? stderr : stdout,
+	    "Usage: librc-bench [-n sizes] [-s chain|fan|layered] "
+	    "[-p density] [-i iterations] [-S seed]\n");
+	exit(status);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *sizes = "50,100,500,1000,5000";
+	char *list, *p, *token, *end;
+	uint64_t *t;
+	long n;
+	size_t i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "hi:n:p:s:S:")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = atoi(optarg);
+			if (iterations < 1)
+				usage(EXIT_FAILURE);
+			break;
+		case 'n':
+			sizes = optarg;
+			break;
+		case 'p':
+			density = strtod(optarg, &end);
+			if (*end || density < 0 || density > 1)
+				usage(EXIT_FAILURE);
+			break;
+		case 's':
+			for (i = 0; i < ARRAY_SIZE(shape_names); i++)
+				if (strcmp(optarg, shape_names[i]) == 0)
+					break;
+			if (i == ARRAY_SIZE(shape_names))
+				usage(EXIT_FAILURE);
+			shape = (enum shape)i;
+			break;
+		case 'S':
+			seed = (uint32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+		default:
+			usage(EXIT_FAILURE);
+		}
+	}
+
+	/* Nothing from the environment we run in should change the results */
+	unsetenv("RC_SVCNAME");
+	unsetenv("RC_BOOTLEVEL");
+	unsetenv("RC_DEFAULTLEVEL");
+	unsetenv("RC_SYS");
+
+	t = xmalloc(sizeof(*t) * (size_t)iterations);
+	printf("# " BENCH_FORMAT "\n");
+	printf("benchmark\tshape\tservices\tdensity\titerations\tops"
+	    "\tmin_ns\tmedian_ns\n");
+	p = list = xstrdup(sizes);
+	while ((token = strsep(&p, ","))) {
+		n = strtol(token, &end, 10);
+		if (*end || n < 1 || n > 9999)
+			usage(EXIT_FAILURE);
+		bench_size((int)n, t);
+	}
+	free(list);
+	free(t);
+	tree_reset();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,306 @@
+#!/bin/sh
+# Simulate booting into a runlevel of synthetic services, to see what a
+# change to rc, openrc-run or the shell libraries does to it without
+# rebooting anything.
+#
+# OpenRC is built again with MKPREFIX=yes into tmp-boot-sim/root, so that
+# RC_SVCDIR, init.d and the runlevels all live in there, and we then time
+# "openrc bench" from nothing started, a few times over.
+#
+# Results go to stdout, one run per line, tab separated, after a header.
+#   wall_ms          from running openrc to it returning
+#   critical_ms      the longest chain of service latencies, which is as
+#                    fast as the runlevel could start
+#   efficiency       critical_ms / wall_ms
+#   forks            processes made while openrc ran, from the system wide
+#                    count in /proc/stat, so keep the machine quiet
+#   execs            programs run, if strace is there to count them
+#   openrc_cpu_ms    cpu used by rc, openrc-run and the shell libraries
+#   service_cpu_ms   cpu used by what the services themselves ran
+
+top_srcdir=${top_srcdir:-..}
+top_srcdir=$(cd "${top_srcdir}" && pwd)
+BENCHDIR=${BENCHDIR:-$(pwd)/tmp-boot-sim}
+
+services=50
+shape=layered
+latency=100
+max_latency=
+parallel=YES
+runs=3
+seed=1
+
+usage()
+{
+	cat <<-EOF
+	Usage: ${0##*/} [-n services] [-s flat|chain|fan|layered]
+	       [-l latency_ms] [-L max_latency_ms] [-P YES|NO] [-r runs]
+	       [-S seed]
+	EOF
+	exit ${1:-0}
+}
+
+while getopts hn:s:l:L:P:r:S: opt; do
+	case ${opt} in
+	n) services=${OPTARG};;
+	s) shape=${OPTARG};;
+	l) latency=${OPTARG};;
+	L) max_latency=${OPTARG};;
+	P) parallel=${OPTARG};;
+	r) runs=${OPTARG};;
+	S) seed=${OPTARG};;
+	h) usage;;
+	*) usage 1;;
+	esac
+done
+: ${max_latency:=${latency}}
+case ${shape} in
+flat|chain|fan|layered) ;;
+*) usage 1;;
+esac
+
+root=${BENCHDIR}/root
+svcdir=${root}/libexec/rc/init.d
+log=${BENCHDIR}/log
+
+say()
+{
+	echo "$*" >&2
+}
+
+# Build and install OpenRC into our prefix, unless we already have since
+# the last change
+build()
+{
+	local stamp=${BENCHDIR}/.built src=${BENCHDIR}/src
+
+	if [ -e "${stamp}" ] && [ -z "$(cd "${top_srcdir}" && find \
+	    Makefile Makefile.inc mk src sh init.d etc conf.d \
+	    -newer "${stamp}" \( -name '*.c' -o -name '*.h' -o \
+	    -name '*.in' -o -name '*.sh' -o -name '*.mk' -o -name Makefile \
+	    -o -name '*.map' \) ! -name rc.h ! -name version.h -print \
+	    2>/dev/null | head -n 1)" ]; then
+		return 0
+	fi
+
+	say "Building OpenRC in ${root}"
+	rm -rf "${src}" "${root}"
+	mkdir -p "${src}" || return 1
+	(cd "${top_srcdir}" && tar -cf - \
+	    --exclude=.git --exclude=test \
+	    --exclude='*.o' --exclude='*.So' --exclude='*.a' \
+	    --exclude='*.so' --exclude='*.so.*' --exclude=.depend .) |
+	    (cd "${src}" && tar -xf -) || return 1
+	(cd "${src}" &&
+	    ${MAKE:-make} clean &&
+	    ${MAKE:-make} MKPREFIX=yes PREFIX="${root}" &&
+	    ${MAKE:-make} MKPREFIX=yes PREFIX="${root}" install) \
+	    >"${BENCHDIR}/build.log" 2>&1 || {
+		say "Building failed, see ${BENCHDIR}/build.log"
+		return 1
+	}
+	touch "${stamp}"
+}
+
+# Our own generator, so a seed gives the same services everywhere
+rand()
+{
+	seed=$(( (seed * 1103515245 + 12345) % 2147483648 ))
+	r=$(( seed / 65536 % 32768 ))
+}
+
+# Write the services, and work out the critical path as we go as each
+# one only needs services written before it
+generate()
+{
+	local i=0 width=1 layer prev a b lat need finish f name
+	local initdir=${root}/etc/init.d
+
+	rm -rf "${root}/etc/runlevels" "${root}/etc/conf.d"
+	find "${initdir}" -type f ! -name functions.sh -exec rm -f {} +
+	for name in sysinit boot default shutdown bench; do
+		mkdir -p "${root}/etc/runlevels/${name}"
+	done
+	mkdir -p "${root}/etc/conf.d" "${root}/libexec/bench"
+	cat >"${root}/etc/rc.conf" <<-EOF
+	rc_parallel="${parallel}"
+	rc_logger="NO"
+	rc_interactive="NO"
+	EOF
+
+	# The work each service does, which reports the cpu it used
+	cat >"${root}/libexec/bench/work" <<-EOF
+	#!/bin/sh
+	[ "\$1" = 0 ] || sleep "\$1"
+	times >>"${log}/service.times"
+	EOF
+	chmod +x "${root}/libexec/bench/work"
+
+	while [ $(( (width + 1) * (width + 1) )) -le ${services} ]; do
+		width=$((width + 1))
+	done
+
+	critical=0
+	while [ ${i} -lt ${services} ]; do
+		name=$(printf "svc%04d" ${i})
+		rand
+		lat=$(( latency + (max_latency > latency ?
+		    r % (max_latency - latency + 1) : 0) ))
+		need=
+		case ${shape} in
+		chain) [ ${i} -gt 0 ] && need=$(( i - 1 ));;
+		fan) [ ${i} -gt 0 ] && need=0;;
+		layered)
+			layer=$(( i / width ))
+			if [ ${layer} -gt 0 ]; then
+				prev=$(( (layer - 1) * width ))
+				rand; a=$(( prev + r % width ))
+				rand; b=$(( prev + r % width ))
+				need="${a} ${b}"
+			fi
+			;;
+		esac
+
+		finish=0
+		for a in ${need}; do
+			eval f=\${finish_${a}}
+			[ ${f} -gt ${finish} ] && finish=${f}
+		done
+		finish=$(( finish + lat ))
+		eval finish_${i}=${finish}
+		[ ${finish} -gt ${critical} ] && critical=${finish}
+
+		{
+			echo "#!${root}/sbin/openrc-run"
+			echo
+			echo "depend()"
+			echo "{"
+			if [ -n "${need}" ]; then
+				printf "\tneed"
+				for a in ${need}; do
+					printf " svc%04d" ${a}
+				done
+				echo
+			else
+				printf "\t:\n"
+			fi
+			echo "}"
+			echo
+			echo "start()"
+			echo "{"
+			printf "\t%s/libexec/bench/work %d.%03d\n" \
+			    "${root}" $(( lat / 1000 )) $(( lat % 1000 ))
+			echo "}"
+		} >"${initdir}/${name}"
+		chmod +x "${initdir}/${name}"
+		ln -s "${initdir}/${name}" "${root}/etc/runlevels/bench/${name}"
+		i=$((i + 1))
+	done
+}
+
+now_ms()
+{
+	local ns
+
+	ns=$(date +%s%N)
+	case ${ns} in
+	*N) echo $(( $(date +%s) * 1000 ));;
+	*) echo $(( ns / 1000000 ));;
+	esac
+}
+
+# Sum the user and system times that times prints, in ms
+times_ms()
+{
+	awk '
+	function ms(t,    m, s) {
+		m = t; sub(/m.*/, "", m)
+		s = t; sub(/.*m/, "", s); sub(/s$/, "", s)
+		return (m * 60 + s) * 1000
+	}
+	{ for (i = 1; i <= NF; i++) total += ms($i) }
+	END { printf "%d\n", total }'
+}
+
+# Every run starts from nothing, as RC_SVCDIR is empty on each boot
+reset()
+{
+	rm -rf "${svcdir}" "${log}"
+	mkdir -p "${svcdir}" "${log}"
+}
+
+openrc_env()
+{
+	PATH=${root}/sbin:${root}/bin:${PATH} \
+	LD_LIBRARY_PATH=${root}/lib${LD_LIBRARY_PATH:+:}${LD_LIBRARY_PATH} \
+	    "$@"
+}
+
+# The number of forks since boot
+forks()
+{
+	local key value
+
+	while read key value; do
+		if [ "${key}" = processes ]; then
+			echo "${value}"
+			return
+		fi
+	done </proc/stat
+	echo 0
+}
+
+# One timed run
+measure()
+{
+	local start end t0 t1
+
+	t0=$(now_ms)
+	# times in a pipe would be a new shell with no children
+	times >"${log}/before.times"
+	start=$(forks)
+	openrc_env openrc bench >"${log}/openrc.log" 2>&1
+	end=$(forks)
+	times >"${log}/after.times"
+	t1=$(now_ms)
+	# Less the subshell that read end
+	echo "$((t1 - t0)) $((end - start - 1))" >"${log}/result"
+}
+
+count_execs()
+{
+	command -v strace >/dev/null 2>&1 || { echo -; return; }
+	reset
+	openrc_env strace -f -qq -o "${log}/strace" -e trace=execve \
+	    openrc bench >/dev/null 2>&1
+	grep execve "${log}/strace" | grep -c ' = 0$'
+}
+
+mkdir -p "${BENCHDIR}" || exit 1
+build || exit 1
+mkdir -p "${log}"
+say "Generating ${services} ${shape} services"
+generate
+
+echo "# boot-sim 1"
+printf "run\tshape\tservices\tlatency_ms\tmax_latency_ms\tparallel"
+printf "\twall_ms\tcritical_ms\tefficiency\tforks\texecs"
+printf "\topenrc_cpu_ms\tservice_cpu_ms\n"
+n=1
+while [ ${n} -le ${runs} ]; do
+	reset
+	measure
+	read wall forks <"${log}/result"
+	# The difference in what our children used before and after
+	total_cpu=$(( $(sed -n 2p "${log}/after.times" | times_ms) - \
+	    $(sed -n 2p "${log}/before.times" | times_ms) ))
+	service_cpu=$(cat "${log}/service.times" 2>/dev/null | times_ms)
+	execs=$(count_execs)
+	printf "%d\t%s\t%d\t%d\t%d\t%s" ${n} ${shape} ${services} \
+	    ${latency} ${max_latency} ${parallel}
+	printf "\t%d\t%d\t%s\t%s\t%s" ${wall} ${critical} \
+	    $(awk "BEGIN { printf \"%.3f\", ${wall} ? ${critical} / ${wall} : 0 }") \
+	    "${forks}" "${execs}"
+	printf "\t%d\t%d\n" $((total_cpu - service_cpu)) ${service_cpu}
+	n=$((n + 1))
+done
@@ -0,0 +1,842 @@
+/*
+ * librc-test.c
+ * Unit tests for the parts of librc the rest of OpenRC builds on.
+ *
+ * Each test prints its name and ok or the checks that failed, and we
+ * exit non zero if any of them did.
+ *
+ * The service tree is our own init.d and conf.d, which the Makefile puts
+ * under the directories built into our copy of librc. We only ever clear
+ * the runlevels and the state directory.
+ */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "helpers.h"
+#include "queue.h"
+#include "rc.h"
+#include "rc-misc.h"
+#include "librc.h"
+
+#define GENDEP		RC_LIBEXECDIR "/sh/gendepends.sh"
+
+static int failed;
+static bool test_failed;
+
+#define CHECK(expr)							\
+	do {								\
+		if (!(expr)) {						\
+			printf("\n  %s:%d: %s", __FILE__, __LINE__, #expr); \
+			test_failed = true;				\
+		}							\
+	} while (0)
+
+static void
+run(const char *name, void (*test)(void))
+{
+	printf("%s:", name);
+	test_failed = false;
+	test();
+	if (test_failed) {
+		printf("\n");
+		failed++;
+	} else
+		printf(" ok\n");
+	fflush(stdout);
+}
+
+static const char *const state_dirs[] = {
+	"started", "starting", "stopping", "inactive", "wasinactive",
+	"failed", "hotplugged", "daemons", "options", "exclusive",
+	"scheduled", "tmp", NULL
+};
+
+static void
+rm_tree(const char *path)
+{
+	DIR *dp;
+	struct dirent *d;
+	char *file;
+
+	if (unlink(path) == 0 || errno == ENOENT)
+		return;
+	if ((dp = opendir(path))) {
+		while ((d = readdir(dp))) {
+			if (strcmp(d->d_name, ".") == 0 ||
+			    strcmp(d->d_name, "..") == 0)
+				continue;
+			xasprintf(&file, "%s/%s", path, d->d_name);
+			rm_tree(file);
+			free(file);
+		}
+		closedir(dp);
+	}
+	rmdir(path);
+}
+
+static void
+make_dir(const char *path)
+{
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		fprintf(stderr, "mkdir `%s': %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* No runlevels but the usual ones, all empty, and every service stopped */
+static void
+tree_reset(void)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	size_t i;
+
+	rm_tree(RC_RUNLEVELDIR);
+	rm_tree(RC_SVCDIR);
+	make_dir(RC_RUNLEVELDIR);
+	make_dir(RC_RUNLEVELDIR "/" RC_LEVEL_SYSINIT);
+	make_dir(RC_RUNLEVELDIR "/" RC_LEVEL_BOOT);
+	make_dir(RC_RUNLEVELDIR "/" RC_LEVEL_DEFAULT);
+	make_dir(RC_RUNLEVELDIR "/" RC_LEVEL_SHUTDOWN);
+	if ((fp = fopen(RC_CONF, "w")))
+		fclose(fp);
+	make_dir(RC_LIBEXECDIR);
+	make_dir(RC_SVCDIR);
+	for (i = 0; state_dirs[i]; i++) {
+		snprintf(path, sizeof(path), RC_SVCDIR "/%s", state_dirs[i]);
+		make_dir(path);
+	}
+	rc_runlevel_set(RC_LEVEL_DEFAULT);
+}
+
+static bool
+list_equal(const RC_STRINGLIST *a, const RC_STRINGLIST *b)
+{
+	const RC_STRING *x = a ? TAILQ_FIRST(a) : NULL;
+	const RC_STRING *y = b ? TAILQ_FIRST(b) : NULL;
+
+	for (; x && y; x = TAILQ_NEXT(x, entries), y = TAILQ_NEXT(y, entries))
+		if (strcmp(x->value, y->value) != 0)
+			return false;
+	return !x && !y;
+}
+
+static void
+test_stringset_duplicates(void)
+{
+	RC_STRINGSET *set = rc_stringset_new();
+	RC_STRINGLIST *list;
+	RC_STRING *s;
+	int a, b;
+
+	CHECK(rc_stringset_count(set) == 0);
+	CHECK(!rc_stringset_find(set, "foo"));
+	CHECK(rc_stringset_add(set, "foo"));
+	CHECK(rc_stringset_add(set, "bar"));
+	errno = 0;
+	CHECK(!rc_stringset_add(set, "foo"));
+	CHECK(errno == EEXIST);
+	CHECK(rc_stringset_count(set) == 2);
+	CHECK(rc_stringset_find(set, "foo"));
+	CHECK(rc_stringset_find(set, "bar"));
+	CHECK(!rc_stringset_find(set, "fo"));
+	CHECK(!rc_stringset_find(set, "foobar"));
+
+	/* put replaces the data but keeps the one entry */
+	CHECK(rc_stringset_put(set, "baz", &a));
+	CHECK(!rc_stringset_put(set, "baz", &b));
+	CHECK(rc_stringset_get(set, "baz") == &b);
+	CHECK(rc_stringset_get(set, "foo") == NULL);
+	CHECK(rc_stringset_count(set) == 3);
+
+	list = rc_stringset_to_list(set);
+	s = TAILQ_FIRST(list);
+	CHECK(s && strcmp(s->value, "foo") == 0);
+	s = s ? TAILQ_NEXT(s, entries) : NULL;
+	CHECK(s && strcmp(s->value, "bar") == 0);
+	s = s ? TAILQ_NEXT(s, entries) : NULL;
+	CHECK(s && strcmp(s->value, "baz") == 0);
+	CHECK(!s || !TAILQ_NEXT(s, entries));
+	rc_stringlist_free(list);
+	rc_stringset_free(set);
+
+	list = rc_stringlist_new();
+	rc_stringlist_add(list, "one");
+	rc_stringlist_add(list, "two");
+	rc_stringlist_add(list, "one");
+	set = rc_stringset_from_list(list);
+	CHECK(rc_stringset_count(set) == 2);
+	CHECK(rc_stringset_find(set, "one"));
+	CHECK(rc_stringset_find(set, "two"));
+	rc_stringset_free(set);
+	rc_stringlist_free(list);
+
+	/* A missing set is an empty one */
+	CHECK(rc_stringset_count(NULL) == 0);
+	CHECK(!rc_stringset_find(NULL, "foo"));
+	CHECK(rc_stringset_get(NULL, "foo") == NULL);
+}
+
+#define NGROW	5000
+
+static void
+test_stringset_growth(void)
+{
+	RC_STRINGSET *set = rc_stringset_new();
+	RC_STRINGLIST *list;
+	RC_STRING *s;
+	static int data[NGROW];
+	char name[32];
+	int i;
+	bool ok;
+
+	/* Enough to go through several rehashes */
+	for (i = 0; i < NGROW; i++) {
+		snprintf(name, sizeof(name), "svc%d", i);
+		CHECK(rc_stringset_put(set, name, &data[i]));
+	}
+	CHECK(rc_stringset_count(set) == NGROW);
+
+	ok = true;
+	for (i = 0; i < NGROW; i++) {
+		snprintf(name, sizeof(name), "svc%d", i);
+		if (rc_stringset_get(set, name) != &data[i])
+			ok = false;
+		snprintf(name, sizeof(name), "svc%d.x", i);
+		if (rc_stringset_find(set, name))
+			ok = false;
+	}
+	CHECK(ok);
+
+	/* Entries keep the order they were added in */
+	list = rc_stringset_to_list(set);
+	i = 0;
+	ok = true;
+	TAILQ_FOREACH(s, list, entries) {
+		snprintf(name, sizeof(name), "svc%d", i++);
+		if (strcmp(s->value, name) != 0)
+			ok = false;
+	}
+	CHECK(ok);
+	CHECK(i == NGROW);
+	rc_stringlist_free(list);
+	rc_stringset_free(set);
+}
+
+static void
+test_stringset_delete(void)
+{
+	RC_STRINGSET *set = rc_stringset_new();
+	RC_STRINGLIST *list;
+	RC_STRING *s;
+	char name[32];
+	int i, round;
+	bool ok;
+
+	for (i = 0; i < NGROW; i++) {
+		snprintf(name, sizeof(name), "svc%d", i);
+		rc_stringset_add(set, name);
+	}
+	for (i = 0; i < NGROW; i += 2) {
+		snprintf(name, sizeof(name), "svc%d", i);
+		CHECK(rc_stringset_delete(set, name));
+	}
+	errno = 0;
+	CHECK(!rc_stringset_delete(set, "svc0"));
+	CHECK(errno == EEXIST);
+	CHECK(rc_stringset_count(set) == NGROW / 2);
+
+	ok = true;
+	for (i = 0; i < NGROW; i++) {
+		snprintf(name, sizeof(name), "svc%d", i);
+		if (rc_stringset_find(set, name) != (i % 2 == 1))
+			ok = false;
+	}
+	CHECK(ok);
+
+	/* Deleting and adding back over and over reuses the deleted
+	 * slots and rehashes them away without losing anything */
+	ok = true;
+	for (round = 0; round < 10; round++) {
+		for (i = 0; i < NGROW; i += 2) {
+			snprintf(name, sizeof(name), "svc%d", i);
+			if (!rc_stringset_add(set, name))
+				ok = false;
+		}
+		for (i = 0; i < NGROW; i += 2) {
+			snprintf(name, sizeof(name), "svc%d", i);
+			if (!rc_stringset_delete(set, name))
+				ok = false;
+		}
+	}
+	CHECK(ok);
+	CHECK(rc_stringset_count(set) == NGROW / 2);
+
+	list = rc_stringset_to_list(set);
+	i = 1;
+	ok = true;
+	TAILQ_FOREACH(s, list, entries) {
+		snprintf(name, sizeof(name), "svc%d", i);
+		if (strcmp(s->value, name) != 0)
+			ok = false;
+		i += 2;
+	}
+	CHECK(ok);
+	CHECK(i == NGROW + 1);
+	rc_stringlist_free(list);
+	rc_stringset_free(set);
+}
+
+static void
+test_arena(void)
+{
+	RC_ARENA *arena;
+	RC_STRINGLIST *list;
+	RC_STRING *s;
+	char **strs, name[32], *p, *q, *big;
+	int i, round;
+	bool ok;
+
+	arena_free(NULL);
+
+	/* Free and start again, as a deptree does on each reload */
+	for (round = 0; round < 3; round++) {
+		arena = arena_new();
+		strs = xmalloc(sizeof(*strs) * NGROW);
+		for (i = 0; i < NGROW; i++) {
+			snprintf(name, sizeof(name), "%d-%d", round, i);
+			strs[i] = arena_strdup(arena, name);
+		}
+		ok = true;
+		for (i = 0; i < NGROW; i++) {
+			snprintf(name, sizeof(name), "%d-%d", round, i);
+			if (strcmp(strs[i], name) != 0)
+				ok = false;
+		}
+		CHECK(ok);
+		free(strs);
+		arena_free(arena);
+	}
+
+	arena = arena_new();
+	ok = true;
+	for (i = 1; i < 200; i++) {
+		p = arena_alloc(arena, (size_t)i);
+		if ((uintptr_t)p % sizeof(void *) != 0 ||
+		    (uintptr_t)p % sizeof(long long) != 0 ||
+		    (uintptr_t)p % sizeof(double) != 0)
+			ok = false;
+		memset(p, 0xa5, (size_t)i);
+	}
+	CHECK(ok);
+
+	/* A big request goes in a block of its own and we carry on
+	 * filling the current one after it */
+	p = arena_alloc(arena, 8);
+	big = arena_alloc(arena, 64 * 1024);
+	memset(big, 0x5a, 64 * 1024);
+	q = arena_alloc(arena, 8);
+	CHECK(q == p + 8);
+	CHECK(big[0] == 0x5a && big[64 * 1024 - 1] == 0x5a);
+
+	list = arena_stringlist_new(arena);
+	CHECK(TAILQ_EMPTY(list));
+	arena_stringlist_add(arena, list, arena_strdup(arena, "a"));
+	arena_stringlist_add(arena, list, arena_strdup(arena, "b"));
+	s = TAILQ_FIRST(list);
+	CHECK(s && strcmp(s->value, "a") == 0);
+	s = s ? TAILQ_NEXT(s, entries) : NULL;
+	CHECK(s && strcmp(s->value, "b") == 0);
+	CHECK(!s || !TAILQ_NEXT(s, entries));
+	arena_free(arena);
+}
+
+static void
+test_services_state_all(void)
+{
+	RC_SERVICE_STATES *states;
+	RC_STRINGLIST *services;
+	RC_STRING *s;
+	bool ok;
+
+	tree_reset();
+	CHECK(rc_service_mark("hostname", RC_SERVICE_STARTED));
+	CHECK(rc_service_mark("localmount", RC_SERVICE_STARTING));
+	CHECK(rc_service_mark("netmount", RC_SERVICE_INACTIVE));
+	CHECK(rc_service_mark("local", RC_SERVICE_STOPPING));
+	CHECK(rc_service_mark("fsck", RC_SERVICE_STARTED));
+	CHECK(rc_service_mark("fsck", RC_SERVICE_FAILED));
+	CHECK(rc_service_mark("network", RC_SERVICE_HOTPLUGGED));
+	CHECK(rc_service_schedule_start("netmount", "staticroute"));
+
+	states = rc_services_state_all();
+	services = rc_services_in_runlevel(NULL);
+	CHECK(!TAILQ_EMPTY(services));
+	ok = true;
+	TAILQ_FOREACH(s, services, entries)
+		if (rc_services_state_get(states, s->value) !=
+		    rc_service_state(s->value))
+		{
+			printf("\n  %s: %#x, not %#x", s->value,
+			    rc_services_state_get(states, s->value),
+			    rc_service_state(s->value));
+			ok = false;
+		}
+	CHECK(ok);
+	CHECK(rc_services_state_get(states, "hostname") & RC_SERVICE_STARTED);
+	CHECK(rc_services_state_get(states, "staticroute") &
+	    RC_SERVICE_SCHEDULED);
+	CHECK(rc_services_state_get(states, "nosuchservice") ==
+	    rc_service_state("nosuchservice"));
+
+	/* What we snapshot stays as it was */
+	CHECK(rc_service_mark("hostname", RC_SERVICE_STOPPED));
+	CHECK(rc_services_state_get(states, "hostname") & RC_SERVICE_STARTED);
+	rc_services_state_free(states);
+	rc_stringlist_free(services);
+
+	states = rc_services_state_all();
+	CHECK(rc_services_state_get(states, "hostname") & RC_SERVICE_STOPPED);
+	rc_services_state_free(states);
+	rc_services_state_free(NULL);
+}
+
+static void
+test_runlevel_members(void)
+{
+	RC_RUNLEVEL_MEMBERS *members;
+	RC_STRINGLIST *runlevels, *services, *list;
+	RC_STRING *s, *r;
+	bool ok;
+
+	tree_reset();
+	CHECK(rc_service_add(RC_LEVEL_BOOT, "hostname"));
+	CHECK(rc_service_add(RC_LEVEL_BOOT, "localmount"));
+	CHECK(rc_service_add(RC_LEVEL_DEFAULT, "netmount"));
+	CHECK(rc_service_add(RC_LEVEL_DEFAULT, "local"));
+	CHECK(rc_service_add(RC_LEVEL_DEFAULT, "localmount"));
+	make_dir(RC_RUNLEVELDIR "/extra");
+	CHECK(rc_service_add("extra", "network"));
+	CHECK(rc_runlevel_stack("extra", RC_LEVEL_DEFAULT));
+
+	runlevels = rc_stringlist_new();
+	rc_stringlist_add(runlevels, RC_LEVEL_DEFAULT);
+	rc_stringlist_add(runlevels, RC_LEVEL_BOOT);
+	rc_stringlist_add(runlevels, "extra");
+	rc_stringlist_add(runlevels, "nosuchlevel");
+	rc_stringlist_add(runlevels, RC_LEVEL_BOOT);
+	members = rc_runlevel_members(runlevels);
+
+	services = rc_services_in_runlevel(NULL);
+	ok = true;
+	TAILQ_FOREACH(s, services, entries)
+		TAILQ_FOREACH(r, runlevels, entries)
+			if (rc_runlevel_members_has(members, r->value,
+			    s->value) !=
+			    rc_service_in_runlevel(s->value, r->value))
+			{
+				printf("\n  %s in %s", s->value, r->value);
+				ok = false;
+			}
+	CHECK(ok);
+	rc_stringlist_free(services);
+
+	/* In the order asked for, each runlevel once */
+	list = rc_runlevel_members_get(members, "localmount");
+	s = TAILQ_FIRST(list);
+	CHECK(s && strcmp(s->value, RC_LEVEL_DEFAULT) == 0);
+	s = s ? TAILQ_NEXT(s, entries) : NULL;
+	CHECK(s && strcmp(s->value, RC_LEVEL_BOOT) == 0);
+	CHECK(!s || !TAILQ_NEXT(s, entries));
+	rc_stringlist_free(list);
+	list = rc_runlevel_members_get(members, "fsck");
+	CHECK(!list || TAILQ_EMPTY(list));
+	rc_stringlist_free(list);
+
+	rc_runlevel_members_free(members);
+	rc_stringlist_free(runlevels);
+
+	/* All of them when we do not say */
+	members = rc_runlevel_members(NULL);
+	CHECK(rc_runlevel_members_has(members, "extra", "network"));
+	CHECK(rc_runlevel_members_has(members, RC_LEVEL_BOOT, "hostname"));
+	CHECK(!rc_runlevel_members_has(members, RC_LEVEL_BOOT, "local"));
+	rc_runlevel_members_free(members);
+}
+
+static const char *const dep_types[] = {
+	"ineed", "needsme", "iuse", "usesme", "iwant", "wantsme",
+	"iafter", "ibefore", "iprovide", "keyword", "config", "broken",
+	"listen", "status", NULL
+};
+
+static bool
+deptree_equal(const RC_DEPTREE *a, const RC_DEPTREE *b)
+{
+	RC_STRINGLIST *services, *x, *y;
+	RC_STRING *s;
+	const char *const levels[] = {
+		RC_LEVEL_SYSINIT, RC_LEVEL_BOOT, RC_LEVEL_DEFAULT,
+		RC_LEVEL_SHUTDOWN, NULL
+	};
+	bool ok = true;
+	size_t i;
+
+	services = rc_services_in_runlevel(NULL);
+	TAILQ_FOREACH(s, services, entries)
+		for (i = 0; dep_types[i]; i++) {
+			x = rc_deptree_depend(a, s->value, dep_types[i]);
+			y = rc_deptree_depend(b, s->value, dep_types[i]);
+			if (!list_equal(x, y)) {
+				printf("\n  %s %s differs", s->value,
+				    dep_types[i]);
+				ok = false;
+			}
+			rc_stringlist_free(x);
+			rc_stringlist_free(y);
+		}
+	rc_stringlist_free(services);
+
+	for (i = 0; levels[i]; i++) {
+		x = rc_deptree_order(a, levels[i], RC_DEP_START);
+		y = rc_deptree_order(b, levels[i], RC_DEP_START);
+		if (!list_equal(x, y)) {
+			printf("\n  %s order differs", levels[i]);
+			ok = false;
+		}
+		rc_stringlist_free(x);
+		rc_stringlist_free(y);
+	}
+	return ok;
+}
+
+static void
+test_deptree_load_fd(void)
+{
+	RC_DEPTREE *text, *tree;
+	RC_STRINGLIST *list;
+	int fd, bad;
+
+	/* Most of our init scripts are left out of a prefixed tree */
+	tree_reset();
+	CHECK(rc_service_add(RC_LEVEL_BOOT, "osclock"));
+	CHECK(rc_service_add(RC_LEVEL_BOOT, "savecache"));
+	CHECK(rc_service_add(RC_LEVEL_DEFAULT, "rpcbind"));
+	CHECK(rc_service_add(RC_LEVEL_DEFAULT, "nscd"));
+	CHECK(rc_service_add(RC_LEVEL_DEFAULT, "local"));
+	CHECK(rc_deptree_update());
+
+	/* Compare what we pass on with what we parse from the text */
+	unlink(RC_DEPTREE_BINARY);
+	text = rc_deptree_load_file(RC_DEPTREE_CACHE);
+	CHECK(text != NULL);
+	if (!text)
+		return;
+	list = rc_deptree_depend(text, "rpcbind", "iprovide");
+	CHECK(list && rc_stringlist_find(list, "rpc"));
+	rc_stringlist_free(list);
+
+	fd = rc_deptree_memfd(text);
+	CHECK(fd != -1);
+	if (fd != -1) {
+		CHECK(fcntl(fd, F_GETFD) & FD_CLOEXEC);
+		tree = rc_deptree_load_fd(fd);
+		CHECK(tree != NULL);
+		if (tree) {
+			CHECK(deptree_equal(text, tree));
+			rc_deptree_free(tree);
+		}
+
+		/* The fd is still ours, and good for another load */
+		CHECK(fcntl(fd, F_GETFD) != -1);
+		tree = rc_deptree_load_fd(fd);
+		CHECK(tree != NULL);
+		rc_deptree_free(tree);
+		close(fd);
+	}
+	rc_deptree_free(text);
+
+	bad = open("/dev/null", O_RDONLY);
+	CHECK(rc_deptree_load_fd(bad) == NULL);
+	close(bad);
+	CHECK(rc_deptree_load_fd(-1) == NULL);
+}
+
+static void
+test_deptree_order_runlevel(void)
+{
+	const int options = RC_DEP_STRICT | RC_DEP_TRACE | RC_DEP_START;
+	RC_DEPTREE *tree;
+	RC_STRINGLIST *list, *again;
+	char file[PATH_MAX];
+	struct stat st1, st2;
+
+	tree_reset();
+	CHECK(rc_service_add(RC_LEVEL_BOOT, "osclock"));
+	CHECK(rc_service_add(RC_LEVEL_DEFAULT, "rpcbind"));
+	CHECK(rc_service_add(RC_LEVEL_DEFAULT, "nscd"));
+	CHECK(rc_service_add(RC_LEVEL_DEFAULT, "local"));
+	CHECK(rc_deptree_update());
+
+	/* The update has already worked out every runlevel */
+	snprintf(file, sizeof(file), RC_SVCDIR "/order/%s.%d",
+	    RC_LEVEL_DEFAULT, options);
+	CHECK(stat(file, &st1) == 0);
+	tree = rc_deptree_load();
+	CHECK(tree != NULL);
+	if (!tree)
+		return;
+	list = rc_deptree_order_runlevel(tree, RC_LEVEL_DEFAULT, options);
+	CHECK(rc_stringlist_find(list, "rpcbind"));
+	CHECK(rc_stringlist_find(list, "nscd"));
+	CHECK(rc_stringlist_find(list, "local"));
+
+	/* Service state makes no difference to the order or its cache */
+	CHECK(rc_service_mark("rpcbind", RC_SERVICE_STARTED));
+	CHECK(rc_service_mark("nscd", RC_SERVICE_STARTING));
+	again = rc_deptree_order_runlevel(tree, RC_LEVEL_DEFAULT, options);
+	CHECK(list_equal(list, again));
+	rc_stringlist_free(again);
+	CHECK(stat(file, &st2) == 0);
+	CHECK(st1.st_ino == st2.st_ino);
+
+	/* Whoever asks is left out */
+	setenv("RC_SVCNAME", "nscd", 1);
+	again = rc_deptree_order_runlevel(tree, RC_LEVEL_DEFAULT, options);
+	unsetenv("RC_SVCNAME");
+	CHECK(!rc_stringlist_find(again, "nscd"));
+	CHECK(rc_stringlist_find(again, "rpcbind"));
+	rc_stringlist_free(again);
+	rc_stringlist_free(list);
+
+	/* Changing the runlevel does */
+	CHECK(rc_service_delete(RC_LEVEL_DEFAULT, "local"));
+	list = rc_deptree_order_runlevel(tree, RC_LEVEL_DEFAULT, options);
+	CHECK(!rc_stringlist_find(list, "local"));
+	rc_stringlist_free(list);
+	rc_deptree_free(tree);
+}
+
+/* Has pid exec'd sleep arg yet */
+static bool
+is_sleep(pid_t pid, const char *arg)
+{
+	char file[PATH_MAX], buf[64];
+	ssize_t len = -1;
+	int fd;
+
+	snprintf(file, sizeof(file), "/proc/%d/cmdline", (int)pid);
+	if ((fd = open(file, O_RDONLY)) != -1) {
+		len = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+	}
+	return len > 6 && strcmp(buf, "sleep") == 0 &&
+	    strcmp(buf + 6, arg) == 0;
+}
+
+static pid_t
+spawn_sleep(const char *arg)
+{
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		execlp("sleep", "sleep", arg, (char *)NULL);
+		_exit(EXIT_FAILURE);
+	}
+	/* Wait for the exec so the snapshot sees the new name */
+	while (pid > 0 && !is_sleep(pid, arg))
+		usleep(1000);
+	return pid;
+}
+
+static bool
+pids_have(const RC_PIDLIST *pids, pid_t pid)
+{
+	const RC_PID *pi;
+
+	if (pids)
+		LIST_FOREACH(pi, pids, entries)
+			if (pi->pid == pid)
+				return true;
+	return false;
+}
+
+static size_t
+pids_free(RC_PIDLIST *pids)
+{
+	RC_PID *pi, *np;
+	size_t n = 0;
+
+	if (!pids)
+		return 0;
+	LIST_FOREACH_SAFE(pi, pids, entries, np) {
+		n++;
+		free(pi);
+	}
+	free(pids);
+	return n;
+}
+
+static void
+test_find_pids_snapshot(void)
+{
+	const char *const argv[] = { "sleep", "31337", NULL };
+	RC_PIDLIST *pids;
+	pid_t before, after;
+
+	tree_reset();
+	before = spawn_sleep("31337");
+	CHECK(rc_proc_snapshot_begin());
+	after = spawn_sleep("31337");
+
+	/* One from the snapshot, one only found by looking at /proc */
+	pids = rc_find_pids(NULL, argv, 0, 0);
+	CHECK(pids_have(pids, before));
+	CHECK(pids_have(pids, after));
+	CHECK(pids_free(pids) == 2);
+
+	kill(before, SIGKILL);
+	waitpid(before, NULL, 0);
+	pids = rc_find_pids(NULL, argv, 0, 0);
+	CHECK(!pids_have(pids, before));
+	CHECK(pids_have(pids, after));
+	CHECK(pids_free(pids) == 1);
+
+	rc_proc_snapshot_end();
+	kill(after, SIGKILL);
+	waitpid(after, NULL, 0);
+	pids = rc_find_pids(NULL, argv, 0, 0);
+	CHECK(pids_free(pids) == 0);
+}
+
+/* What gendepends.sh says about one init script, less the line with
+ * its path */
+static char *
+gendepends_sh(const char *path, size_t *len)
+{
+	char buf[BUFSIZ], *out = NULL, *p;
+	size_t size = 0;
+	ssize_t nr;
+	int fds[2], status;
+	pid_t pid;
+
+	if (pipe(fds) == -1)
+		return NULL;
+	if ((pid = fork()) == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execl(GENDEP, GENDEP, path, (char *)NULL);
+		_exit(127);
+	}
+	close(fds[1]);
+	while ((nr = read(fds[0], buf, sizeof(buf))) > 0 ||
+	    (nr == -1 && errno == EINTR))
+	{
+		if (nr <= 0)
+			continue;
+		out = xrealloc(out, size + (size_t)nr + 1);
+		memcpy(out + size, buf, (size_t)nr);
+		size += (size_t)nr;
+	}
+	close(fds[0]);
+	if (pid == -1 || waitpid(pid, &status, 0) == -1 ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !out)
+	{
+		free(out);
+		return NULL;
+	}
+	out[size] = '\0';
+	p = strchr(out, '\n');
+	p = p ? p + 1 : out + size;
+	*len = size - (size_t)(p - out);
+	memmove(out, p, *len + 1);
+	return out;
+}
+
+static void
+test_gendep_native(void)
+{
+	GENDEP_CONF *conf;
+	struct dirent **files = NULL;
+	char path[PATH_MAX], *native, *shell;
+	size_t nlen, slen;
+	int n, i, nnative = 0;
+	bool ok = true;
+
+	tree_reset();
+	conf = gendep_conf_load();
+	CHECK(conf != NULL);
+	if (!conf)
+		return;
+	CHECK((n = scandir(RC_INITDIR, &files, NULL, alphasort)) > 0);
+	for (i = 0; i < n; i++) {
+		if (files[i]->d_name[0] == '.') {
+			free(files[i]);
+			continue;
+		}
+		snprintf(path, sizeof(path), RC_INITDIR "/%s",
+		    files[i]->d_name);
+		free(files[i]);
+
+		/* Scripts it cannot do on its own go to the shell anyway */
+		if (!(native = gendep_native(conf, path, &nlen)))
+			continue;
+		nnative++;
+		shell = gendepends_sh(path, &slen);
+		if (!shell || nlen != slen || memcmp(native, shell, nlen) != 0)
+		{
+			printf("\n  %s:\n--- native\n%.*s--- shell\n%s",
+			    path, (int)nlen, native, shell ? shell : "");
+			ok = false;
+		}
+		free(native);
+		free(shell);
+	}
+	free(files);
+	gendep_conf_free(conf);
+	CHECK(ok);
+	/* Most of ours are simple enough */
+	CHECK(nnative > n / 2);
+}
+
+int
+main(void)
+{
+	run("stringset_duplicates", test_stringset_duplicates);
+	run("stringset_growth", test_stringset_growth);
+	run("stringset_delete", test_stringset_delete);
+	run("arena", test_arena);
+	run("services_state_all", test_services_state_all);
+	run("runlevel_members", test_runlevel_members);
+	run("find_pids_snapshot", test_find_pids_snapshot);
+	run("deptree_load_fd", test_deptree_load_fd);
+	run("deptree_order_runlevel", test_deptree_order_runlevel);
+	run("gendep_native", test_gendep_native);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
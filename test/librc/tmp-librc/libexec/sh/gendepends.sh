@@ -0,0 +1,170 @@
+#!/bin/sh
+# Shell wrapper to list our dependencies
+
+# Copyright (c) 2007-2015 The OpenRC Authors.
+# See the Authors file at the top-level directory of this distribution and
+# https://github.com/OpenRC/openrc/blob/master/AUTHORS
+#
+# This file is part of OpenRC. It is subject to the license terms in
+# the LICENSE file found in the top-level directory of this
+# distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+# This file may not be copied, modified, propagated, or distributed
+#    except according to the terms contained in the LICENSE file.
+
+. /root/repo/test/librc/tmp-librc/libexec/sh/functions.sh
+. /root/repo/test/librc/tmp-librc/libexec/sh/rc-functions.sh
+
+config() {
+	[ -n "$*" ] && echo "$RC_SVCNAME config $*" >&3
+}
+need() {
+	[ -n "$*" ] && echo "$RC_SVCNAME ineed $*" >&3
+}
+use() {
+	[ -n "$*" ] && echo "$RC_SVCNAME iuse $*" >&3
+}
+want() {
+	[ -n "$*" ] && echo "$RC_SVCNAME iwant $*" >&3
+}
+before() {
+	[ -n "$*" ] && echo "$RC_SVCNAME ibefore $*" >&3
+}
+after() {
+	[ -n "$*" ] && echo "$RC_SVCNAME iafter $*" >&3
+}
+provide() {
+	[ -n "$*" ] && echo "$RC_SVCNAME iprovide $*" >&3
+}
+listen() {
+	[ -n "$*" ] && echo "$RC_SVCNAME listen $*" >&3
+}
+keyword() {
+	local c x
+	set -- $*
+	while [ -n "$*" ]; do
+		case "$1" in
+			-containers) x="$(_get_containers)" ;;
+			!-containers) x="$(_get_containers_remove)" ;;
+			*) x=$1 ;;
+		esac
+		c="${c}${x} "
+		shift
+	done
+	[ -n "$c" ] && echo "$RC_SVCNAME keyword $c" >&3
+}
+depend() {
+	:
+}
+
+# Tell openrc-run it can answer status itself when the service leaves it
+# to a supervisor it knows about
+_status() {
+	local _f
+	for _f in status status_pre status_post; do
+		case "$(type $_f 2>/dev/null)" in
+			*function*) return ;;
+		esac
+	done
+	case "$supervisor" in
+		""|start-stop-daemon) ;;
+		supervise-daemon) ;;
+		*) return ;;
+	esac
+	echo "$RC_SVCNAME status ${supervisor:-start-stop-daemon}" >&3
+}
+
+# Only generate dependencies for OpenRC scripts
+_openrc_script() {
+	local one two three
+	[ -x "$1" -a -f "$1" ] || return 1
+	read one two three <"$1"
+	case "$one" in
+		\#*/openrc-run) ;;
+		\#*/runscript) ;;
+		\#!)
+			case "$two" in
+				*/openrc-run) ;;
+				*/runscript) ;;
+				*) return 1 ;;
+			esac
+			;;
+		*) return 1 ;;
+	esac
+}
+
+# Print the dependencies of $_dir/$RC_SERVICE
+_gendepends() {
+	RC_SVCNAME=${RC_SERVICE##*/} ; export RC_SVCNAME
+
+	# Compat
+	SVCNAME=$RC_SVCNAME ; export SVCNAME
+
+	(
+	# Save stdout in fd3, then remap it to stderr
+	exec 3>&1 1>&2
+
+	_rc_c=${RC_SVCNAME%%.*}
+	if [ -n "$_rc_c" -a "$_rc_c" != "$RC_SVCNAME" ]; then
+		if [ -e "$_dir/../conf.d/$_rc_c" ]; then
+			. "$_dir/../conf.d/$_rc_c"
+		fi
+	fi
+	unset _rc_c
+
+	if [ -e "$_dir/../conf.d/$RC_SVCNAME" ]; then
+		. "$_dir/../conf.d/$RC_SVCNAME"
+	fi
+
+	[ -e /root/repo/test/librc/tmp-librc/etc/rc.conf ] && . /root/repo/test/librc/tmp-librc/etc/rc.conf
+	if [ -d "/root/repo/test/librc/tmp-librc/etc/rc.conf.d" ]; then
+		for _f in "/root/repo/test/librc/tmp-librc/etc"/rc.conf.d/*.conf; do
+			[ -e "$_f" ] && . "$_f"
+		done
+	fi
+
+	if . "$_dir/$RC_SVCNAME"; then
+		echo "$RC_SVCNAME" >&3
+		_depend
+		_status
+	fi
+	)
+}
+
+# If we are given init scripts then just do those, printing the path of
+# each one before its dependencies so they can be told apart.
+if [ $# -gt 0 -a "$1" != "--list" ]; then
+	for _path; do
+		echo "$_path"
+		_dir=${_path%/*}
+		RC_SERVICE=${_path##*/}
+		cd "$_dir" && _openrc_script "$RC_SERVICE" && _gendepends
+	done
+	exit 0
+fi
+
+_done_dirs=
+for _dir in \
+/root/repo/test/librc/tmp-librc/etc/init.d \
+/etc/init.d \
+/root/repo/test/librc/tmp-librc/local/etc/init.d
+do
+	[ -d "$_dir" ] || continue
+
+	# Don't do the same dir twice
+	for _d in $_done_dirs; do
+		[ "$_d" = "$_dir" ] && continue 2
+	done
+	unset _d
+	_done_dirs="$_done_dirs $_dir"
+
+	cd "$_dir"
+	for RC_SERVICE in *; do
+		_openrc_script "$RC_SERVICE" || continue
+		# With --list we only say which init scripts we would use
+		if [ "$1" = "--list" ]; then
+			echo "$_dir/$RC_SERVICE"
+		else
+			_gendepends
+		fi
+	done
+done
@@ -0,0 +1,2502 @@
+/*
+ *  librc-depend
+ *  rc service dependency and ordering
+   */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+
+#ifdef __linux__
+# include <sys/syscall.h>
+# ifndef MFD_CLOEXEC
+#  define MFD_CLOEXEC		0x0001U
+#  define MFD_ALLOW_SEALING	0x0002U
+# endif
+# ifndef F_ADD_SEALS
+#  define F_ADD_SEALS		1033
+#  define F_SEAL_SEAL		0x0001
+#  define F_SEAL_SHRINK		0x0002
+#  define F_SEAL_GROW		0x0004
+#  define F_SEAL_WRITE		0x0008
+# endif
+#endif
+
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+
+#include "queue.h"
+#include "librc.h"
+
+#define GENDEP          RC_LIBEXECDIR "/sh/gendepends.sh"
+#define GENDEP_MAX_WORKERS	64
+
+
+/* Binary deptree cache.
+ * This holds the same data as the shell parseable cache, but laid out as
+ * flat tables so it can be mapped and used without any parsing.
+ * Each service owns the next run of dependency types and each type owns
+ * the next run of references into the string table, which stores every
+ * name once. We only trust it when it was written after the shell
+ * parseable cache and matches its size. */
+#define DEPTREE_BIN_MAGIC	"RCDTREE"
+#define DEPTREE_BIN_VERSION	1
+
+struct deptree_bin_header {
+	char magic[8];
+	uint64_t size;
+	uint64_t textsize;
+	uint32_t version;
+	uint32_t ndepinfo;
+	uint32_t ndeptype;
+	uint32_t nref;
+	uint32_t strsize;
+	uint32_t reserved;
+};
+
+struct deptree_bin_depinfo {
+	uint32_t service;
+	uint32_t deptype;
+	uint32_t ndeptype;
+};
+
+struct deptree_bin_deptype {
+	uint32_t type;
+	uint32_t ref;
+	uint32_t nref;
+};
+
+static const char *bootlevel = NULL;
+/* Set while working out an order that does not look at service state,
+ * order_uncacheable is set if the order needed state after all. */
+static bool order_stateless = false;
+static bool order_uncacheable = false;
+
+/* Dependency types we can find without walking the list.
+ * This has to stay in step with deptype_slot. */
+static const char *const deptype_names[RC_DEPTYPE_INDEXED] = {
+	"ineed", "needsme", "iuse", "usesme", "iwant", "wantsme",
+	"iafter", "ibefore", "iprovide", "providedby", "keyword", "broken",
+};
+
+static int
+deptype_slot(const char *type)
+{
+	int slot;
+
+	/* The first two characters are unique amongst the known types */
+	switch (type[0]) {
+	case 'i':
+		switch (type[1]) {
+		case 'n': slot = 0; break;
+		case 'u': slot = 2; break;
+		case 'w': slot = 4; break;
+		case 'a': slot = 6; break;
+		case 'b': slot = 7; break;
+		case 'p': slot = 8; break;
+		default: return -1;
+		}
+		break;
+	case 'n': slot = 1; break;
+	case 'u': slot = 3; break;
+	case 'w': slot = 5; break;
+	case 'p': slot = 9; break;
+	case 'k': slot = 10; break;
+	case 'b': slot = 11; break;
+	default: return -1;
+	}
+	if (strcmp(type, deptype_names[slot]) != 0)
+		return -1;
+	return slot;
+}
+
+static uint32_t
+hash_string(const char *s)
+{
+	uint32_t h = 2166136261U;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static char *
+get_shell_value(char *string)
+{
+	char *p = string;
+	char *e;
+
+	if (! string)
+		return NULL;
+
+	if (*p == '\'')
+		p++;
+
+	e = p + strlen(p) - 1;
+	if (*e == '\n')
+		*e-- = 0;
+	if (*e == '\'')
+		*e-- = 0;
+
+	if (*p != 0)
+		return p;
+
+	return NULL;
+}
+
+void
+rc_deptree_free(RC_DEPTREE *deptree)
+{
+	RC_DEPINFO *di;
+	RC_DEPINFO *di2;
+	RC_DEPTYPE *dt;
+	RC_DEPTYPE *dt2;
+
+	if (!deptree)
+		return;
+
+	/* A tree loaded from the binary cache is one block over the map */
+	if (deptree->map) {
+		munmap(deptree->map, deptree->mapsize);
+		free(deptree);
+		return;
+	}
+	if (deptree->arena) {
+		arena_free(deptree->arena);
+		free(deptree->index);
+		free(deptree);
+		return;
+	}
+
+	di = TAILQ_FIRST(&deptree->services);
+	while (di) {
+		di2 = TAILQ_NEXT(di, entries);
+		dt = TAILQ_FIRST(&di->depends);
+		while (dt) {
+			dt2 = TAILQ_NEXT(dt, entries);
+			rc_stringlist_free(dt->services);
+			free(dt->type);
+			free(dt);
+			dt = dt2;
+		}
+		free(di->service);
+		free(di);
+		di = di2;
+	}
+	free(deptree->index);
+	free(deptree);
+}
+
+/* Size the service index so it is never more than half full */
+static size_t
+deptree_index_size(size_t n)
+{
+	size_t size = 16;
+
+	while (size < n * 2)
+		size <<= 1;
+	return size;
+}
+
+/* Hash every service in the tree into index, which has size slots,
+ * and number them. If a name appears twice the first one wins, as it
+ * did in the list, and both share its number. */
+static void
+deptree_index(RC_DEPTREE *deptree, RC_DEPINFO **index, size_t size)
+{
+	RC_DEPINFO *di;
+	size_t i;
+
+	memset(index, 0, size * sizeof(*index));
+	deptree->index = index;
+	deptree->indexsize = size;
+	deptree->nservices = 0;
+	TAILQ_FOREACH(di, &deptree->services, entries) {
+		for (i = hash_string(di->service) & (size - 1);
+		     index[i];
+		     i = (i + 1) & (size - 1))
+			if (strcmp(index[i]->service, di->service) == 0)
+				break;
+		if (index[i]) {
+			di->id = index[i]->id;
+		} else {
+			index[i] = di;
+			di->id = deptree->nservices++;
+		}
+	}
+}
+
+static void
+deptree_index_build(RC_DEPTREE *deptree)
+{
+	RC_DEPINFO *di;
+	size_t n = 0;
+	size_t size;
+
+	free(deptree->index);
+	TAILQ_FOREACH(di, &deptree->services, entries)
+		n++;
+	size = deptree_index_size(n);
+	deptree_index(deptree, xmalloc(size * sizeof(*deptree->index)), size);
+}
+
+static RC_DEPINFO *
+get_depinfo(const RC_DEPTREE *deptree, const char *service)
+{
+	RC_DEPINFO *di;
+	size_t i;
+
+	if (!deptree)
+		return NULL;
+	if (deptree->index) {
+		for (i = hash_string(service) & (deptree->indexsize - 1);
+		     (di = deptree->index[i]);
+		     i = (i + 1) & (deptree->indexsize - 1))
+			if (strcmp(di->service, service) == 0)
+				return di;
+		return NULL;
+	}
+	TAILQ_FOREACH(di, &deptree->services, entries)
+		if (strcmp(di->service, service) == 0)
+			return di;
+	return NULL;
+}
+
+static RC_DEPTYPE *
+get_deptype(const RC_DEPINFO *depinfo, const char *type)
+{
+	RC_DEPTYPE *dt;
+	int slot;
+
+	if (depinfo) {
+		if ((slot = deptype_slot(type)) != -1)
+			return depinfo->index[slot];
+		TAILQ_FOREACH(dt, &depinfo->depends, entries)
+			if (strcmp(dt->type, type) == 0)
+				return dt;
+	}
+	return NULL;
+}
+
+/* Trees we edit after building them come from the heap, arena is NULL */
+static RC_DEPINFO *
+new_depinfo(RC_ARENA *arena, const char *service)
+{
+	RC_DEPINFO *depinfo;
+
+	if (arena) {
+		depinfo = arena_alloc(arena, sizeof(*depinfo));
+		depinfo->service = arena_strdup(arena, service);
+	} else {
+		depinfo = xmalloc(sizeof(*depinfo));
+		depinfo->service = xstrdup(service);
+	}
+	TAILQ_INIT(&depinfo->depends);
+	memset(depinfo->index, 0, sizeof(depinfo->index));
+	depinfo->id = 0;
+	return depinfo;
+}
+
+/* Add deptype to the end of our dependencies and index it */
+static void
+link_deptype(RC_DEPINFO *depinfo, RC_DEPTYPE *deptype)
+{
+	int slot;
+
+	TAILQ_INSERT_TAIL(&depinfo->depends, deptype, entries);
+	if ((slot = deptype_slot(deptype->type)) != -1 &&
+	    !depinfo->index[slot])
+		depinfo->index[slot] = deptype;
+}
+
+static void
+unlink_deptype(RC_DEPINFO *depinfo, RC_DEPTYPE *deptype)
+{
+	int slot;
+
+	TAILQ_REMOVE(&depinfo->depends, deptype, entries);
+	if ((slot = deptype_slot(deptype->type)) != -1 &&
+	    depinfo->index[slot] == deptype)
+		depinfo->index[slot] = NULL;
+}
+
+static RC_DEPTYPE *
+new_deptype(RC_ARENA *arena, RC_DEPINFO *depinfo, const char *type)
+{
+	RC_DEPTYPE *deptype;
+
+	if (arena) {
+		deptype = arena_alloc(arena, sizeof(*deptype));
+		deptype->type = arena_strdup(arena, type);
+		deptype->services = arena_stringlist_new(arena);
+	} else {
+		deptype = xmalloc(sizeof(*deptype));
+		deptype->type = xstrdup(type);
+		deptype->services = rc_stringlist_new();
+	}
+	link_deptype(depinfo, deptype);
+	return deptype;
+}
+
+static uint64_t
+deptree_bin_size(const struct deptree_bin_header *hdr)
+{
+	return sizeof(*hdr) +
+	    (uint64_t)hdr->ndepinfo * sizeof(struct deptree_bin_depinfo) +
+	    (uint64_t)hdr->ndeptype * sizeof(struct deptree_bin_deptype) +
+	    (uint64_t)hdr->nref * sizeof(uint32_t) +
+	    hdr->strsize;
+}
+
+/* Map the binary deptree in fd and point a tree at it.
+ * All the list nodes come from one allocation and every string is
+ * used in place from the map. textsize is the size the header should
+ * give for the shell parseable cache, or -1 not to check. */
+static RC_DEPTREE *
+deptree_map(int fd, off_t textsize)
+{
+	struct stat bin;
+	const struct deptree_bin_header *hdr;
+	const struct deptree_bin_depinfo *bdi;
+	const struct deptree_bin_deptype *bdt;
+	const uint32_t *ref;
+	const char *strtab;
+	RC_DEPTREE *deptree;
+	RC_DEPINFO **index;
+	RC_DEPINFO *di;
+	RC_DEPTYPE *dt;
+	RC_STRINGLIST *sl;
+	RC_STRING *str;
+	void *map;
+	size_t size, indexsize, i, j, k, t, r;
+
+	if (fstat(fd, &bin) != 0 || (size_t)bin.st_size < sizeof(*hdr))
+		return NULL;
+	size = (size_t)bin.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = map;
+	if (memcmp(hdr->magic, DEPTREE_BIN_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != DEPTREE_BIN_VERSION ||
+	    hdr->size != size ||
+	    (textsize != -1 && hdr->textsize != (uint64_t)textsize) ||
+	    deptree_bin_size(hdr) != size ||
+	    hdr->strsize == 0)
+		goto bad;
+	bdi = (const void *)(hdr + 1);
+	bdt = (const void *)(bdi + hdr->ndepinfo);
+	ref = (const void *)(bdt + hdr->ndeptype);
+	strtab = (const char *)(ref + hdr->nref);
+	if (strtab[hdr->strsize - 1] != '\0')
+		goto bad;
+
+	indexsize = deptree_index_size(hdr->ndepinfo);
+	deptree = xmalloc(sizeof(*deptree) +
+	    indexsize * sizeof(*deptree->index) +
+	    hdr->ndepinfo * sizeof(*di) +
+	    hdr->ndeptype * (sizeof(*dt) + sizeof(*sl)) +
+	    hdr->nref * sizeof(*str));
+	TAILQ_INIT(&deptree->services);
+	deptree->map = map;
+	deptree->mapsize = size;
+	deptree->arena = NULL;
+	index = (RC_DEPINFO **)(deptree + 1);
+	di = (RC_DEPINFO *)(index + indexsize);
+	dt = (RC_DEPTYPE *)(di + hdr->ndepinfo);
+	sl = (RC_STRINGLIST *)(dt + hdr->ndeptype);
+	str = (RC_STRING *)(sl + hdr->ndeptype);
+
+	t = r = 0;
+	for (i = 0; i < hdr->ndepinfo; i++, di++) {
+		if (bdi[i].service >= hdr->strsize ||
+		    bdi[i].deptype != t ||
+		    bdi[i].ndeptype > hdr->ndeptype - t)
+			goto badtree;
+		di->service = UNCONST(strtab + bdi[i].service);
+		TAILQ_INIT(&di->depends);
+		memset(di->index, 0, sizeof(di->index));
+		TAILQ_INSERT_TAIL(&deptree->services, di, entries);
+		for (j = 0; j < bdi[i].ndeptype; j++, t++, dt++, sl++) {
+			if (bdt[t].type >= hdr->strsize ||
+			    bdt[t].ref != r ||
+			    bdt[t].nref > hdr->nref - r)
+				goto badtree;
+			dt->type = UNCONST(strtab + bdt[t].type);
+			dt->services = sl;
+			TAILQ_INIT(sl);
+			link_deptype(di, dt);
+			for (k = 0; k < bdt[t].nref; k++, r++, str++) {
+				if (ref[r] >= hdr->strsize)
+					goto badtree;
+				str->value = UNCONST(strtab + ref[r]);
+				TAILQ_INSERT_TAIL(sl, str, entries);
+			}
+		}
+	}
+	if (t != hdr->ndeptype || r != hdr->nref)
+		goto badtree;
+	deptree_index(deptree, index, indexsize);
+	return deptree;
+
+badtree:
+	free(deptree);
+bad:
+	munmap(map, size);
+	return NULL;
+}
+
+/* Use the binary cache for deptree_file if it is up to date */
+static RC_DEPTREE *
+deptree_load_binary(const char *deptree_file)
+{
+	struct stat text, bin;
+	RC_DEPTREE *deptree = NULL;
+	char *file;
+	int fd;
+
+	if (stat(deptree_file, &text) != 0)
+		return NULL;
+	xasprintf(&file, "%s" RC_DEPTREE_BIN_SUFFIX, deptree_file);
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	free(file);
+	if (fd == -1)
+		return NULL;
+	/* To the nanosecond, as the text can change within a second of
+	 * us writing both */
+	if (fstat(fd, &bin) == 0 &&
+	    (bin.st_mtim.tv_sec > text.st_mtim.tv_sec ||
+	    (bin.st_mtim.tv_sec == text.st_mtim.tv_sec &&
+	    bin.st_mtim.tv_nsec >= text.st_mtim.tv_nsec)))
+		deptree = deptree_map(fd, text.st_size);
+	close(fd);
+	return deptree;
+}
+
+RC_DEPTREE *
+rc_deptree_load_fd(int fd)
+{
+	return deptree_map(fd, -1);
+}
+
+RC_DEPTREE *
+rc_deptree_load(void) {
+	return rc_deptree_load_file(RC_DEPTREE_CACHE);
+}
+
+RC_DEPTREE *
+rc_deptree_load_file(const char *deptree_file)
+{
+	FILE *fp;
+	RC_DEPTREE *deptree;
+	RC_DEPINFO *depinfo = NULL;
+	RC_DEPTYPE *deptype = NULL;
+	char *line = NULL;
+	size_t len = 0;
+	char *type;
+	char *p;
+	char *e;
+	int i;
+
+	if ((deptree = deptree_load_binary(deptree_file)))
+		return deptree;
+
+	if (!(fp = fopen(deptree_file, "r")))
+		return NULL;
+
+	/* Nothing is removed from a loaded tree, so it can all come
+	 * from one arena and be freed in one go */
+	deptree = xmalloc(sizeof(*deptree));
+	TAILQ_INIT(&deptree->services);
+	deptree->map = NULL;
+	deptree->mapsize = 0;
+	deptree->index = NULL;
+	deptree->arena = arena_new();
+	while ((rc_getline(&line, &len, fp)))
+	{
+		p = line;
+		e = strsep(&p, "_");
+		if (!e || strcmp(e, "depinfo") != 0)
+			continue;
+		e = strsep(&p, "_");
+		if (!e || sscanf(e, "%d", &i) != 1)
+			continue;
+		if (!(type = strsep(&p, "_=")))
+			continue;
+		if (strcmp(type, "service") == 0) {
+			/* Sanity */
+			e = get_shell_value(p);
+			if (! e || *e == '\0')
+				continue;
+			depinfo = new_depinfo(deptree->arena, e);
+			TAILQ_INSERT_TAIL(&deptree->services, depinfo, entries);
+			deptype = NULL;
+			continue;
+		}
+		e = strsep(&p, "=");
+		if (!e || sscanf(e, "%d", &i) != 1)
+			continue;
+		/* Sanity */
+		e = get_shell_value(p);
+		if (!e || *e == '\0')
+			continue;
+		if (!deptype || strcmp(deptype->type, type) != 0)
+			deptype = new_deptype(deptree->arena, depinfo, type);
+		arena_stringlist_add(deptree->arena, deptype->services,
+		    arena_strdup(deptree->arena, e));
+	}
+	fclose(fp);
+	free(line);
+	deptree_index_build(deptree);
+
+	return deptree;
+}
+
+static bool
+valid_service(const char *runlevel, const char *service, const char *type)
+{
+	RC_SERVICE state;
+
+	if (!runlevel ||
+	    strcmp(type, "ineed") == 0 ||
+	    strcmp(type, "needsme") == 0  ||
+	    strcmp(type, "iwant") == 0 ||
+	    strcmp(type, "wantsme") == 0)
+		return true;
+
+	if (rc_service_in_runlevel(service, runlevel))
+		return true;
+	if (strcmp(runlevel, RC_LEVEL_SYSINIT) == 0)
+		    return false;
+	if (strcmp(runlevel, RC_LEVEL_SHUTDOWN) == 0 &&
+	    strcmp(type, "iafter") == 0)
+		    return false;
+	if (strcmp(runlevel, bootlevel) != 0) {
+		if (rc_service_in_runlevel(service, bootlevel))
+			return true;
+	}
+
+	if (order_stateless)
+		return false;
+	state = rc_service_state(service);
+	if (state & RC_SERVICE_HOTPLUGGED ||
+	    state & RC_SERVICE_STARTED)
+		return true;
+
+	return false;
+}
+
+static bool
+get_provided1(RC_ARENA *arena, const char *runlevel, RC_STRINGLIST *providers,
+	      RC_DEPTYPE *deptype, const char *level,
+	      bool hotplugged, RC_SERVICE state)
+{
+	RC_STRING *service;
+	RC_SERVICE st;
+	bool retval = false;
+	bool ok;
+	const char *svc;
+
+	TAILQ_FOREACH(service, deptype->services, entries) {
+		ok = true;
+		svc = service->value;
+		st = rc_service_state(svc);
+
+		if (level)
+			ok = rc_service_in_runlevel(svc, level);
+		else if (hotplugged)
+			ok = (st & RC_SERVICE_HOTPLUGGED &&
+			      !rc_service_in_runlevel(svc, runlevel) &&
+			      !rc_service_in_runlevel(svc, bootlevel));
+		if (!ok)
+			continue;
+		switch (state) {
+			case RC_SERVICE_STARTED:
+				ok = (st & RC_SERVICE_STARTED);
+				break;
+			case RC_SERVICE_INACTIVE:
+			case RC_SERVICE_STARTING:
+			case RC_SERVICE_STOPPING:
+				ok = (st & RC_SERVICE_STARTING ||
+				      st & RC_SERVICE_STOPPING ||
+				      st & RC_SERVICE_INACTIVE);
+				break;
+			default:
+				break;
+		}
+		if (!ok)
+			continue;
+		retval = true;
+		arena_stringlist_add(arena, providers, service->value);
+	}
+
+	return retval;
+}
+
+/* Work out if a service is provided by another service.
+   For example metalog provides logger.
+   We need to be able to handle syslogd providing logger too.
+   We do this by checking whats running, then what's starting/stopping,
+   then what's run in the runlevels and finally alphabetical order.
+
+   If there are any bugs in rc-depend, they will probably be here as
+   provided dependancy can change depending on runlevel state.
+
+   The list comes from arena and points to the names in the tree.
+   */
+static RC_STRINGLIST *
+get_provided(RC_ARENA *arena, const RC_DEPINFO *depinfo,
+	     const char *runlevel, int options)
+{
+	RC_DEPTYPE *dt;
+	RC_STRINGLIST *providers = arena_stringlist_new(arena);
+	RC_STRING *service;
+
+	dt = get_deptype(depinfo, "providedby");
+	if (!dt)
+		return providers;
+
+	/* If we are stopping then all depends are true, regardless of state.
+	   This is especially true for net services as they could force a restart
+	   of the local dns resolver which may depend on net. */
+	if (options & RC_DEP_STOP) {
+		TAILQ_FOREACH(service, dt->services, entries)
+			arena_stringlist_add(arena, providers, service->value);
+		return providers;
+	}
+
+	/* If we're strict or starting, then only use what we have in our
+	 * runlevel and bootlevel. If we starting then check hotplugged too. */
+	if (options & RC_DEP_STRICT || options & RC_DEP_START) {
+		TAILQ_FOREACH(service, dt->services, entries)
+			if (rc_service_in_runlevel(service->value, runlevel) ||
+			    rc_service_in_runlevel(service->value, bootlevel) ||
+			    (options & RC_DEP_START && !order_stateless &&
+			     rc_service_state(service->value) & RC_SERVICE_HOTPLUGGED))
+				arena_stringlist_add(arena, providers,
+				    service->value);
+		if (TAILQ_FIRST(providers))
+			return providers;
+	}
+
+	/* OK, we're not strict or there were no services in our runlevel.
+	 * This is now where the logic gets a little fuzzy :)
+	 * If there is >1 running service then we return NULL.
+	 * We do this so we don't hang around waiting for inactive services and
+	 * our need has already been satisfied as it's not strict.
+	 * We apply this to these states in order:-
+	 *     started, starting | stopping | inactive, stopped
+	 * Our sub preference in each of these is in order:-
+	 *     runlevel, hotplugged, bootlevel, any
+	 */
+	order_uncacheable = true;
+#define DO \
+	if (TAILQ_FIRST(providers)) { \
+		if (TAILQ_NEXT(TAILQ_FIRST(providers), entries)) \
+			providers = arena_stringlist_new(arena); \
+		return providers; \
+	}
+
+	/* Anything running has to come first */
+	if (get_provided1(arena, runlevel, providers, dt, runlevel, false, RC_SERVICE_STARTED))
+	{ DO }
+	if (get_provided1(arena, runlevel, providers, dt, NULL, true, RC_SERVICE_STARTED))
+	{ DO }
+	if (bootlevel && strcmp(runlevel, bootlevel) != 0 &&
+	    get_provided1(arena, runlevel, providers, dt, bootlevel, false, RC_SERVICE_STARTED))
+	{ DO }
+	if (get_provided1(arena, runlevel, providers, dt, NULL, false, RC_SERVICE_STARTED))
+	{ DO }
+
+	/* Check starting services */
+	if (get_provided1(arena, runlevel, providers, dt, runlevel, false, RC_SERVICE_STARTING))
+		return providers;
+	if (get_provided1(arena, runlevel, providers, dt, NULL, true, RC_SERVICE_STARTING))
+		return providers;
+	if (bootlevel && strcmp(runlevel, bootlevel) != 0 &&
+	    get_provided1(arena, runlevel, providers, dt, bootlevel, false, RC_SERVICE_STARTING))
+	    return providers;
+	if (get_provided1(arena, runlevel, providers, dt, NULL, false, RC_SERVICE_STARTING))
+		return providers;
+
+	/* Nothing started then. OK, lets get the stopped services */
+	if (get_provided1(arena, runlevel, providers, dt, runlevel, false, RC_SERVICE_STOPPED))
+		return providers;
+	if (get_provided1(arena, runlevel, providers, dt, NULL, true, RC_SERVICE_STOPPED))
+	{ DO }
+	if (bootlevel && (strcmp(runlevel, bootlevel) != 0) &&
+	    get_provided1(arena, runlevel, providers, dt, bootlevel, false, RC_SERVICE_STOPPED))
+		return providers;
+
+	/* Still nothing? OK, list our first provided service. */
+	service = TAILQ_FIRST(dt->services);
+	if (service != NULL)
+		arena_stringlist_add(arena, providers, service->value);
+
+	return providers;
+}
+
+/* Ordering state, services are tracked by their number in the tree so
+ * checking if we visited or sorted one is just a bit test. */
+typedef struct deporder
+{
+	RC_STRINGLIST *sorted;
+	unsigned char *visited;
+	unsigned char *added;
+	/* Lists we only need while working out the order */
+	RC_ARENA *arena;
+} DEPORDER;
+
+#define BIT_TEST(map, n)	((map)[(n) / CHAR_BIT] & (1 << ((n) % CHAR_BIT)))
+#define BIT_SET(map, n)		((map)[(n) / CHAR_BIT] |= (1 << ((n) % CHAR_BIT)))
+
+static void
+deporder_init(DEPORDER *order, const RC_DEPTREE *deptree)
+{
+	size_t len = 1;
+
+	if (deptree)
+		len += deptree->nservices / CHAR_BIT;
+	order->sorted = rc_stringlist_new();
+	order->visited = xmalloc(len * 2);
+	memset(order->visited, 0, len * 2);
+	order->added = order->visited + len;
+	order->arena = arena_new();
+}
+
+/* Free everything but the sorted list */
+static void
+deporder_free(DEPORDER *order)
+{
+	free(order->visited);
+	arena_free(order->arena);
+}
+
+/* Add service to the order unless it's already there */
+static void
+deporder_add(DEPORDER *order, const RC_DEPTREE *deptree, const char *service)
+{
+	const RC_DEPINFO *di = get_depinfo(deptree, service);
+
+	if (di) {
+		if (BIT_TEST(order->added, di->id))
+			return;
+		BIT_SET(order->added, di->id);
+	} else if (rc_stringlist_find(order->sorted, service))
+		return;
+	rc_stringlist_add(order->sorted, service);
+}
+
+static void
+visit_service(const RC_DEPTREE *deptree,
+	      const RC_STRINGLIST *types,
+	      DEPORDER *order,
+	      const RC_DEPINFO *depinfo,
+	      const char *runlevel, int options)
+{
+	RC_STRING *type;
+	RC_STRING *service;
+	RC_DEPTYPE *dt;
+	RC_DEPINFO *di;
+	RC_STRINGLIST *provided;
+	RC_STRING *p;
+	const char *svcname;
+
+	/* Check if we have already visited this service or not */
+	if (BIT_TEST(order->visited, depinfo->id))
+		return;
+	/* Add ourselves as a visited service */
+	BIT_SET(order->visited, depinfo->id);
+
+	TAILQ_FOREACH(type, types, entries)
+	{
+		if (!(dt = get_deptype(depinfo, type->value)))
+			continue;
+
+		TAILQ_FOREACH(service, dt->services, entries) {
+			if (!(options & RC_DEP_TRACE) ||
+			    strcmp(type->value, "iprovide") == 0)
+			{
+				deporder_add(order, deptree, service->value);
+				continue;
+			}
+
+			if (!(di = get_depinfo(deptree, service->value)))
+				continue;
+			provided = get_provided(order->arena, di, runlevel,
+			    options);
+
+			if (TAILQ_FIRST(provided)) {
+				TAILQ_FOREACH(p, provided, entries) {
+					di = get_depinfo(deptree, p->value);
+					if (di && valid_service(runlevel, di->service, type->value))
+						visit_service(deptree, types, order, di,
+							      runlevel, options | RC_DEP_TRACE);
+				}
+			}
+			else if (di && valid_service(runlevel, service->value, type->value))
+				visit_service(deptree, types, order, di,
+					      runlevel, options | RC_DEP_TRACE);
+		}
+	}
+
+	/* Now visit the stuff we provide for */
+	if (options & RC_DEP_TRACE &&
+	    (dt = get_deptype(depinfo, "iprovide")))
+	{
+		TAILQ_FOREACH(service, dt->services, entries) {
+			if (!(di = get_depinfo(deptree, service->value)))
+				continue;
+			provided = get_provided(order->arena, di, runlevel,
+			    options);
+			TAILQ_FOREACH(p, provided, entries)
+				if (strcmp(p->value, depinfo->service) == 0) {
+					visit_service(deptree, types, order, di,
+						       runlevel, options | RC_DEP_TRACE);
+					break;
+				}
+		}
+	}
+
+	/* We've visited everything we need, so add ourselves unless we
+	   are also the service calling us or we are provided by something */
+	svcname = order_stateless ? NULL : getenv("RC_SVCNAME");
+	if (!svcname || strcmp(svcname, depinfo->service) != 0) {
+		if (!get_deptype(depinfo, "providedby"))
+			deporder_add(order, deptree, depinfo->service);
+	}
+}
+
+RC_STRINGLIST *
+rc_deptree_depend(const RC_DEPTREE *deptree,
+		  const char *service, const char *type)
+{
+	RC_DEPINFO *di;
+	RC_DEPTYPE *dt;
+	RC_STRINGLIST *svcs;
+	RC_STRING *svc;
+
+	svcs = rc_stringlist_new();
+	if (!(di = get_depinfo(deptree, service)) ||
+	    !(dt = get_deptype(di, type)))
+	{
+		errno = ENOENT;
+		return svcs;
+	}
+
+	/* For consistency, we copy the array */
+	TAILQ_FOREACH(svc, dt->services, entries)
+		rc_stringlist_add(svcs, svc->value);
+	return svcs;
+}
+
+RC_STRINGLIST *
+rc_deptree_depends(const RC_DEPTREE *deptree,
+		   const RC_STRINGLIST *types,
+		   const RC_STRINGLIST *services,
+		   const char *runlevel, int options)
+{
+	DEPORDER order;
+	RC_DEPINFO *di;
+	const RC_STRING *service;
+
+	bootlevel = getenv("RC_BOOTLEVEL");
+	if (!bootlevel)
+		bootlevel = RC_LEVEL_BOOT;
+	deporder_init(&order, deptree);
+	TAILQ_FOREACH(service, services, entries) {
+		if (!(di = get_depinfo(deptree, service->value))) {
+			errno = ENOENT;
+			continue;
+		}
+		if (types)
+			visit_service(deptree, types, &order,
+				      di, runlevel, options);
+	}
+	deporder_free(&order);
+	return order.sorted;
+}
+
+RC_STRINGLIST *
+rc_deptree_order(const RC_DEPTREE *deptree, const char *runlevel, int options)
+{
+	RC_STRINGLIST *list;
+	RC_STRINGLIST *list2;
+	RC_STRINGLIST *types;
+	RC_STRINGLIST *services;
+
+	bootlevel = getenv("RC_BOOTLEVEL");
+	if (! bootlevel)
+		bootlevel = RC_LEVEL_BOOT;
+
+	/* When shutting down, list all running services */
+	if (strcmp(runlevel, RC_LEVEL_SINGLE) == 0 ||
+	    strcmp(runlevel, RC_LEVEL_SHUTDOWN) == 0)
+	{
+		list = rc_services_in_state(RC_SERVICE_STARTED);
+		list2 = rc_services_in_state(RC_SERVICE_INACTIVE);
+		TAILQ_CONCAT(list, list2, entries);
+		free(list2);
+		list2 = rc_services_in_state(RC_SERVICE_STARTING);
+		TAILQ_CONCAT(list, list2, entries);
+		free(list2);
+	} else {
+		list = rc_services_in_runlevel(RC_LEVEL_SYSINIT);
+		if (strcmp(runlevel, RC_LEVEL_SYSINIT) != 0) {
+			list2 = rc_services_in_runlevel(runlevel);
+			TAILQ_CONCAT(list, list2, entries);
+			free(list2);
+			list2 = rc_services_in_state(RC_SERVICE_HOTPLUGGED);
+			TAILQ_CONCAT(list, list2, entries);
+			free(list2);
+			/* If we're not the boot runlevel then add that too */
+			if (strcmp(runlevel, bootlevel) != 0) {
+				list2 = rc_services_in_runlevel(bootlevel);
+				TAILQ_CONCAT(list, list2, entries);
+				free(list2);
+			}
+		}
+	}
+
+	/* Now we have our lists, we need to pull in any dependencies
+	   and order them */
+	types = rc_stringlist_new();
+	rc_stringlist_add(types, "ineed");
+	rc_stringlist_add(types, "iuse");
+	rc_stringlist_add(types, "iwant");
+	rc_stringlist_add(types, "iafter");
+	services = rc_deptree_depends(deptree, types, list, runlevel,
+				      RC_DEP_STRICT | RC_DEP_TRACE | options);
+	rc_stringlist_free(list);
+	rc_stringlist_free(types);
+	return services;
+}
+
+/* Cached runlevel orders.
+ * Ordering a runlevel walks the whole tree, but rc only uses the order
+ * to start what is not already started, so we work it out as if no
+ * service was running. That only changes with the deptree and what is
+ * in the runlevel and bootlevel, so rc_deptree_update works out the order
+ * of every runlevel into RC_DEPTREE_ORDERS, behind a key made of those,
+ * and we use it again while the key still matches.
+ * An order that had to pick a provider by state is worked out each time. */
+#define RC_DEPTREE_ORDERS	RC_SVCDIR "/order"
+
+static bool
+order_mtime(const char *path, FILE *fp)
+{
+	struct stat st;
+
+	if (stat(path, &st) != 0)
+		return false;
+	fprintf(fp, " %ju:%jd.%09ld:%jd", (uintmax_t)st.st_ino,
+	    (intmax_t)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec,
+	    (intmax_t)st.st_size);
+	return true;
+}
+
+static char *
+order_key(const char *runlevel, int options)
+{
+	char path[PATH_MAX];
+	char *key = NULL;
+	size_t len = 0;
+	FILE *fp;
+	bool ok;
+
+	if (!(fp = open_memstream(&key, &len)))
+		return NULL;
+	fprintf(fp, "%s %s %d", runlevel, bootlevel, options);
+	ok = order_mtime(RC_DEPTREE_CACHE, fp);
+	snprintf(path, sizeof(path), RC_RUNLEVELDIR "/%s", runlevel);
+	ok = ok && order_mtime(path, fp);
+	snprintf(path, sizeof(path), RC_RUNLEVELDIR "/%s", bootlevel);
+	if (ok && !order_mtime(path, fp))
+		fputs(" -", fp);
+	fclose(fp);
+	if (!ok) {
+		free(key);
+		return NULL;
+	}
+	return key;
+}
+
+static RC_STRINGLIST *
+order_load(const char *file, const char *key)
+{
+	RC_STRINGLIST *list = NULL;
+	char *line = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	if (!(fp = fopen(file, "r")))
+		return NULL;
+	if (rc_getline(&line, &len, fp) && strcmp(line, key) == 0) {
+		list = rc_stringlist_new();
+		while ((rc_getline(&line, &len, fp)))
+			if (*line)
+				rc_stringlist_add(list, line);
+	}
+	free(line);
+	fclose(fp);
+	return list;
+}
+
+/* Best effort, someone else may be ordering the same runlevel */
+static void
+order_save(const char *file, const char *key, const RC_STRINGLIST *list)
+{
+	char tmp[PATH_MAX + 16];
+	const RC_STRING *s;
+	FILE *fp;
+
+	if (mkdir(RC_DEPTREE_ORDERS, 0755) != 0 && errno != EEXIST)
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+	if (!(fp = fopen(tmp, "w")))
+		return;
+	fprintf(fp, "%s\n", key);
+	TAILQ_FOREACH(s, list, entries)
+		fprintf(fp, "%s\n", s->value);
+	if (fclose(fp) != 0 || rename(tmp, file) != 0)
+		unlink(tmp);
+}
+
+static RC_STRINGLIST *
+order_runlevel(const RC_DEPTREE *deptree, const char *runlevel, int options)
+{
+	RC_STRINGLIST *types, *services, *list;
+
+	types = rc_stringlist_new();
+	rc_stringlist_add(types, "ineed");
+	rc_stringlist_add(types, "iwant");
+	rc_stringlist_add(types, "iuse");
+	rc_stringlist_add(types, "iafter");
+	services = rc_services_in_runlevel(runlevel);
+	list = rc_deptree_depends(deptree, types, services, runlevel, options);
+	rc_stringlist_free(services);
+	rc_stringlist_free(types);
+	return list;
+}
+
+/* Work out the stateless order, or NULL if it needed state */
+static RC_STRINGLIST *
+order_runlevel_stateless(const RC_DEPTREE *deptree, const char *runlevel,
+			 int options)
+{
+	RC_STRINGLIST *list;
+
+	order_stateless = true;
+	order_uncacheable = false;
+	list = order_runlevel(deptree, runlevel, options);
+	order_stateless = false;
+	if (order_uncacheable) {
+		rc_stringlist_free(list);
+		return NULL;
+	}
+	return list;
+}
+
+static void
+order_precompute(const RC_DEPTREE *deptree)
+{
+	const int options = RC_DEP_STRICT | RC_DEP_TRACE | RC_DEP_START;
+	RC_STRINGLIST *runlevels, *list;
+	RC_STRING *runlevel;
+	char file[PATH_MAX];
+	char *key;
+
+	bootlevel = getenv("RC_BOOTLEVEL");
+	if (!bootlevel)
+		bootlevel = RC_LEVEL_BOOT;
+	runlevels = rc_runlevel_list();
+	TAILQ_FOREACH(runlevel, runlevels, entries) {
+		snprintf(file, sizeof(file), RC_DEPTREE_ORDERS "/%s.%d",
+		    runlevel->value, options);
+		if (!(key = order_key(runlevel->value, options))) {
+			unlink(file);
+			continue;
+		}
+		if ((list = order_runlevel_stateless(deptree, runlevel->value,
+		    options)))
+		{
+			order_save(file, key, list);
+			rc_stringlist_free(list);
+		} else
+			unlink(file);
+		free(key);
+	}
+	rc_stringlist_free(runlevels);
+}
+
+RC_STRINGLIST *
+rc_deptree_order_runlevel(const RC_DEPTREE *deptree, const char *runlevel,
+			  int options)
+{
+	RC_STRINGLIST *list;
+	char file[PATH_MAX];
+	char *key;
+	const char *svcname;
+
+	bootlevel = getenv("RC_BOOTLEVEL");
+	if (!bootlevel)
+		bootlevel = RC_LEVEL_BOOT;
+	snprintf(file, sizeof(file), RC_DEPTREE_ORDERS "/%s.%d",
+	    runlevel, options);
+	key = order_key(runlevel, options);
+	if (!key || !(list = order_load(file, key))) {
+		list = order_runlevel_stateless(deptree, runlevel, options);
+		if (list && key)
+			order_save(file, key, list);
+		else if (!list)
+			list = order_runlevel(deptree, runlevel, options);
+	}
+	free(key);
+
+	/* Orders are worked out for everyone, so leave out whoever is asking */
+	svcname = getenv("RC_SVCNAME");
+	if (svcname)
+		rc_stringlist_delete(list, svcname);
+	return list;
+}
+
+
+/* Given a time, recurse the target path to find out if there are
+   any older (or newer) files.   If false, sets the time to the
+   oldest (or newest) found.
+*/
+static bool
+deep_mtime_check(const char *target, bool newer,
+	    time_t *rel, char *file)
+{
+	struct stat buf;
+	bool retval = true;
+	DIR *dp;
+	struct dirent *d;
+	char path[PATH_MAX];
+	int serrno = errno;
+
+	/* If target does not exist, return true to mimic shell test */
+	if (stat(target, &buf) != 0)
+		return true;
+
+	if (newer) {
+		if (*rel < buf.st_mtime) {
+			retval = false;
+
+			if (file)
+				strlcpy(file, target, PATH_MAX);
+			*rel = buf.st_mtime;
+		}
+	} else {
+		if (*rel > buf.st_mtime) {
+			retval = false;
+
+			if (file)
+				strlcpy(file, target, PATH_MAX);
+			*rel = buf.st_mtime;
+		}
+	}
+
+	/* If not a dir then reset errno */
+	if (!(dp = opendir(target))) {
+		errno = serrno;
+		return retval;
+	}
+
+	/* Check all the entries in the dir */
+	while ((d = readdir(dp))) {
+		if (d->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", target, d->d_name);
+		if (!deep_mtime_check(path, newer, rel, file)) {
+			retval = false;
+		}
+	}
+	closedir(dp);
+	return retval;
+}
+
+/* Recursively check if target is older/newer than source.
+ * If false, return the filename and most different time (if
+ * the return value arguments are non-null).
+ */
+static bool
+mtime_check(const char *source, const char *target, bool newer,
+	    time_t *rel, char *file)
+{
+	struct stat buf;
+	time_t mtime;
+	bool retval = true;
+
+	/* We have to exist */
+	if (stat(source, &buf) != 0)
+		return false;
+	mtime = buf.st_mtime;
+
+	retval = deep_mtime_check(target,newer,&mtime,file);
+	if (rel) {
+		*rel = mtime;
+	}
+	return retval;
+}
+
+bool
+rc_newer_than(const char *source, const char *target,
+	      time_t *newest, char *file)
+{
+
+	return mtime_check(source, target, true, newest, file);
+}
+
+bool
+rc_older_than(const char *source, const char *target,
+	      time_t *oldest, char *file)
+{
+	return mtime_check(source, target, false, oldest, file);
+}
+
+typedef struct deppair
+{
+	const char *depend;
+	const char *addto;
+} DEPPAIR;
+
+static const DEPPAIR deppairs[] = {
+	{ "ineed",	"needsme" },
+	{ "iuse",	"usesme" },
+	{ "iwant",	"wantsme" },
+	{ "iafter",	"ibefore" },
+	{ "ibefore",	"iafter" },
+	{ "iprovide",	"providedby" },
+	{ NULL, NULL }
+};
+
+static const char *const depdirs[] =
+{
+	RC_SVCDIR,
+	RC_SVCDIR "/starting",
+	RC_SVCDIR "/started",
+	RC_SVCDIR "/stopping",
+	RC_SVCDIR "/inactive",
+	RC_SVCDIR "/wasinactive",
+	RC_SVCDIR "/failed",
+	RC_SVCDIR "/hotplugged",
+	RC_SVCDIR "/daemons",
+	RC_SVCDIR "/options",
+	RC_SVCDIR "/exclusive",
+	RC_SVCDIR "/scheduled",
+	RC_SVCDIR "/state",
+	RC_SVCDIR "/listening",
+	RC_SVCDIR "/order",
+	RC_SVCDIR "/tmp",
+	NULL
+};
+
+/* rc-depwatch keeps its pid and a generation number in RC_DEPWATCH and
+ * bumps the generation whenever anything the deptree is made from
+ * changes. We only trust it while it's running, which we know by it
+ * holding RC_DEPWATCH_LOCK, as its pid could have been reused. */
+static bool
+depwatch_state(char *state, size_t len)
+{
+	FILE *fp;
+	int fd, pid;
+	int serrno = errno;
+	bool retval = false;
+
+	if ((fd = open(RC_DEPWATCH_LOCK, O_RDONLY | O_CLOEXEC)) == -1) {
+		errno = serrno;
+		return false;
+	}
+	if (flock(fd, LOCK_SH | LOCK_NB) == 0 || errno != EWOULDBLOCK) {
+		close(fd);
+		errno = serrno;
+		return false;
+	}
+	close(fd);
+
+	if (!(fp = fopen(RC_DEPWATCH, "r"))) {
+		errno = serrno;
+		return false;
+	}
+	if (fgets(state, (int)len, fp) &&
+	    sscanf(state, "%d", &pid) == 1 && pid > 0)
+		retval = true;
+	fclose(fp);
+	errno = serrno;
+	return retval;
+}
+
+bool
+rc_deptree_update_needed(time_t *newest, char *file)
+{
+	bool newer = false;
+	RC_STRINGLIST *config;
+	RC_STRING *s;
+	int i;
+	struct stat buf;
+	time_t mtime;
+	char state[64], clean[64];
+	bool watched;
+	FILE *fp;
+
+	/* Create base directories if needed */
+	for (i = 0; depdirs[i]; i++)
+		if (mkdir(depdirs[i], 0755) != 0 && errno != EEXIST)
+			fprintf(stderr, "mkdir `%s': %s\n", depdirs[i], strerror(errno));
+
+	/* If we were last updated at the generation rc-depwatch is at now
+	 * then nothing changed and we don't need to look */
+	watched = depwatch_state(state, sizeof(state));
+	if (watched && exists(RC_DEPTREE_CACHE) &&
+	    (fp = fopen(RC_DEPTREE_GEN, "r")))
+	{
+		if (!fgets(clean, sizeof(clean), fp))
+			clean[0] = '\0';
+		fclose(fp);
+		if (strcmp(state, clean) == 0)
+			return false;
+	}
+
+	/* Quick test to see if anything we use has changed and we have
+	 * data in our deptree. */
+
+	if (stat(RC_DEPTREE_CACHE, &buf) == 0) {
+		mtime = buf.st_mtime;
+	} else {
+		/* No previous cache found.
+		 * We still run the scan, in case of clock skew; we still need to return
+		 * the newest time.
+		 */
+		newer = true;
+		mtime = time(NULL);
+	}
+
+	newer |= !deep_mtime_check(RC_INITDIR,true,&mtime,file);
+	newer |= !deep_mtime_check(RC_CONFDIR,true,&mtime,file);
+#ifdef RC_PKG_INITDIR
+    newer |= !deep_mtime_check(RC_PKG_INITDIR,true,&mtime,file);
+#endif
+#ifdef RC_PKG_CONFDIR
+    newer |= !deep_mtime_check(RC_PKG_CONFDIR,true,&mtime,file);
+#endif
+#ifdef RC_LOCAL_INITDIRs
+    newer |= !deep_mtime_check(RC_LOCAL_INITDIR,true,&mtime,file);
+#endif
+#ifdef RC_LOCAL_CONFDIR
+    newer |= !deep_mtime_check(RC_LOCAL_CONFDIR,true,&mtime,file);
+#endif
+    newer |= !deep_mtime_check(RC_CONF,true,&mtime,file);
+
+	/* Some init scripts dependencies change depending on config files
+	 * outside of baselayout, like syslog-ng, so we check those too. */
+	config = rc_config_list(RC_DEPCONFIG);
+	TAILQ_FOREACH(s, config, entries) {
+		newer |= !deep_mtime_check(s->value, true, &mtime, file);
+	}
+	rc_stringlist_free(config);
+
+	/* Nothing changed up to the generation we read before looking,
+	 * so remember that for next time. */
+	if (!newer && watched && (fp = fopen(RC_DEPTREE_GEN, "w"))) {
+		fputs(state, fp);
+		fclose(fp);
+	}
+
+	/* Return newest file time, if requested */
+	if ((newer) && (newest != NULL)) {
+	    *newest = mtime;
+	}
+
+	return newer;
+}
+
+/* String table for the binary deptree, each string is only stored once */
+struct deptree_bin_strtab {
+	char *buf;
+	size_t len;
+	size_t size;
+	uint32_t *slots;
+	size_t nslots;
+};
+
+/* Slots hold the string offset plus one so that zero means unused.
+ * The table is sized up front for every string we could add. */
+static uint32_t
+strtab_add(struct deptree_bin_strtab *st, const char *s)
+{
+	size_t mask = st->nslots - 1;
+	size_t i = hash_string(s) & mask;
+	size_t l;
+	uint32_t off;
+
+	while (st->slots[i]) {
+		off = st->slots[i] - 1;
+		if (strcmp(st->buf + off, s) == 0)
+			return off;
+		i = (i + 1) & mask;
+	}
+
+	l = strlen(s) + 1;
+	if (st->len + l > st->size) {
+		while (st->len + l > st->size)
+			st->size = st->size ? st->size * 2 : BUFSIZ;
+		st->buf = xrealloc(st->buf, st->size);
+	}
+	off = (uint32_t)st->len;
+	memcpy(st->buf + st->len, s, l);
+	st->len += l;
+	st->slots[i] = off + 1;
+	return off;
+}
+
+/* Write the binary version of deptree to fp, textsize being the size
+ * of the shell parseable cache it goes with */
+static bool
+deptree_write_binary(const RC_DEPTREE *deptree, FILE *fp, uint64_t textsize)
+{
+	struct deptree_bin_header hdr;
+	struct deptree_bin_depinfo *bdi;
+	struct deptree_bin_deptype *bdt;
+	struct deptree_bin_strtab st;
+	uint32_t *ref;
+	const RC_DEPINFO *depinfo;
+	const RC_DEPTYPE *deptype;
+	const RC_STRING *s;
+	size_t i, t, r;
+	bool retval = false;
+
+	memset(&hdr, 0, sizeof(hdr));
+	TAILQ_FOREACH(depinfo, &deptree->services, entries) {
+		hdr.ndepinfo++;
+		TAILQ_FOREACH(deptype, &depinfo->depends, entries) {
+			/* Empty types are not in the shell cache either */
+			if (!TAILQ_FIRST(deptype->services))
+				continue;
+			hdr.ndeptype++;
+			TAILQ_FOREACH(s, deptype->services, entries)
+				hdr.nref++;
+		}
+	}
+
+	memset(&st, 0, sizeof(st));
+	st.nslots = 16;
+	while (st.nslots < 2 * ((size_t)hdr.ndepinfo + hdr.ndeptype + hdr.nref))
+		st.nslots <<= 1;
+	st.slots = xmalloc(st.nslots * sizeof(*st.slots));
+	memset(st.slots, 0, st.nslots * sizeof(*st.slots));
+	bdi = xmalloc(hdr.ndepinfo * sizeof(*bdi) + 1);
+	bdt = xmalloc(hdr.ndeptype * sizeof(*bdt) + 1);
+	ref = xmalloc(hdr.nref * sizeof(*ref) + 1);
+
+	i = t = r = 0;
+	TAILQ_FOREACH(depinfo, &deptree->services, entries) {
+		bdi[i].service = strtab_add(&st, depinfo->service);
+		bdi[i].deptype = (uint32_t)t;
+		TAILQ_FOREACH(deptype, &depinfo->depends, entries) {
+			if (!TAILQ_FIRST(deptype->services))
+				continue;
+			bdt[t].type = strtab_add(&st, deptype->type);
+			bdt[t].ref = (uint32_t)r;
+			TAILQ_FOREACH(s, deptype->services, entries)
+				ref[r++] = strtab_add(&st, s->value);
+			bdt[t].nref = (uint32_t)(r - bdt[t].ref);
+			t++;
+		}
+		bdi[i].ndeptype = (uint32_t)(t - bdi[i].deptype);
+		i++;
+	}
+
+	memcpy(hdr.magic, DEPTREE_BIN_MAGIC, sizeof(hdr.magic));
+	hdr.version = DEPTREE_BIN_VERSION;
+	hdr.strsize = (uint32_t)st.len;
+	hdr.textsize = textsize;
+	hdr.size = deptree_bin_size(&hdr);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+	    fwrite(bdi, sizeof(*bdi), hdr.ndepinfo, fp) == hdr.ndepinfo &&
+	    fwrite(bdt, sizeof(*bdt), hdr.ndeptype, fp) == hdr.ndeptype &&
+	    fwrite(ref, sizeof(*ref), hdr.nref, fp) == hdr.nref &&
+	    fwrite(st.buf, 1, st.len, fp) == st.len)
+		retval = true;
+
+	free(st.buf);
+	free(st.slots);
+	free(bdi);
+	free(bdt);
+	free(ref);
+	return retval;
+}
+
+/* Write the binary version of deptree, text is the stat of the shell
+ * parseable cache we just saved. We write to a temporary file and
+ * rename it so anyone with the old one mapped is unaffected. */
+static bool
+deptree_save_binary(const RC_DEPTREE *deptree, const char *file,
+		    const struct stat *text)
+{
+	char *tmp;
+	int fd;
+	FILE *fp;
+	bool retval = false;
+
+	xasprintf(&tmp, "%s.XXXXXX", file);
+	if ((fd = mkstemp(tmp)) == -1) {
+		fprintf(stderr, "mkstemp `%s': %s\n", tmp, strerror(errno));
+		free(tmp);
+		return false;
+	}
+	fchmod(fd, 0644);
+	if (!(fp = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return false;
+	}
+	retval = deptree_write_binary(deptree, fp, (uint64_t)text->st_size);
+	if (fclose(fp) != 0)
+		retval = false;
+	if (retval && rename(tmp, file) != 0) {
+		fprintf(stderr, "rename `%s': %s\n", tmp, strerror(errno));
+		retval = false;
+	}
+	if (!retval)
+		unlink(tmp);
+	free(tmp);
+	return retval;
+}
+
+/* An unnamed file we can hand to other processes, sealed so none of
+ * them can change it under the others where the system allows */
+static int
+deptree_anon_file(void)
+{
+	char *tmp;
+	int fd;
+
+#ifdef SYS_memfd_create
+	if ((fd = (int)syscall(SYS_memfd_create, "deptree",
+		    MFD_CLOEXEC | MFD_ALLOW_SEALING)) != -1)
+		return fd;
+#endif
+	xasprintf(&tmp, "%s/deptree.XXXXXX", RC_SVCDIR);
+	if ((fd = mkstemp(tmp)) != -1) {
+		unlink(tmp);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+	free(tmp);
+	return fd;
+}
+
+int
+rc_deptree_memfd(const RC_DEPTREE *deptree)
+{
+	FILE *fp;
+	int fd, wfd;
+	bool ok;
+
+	if ((fd = deptree_anon_file()) == -1)
+		return -1;
+	/* A tree we mapped is already in the right form */
+	if (deptree->map) {
+		ok = write(fd, deptree->map, deptree->mapsize) ==
+		    (ssize_t)deptree->mapsize;
+	} else if ((wfd = dup(fd)) != -1 && (fp = fdopen(wfd, "w"))) {
+		ok = deptree_write_binary(deptree, fp, 0);
+		if (fclose(fp) != 0)
+			ok = false;
+	} else {
+		if (wfd != -1)
+			close(wfd);
+		ok = false;
+	}
+	if (!ok) {
+		close(fd);
+		return -1;
+	}
+#ifdef F_ADD_SEALS
+	fcntl(fd, F_ADD_SEALS,
+	    F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+	return fd;
+}
+
+/* How many shells we shard gendepends over, from rc_depend_workers in
+ * rc.conf or the number of online CPUs. */
+static int
+gendepends_workers(void)
+{
+	const char *value = rc_conf_value("rc_depend_workers");
+	long n;
+
+	if (value)
+		n = strtol(value, NULL, 10);
+	else
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		n = 1;
+	if (n > GENDEP_MAX_WORKERS)
+		n = GENDEP_MAX_WORKERS;
+	return (int)n;
+}
+
+/* Output of gendepends for one init script.
+ * We keep these in RC_DEPCACHE along with a fingerprint of the files
+ * that went into them, so that next time we only have to source the
+ * init scripts that changed. */
+typedef struct depcache
+{
+	char *path;
+	uint64_t fingerprint;
+	const char *output;
+	size_t len;
+	char *native;
+	bool dirty;
+	bool valid;
+} DEPCACHE;
+
+#define DEPCACHE_VERSION	1
+#define FINGERPRINT_INIT	14695981039346656037ULL
+
+static uint64_t
+fingerprint_add(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static uint64_t
+fingerprint_file(uint64_t h, const char *file)
+{
+	struct stat st;
+	uint64_t v[4] = { 0, 0, 0, 0 };
+
+	if (stat(file, &st) == 0) {
+		v[0] = (uint64_t)st.st_ino;
+		v[1] = (uint64_t)st.st_size;
+		v[2] = (uint64_t)st.st_mtime;
+		v[3] = (uint64_t)st.st_ctime;
+	}
+	h = fingerprint_add(h, file, strlen(file) + 1);
+	return fingerprint_add(h, v, sizeof(v));
+}
+
+/* Everything every init script sees. If any of this changes then we
+ * have to source them all again. */
+static uint64_t
+depcache_global(void)
+{
+	uint64_t h = FINGERPRINT_INIT;
+	uint64_t files = 0;
+	const char *uname = getenv("RC_UNAME");
+	DIR *dp;
+	struct dirent *d;
+	char path[PATH_MAX];
+
+	h = fingerprint_file(h, GENDEP);
+	h = fingerprint_file(h, RC_LIBEXECDIR "/sh/functions.sh");
+	h = fingerprint_file(h, RC_LIBEXECDIR "/sh/rc-functions.sh");
+	h = fingerprint_file(h, RC_CONF);
+	h = fingerprint_file(h, RC_CONF_D);
+	if ((dp = opendir(RC_CONF_D))) {
+		/* Readdir order does not matter, so just add them up */
+		while ((d = readdir(dp))) {
+			if (d->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", RC_CONF_D, d->d_name);
+			files += fingerprint_file(FINGERPRINT_INIT, path);
+		}
+		closedir(dp);
+	}
+	h = fingerprint_add(h, &files, sizeof(files));
+	if (uname)
+		h = fingerprint_add(h, uname, strlen(uname));
+	return h;
+}
+
+/* The init script itself, its conf.d files and any config files it
+ * told us about. Anything else it sources is not tracked. */
+static uint64_t
+depcache_fingerprint(const char *path, const char *output, size_t len)
+{
+	uint64_t h = fingerprint_file(FINGERPRINT_INIT, path);
+	const char *name = strrchr(path, '/');
+	const char *e, *end = output + len;
+	char file[PATH_MAX];
+	char *line, *p, *svc, *type, *conf;
+	size_t l;
+
+	if (!name)
+		return h;
+	name++;
+	snprintf(file, sizeof(file), "%.*s/../conf.d/%s",
+	    (int)(name - path - 1), path, name);
+	h = fingerprint_file(h, file);
+	if ((e = strchr(name, '.')) && e != name) {
+		snprintf(file, sizeof(file), "%.*s/../conf.d/%.*s",
+		    (int)(name - path - 1), path, (int)(e - name), name);
+		h = fingerprint_file(h, file);
+	}
+
+	for (; output < end; output = e + 1) {
+		if (!(e = memchr(output, '\n', (size_t)(end - output))))
+			e = end;
+		l = (size_t)(e - output);
+		line = xmalloc(l + 1);
+		memcpy(line, output, l);
+		line[l] = '\0';
+		p = line;
+		svc = strsep(&p, " ");
+		type = strsep(&p, " ");
+		if (svc && type && strcmp(type, "config") == 0)
+			while ((conf = strsep(&p, " ")))
+				if (*conf)
+					h = fingerprint_file(h, conf);
+		free(line);
+	}
+	return h;
+}
+
+/* Load the cached output of each init script from RC_DEPCACHE into a
+ * hash table by path, with the strings pointing into buffer. */
+static DEPCACHE **
+depcache_load(uint64_t global, size_t *size, char **buffer)
+{
+	DEPCACHE **table = NULL;
+	DEPCACHE *c;
+	char *p, *e, *end, *path;
+	size_t len = 0, n = 0, i, l;
+	unsigned int version;
+	uint64_t fingerprint;
+
+	*size = 0;
+	if (!rc_getfile(RC_DEPCACHE, buffer, &len)) {
+		*buffer = NULL;
+		return NULL;
+	}
+	p = *buffer;
+	end = p + len - 1;
+	if (sscanf(p, "depcache %u %" SCNx64, &version, &fingerprint) != 2 ||
+	    version != DEPCACHE_VERSION || fingerprint != global ||
+	    !(p = strchr(p, '\n')))
+		return NULL;
+
+	for (e = ++p; e < end && (e = strchr(e, '\n')); e++)
+		n++;
+	*size = deptree_index_size(n);
+	table = xmalloc(*size * sizeof(*table));
+	memset(table, 0, *size * sizeof(*table));
+
+	while (p < end) {
+		fingerprint = strtoull(p, &e, 16);
+		if (*e != ' ')
+			break;
+		l = strtoul(e + 1, &e, 10);
+		if (*e != ' ')
+			break;
+		path = e + 1;
+		if (!(e = strchr(path, '\n')))
+			break;
+		*e++ = '\0';
+		if (l > (size_t)(end - e))
+			break;
+		c = xmalloc(sizeof(*c));
+		c->path = path;
+		c->fingerprint = fingerprint;
+		c->output = e;
+		c->len = l;
+		for (i = hash_string(path) & (*size - 1);
+		     table[i];
+		     i = (i + 1) & (*size - 1))
+			;
+		table[i] = c;
+		p = e + l;
+	}
+	return table;
+}
+
+static const DEPCACHE *
+depcache_find(DEPCACHE **table, size_t size, const char *path)
+{
+	size_t i;
+
+	if (!table)
+		return NULL;
+	for (i = hash_string(path) & (size - 1);
+	     table[i];
+	     i = (i + 1) & (size - 1))
+		if (strcmp(table[i]->path, path) == 0)
+			return table[i];
+	return NULL;
+}
+
+static void
+depcache_save(uint64_t global, const DEPCACHE *scripts, size_t n)
+{
+	FILE *fp;
+	size_t i;
+
+	if (!(fp = fopen(RC_DEPCACHE, "w"))) {
+		fprintf(stderr, "fopen `%s': %s\n", RC_DEPCACHE, strerror(errno));
+		return;
+	}
+	fprintf(fp, "depcache %u %" PRIx64 "\n", DEPCACHE_VERSION, global);
+	for (i = 0; i < n; i++) {
+		if (!scripts[i].valid)
+			continue;
+		fprintf(fp, "%" PRIx64 " %zu %s\n", scripts[i].fingerprint,
+		    scripts[i].len, scripts[i].path);
+		fwrite(scripts[i].output, 1, scripts[i].len, fp);
+	}
+	if (fclose(fp) != 0)
+		unlink(RC_DEPCACHE);
+}
+
+static pid_t
+gendepends_spawn(char *const *argv, int *fd)
+{
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) == -1)
+		return -1;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	if ((pid = fork()) == -1) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[1]);
+		execv(GENDEP, argv);
+		fprintf(stderr, "execv `%s': %s\n", GENDEP, strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	close(fds[1]);
+	*fd = fds[0];
+	return pid;
+}
+
+/* Run gendepends once for each of the n argument vectors, all at the
+ * same time, and return their output joined in order.
+ * We have to read them all as they go or they would block each other. */
+static char *
+gendepends_run(char **argv[], int n, size_t *len)
+{
+	pid_t pid[GENDEP_MAX_WORKERS];
+	struct pollfd pfd[GENDEP_MAX_WORKERS];
+	char *buf[GENDEP_MAX_WORKERS];
+	size_t blen[GENDEP_MAX_WORKERS];
+	size_t bsize[GENDEP_MAX_WORKERS];
+	char *out = NULL;
+	ssize_t r;
+	int i, running = 0;
+	bool failed = false;
+
+	for (i = 0; i < n; i++) {
+		buf[i] = NULL;
+		blen[i] = bsize[i] = 0;
+		pfd[i].events = POLLIN;
+		if ((pid[i] = gendepends_spawn(argv[i], &pfd[i].fd)) == -1) {
+			pfd[i].fd = -1;
+			failed = true;
+		} else
+			running++;
+	}
+
+	while (running > 0) {
+		if (poll(pfd, (nfds_t)n, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			failed = true;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (pfd[i].fd == -1 || !pfd[i].revents)
+				continue;
+			if (bsize[i] - blen[i] < BUFSIZ) {
+				bsize[i] += BUFSIZ * 4;
+				buf[i] = xrealloc(buf[i], bsize[i]);
+			}
+			r = read(pfd[i].fd, buf[i] + blen[i], bsize[i] - blen[i]);
+			if (r > 0)
+				blen[i] += (size_t)r;
+			else if (r == 0 || errno != EINTR) {
+				close(pfd[i].fd);
+				pfd[i].fd = -1;
+				running--;
+			}
+		}
+	}
+
+	*len = 0;
+	for (i = 0; i < n; i++) {
+		if (pfd[i].fd != -1)
+			close(pfd[i].fd);
+		if (pid[i] != -1)
+			waitpid(pid[i], NULL, 0);
+		*len += blen[i];
+	}
+	/* Every worker has to run or we would miss some services */
+	if (!failed) {
+		out = xmalloc(*len + 1);
+		*len = 0;
+		for (i = 0; i < n; i++) {
+			if (blen[i])
+				memcpy(out + *len, buf[i], blen[i]);
+			*len += blen[i];
+		}
+		out[*len] = '\0';
+	}
+	for (i = 0; i < n; i++)
+		free(buf[i]);
+	return out;
+}
+
+/* Source the init scripts that changed since we last cached their
+ * output, sharing them out over a few shells, and return the
+ * dependencies of all the init scripts in the order gendepends would
+ * have printed them. */
+static char *
+gendepends(size_t *len)
+{
+	char *list_argv[] = { UNCONST(GENDEP), UNCONST("--list"), NULL };
+	char **argv[GENDEP_MAX_WORKERS];
+	DEPCACHE **cache = NULL;
+	DEPCACHE *scripts = NULL;
+	DEPCACHE *c = NULL;
+	const DEPCACHE *cached;
+	GENDEP_CONF *conf;
+	size_t nscripts = 0, ndirty = 0, cachesize = 0, size = 0;
+	size_t llen, flen, i, j, k;
+	char *list, *fresh = NULL, *cachebuf = NULL, *out = NULL;
+	char *p, *e;
+	uint64_t global = depcache_global();
+	int workers, w;
+
+	argv[0] = list_argv;
+	if (!(list = gendepends_run(argv, 1, &llen)))
+		return NULL;
+	for (p = list; (e = strchr(p, '\n')); p = e + 1) {
+		*e = '\0';
+		if (!*p)
+			continue;
+		if (nscripts == size) {
+			size = size ? size * 2 : 64;
+			scripts = xrealloc(scripts, size * sizeof(*scripts));
+		}
+		c = &scripts[nscripts++];
+		c->path = p;
+		c->output = NULL;
+		c->len = 0;
+		c->native = NULL;
+		c->valid = true;
+		c->dirty = true;
+	}
+
+	cache = depcache_load(global, &cachesize, &cachebuf);
+	for (i = 0; i < nscripts; i++) {
+		c = &scripts[i];
+		cached = depcache_find(cache, cachesize, c->path);
+		if (cached && cached->fingerprint ==
+		    depcache_fingerprint(c->path, cached->output, cached->len))
+		{
+			c->fingerprint = cached->fingerprint;
+			c->output = cached->output;
+			c->len = cached->len;
+			c->dirty = false;
+		} else
+			ndirty++;
+	}
+
+	/* Most init scripts only declare what they depend on, so we can
+	 * skip the shell for those */
+	if (ndirty && (conf = gendep_conf_load())) {
+		for (i = 0; i < nscripts; i++) {
+			c = &scripts[i];
+			if (!c->dirty ||
+			    !(c->native = gendep_native(conf, c->path, &c->len)))
+				continue;
+			c->output = c->native;
+			c->fingerprint = depcache_fingerprint(c->path,
+			    c->output, c->len);
+			c->dirty = false;
+			ndirty--;
+		}
+		gendep_conf_free(conf);
+	}
+
+	if (ndirty) {
+		workers = gendepends_workers();
+		if ((size_t)workers > ndirty)
+			workers = (int)ndirty;
+		/* Each worker gets a contiguous run of the changed scripts */
+		for (w = 0, i = 0; w < workers; w++) {
+			k = ndirty * (size_t)(w + 1) / (size_t)workers -
+			    ndirty * (size_t)w / (size_t)workers;
+			argv[w] = xmalloc((k + 2) * sizeof(*argv[w]));
+			argv[w][0] = UNCONST(GENDEP);
+			for (j = 1; j <= k; i++)
+				if (scripts[i].dirty)
+					argv[w][j++] = scripts[i].path;
+			argv[w][j] = NULL;
+		}
+		fresh = gendepends_run(argv, workers, &flen);
+		for (w = 0; w < workers; w++)
+			free(argv[w]);
+		if (!fresh)
+			goto out;
+
+		/* Each script's output follows a line with just its path */
+		c = NULL;
+		for (i = 0, p = fresh; *p; p = e + 1) {
+			if (!(e = strchr(p, '\n')))
+				e = p + strlen(p);
+			while (i < nscripts && !scripts[i].dirty)
+				i++;
+			if (i < nscripts &&
+			    strncmp(p, scripts[i].path, (size_t)(e - p)) == 0 &&
+			    scripts[i].path[e - p] == '\0')
+			{
+				if (c)
+					c->len = (size_t)(p - c->output);
+				c = &scripts[i++];
+				c->output = *e ? e + 1 : e;
+			}
+			if (!*e)
+				break;
+		}
+		if (c)
+			c->len = (size_t)(fresh + flen - c->output);
+		for (i = 0; i < nscripts; i++) {
+			c = &scripts[i];
+			if (!c->dirty)
+				continue;
+			/* It never got to this script, so don't remember it */
+			if (!c->output)
+				c->valid = false;
+			else
+				c->fingerprint = depcache_fingerprint(c->path,
+				    c->output, c->len);
+		}
+	}
+	depcache_save(global, scripts, nscripts);
+
+	*len = 0;
+	for (i = 0; i < nscripts; i++)
+		*len += scripts[i].len;
+	/* Always end with a newline, an empty line is ignored */
+	out = xmalloc(*len + 1);
+	*len = 0;
+	for (i = 0; i < nscripts; i++) {
+		if (scripts[i].len)
+			memcpy(out + *len, scripts[i].output, scripts[i].len);
+		*len += scripts[i].len;
+	}
+	out[(*len)++] = '\n';
+
+out:
+	if (cache) {
+		for (i = 0; i < cachesize; i++)
+			free(cache[i]);
+		free(cache);
+	}
+	free(cachebuf);
+	free(fresh);
+	for (i = 0; i < nscripts; i++)
+		free(scripts[i].native);
+	free(scripts);
+	free(list);
+	return out;
+}
+
+/* This is a 7 phase operation
+   Phase 1 is a shell script which loads each init script and config in turn
+   and echos their dependency info to stdout
+   Phase 2 takes that and populates a depinfo object with that data
+   Phase 3 adds any provided services to the depinfo object
+   Phase 4 scans that depinfo object and puts in backlinks
+   Phase 5 removes broken before dependencies
+   Phase 6 looks for duplicate services indicating a real and virtual service
+   with the same names
+   Phase 7 saves the depinfo object to disk
+   */
+bool
+rc_deptree_update(void)
+{
+	FILE *fp;
+	RC_DEPTREE *deptree, *providers;
+	RC_DEPINFO *depinfo = NULL, *depinfo_np, *di;
+	RC_DEPTYPE *deptype = NULL, *dt_np, *dt, *provide;
+	RC_STRINGLIST *config, *dupes, *types, *sorted;
+	DEPORDER order;
+	RC_STRING *s, *s2, *s2_np, *s3, *s4;
+	char *line = NULL;
+	size_t len = 0;
+	char *gendep;
+	char *depend, *depends, *service, *type, *nosys, *onosys;
+	size_t i, k, l;
+	bool retval = true;
+	const char *sys = rc_sys();
+	struct utsname uts;
+	struct stat st;
+	int serrno;
+	char state[64];
+	bool watched;
+
+	/* Note where rc-depwatch is before we look at anything */
+	watched = depwatch_state(state, sizeof(state));
+
+	/* Some init scripts need RC_LIBEXECDIR to source stuff
+	   Ideally we should be setting our full env instead */
+	if (!getenv("RC_LIBEXECDIR"))
+		setenv("RC_LIBEXECDIR", RC_LIBEXECDIR, 0);
+
+	if (uname(&uts) == 0)
+		setenv("RC_UNAME", uts.sysname, 1);
+	/* Phase 1 - source all init scripts and print dependencies */
+	if (!(gendep = gendepends(&len)))
+		return false;
+	if (!(fp = fmemopen(gendep, len, "r"))) {
+		free(gendep);
+		return false;
+	}
+	len = 0;
+
+	deptree = xmalloc(sizeof(*deptree));
+	TAILQ_INIT(&deptree->services);
+	deptree->map = NULL;
+	deptree->mapsize = 0;
+	deptree->index = NULL;
+	deptree->arena = NULL;
+	config = rc_stringlist_new();
+	while ((rc_getline(&line, &len, fp)))
+	{
+		depends = line;
+		service = strsep(&depends, " ");
+		if (!service || !*service)
+			continue;
+
+		type = strsep(&depends, " ");
+		if (!depinfo || strcmp(depinfo->service, service) != 0) {
+			deptype = NULL;
+			depinfo = get_depinfo(deptree, service);
+			if (!depinfo) {
+				depinfo = new_depinfo(NULL, service);
+				TAILQ_INSERT_TAIL(&deptree->services, depinfo, entries);
+			}
+		}
+
+		/* We may not have any depends */
+		if (!type || !depends)
+			continue;
+
+		/* Get the type */
+		if (strcmp(type, "config") != 0) {
+			if (!deptype || strcmp(deptype->type, type) != 0)
+				deptype = get_deptype(depinfo, type);
+			if (!deptype)
+				deptype = new_deptype(NULL, depinfo, type);
+		}
+
+		/* Now add each depend to our type.
+		   We do this individually so we handle multiple spaces gracefully */
+		while ((depend = strsep(&depends, " ")))
+		{
+			if (depend[0] == 0)
+				continue;
+
+			if (strcmp(type, "config") == 0) {
+				rc_stringlist_addu(config, depend);
+				continue;
+			}
+
+			/* Don't provide ourself */
+			if (strcmp(type, "iprovide") == 0 &&
+			    strcmp(depend, service) == 0)
+				continue;
+
+			/* .sh files are not init scripts */
+			l = strlen(depend);
+			if (l > 2 &&
+			    depend[l - 3] == '.' &&
+			    depend[l - 2] == 's' &&
+			    depend[l - 1] == 'h')
+				continue;
+
+			/* Remove our dependency if instructed */
+			if (depend[0] == '!') {
+				rc_stringlist_delete(deptype->services, depend + 1);
+				continue;
+			}
+
+			rc_stringlist_add(deptype->services, depend);
+
+			/* We need to allow `after *; before local;` to work.
+			 * Conversely, we need to allow 'before *; after modules' also */
+			/* If we're before something, remove us from the after list */
+			if (strcmp(type, "ibefore") == 0) {
+				if ((dt = get_deptype(depinfo, "iafter")))
+					rc_stringlist_delete(dt->services, depend);
+			}
+			/* If we're after something, remove us from the before list */
+			if (strcmp(type, "iafter") == 0 ||
+			    strcmp(type, "ineed") == 0 ||
+			    strcmp(type, "iwant") == 0 ||
+			    strcmp(type, "iuse") == 0) {
+				if ((dt = get_deptype(depinfo, "ibefore")))
+					rc_stringlist_delete(dt->services, depend);
+			}
+		}
+	}
+	free(line);
+	fclose(fp);
+	free(gendep);
+
+	/* Phase 2 - if we're a special system, remove services that don't
+	 * work for them. This doesn't stop them from being run directly. */
+	if (sys) {
+		len = strlen(sys);
+		nosys = xmalloc(len + 2);
+		nosys[0] = '-';
+		for (i = 0; i < len; i++)
+			nosys[i + 1] = (char)tolower((unsigned char)sys[i]);
+		nosys[i + 1] = '\0';
+
+		onosys = xmalloc(len + 3);
+		onosys[0] = 'n';
+		onosys[1] = 'o';
+		for (i = 0; i < len; i++)
+			onosys[i + 2] = (char)tolower((unsigned char)sys[i]);
+		onosys[i + 2] = '\0';
+
+		TAILQ_FOREACH_SAFE(depinfo, &deptree->services, entries, depinfo_np)
+			if ((deptype = get_deptype(depinfo, "keyword")))
+				TAILQ_FOREACH(s, deptype->services, entries)
+					if (strcmp(s->value, nosys) == 0 ||
+					    strcmp(s->value, onosys) == 0)
+					{
+						provide = get_deptype(depinfo, "iprovide");
+						TAILQ_REMOVE(&deptree->services, depinfo, entries);
+						TAILQ_FOREACH(di, &deptree->services, entries) {
+							TAILQ_FOREACH_SAFE(dt, &di->depends, entries, dt_np) {
+								rc_stringlist_delete(dt->services, depinfo->service);
+								if (provide)
+									TAILQ_FOREACH(s2, provide->services, entries)
+										rc_stringlist_delete(dt->services, s2->value);
+								if (!TAILQ_FIRST(dt->services)) {
+									unlink_deptype(di, dt);
+									free(dt->type);
+									free(dt->services);
+									free(dt);
+								}
+							}
+						}
+					}
+		free(nosys);
+		free(onosys);
+	}
+
+	/* Phase 3 - add our providers to the tree */
+	providers = xmalloc(sizeof(*providers));
+	TAILQ_INIT(&providers->services);
+	providers->map = NULL;
+	providers->mapsize = 0;
+	providers->index = NULL;
+	providers->arena = NULL;
+	TAILQ_FOREACH(depinfo, &deptree->services, entries)
+		if ((deptype = get_deptype(depinfo, "iprovide")))
+			TAILQ_FOREACH(s, deptype->services, entries) {
+				TAILQ_FOREACH(di, &providers->services, entries)
+					if (strcmp(di->service, s->value) == 0)
+						break;
+				if (!di) {
+					di = new_depinfo(NULL, s->value);
+					TAILQ_INSERT_TAIL(&providers->services, di, entries);
+				}
+			}
+	TAILQ_CONCAT(&deptree->services, &providers->services, entries);
+	free(providers);
+
+	/* We don't add or remove services from here on */
+	deptree_index_build(deptree);
+
+	/* Phase 4 - backreference our depends */
+	TAILQ_FOREACH(depinfo, &deptree->services, entries)
+		for (i = 0; deppairs[i].depend; i++) {
+			deptype = get_deptype(depinfo, deppairs[i].depend);
+			if (!deptype)
+				continue;
+			TAILQ_FOREACH(s, deptype->services, entries) {
+				di = get_depinfo(deptree, s->value);
+				if (!di) {
+					if (strcmp(deptype->type, "ineed") == 0) {
+						fprintf(stderr,
+							 "Service `%s' needs non"
+							 " existent service `%s'\n",
+							 depinfo->service, s->value);
+						dt = get_deptype(depinfo, "broken");
+						if (!dt)
+							dt = new_deptype(NULL, depinfo, "broken");
+						rc_stringlist_addu(dt->services, s->value);
+					}
+					continue;
+				}
+
+				dt = get_deptype(di, deppairs[i].addto);
+				if (!dt)
+					dt = new_deptype(NULL, di, deppairs[i].addto);
+				rc_stringlist_addu(dt->services, depinfo->service);
+			}
+		}
+
+
+	/* Phase 5 - Remove broken before directives */
+	types = rc_stringlist_new();
+	rc_stringlist_add(types, "ineed");
+	rc_stringlist_add(types, "iwant");
+	rc_stringlist_add(types, "iuse");
+	rc_stringlist_add(types, "iafter");
+	TAILQ_FOREACH(depinfo, &deptree->services, entries) {
+		deptype = get_deptype(depinfo, "ibefore");
+		if (!deptype)
+			continue;
+		deporder_init(&order, deptree);
+		visit_service(deptree, types, &order, depinfo, NULL, 0);
+		deporder_free(&order);
+		sorted = order.sorted;
+		TAILQ_FOREACH_SAFE(s2, deptype->services, entries, s2_np) {
+			TAILQ_FOREACH(s3, sorted, entries) {
+				di = get_depinfo(deptree, s3->value);
+				if (!di)
+					continue;
+				if (strcmp(s2->value, s3->value) == 0) {
+					dt = get_deptype(di, "iafter");
+					if (dt)
+						rc_stringlist_delete(dt->services, depinfo->service);
+					break;
+				}
+				dt = get_deptype(di, "iprovide");
+				if (!dt)
+					continue;
+				TAILQ_FOREACH(s4, dt->services, entries) {
+					if (strcmp(s4->value, s2->value) == 0)
+						break;
+				}
+				if (s4) {
+					di = get_depinfo(deptree, s4->value);
+					if (di) {
+						dt = get_deptype(di, "iafter");
+						if (dt)
+							rc_stringlist_delete(dt->services, depinfo->service);
+					}
+					break;
+				}
+			}
+			if (s3)
+				rc_stringlist_delete(deptype->services, s2->value);
+		}
+		rc_stringlist_free(sorted);
+	}
+	rc_stringlist_free(types);
+
+	/* Phase 6 - Print errors for duplicate services */
+	dupes = rc_stringlist_new();
+	TAILQ_FOREACH(depinfo, &deptree->services, entries) {
+		serrno = errno;
+		errno = 0;
+		rc_stringlist_addu(dupes,depinfo->service);
+		if (errno == EEXIST) {
+			fprintf(stderr,
+					"Error: %s is the name of a real and virtual service.\n",
+					depinfo->service);
+		}
+		errno = serrno;
+	}
+	rc_stringlist_free(dupes);
+
+	/* Phase 7 - save to disk
+	   Now that we're purely in C, do we need to keep a shell parseable file?
+	   I think yes as then it stays human readable
+	   This works and should be entirely shell parseable provided that depend
+	   names don't have any non shell variable characters in
+	   */
+	if ((fp = fopen(RC_DEPTREE_CACHE, "w"))) {
+		i = 0;
+		TAILQ_FOREACH(depinfo, &deptree->services, entries) {
+			fprintf(fp, "depinfo_%zu_service='%s'\n",
+				i, depinfo->service);
+			TAILQ_FOREACH(deptype, &depinfo->depends, entries) {
+				k = 0;
+				TAILQ_FOREACH(s, deptype->services, entries) {
+					fprintf(fp,
+						"depinfo_%zu_%s_%zu='%s'\n",
+						i, deptype->type, k, s->value);
+					k++;
+				}
+			}
+			i++;
+		}
+		fclose(fp);
+		/* Save the binary version for quick loading alongside it */
+		if (stat(RC_DEPTREE_CACHE, &st) != 0 ||
+		    !deptree_save_binary(deptree, RC_DEPTREE_BINARY, &st))
+			unlink(RC_DEPTREE_BINARY);
+		/* So booting does not have to order anything */
+		order_precompute(deptree);
+	} else {
+		fprintf(stderr, "fopen `%s': %s\n",
+			RC_DEPTREE_CACHE, strerror(errno));
+		unlink(RC_DEPTREE_BINARY);
+		retval = false;
+	}
+
+	/* Save our external config files to disk */
+	if (TAILQ_FIRST(config)) {
+		if ((fp = fopen(RC_DEPCONFIG, "w"))) {
+			TAILQ_FOREACH(s, config, entries)
+				fprintf(fp, "%s\n", s->value);
+			fclose(fp);
+		} else {
+			fprintf(stderr, "fopen `%s': %s\n",
+				RC_DEPCONFIG, strerror(errno));
+			retval = false;
+		}
+	} else {
+		unlink(RC_DEPCONFIG);
+	}
+
+	/* Remember which generation of rc-depwatch we are up to date with */
+	unlink(RC_DEPTREE_GEN);
+	if (retval && watched && (fp = fopen(RC_DEPTREE_GEN, "w"))) {
+		fputs(state, fp);
+		fclose(fp);
+	}
+
+	rc_stringlist_free(config);
+	rc_deptree_free(deptree);
+	return retval;
+}
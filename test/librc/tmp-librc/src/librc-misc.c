@@ -0,0 +1,769 @@
+/*
+ * rc-misc.c
+ * rc misc functions
+*/
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <sys/mman.h>
+
+#include <fnmatch.h>
+#include <stdint.h>
+
+#include "queue.h"
+#include "librc.h"
+#include "helpers.h"
+
+bool
+rc_yesno(const char *value)
+{
+	if (!value) {
+		errno = ENOENT;
+		return false;
+	}
+
+	if (strcasecmp(value, "yes") == 0 ||
+	    strcasecmp(value, "y") == 0 ||
+	    strcasecmp(value, "true") == 0 ||
+	    strcasecmp(value, "1") == 0)
+		return true;
+
+	if (strcasecmp(value, "no") != 0 &&
+	    strcasecmp(value, "n") != 0 &&
+	    strcasecmp(value, "false") != 0 &&
+	    strcasecmp(value, "0") != 0)
+		errno = EINVAL;
+
+	return false;
+}
+
+
+/**
+ * Read the entire @file into the buffer and set @len to the
+ * size of the buffer when finished. For C strings, this will
+ * be strlen(buffer) + 1.
+ * Don't forget to free the buffer afterwards!
+ */
+bool
+rc_getfile(const char *file, char **buffer, size_t *len)
+{
+	bool ret = false;
+	FILE *fp;
+	int fd;
+	struct stat st;
+	size_t done, left;
+
+	fp = fopen(file, "re");
+	if (!fp)
+		return false;
+
+	/* assume fileno() never fails */
+	fd = fileno(fp);
+
+	if (fstat(fd, &st))
+		goto finished;
+
+	left = st.st_size;
+	*len = left + 1; /* NUL terminator */
+	*buffer = xrealloc(*buffer, *len);
+	while (left) {
+		done = fread(*buffer, sizeof(*buffer[0]), left, fp);
+		if (done == 0 && ferror(fp))
+			goto finished;
+		left -= done;
+	}
+	ret = true;
+
+ finished:
+	if (!ret) {
+		free(*buffer);
+		*len = 0;
+	} else
+		(*buffer)[*len - 1] = '\0';
+	fclose(fp);
+	return ret;
+}
+
+ssize_t
+rc_getline(char **line, size_t *len, FILE *fp)
+{
+	char *p;
+	size_t last = 0;
+
+	while (!feof(fp)) {
+		if (*line == NULL || last != 0) {
+			*len += BUFSIZ;
+			*line = xrealloc(*line, *len);
+		}
+		p = *line + last;
+		memset(p, 0, BUFSIZ);
+		if (fgets(p, BUFSIZ, fp) == NULL)
+			break;
+		last += strlen(p);
+		if (last && (*line)[last - 1] == '\n') {
+			(*line)[last - 1] = '\0';
+			break;
+		}
+	}
+	return last;
+}
+
+char *
+rc_proc_getent(const char *ent _unused)
+{
+#ifdef __linux__
+	FILE *fp;
+	char *proc, *p, *value = NULL;
+	size_t i, len;
+
+	if (!exists("/proc/cmdline"))
+		return NULL;
+
+	if (!(fp = fopen("/proc/cmdline", "r")))
+		return NULL;
+
+	proc = NULL;
+	i = 0;
+	if (rc_getline(&proc, &i, fp) == -1 || proc == NULL)
+		return NULL;
+
+	if (proc != NULL) {
+		len = strlen(ent);
+
+		while ((p = strsep(&proc, " "))) {
+			if (strncmp(ent, p, len) == 0 && (p[len] == '\0' || p[len] == ' ' || p[len] == '=')) {
+				p += len;
+
+				if (*p == '=')
+					p++;
+
+				value = xstrdup(p);
+			}
+		}
+	}
+
+	if (!value)
+		errno = ENOENT;
+
+	fclose(fp);
+	free(proc);
+
+	return value;
+#else
+	return NULL;
+#endif
+}
+
+RC_STRINGLIST *
+rc_config_list(const char *file)
+{
+	FILE *fp;
+	char *buffer = NULL;
+	size_t len = 0;
+	char *p;
+	char *token;
+	RC_STRINGLIST *list = rc_stringlist_new();
+
+	if (!(fp = fopen(file, "r")))
+		return list;
+
+	while ((rc_getline(&buffer, &len, fp))) {
+		p = buffer;
+		/* Strip leading spaces/tabs */
+		while ((*p == ' ') || (*p == '\t'))
+			p++;
+
+		/* Get entry - we do not want comments */
+		token = strsep(&p, "#");
+		if (token && (strlen(token) > 1)) {
+			/* If not variable assignment then skip */
+			if (strchr(token, '=')) {
+				/* Stip the newline if present */
+				if (token[strlen(token) - 1] == '\n')
+					token[strlen(token) - 1] = 0;
+
+				rc_stringlist_add(list, token);
+			}
+		}
+	}
+	fclose(fp);
+	free(buffer);
+
+	return list;
+}
+
+static void rc_config_set_value(RC_STRINGLIST *config, char *value)
+{
+	RC_STRING *cline;
+	char *entry;
+	size_t i = 0;
+	char *newline;
+	char *p = value;
+	bool replaced;
+	char *token;
+
+	if (! p)
+		return;
+	if (strncmp(p, "export ", 7) == 0)
+		p += 7;
+	if (! (token = strsep(&p, "=")))
+		return;
+
+	entry = xstrdup(token);
+	/* Preserve shell coloring */
+	if (*p == '$')
+		token = value;
+	else
+		do {
+			/* Bash variables are usually quoted */
+			token = strsep(&p, "\"\'");
+		} while (token && *token == '\0');
+
+	/* Drop a newline if that's all we have */
+	if (token) {
+		i = strlen(token) - 1;
+		if (token[i] == '\n')
+			token[i] = 0;
+
+		xasprintf(&newline, "%s=%s", entry, token);
+	} else {
+		xasprintf(&newline, "%s=", entry);
+	}
+
+	replaced = false;
+	/* In shells the last item takes precedence, so we need to remove
+	   any prior values we may already have */
+	TAILQ_FOREACH(cline, config, entries) {
+		i = strlen(entry);
+		if (strncmp(entry, cline->value, i) == 0 && cline->value[i] == '=') {
+			/* We have a match now - to save time we directly replace it */
+			free(cline->value);
+			cline->value = newline;
+			replaced = true;
+			break;
+		}
+	}
+
+	if (!replaced) {
+		rc_stringlist_add(config, newline);
+		free(newline);
+	}
+	free(entry);
+}
+
+/*
+ * Override some specific rc.conf options on the kernel command line.
+ * I only know how to do this in Linux, so if someone wants to supply
+ * a patch for this on *BSD or tell me how to write the code to do this,
+ * any suggestions are welcome.
+ */
+/* A list of variables which may be overridden on the kernel command line */
+static const char *const kcl_overrides[] = {
+	"rc_parallel",
+	NULL
+};
+
+static RC_STRINGLIST *rc_config_kcl(RC_STRINGLIST *config)
+{
+#ifdef __linux__
+	RC_STRING *cline, *config_np;
+	const char *const *override;
+	char *tmp = NULL;
+	char *value = NULL;
+	size_t varlen = 0;
+
+	for (override = kcl_overrides; *override; override++) {
+		varlen = strlen(*override);
+		value = rc_proc_getent(*override);
+
+		/* No need to continue if there's nothing to override */
+		if (!value) {
+			free(value);
+			continue;
+		}
+
+		if (value != NULL) {
+			xasprintf(&tmp, "%s=%s", *override, value);
+		}
+
+		/*
+		 * Whenever necessary remove the old config entry first to prevent
+		 * duplicates
+		 */
+		TAILQ_FOREACH_SAFE(cline, config, entries, config_np) {
+			if (strncmp(*override, cline->value, varlen) == 0
+				&& cline->value[varlen] == '=') {
+				rc_stringlist_delete(config, cline->value);
+				break;
+			}
+		}
+
+		/* Add the option (var/value) to the current config */
+		rc_stringlist_add(config, tmp);
+
+		free(tmp);
+		free(value);
+	}
+#endif
+	return config;
+}
+
+static RC_STRINGLIST * rc_config_directory(RC_STRINGLIST *config)
+{
+	DIR *dp;
+	struct dirent *d;
+	RC_STRINGLIST *rc_conf_d_files = rc_stringlist_new();
+	RC_STRING *fname;
+	RC_STRINGLIST *rc_conf_d_list;
+	char path[PATH_MAX];
+	RC_STRING *line;
+
+	if ((dp = opendir(RC_CONF_D)) != NULL) {
+		while ((d = readdir(dp)) != NULL) {
+			if (fnmatch("*.conf", d->d_name, FNM_PATHNAME) == 0) {
+				rc_stringlist_addu(rc_conf_d_files, d->d_name);
+			}
+		}
+		closedir(dp);
+
+		if (rc_conf_d_files) {
+			rc_stringlist_sort(&rc_conf_d_files);
+			TAILQ_FOREACH(fname, rc_conf_d_files, entries) {
+				if (! fname->value)
+					continue;
+				sprintf(path, "%s/%s", RC_CONF_D, fname->value);
+				rc_conf_d_list = rc_config_list(path);
+				TAILQ_FOREACH(line, rc_conf_d_list, entries)
+					if (line->value)
+						rc_config_set_value(config, line->value);
+				rc_stringlist_free(rc_conf_d_list);
+			}
+			rc_stringlist_free(rc_conf_d_files);
+		}
+	}
+	return config;
+}
+
+RC_STRINGLIST *
+rc_config_load(const char *file)
+{
+	RC_STRINGLIST *list;
+	RC_STRINGLIST *config;
+	RC_STRING *line;
+
+	list = rc_config_list(file);
+	config = rc_stringlist_new();
+	TAILQ_FOREACH(line, list, entries) {
+		rc_config_set_value(config, line->value);
+	}
+	rc_stringlist_free(list);
+
+	return config;
+}
+
+char *
+rc_config_value(RC_STRINGLIST *list, const char *entry)
+{
+	RC_STRING *line;
+	char *p;
+	size_t len;
+
+	len = strlen(entry);
+	TAILQ_FOREACH(line, list, entries) {
+		p = strchr(line->value, '=');
+		if (p != NULL) {
+			if (strncmp(entry, line->value, len) == 0 && line->value[len] == '=')
+				return ++p;
+		}
+	}
+	return NULL;
+}
+
+/* Global for caching the strings loaded from rc.conf to avoid reparsing for
+ * each rc_conf_value call */
+static RC_STRINGLIST *rc_conf = NULL;
+
+static void
+_free_rc_conf(void)
+{
+	rc_stringlist_free(rc_conf);
+}
+
+/* Binary rc.conf cache.
+ * Every process that looks at a setting would otherwise parse rc.conf and
+ * rc.conf.d for itself, so the first one to do so leaves the merged
+ * settings in RC_CONF_CACHE sorted by name, for the rest to map and
+ * search. It lists every file they came from and we only trust it while
+ * they still match. Kernel command line overrides are not cached. */
+#define CONF_BIN_MAGIC		"RCCONF"
+#define CONF_BIN_VERSION	1
+
+struct conf_bin_header {
+	char magic[8];
+	uint64_t size;
+	uint32_t version;
+	uint32_t nfile;
+	uint32_t nvar;
+	uint32_t strsize;
+};
+
+struct conf_bin_file {
+	uint64_t ino;
+	int64_t mtime;
+	int64_t size;
+	uint32_t path;
+	uint32_t exists;
+};
+
+struct conf_bin_var {
+	uint32_t name;
+	uint32_t value;
+};
+
+static const struct conf_bin_header *conf_map;
+static const struct conf_bin_var *conf_vars;
+static const char *conf_strtab;
+
+static uint64_t
+conf_bin_size(const struct conf_bin_header *hdr)
+{
+	return sizeof(*hdr) +
+	    (uint64_t)hdr->nfile * sizeof(struct conf_bin_file) +
+	    (uint64_t)hdr->nvar * sizeof(struct conf_bin_var) +
+	    hdr->strsize;
+}
+
+static void
+conf_bin_stat(struct conf_bin_file *f, const char *path)
+{
+	struct stat st;
+
+	memset(f, 0, sizeof(*f));
+	if (stat(path, &st) != 0)
+		return;
+	f->exists = 1;
+	f->ino = (uint64_t)st.st_ino;
+	f->mtime = (int64_t)st.st_mtime;
+	f->size = (int64_t)st.st_size;
+}
+
+/* Everything rc_conf_value reads from */
+static RC_STRINGLIST *
+conf_sources(void)
+{
+	RC_STRINGLIST *files = rc_stringlist_new();
+	RC_STRINGLIST *confd = rc_stringlist_new();
+	RC_STRING *s;
+	DIR *dp;
+	struct dirent *d;
+	char *path;
+
+	rc_stringlist_add(files, RC_CONF);
+	rc_stringlist_add(files, RC_CONF_OLD);
+	rc_stringlist_add(files, RC_CONF_D);
+	if ((dp = opendir(RC_CONF_D)) != NULL) {
+		while ((d = readdir(dp)) != NULL)
+			if (fnmatch("*.conf", d->d_name, FNM_PATHNAME) == 0)
+				rc_stringlist_addu(confd, d->d_name);
+		closedir(dp);
+	}
+	rc_stringlist_sort(&confd);
+	TAILQ_FOREACH(s, confd, entries) {
+		xasprintf(&path, "%s/%s", RC_CONF_D, s->value);
+		rc_stringlist_add(files, path);
+		free(path);
+	}
+	rc_stringlist_free(confd);
+	return files;
+}
+
+static bool
+conf_load_binary(void)
+{
+	const struct conf_bin_header *hdr;
+	const struct conf_bin_file *files;
+	struct conf_bin_file f;
+	struct stat st;
+	void *map;
+	size_t size;
+	uint32_t i;
+	int fd;
+
+	if ((fd = open(RC_CONF_CACHE, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return false;
+	}
+	size = (size_t)st.st_size;
+	/* Private and writable, as callers have always been able to
+	 * scribble on what we return */
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	hdr = map;
+	if (memcmp(hdr->magic, CONF_BIN_MAGIC, sizeof(CONF_BIN_MAGIC)) != 0 ||
+	    hdr->version != CONF_BIN_VERSION ||
+	    hdr->size != size ||
+	    conf_bin_size(hdr) != size ||
+	    hdr->strsize == 0)
+		goto bad;
+	files = (const void *)(hdr + 1);
+	conf_vars = (const void *)(files + hdr->nfile);
+	conf_strtab = (const char *)(conf_vars + hdr->nvar);
+	if (conf_strtab[hdr->strsize - 1] != '\0')
+		goto bad;
+
+	for (i = 0; i < hdr->nfile; i++) {
+		if (files[i].path >= hdr->strsize)
+			goto bad;
+		conf_bin_stat(&f, conf_strtab + files[i].path);
+		if (f.exists != files[i].exists || f.ino != files[i].ino ||
+		    f.mtime != files[i].mtime || f.size != files[i].size)
+			goto bad;
+	}
+	for (i = 0; i < hdr->nvar; i++)
+		if (conf_vars[i].name >= hdr->strsize ||
+		    conf_vars[i].value >= hdr->strsize ||
+		    (i > 0 && strcmp(conf_strtab + conf_vars[i - 1].name,
+			    conf_strtab + conf_vars[i].name) >= 0))
+			goto bad;
+
+	conf_map = hdr;
+	return true;
+
+bad:
+	munmap(map, size);
+	return false;
+}
+
+struct conf_var {
+	const char *name;
+	const char *value;
+	size_t order;
+};
+
+static int
+conf_var_cmp(const void *a, const void *b)
+{
+	const struct conf_var *va = a;
+	const struct conf_var *vb = b;
+	int r = strcmp(va->name, vb->name);
+
+	if (r != 0)
+		return r;
+	return va->order < vb->order ? -1 : va->order > vb->order;
+}
+
+static uint32_t
+conf_strtab_add(char **buf, size_t *len, const char *str)
+{
+	size_t l = strlen(str) + 1;
+	uint32_t off = (uint32_t)*len;
+
+	*buf = xrealloc(*buf, *len + l);
+	memcpy(*buf + *len, str, l);
+	*len += l;
+	return off;
+}
+
+/* Save config, which we loaded from sources we stat'ed as files
+ * beforehand so that anything changed since is noticed.
+ * We write to a temporary file and rename it so anyone with the old one
+ * mapped is unaffected. */
+static void
+conf_save_binary(RC_STRINGLIST *config, RC_STRINGLIST *sources,
+    struct conf_bin_file *files)
+{
+	struct conf_bin_header hdr;
+	struct conf_bin_var *bvars;
+	struct conf_var *vars;
+	RC_STRING *s;
+	char *buf = NULL;
+	char *tmp;
+	char *p;
+	size_t len = 0, nvars = 0, i, n;
+	int fd;
+	FILE *fp;
+	bool ok = false;
+
+	/* We cannot tell a change later in the same second from what we
+	 * read, so wait for things to settle before caching them */
+	i = 0;
+	TAILQ_FOREACH(s, sources, entries)
+		if (files[i++].mtime >= (int64_t)time(NULL) - 1)
+			return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	TAILQ_FOREACH(s, config, entries)
+		nvars++;
+	vars = xmalloc(sizeof(*vars) * (nvars + 1));
+	bvars = xmalloc(sizeof(*bvars) * (nvars + 1));
+
+	i = 0;
+	TAILQ_FOREACH(s, sources, entries)
+		files[i++].path = conf_strtab_add(&buf, &len, s->value);
+	hdr.nfile = (uint32_t)i;
+
+	/* The first of any duplicates is the one rc_config_value finds */
+	n = 0;
+	TAILQ_FOREACH(s, config, entries) {
+		if (!(p = strchr(s->value, '=')))
+			continue;
+		*p = '\0';
+		vars[n].name = xstrdup(s->value);
+		*p = '=';
+		vars[n].value = p + 1;
+		vars[n].order = n;
+		n++;
+	}
+	qsort(vars, n, sizeof(*vars), conf_var_cmp);
+	for (i = 0; i < n; i++) {
+		if (i == 0 || strcmp(vars[i].name, vars[i - 1].name) != 0) {
+			bvars[hdr.nvar].name = conf_strtab_add(&buf, &len,
+			    vars[i].name);
+			bvars[hdr.nvar].value = conf_strtab_add(&buf, &len,
+			    vars[i].value);
+			hdr.nvar++;
+		}
+	}
+
+	memcpy(hdr.magic, CONF_BIN_MAGIC, sizeof(CONF_BIN_MAGIC));
+	hdr.version = CONF_BIN_VERSION;
+	hdr.strsize = (uint32_t)len;
+	hdr.size = conf_bin_size(&hdr);
+
+	xasprintf(&tmp, "%s.XXXXXX", RC_CONF_CACHE);
+	if ((fd = mkstemp(tmp)) == -1)
+		goto out;
+	fchmod(fd, 0644);
+	if (!(fp = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+	    fwrite(files, sizeof(*files), hdr.nfile, fp) == hdr.nfile &&
+	    fwrite(bvars, sizeof(*bvars), hdr.nvar, fp) == hdr.nvar &&
+	    fwrite(buf, 1, len, fp) == len)
+		ok = true;
+	if (fclose(fp) != 0)
+		ok = false;
+	if (!ok || rename(tmp, RC_CONF_CACHE) != 0)
+		unlink(tmp);
+
+out:
+	free(tmp);
+	for (i = 0; i < n; i++)
+		free(UNCONST(vars[i].name));
+	free(vars);
+	free(bvars);
+	free(buf);
+}
+
+static char *
+conf_bin_value(const char *setting)
+{
+#ifdef __linux__
+	static char *kcl_values[ARRAY_SIZE(kcl_overrides)];
+	static bool kcl_loaded[ARRAY_SIZE(kcl_overrides)];
+	size_t i;
+#endif
+	size_t lo = 0, hi = conf_map->nvar, mid;
+	int r;
+
+#ifdef __linux__
+	for (i = 0; kcl_overrides[i]; i++)
+		if (strcmp(setting, kcl_overrides[i]) == 0)
+			break;
+	if (kcl_overrides[i]) {
+		if (!kcl_loaded[i]) {
+			kcl_values[i] = rc_proc_getent(kcl_overrides[i]);
+			kcl_loaded[i] = true;
+		}
+		if (kcl_values[i])
+			return kcl_values[i];
+	}
+#endif
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		r = strcmp(setting, conf_strtab + conf_vars[mid].name);
+		if (r == 0)
+			return UNCONST(conf_strtab + conf_vars[mid].value);
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+char *
+rc_conf_value(const char *setting)
+{
+	RC_STRINGLIST *old;
+	RC_STRINGLIST *sources;
+	RC_STRING *s;
+	struct conf_bin_file *files;
+	size_t nfiles = 0;
+	char *p;
+
+	if (conf_map)
+		return conf_bin_value(setting);
+
+	if (! rc_conf) {
+		if (conf_load_binary())
+			return conf_bin_value(setting);
+
+		sources = conf_sources();
+		TAILQ_FOREACH(s, sources, entries)
+			nfiles++;
+		files = xmalloc(sizeof(*files) * nfiles);
+		nfiles = 0;
+		TAILQ_FOREACH(s, sources, entries)
+			conf_bin_stat(&files[nfiles++], s->value);
+
+		rc_conf = rc_config_load(RC_CONF);
+		atexit(_free_rc_conf);
+
+		/* Support old configs. */
+		if (exists(RC_CONF_OLD)) {
+			old = rc_config_load(RC_CONF_OLD);
+			TAILQ_CONCAT(rc_conf, old, entries);
+			free(old);
+		}
+
+		rc_conf = rc_config_directory(rc_conf);
+
+		/* Convert old uppercase to lowercase */
+		TAILQ_FOREACH(s, rc_conf, entries) {
+			p = s->value;
+			while (p && *p && *p != '=') {
+				if (isupper((unsigned char)*p))
+					*p = tolower((unsigned char)*p);
+				p++;
+			}
+		}
+
+		conf_save_binary(rc_conf, sources, files);
+		rc_stringlist_free(sources);
+		free(files);
+
+		rc_conf = rc_config_kcl(rc_conf);
+	}
+
+	return rc_config_value(rc_conf, setting);
+}
@@ -0,0 +1,158 @@
+/*
+ * librc-strlist.h
+ * String list functions to make using queue(3) a little easier.
+*/
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include "queue.h"
+#include "librc.h"
+
+RC_STRINGLIST *
+rc_stringlist_new(void)
+{
+	RC_STRINGLIST *l = xmalloc(sizeof(*l));
+	TAILQ_INIT(l);
+	return l;
+}
+
+RC_STRING *
+rc_stringlist_add(RC_STRINGLIST *list, const char *value)
+{
+	RC_STRING *s = xmalloc(sizeof(*s));
+
+	s->value = xstrdup(value);
+	TAILQ_INSERT_TAIL(list, s, entries);
+	return s;
+}
+
+RC_STRING *
+rc_stringlist_addu(RC_STRINGLIST *list, const char *value)
+{
+	RC_STRING *s;
+
+	TAILQ_FOREACH(s, list, entries)
+	    if (strcmp(s->value, value) == 0) {
+		    errno = EEXIST;
+		    return NULL;
+	    }
+
+	return rc_stringlist_add(list, value);
+}
+
+bool
+rc_stringlist_delete(RC_STRINGLIST *list, const char *value)
+{
+	RC_STRING *s;
+
+	TAILQ_FOREACH(s, list, entries)
+	    if (strcmp(s->value, value) == 0) {
+		    TAILQ_REMOVE(list, s, entries);
+		    free(s->value);
+		    free(s);
+		    return true;
+	    }
+
+	errno = EEXIST;
+	return false;
+}
+
+RC_STRING *
+rc_stringlist_find(RC_STRINGLIST *list, const char *value)
+{
+	RC_STRING *s;
+
+	if (list) {
+		TAILQ_FOREACH(s, list, entries)
+		    if (strcmp(s->value, value) == 0)
+			    return s;
+	}
+	return NULL;
+}
+
+RC_STRINGLIST *
+rc_stringlist_split(const char *value, const char *sep)
+{
+	RC_STRINGLIST *list = rc_stringlist_new();
+	char *d = xstrdup(value);
+	char *p = d, *token;
+
+	while ((token = strsep(&p, sep)))
+		rc_stringlist_add(list, token);
+	free(d);
+
+	return list;
+}
+
+struct sortent {
+	RC_STRING *s;
+	size_t n;
+};
+
+static int
+sortent_cmp(const void *a, const void *b)
+{
+	const struct sortent *sa = a, *sb = b;
+	int r = strcmp(sa->s->value, sb->s->value);
+
+	/* Keep equal items in the order we found them */
+	if (r == 0)
+		r = (sa->n > sb->n) - (sa->n < sb->n);
+	return r;
+}
+
+void
+rc_stringlist_sort(RC_STRINGLIST **list)
+{
+	RC_STRINGLIST *l = *list;
+	RC_STRING *s;
+	struct sortent *ents;
+	size_t i, n = 0;
+
+	TAILQ_FOREACH(s, l, entries)
+		n++;
+	if (n < 2)
+		return;
+
+	ents = xmalloc(sizeof(*ents) * n);
+	i = 0;
+	TAILQ_FOREACH(s, l, entries) {
+		ents[i].s = s;
+		ents[i].n = i;
+		i++;
+	}
+	qsort(ents, n, sizeof(*ents), sortent_cmp);
+	TAILQ_INIT(l);
+	for (i = 0; i < n; i++)
+		TAILQ_INSERT_TAIL(l, ents[i].s, entries);
+	free(ents);
+}
+
+void
+rc_stringlist_free(RC_STRINGLIST *list)
+{
+	RC_STRING *s1;
+	RC_STRING *s2;
+
+	if (!list)
+		return;
+
+	s1 = TAILQ_FIRST(list);
+	while (s1) {
+		s2 = TAILQ_NEXT(s1, entries);
+		free(s1->value);
+		free(s1);
+		s1 = s2;
+	}
+	free(list);
+}
@@ -0,0 +1,79 @@
+/*
+ * librc.h
+ * Internal header file to setup build env for files in librc.so
+ */
+
+/*
+ * Copyright (c) 2007-2015 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/master/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/master/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#ifndef _LIBRC_H_
+#define _LIBRC_H_
+
+#define _IN_LIBRC
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <paths.h>
+#include <regex.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(BSD) && !defined(__GNU__)
+#include <sys/param.h>
+#include <sys/user.h>
+#include <sys/sysctl.h>
+#include <kvm.h>
+#else
+#include <sys/param.h>
+#endif
+
+#include "rc.h"
+#include "rc-misc.h"
+
+/* Arenas hand out memory from a few large blocks and free it all at once.
+ * Lists from an arena must not be passed to rc_stringlist_free or
+ * rc_stringlist_delete, and arena_stringlist_add does not copy value. */
+typedef struct rc_arena RC_ARENA;
+
+RC_ARENA *arena_new(void);
+void *arena_alloc(RC_ARENA *, size_t);
+char *arena_strdup(RC_ARENA *, const char *);
+RC_STRINGLIST *arena_stringlist_new(RC_ARENA *);
+RC_STRING *arena_stringlist_add(RC_ARENA *, RC_STRINGLIST *, char *);
+void arena_free(RC_ARENA *);
+
+/* Dependencies of simple init scripts without a shell, or NULL if
+ * gendepends.sh has to source them after all. */
+typedef struct gendep_conf GENDEP_CONF;
+
+GENDEP_CONF *gendep_conf_load(void);
+char *gendep_native(const GENDEP_CONF *, const char *, size_t *);
+void gendep_conf_free(GENDEP_CONF *);
+
+#endif